@@ -4,6 +4,8 @@
 #include <psibase/net_base.hpp>
 #include <psio/reflect.hpp>
 
+#include <boost/asio/post.hpp>
+
 #include <algorithm>
 #include <cassert>
 #include <chrono>
@@ -319,6 +321,19 @@ namespace psibase::net
       void start_leader()
       {
          assert(_state == producer_state::leader);
+         if (chain().getSwitchProgress())
+         {
+            // The block would build on the old head. Try again after the
+            // switch has executed a few more blocks.
+            _block_timer.expires_after(_block_interval);
+            _block_timer.async_wait(
+                [this](const std::error_code& ec)
+                {
+                   if (!ec && _state == producer_state::leader)
+                      start_leader();
+                });
+            return;
+         }
          auto head = chain().get_head();
          // The next block production time is the later of:
          // - The last block interval boundary before the current time
@@ -498,7 +513,9 @@ namespace psibase::net
                 consensus().on_fork_switch(h);
                 do_gc();
              },
-             [this](BlockHeaderState* state) { consensus().on_accept_block(state); });
+             [this](BlockHeaderState* state) { consensus().on_accept_block(state); },
+             // Execute one block at a time, so that messages are handled in between
+             [this](auto step) { boost::asio::post(_block_timer.get_executor(), std::move(step)); });
       }
 
       void do_gc()
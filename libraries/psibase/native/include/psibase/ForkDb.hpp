@@ -2,11 +2,15 @@
 
 #include <boost/container/flat_map.hpp>
 #include <boost/log/attributes/constant.hpp>
+#include <atomic>
 #include <iostream>
+#include <set>
 #include <psibase/BlockContext.hpp>
 #include <psibase/Prover.hpp>
+#include <psibase/VerifyPool.hpp>
 #include <psibase/VerifyProver.hpp>
 #include <psibase/block.hpp>
+#include <psibase/crypto.hpp>
 #include <psibase/db.hpp>
 #include <psibase/log.hpp>
 
@@ -257,6 +261,9 @@ namespace psibase
 
    class ForkDb
    {
+      // Limits the work a non-producer spends on transactions between blocks
+      static constexpr std::size_t maxSpeculativeTransactions = 1000;
+
      public:
       using id_type = Checksum256;
       const BlockHeaderState* insert(const psio::shared_view_ptr<SignedBlock>& b)
@@ -440,6 +447,23 @@ namespace psibase
          }
       }
 
+      // Switching to a fork executes one block at a time. If post is given,
+      // each remaining step is passed to it, so that the caller's other work
+      // (e.g. consensus messages) runs between blocks. Until the switch
+      // finishes, the head and the best chain stay as they were, and commits
+      // past the fork point wait for it; see commit.
+      //
+      // Each step looks for the best fork again. If a better one arrives
+      // during a switch, the switch continues towards it instead; blocks which
+      // were already executed keep their state. A call during a switch only
+      // replaces the callbacks. Block production pauses a switch, and
+      // finish_block or abort_block resumes it.
+      template <typename F, typename Accept, typename Post>
+      void async_switch_fork(F&& callback, Accept&& on_accept_block, Post&& post)
+      {
+         switchForkPost = std::forward<Post>(post);
+         async_switch_fork(std::forward<F>(callback), std::forward<Accept>(on_accept_block));
+      }
       template <typename F, typename Accept>
       void async_switch_fork(F&& callback, Accept&& on_accept_block)
       {
@@ -450,54 +474,156 @@ namespace psibase
             switchForkCallback = std::move(callback);
             return;
          }
+         switchForkCallback = std::forward<F>(callback);
+         acceptBlockCallback = std::forward<Accept>(on_accept_block);
+         if (switchProgress)
+            return;
+         while (switch_fork_step() && !switchForkPost)
+         {
+         }
+      }
+      // Progress of the current fork switch
+      struct SwitchProgress
+      {
+         BlockNum    forkPoint = 0;  // the last block shared with the old head
+         Checksum256 target;         // the new head
+         BlockNum    targetNum = 0;
+         BlockNum    executed  = 0;  // the last executed block on the way to target
+      };
+      const std::optional<SwitchProgress>& getSwitchProgress() const { return switchProgress; }
+
+     private:
+      // Returns true if there is more to do
+      bool switch_fork_step()
+      {
+         // A block can't be started during a switch, and a switch can't be
+         // started during a block
+         assert(!blockContext);
          auto pos =
              byOrderIndex.lower_bound(std::tuple(currentTerm + 1, BlockNum(0), Checksum256{}));
          --pos;
          auto new_head = get_state(pos->second);
-         if (head != new_head)
+         if (head == new_head)
          {
-            for (auto i = new_head->blockNum() + 1; i <= head->blockNum(); ++i)
-            {
-               // TODO: this should not be an assert, because it depends on other nodes behaving correctly
-               assert(i > commitIndex);
-               byBlocknumIndex.erase(i);
-            }
-            auto id = new_head->blockId();
-            for (auto i = new_head->blockNum(); i > head->blockNum(); --i)
+            end_switch_fork();
+            return false;
+         }
+
+         // Blocks from new_head back to the last one in the current chain
+         std::vector<BlockHeaderState*> path;
+         auto*                          forkPoint = new_head;
+         for (;;)
+         {
+            auto current = byBlocknumIndex.find(forkPoint->blockNum());
+            if (current != byBlocknumIndex.end() && current->second == forkPoint->blockId())
+               break;
+            path.push_back(forkPoint);
+            auto* prev = get_state(forkPoint->info.header.previous);
+            if (!prev)
             {
-               byBlocknumIndex.insert({i, id});
-               id = get_prev_id(id);
+               // The fork doesn't connect to the current chain
+               blacklist_subtree(forkPoint);
+               return post_switch_fork_step();
             }
-            for (auto iter = byBlocknumIndex.upper_bound(
-                          std::min(new_head->blockNum(), head->blockNum())),
-                      begin = byBlocknumIndex.begin();
-                 iter != begin;)
+            forkPoint = prev;
+         }
+         assert(forkPoint->revision);
+
+         if (!switchProgress || switchProgress->target != new_head->blockId())
+         {
+            if (switchProgress)
+               PSIBASE_LOG(logger, info)
+                   << "Switching to a better fork before reaching block "
+                   << switchProgress->targetNum;
+            else if (path.size() > 1)
+               PSIBASE_LOG(logger, info) << "Switching to a fork of " << path.size()
+                                         << " blocks after block " << forkPoint->blockNum();
+            switchProgress = SwitchProgress{.forkPoint = forkPoint->blockNum(),
+                                            .target    = new_head->blockId(),
+                                            .targetNum = new_head->blockNum()};
+         }
+
+         // Execute the first block which doesn't have a state yet
+         auto* prev = forkPoint;
+         for (auto iter = path.rbegin(); iter != path.rend(); ++iter)
+         {
+            auto* nextState = *iter;
+            if (!nextState->revision)
             {
-               --iter;
-               if (iter->second == id)
+               switchProgress->executed = prev->blockNum();
+               switchBlock              = nextState;
+               bool executed            = execute_block(prev, nextState, acceptBlockCallback);
+               switchBlock              = nullptr;
+               if (!executed)
                {
-                  if (execute_fork(iter, byBlocknumIndex.end(), on_accept_block))
-                  {
-                     break;
-                  }
-                  else
-                  {
-                     // If execute fork fails, the trial head block and possibly
-                     // others are removed from byOrderIndex and byBlocknumIndex.
-                     // Start over.
-                     return async_switch_fork(
-                         static_cast<decltype(callback)>(callback),
-                         static_cast<decltype(on_accept_block)>(on_accept_block));
-                  }
+                  // Look for the best fork again without this block
+                  blacklist_subtree(nextState);
                }
-               assert(iter->first > commitIndex);
-               iter->second = id;
-               id           = get_prev_id(id);
+               else
+               {
+                  // The shared head stays at head until the whole path is
+                  // executed, so readers never see a partial switch
+                  switchProgress->executed = nextState->blockNum();
+                  if (nextState->blockNum() % 1000 == 0)
+                     PSIBASE_LOG(logger, info)
+                         << "Switching fork: executed block " << nextState->blockNum() << " of "
+                         << switchProgress->targetNum;
+               }
+               return post_switch_fork_step();
             }
-            head = new_head;
-            callback(&head->info.header);
+            prev = nextState;
+         }
+
+         // Every block is executed; make new_head the head. commit kept
+         // commitIndex at or before the fork point.
+         for (auto i = new_head->blockNum() + 1; i <= head->blockNum(); ++i)
+         {
+            // TODO: this should not be an assert, because it depends on other nodes behaving correctly
+            assert(i > commitIndex);
+            byBlocknumIndex.erase(i);
+         }
+         for (auto* state : path)
+         {
+            assert(state->blockNum() > commitIndex);
+            byBlocknumIndex[state->blockNum()] = state->blockId();
          }
+         systemContext->sharedDatabase.setHead(*writer, new_head->revision);
+         head = new_head;
+         end_switch_fork();
+         // Copy the callback, because it may start another switch
+         auto callback = switchForkCallback;
+         callback(&head->info.header);
+         return false;
+      }
+      bool post_switch_fork_step()
+      {
+         if (switchForkPost && !switchStepPosted)
+         {
+            switchStepPosted = true;
+            switchForkPost(
+                [this]
+                {
+                   switchStepPosted = false;
+                   // Production may have started if the step was posted
+                   // before there was any switchProgress. The next
+                   // async_switch_fork tries again.
+                   if (!blockContext)
+                      switch_fork_step();
+                });
+         }
+         return true;
+      }
+      // Applies the commit which waited for the switch, if its block made it
+      // into the best chain
+      void end_switch_fork()
+      {
+         switchProgress.reset();
+         if (auto pending = std::exchange(switchCommit, std::nullopt))
+            if (in_best_chain(*pending))
+               commit(pending->num());
       }
+
+     public:
       // TODO: somehow prevent poisoning the cache if a malicious peer
       // sends a correct block with the wrong signature.
       Claim validateBlockSignature(BlockHeaderState* prev, const BlockInfo& info, const auto& sig)
@@ -512,19 +638,73 @@ namespace psibase
          prover.prove(BlockSignatureInfo(info), *claim);
          return std::move(*claim);
       }
-      // TODO: this can run concurrently.
+      // Proofs only read the state at the start of the block, so when there
+      // is a verifyPool, its threads split the block's transactions between
+      // them. Each thread verifies the proofs of one transaction at a time.
+      //
+      // Transactions whose proofs already passed against the same state
+      // during speculation are skipped. They are keyed by the hash of the
+      // signed transaction, which covers the claims and the proofs. Proofs
+      // can't read the database, so the block time doesn't change the result.
+      // Speculation ran them with a watchdog limit and these run without one,
+      // so a proof which passed then also passes now.
       void validateTransactionSignatures(const Block& b, const ConstRevisionPtr& revision)
       {
-         BlockContext verifyBc(*systemContext, revision);
-         verifyBc.start(b.header.time);
-         for (const auto& trx : b.transactions)
+         bool reuseProofs = revision == speculativeRevision && !speculativeProofs.empty();
+
+         std::atomic<std::size_t> numReused{0};
+         auto                     verifyAll = [&](SystemContext& sc, auto&& nextTransaction)
          {
-            for (std::size_t i = 0; i < trx.proofs.size(); ++i)
+            BlockContext verifyBc(sc, revision);
+            verifyBc.start(b.header.time);
+            while (const SignedTransaction* trx = nextTransaction())
             {
-               TransactionTrace trace;
-               verifyBc.verifyProof(trx, trace, i, std::nullopt);
+               if (reuseProofs && speculativeProofs.contains(sha256(*trx)))
+               {
+                  ++numReused;
+                  continue;
+               }
+               for (std::size_t i = 0; i < trx->proofs.size(); ++i)
+               {
+                  TransactionTrace trace;
+                  verifyBc.verifyProof(*trx, trace, i, std::nullopt);
+               }
             }
+         };
+         std::size_t numTransactions = b.transactions.size();
+         if (!verifyPool || numTransactions < 2)
+         {
+            std::size_t next = 0;
+            verifyAll(*systemContext, [&]() -> const SignedTransaction*
+                      { return next < numTransactions ? &b.transactions[next++] : nullptr; });
+         }
+         else
+         {
+            std::atomic<std::size_t> next{0};
+            auto numJobs = std::min<std::size_t>(verifyPool->numThreads(), numTransactions);
+            verifyPool->runAll(numJobs,
+                               [&](SystemContext& sc)
+                               {
+                                  auto nextTransaction = [&]() -> const SignedTransaction*
+                                  {
+                                     auto i = next++;
+                                     return i < numTransactions ? &b.transactions[i] : nullptr;
+                                  };
+                                  try
+                                  {
+                                     verifyAll(sc, nextTransaction);
+                                  }
+                                  catch (...)
+                                  {
+                                     // The block is invalid. Stop the other threads early.
+                                     next = numTransactions;
+                                     throw;
+                                  }
+                               });
          }
+         if (numReused)
+            PSIBASE_LOG(blockLogger, debug)
+                << "Reused the proofs of " << numReused << " speculative transactions";
       }
       // \pre the state of prev has been set
       bool execute_block(BlockHeaderState* prev, BlockHeaderState* state, auto&& on_accept_block)
@@ -532,6 +712,8 @@ namespace psibase
          std::error_code ec{};
          if (!state->revision)
          {
+            // The speculative block shares the writer
+            speculativeBlock.reset();
             BlockContext ctx(*systemContext, prev->revision, writer, false);
             auto         blockPtr = get(state->blockId());
             PSIBASE_LOG_CONTEXT_BLOCK(state->info.header, state->blockId());
@@ -559,29 +741,6 @@ namespace psibase
          }
          return true;
       }
-      // TODO: run this in a separate thread and make it interruptable
-      bool execute_fork(auto iter, auto end, auto&& on_accept_block)
-      {
-         if (iter != end)
-         {
-            auto* prev = get_state(iter->second);
-            assert(prev->revision);
-            ++iter;
-            for (; iter != end; ++iter)
-            {
-               BlockHeaderState* nextState = get_state(iter->second);
-               if (!execute_block(prev, nextState, on_accept_block))
-               {
-                  byBlocknumIndex.erase(iter, end);
-                  blacklist_subtree(nextState);
-                  return false;
-               }
-               systemContext->sharedDatabase.setHead(*writer, nextState->revision);
-               prev = nextState;
-            }
-         }
-         return true;
-      }
       BlockHeaderState* get_state(const id_type& id)
       {
          auto pos = states.find(id);
@@ -606,8 +765,23 @@ namespace psibase
             return {head->producers, head->nextProducers};
          }
       }
+      // During a fork switch, the best chain past the fork point still holds
+      // the old blocks, which gc would keep instead of the new ones. The
+      // commit stops at the fork point, and the rest is applied when the
+      // switch finishes. It refers to the chain of the block being executed,
+      // if this is called while accepting it, and otherwise to the best chain.
       bool commit(BlockNum num)
       {
+         if (switchProgress && num > switchProgress->forkPoint)
+         {
+            const BlockHeaderState* chainHead = switchBlock ? switchBlock : head;
+            auto                    target    = std::min(num, chainHead->blockNum());
+            if (target > switchProgress->forkPoint &&
+                (!switchCommit || target > switchCommit->num()))
+               switchCommit = ExtendedBlockId{
+                   get_ancestor(chainHead->blockId(), chainHead->blockNum() - target), target};
+            num = switchProgress->forkPoint;
+         }
          auto newCommitIndex = std::max(std::min(num, head->blockNum()), commitIndex);
          auto result         = newCommitIndex != commitIndex;
          commitIndex         = newCommitIndex;
@@ -726,10 +900,15 @@ namespace psibase
       }
 
       // Block production:
+      //
+      // Production builds on the head, so the caller must wait until
+      // getSwitchProgress() is empty.
       template <typename... A>
       void start_block(A&&... a)
       {
          assert(!blockContext);
+         assert(!switchProgress);
+         speculativeBlock.reset();
          blockContext.emplace(*systemContext, head->revision, writer, true);
          blockContext->start(std::forward<A>(a)...);
          blockContext->callStartBlock();
@@ -751,7 +930,7 @@ namespace psibase
             {
                auto callback = std::move(switchForkCallback);
                // TODO: get rid of this. the caller should handle nullptr and call async_switch_fork instead of calling it here.
-               async_switch_fork(std::move(callback), [](const void*) {});
+               async_switch_fork(std::move(callback), acceptBlockCallback);
             }
             return nullptr;
          }
@@ -802,6 +981,67 @@ namespace psibase
 
       bool isProducing() const { return !!blockContext; }
 
+      // A node which isn't producing runs the transactions that it receives
+      // on a block which is never committed, on top of the head. This loads
+      // the services and the database nodes which the block that includes
+      // the transactions will need. If proofsVerified, the transaction's
+      // proofs passed against the head's state, so they are not checked again
+      // if it is in the next block.
+      //
+      // The speculative block is discarded when the head changes.
+      void speculate(const SignedTransaction&                 trx,
+                     bool                                     proofsVerified,
+                     std::optional<std::chrono::microseconds> watchdogLimit)
+      {
+         if (blockContext)
+            return;
+         if (speculativeRevision != head->revision)
+         {
+            speculativeBlock.reset();
+            speculativeProofs.clear();
+            speculativeRevision = head->revision;
+            numSpeculative      = 0;
+         }
+         if (numSpeculative >= maxSpeculativeTransactions)
+            return;
+         ++numSpeculative;
+         if (proofsVerified)
+            speculativeProofs.insert(sha256(trx));
+         try
+         {
+            if (!speculativeBlock)
+            {
+               auto& bc = speculativeBlock.emplace(*systemContext, head->revision, writer, true);
+               try
+               {
+                  bc.start();
+                  bc.callStartBlock();
+               }
+               catch (...)
+               {
+                  speculativeBlock.reset();
+                  throw;
+               }
+            }
+            if (speculativeBlock->needGenesisAction)
+               return;
+            TransactionTrace trace;
+            speculativeBlock->pushTransaction(trx, trace, watchdogLimit);
+         }
+         catch (std::exception& e)
+         {
+            // A failed transaction is undone, but anything else leaves the
+            // block unusable
+            if (speculativeBlock && !speculativeBlock->active)
+               speculativeBlock.reset();
+            PSIBASE_LOG(logger, debug) << "Speculative transaction failed: " << e.what();
+         }
+      }
+
+      // Verifies the transaction proofs of incoming blocks on pool's threads.
+      // The pool must outlive any block execution.
+      void setVerifyPool(VerifyPool* pool) { verifyPool = pool; }
+
       auto& getLogger() { return logger; }
 
       explicit ForkDb(SystemContext*          sc,
@@ -921,8 +1161,19 @@ namespace psibase
 
      private:
       std::optional<BlockContext>                               blockContext;
+      std::optional<BlockContext>                               speculativeBlock;
+      ConstRevisionPtr                                          speculativeRevision;
+      std::set<Checksum256>                                     speculativeProofs;
+      std::size_t                                               numSpeculative = 0;
       std::function<void(BlockHeader*)>                         switchForkCallback;
+      std::function<void(BlockHeaderState*)> acceptBlockCallback = [](BlockHeaderState*) {};
+      std::function<void(std::function<void()>)>                switchForkPost;
+      std::optional<SwitchProgress>                             switchProgress;
+      bool                                                      switchStepPosted = false;
+      const BlockHeaderState*                                   switchBlock      = nullptr;
+      std::optional<ExtendedBlockId>                            switchCommit;
       SystemContext*                                            systemContext = nullptr;
+      VerifyPool*                                               verifyPool    = nullptr;
       WriterPtr                                                 writer;
       CheckedProver                                             prover;
       BlockNum                                                  commitIndex = 1;
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <psibase/db.hpp>
+
+#include <iosfwd>
+
+namespace psibase
+{
+   // Snapshot file layout:
+   //
+   //    magic    "psisnap\0"
+   //    record   SnapshotHeader
+   //    record   SnapshotChunk      (zero or more)
+   //    record   SnapshotFooter
+   //
+   // Each record is a little-endian uint32_t size, the sha256 of the data,
+   // and the data, which is a fracpacked SnapshotRecord. Chunks hold rows of
+   // a single database in key order; keys increase across the chunks of a
+   // database. New fields may be appended to the structs; readers reject
+   // files whose version is newer than snapshotVersion.
+   inline constexpr uint32_t snapshotVersion = 1;
+
+   struct SnapshotHeader
+   {
+      uint32_t                                version = snapshotVersion;
+      Checksum256                             blockId;
+      std::optional<std::vector<Checksum256>> stateRoots;
+   };
+   PSIO_REFLECT(SnapshotHeader, version, blockId, stateRoots)
+
+   struct SnapshotRow
+   {
+      std::vector<char> key;
+      std::vector<char> value;
+   };
+   PSIO_REFLECT(SnapshotRow, key, value)
+
+   struct SnapshotChunk
+   {
+      uint32_t                 db;  // DbId
+      std::vector<SnapshotRow> rows;
+   };
+   PSIO_REFLECT(SnapshotChunk, db, rows)
+
+   struct SnapshotFooter
+   {
+      uint64_t numChunks = 0;
+      uint64_t numRows   = 0;
+   };
+   PSIO_REFLECT(SnapshotFooter, numChunks, numRows)
+
+   using SnapshotRecord = std::variant<SnapshotHeader, SnapshotChunk, SnapshotFooter>;
+
+   // Writes the head state of shared to out. Returns the block id.
+   Checksum256 exportSnapshot(SharedDatabase& shared, std::ostream& out);
+
+   // Loads a snapshot into shared, which must not contain a chain yet, and
+   // makes it the head. Chunks are verified and decoded on numThreads
+   // threads while the calling thread reads the file and builds the trie.
+   // Returns the block id.
+   Checksum256 importSnapshot(SharedDatabase& shared, std::istream& in, unsigned numThreads);
+}  // namespace psibase
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace psibase
+{
+   // Holds incoming transactions until the chain thread takes them.
+   //
+   // A transaction counts against maxPending from push until the consumer
+   // calls release, so transactions which are still being verified or
+   // executed count too. While several sources (e.g. client addresses) have
+   // pending transactions, each of them may only hold an equal share of
+   // maxPending, but at least one. pop takes transactions from the sources
+   // in turn.
+   //
+   // onReady is called, without holding the lock, when a transaction arrives
+   // and the consumer isn't already scheduled. The consumer keeps calling pop
+   // until it returns false; after that the next push calls onReady again.
+   template <typename T>
+   class TransactionQueue
+   {
+     public:
+      enum class PushResult
+      {
+         accepted,
+         full,
+         closed,
+      };
+
+      TransactionQueue(std::size_t maxPending, std::function<void()> onReady)
+          : maxPending{std::max(maxPending, std::size_t{1})}, onReady{std::move(onReady)}
+      {
+      }
+
+      // item is only moved from if it's accepted, so that the caller can
+      // still answer it otherwise.
+      PushResult push(const std::string& source, T&& item)
+      {
+         {
+            std::lock_guard lock{mutex};
+            if (closed)
+               return PushResult::closed;
+            auto pos        = sources.try_emplace(source).first;
+            auto numSources = sources.size();
+            auto share      = std::max<std::size_t>(1, maxPending / numSources);
+            if (totalPending >= maxPending || pos->second.pending >= share)
+            {
+               if (pos->second.pending == 0)
+                  sources.erase(pos);
+               return PushResult::full;
+            }
+            ++totalPending;
+            ++pos->second.pending;
+            if (pos->second.queued.empty())
+               ready.push_back(pos);
+            pos->second.queued.push_back(std::move(item));
+            if (scheduled)
+               return PushResult::accepted;
+            scheduled = true;
+         }
+         onReady();
+         return PushResult::accepted;
+      }
+
+      // Moves up to max transactions into out. Returns true if there are
+      // more, in which case the consumer must call pop again later.
+      bool pop(std::vector<T>& out, std::size_t max)
+      {
+         std::lock_guard lock{mutex};
+         for (std::size_t i = 0; i < max && !ready.empty(); ++i)
+         {
+            auto pos = ready.front();
+            ready.pop_front();
+            out.push_back(std::move(pos->second.queued.front()));
+            pos->second.queued.pop_front();
+            if (!pos->second.queued.empty())
+               ready.push_back(pos);
+         }
+         if (ready.empty())
+            scheduled = false;
+         return scheduled;
+      }
+
+      // Called once for each accepted transaction after it has been answered
+      void release(const std::string& source)
+      {
+         std::lock_guard lock{mutex};
+         auto            pos = sources.find(source);
+         if (pos == sources.end())
+            return;
+         --totalPending;
+         if (--pos->second.pending == 0)
+            sources.erase(pos);
+      }
+
+      // Rejects any later push. Returns the transactions which haven't been
+      // popped yet; the caller still has to release them.
+      std::vector<T> close()
+      {
+         std::vector<T> result;
+         {
+            std::lock_guard lock{mutex};
+            closed = true;
+         }
+         while (pop(result, std::size_t(-1)))
+         {
+         }
+         return result;
+      }
+
+      std::size_t pending()
+      {
+         std::lock_guard lock{mutex};
+         return totalPending;
+      }
+
+     private:
+      struct Source
+      {
+         std::size_t   pending = 0;
+         std::deque<T> queued;
+      };
+      using SourceMap = std::map<std::string, Source, std::less<>>;
+
+      std::mutex                               mutex;
+      std::size_t                              maxPending;
+      std::function<void()>                    onReady;
+      std::size_t                              totalPending = 0;
+      SourceMap                                sources;
+      std::deque<typename SourceMap::iterator> ready;  // sources with queued transactions
+      bool                                     scheduled = false;
+      bool                                     closed    = false;
+   };  // TransactionQueue
+}  // namespace psibase
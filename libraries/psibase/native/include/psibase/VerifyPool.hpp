@@ -0,0 +1,59 @@
+#pragma once
+
+#include <psibase/SystemContext.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace psibase
+{
+   // Runs work which only reads the state at the start of a block, such as
+   // transaction proofs and first auth checks, on background threads. Each
+   // thread has its own SystemContext from the SharedState, so that they
+   // don't share execution memories.
+   //
+   // The destructor finishes the queued jobs before joining the threads, so
+   // every job runs exactly once.
+   class VerifyPool
+   {
+     public:
+      using Job = std::function<void(SystemContext&)>;
+
+      VerifyPool(std::shared_ptr<SharedState> sharedState, unsigned numThreads);
+      ~VerifyPool();
+
+      VerifyPool(const VerifyPool&)            = delete;
+      VerifyPool& operator=(const VerifyPool&) = delete;
+
+      // Runs job on one of the threads. Jobs start in the order they were
+      // posted, but may finish in any order. An exception thrown by the job
+      // is logged and otherwise ignored.
+      void post(Job job);
+
+      // Runs job on numJobs threads at once, ahead of anything already queued,
+      // and waits for all of them to finish. If any of them throw, the first
+      // exception is rethrown after the rest finish. This must not be called
+      // from one of the pool's own threads.
+      void runAll(unsigned numJobs, const Job& job);
+
+      unsigned numThreads() const { return threads.size(); }
+
+      // Number of jobs which haven't started yet
+      size_t queued();
+
+     private:
+      void run();
+
+      std::shared_ptr<SharedState> sharedState;
+      std::mutex                   mutex;
+      std::condition_variable      queueChanged;
+      std::deque<Job>              queue;
+      bool                         stopping = false;
+      std::vector<std::thread>     threads;
+   };  // VerifyPool
+}  // namespace psibase
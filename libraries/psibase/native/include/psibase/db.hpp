@@ -9,6 +9,7 @@
 #include <psio/to_key.hpp>
 
 #include <boost/filesystem/path.hpp>
+#include <functional>
 
 namespace triedent
 {
@@ -23,6 +24,96 @@ namespace psibase
    using Writer    = triedent::write_session;
    using WriterPtr = std::shared_ptr<Writer>;
 
+   struct RootReleaseStats
+   {
+      uint64_t queueDepth     = 0;  // Dropped revisions waiting to be released
+      uint64_t maxQueueDepth  = 0;
+      uint64_t released       = 0;
+      uint64_t blocked        = 0;  // Number of times the queue was full
+      uint64_t totalLatencyNs = 0;  // Summed over released; includes time spent queued
+      uint64_t maxLatencyNs   = 0;
+   };
+   PSIO_REFLECT(RootReleaseStats,
+                queueDepth,
+                maxQueueDepth,
+                released,
+                blocked,
+                totalLatencyNs,
+                maxLatencyNs)
+
+   // See triedent::ring_allocator::level_stats
+   struct DatabaseLevelStats
+   {
+      uint64_t capacity        = 0;
+      uint64_t used            = 0;
+      uint64_t free            = 0;
+      uint64_t swapLag         = 0;
+      uint64_t hits            = 0;
+      uint64_t misses          = 0;
+      uint64_t swappedBytes    = 0;
+      double   swapBytesPerSec = 0;
+      bool     hugePages       = false;
+   };
+   PSIO_REFLECT(DatabaseLevelStats,
+                capacity,
+                used,
+                free,
+                swapLag,
+                hits,
+                misses,
+                swappedBytes,
+                swapBytesPerSec,
+                hugePages)
+
+   // See triedent::ring_allocator::memory_config
+   struct DatabaseMemoryConfig
+   {
+      bool hugePages = false;
+      bool prefault  = false;
+      // Called while prefaulting with the level ("hot" or "warm") and the bytes done and total
+      std::function<void(std::string_view level, uint64_t done, uint64_t total)> onPrefault;
+   };
+
+   // See triedent::database::scrub_stats
+   struct DatabaseScrubStats
+   {
+      uint64_t    passes = 0;
+      uint64_t    nodes  = 0;
+      uint64_t    bytes  = 0;
+      uint64_t    errors = 0;
+      std::string lastError;
+   };
+   PSIO_REFLECT(DatabaseScrubStats, passes, nodes, bytes, errors, lastError)
+
+   struct DatabaseStats
+   {
+      DatabaseLevelStats hot;
+      DatabaseLevelStats warm;
+      DatabaseLevelStats cool;
+      DatabaseLevelStats cold;
+      uint64_t           usedObjectIds   = 0;
+      uint64_t           maxObjectIds    = 0;
+      uint64_t           freeSpaceWaits  = 0;
+      uint32_t           activeSessions  = 0;
+      uint32_t           replicaSessions = 0;  // Sessions of read-only processes
+      uint32_t           deferredRoots   = 0;  // Old heads which read-only processes still use
+      RootReleaseStats   rootRelease;
+      DatabaseScrubStats scrub;
+   };
+   PSIO_REFLECT(DatabaseStats,
+                hot,
+                warm,
+                cool,
+                cold,
+                usedObjectIds,
+                maxObjectIds,
+                freeSpaceWaits,
+                activeSessions,
+                replicaSessions,
+                deferredRoots,
+                rootRelease,
+                scrub)
+
    struct SharedDatabaseImpl;
    struct SharedDatabase
    {
@@ -31,6 +122,7 @@ namespace psibase
       SharedDatabase() = default;
       SharedDatabase(const boost::filesystem::path& dir,
                      bool                           allowSlow,
+                     const DatabaseMemoryConfig&    memory         = {},
                      uint64_t                       max_objects    = 1'000'000'000ul,
                      uint64_t                       hot_addr_bits  = 32,
                      uint64_t                       warm_addr_bits = 32,
@@ -39,6 +131,12 @@ namespace psibase
       SharedDatabase(const SharedDatabase&) = default;
       SharedDatabase(SharedDatabase&&)      = default;
 
+      // Opens a database which another process has open for writing. There's
+      // no writer; getHead returns the head which the writer stored most
+      // recently. The writer can't free a head while a revision from it is
+      // alive, so don't hold on to revisions.
+      static SharedDatabase openReadOnly(const boost::filesystem::path& dir);
+
       SharedDatabase& operator=(const SharedDatabase&) = default;
       SharedDatabase& operator=(SharedDatabase&&)      = default;
 
@@ -56,6 +154,32 @@ namespace psibase
                                                     const Checksum256&    blockId,
                                                     std::span<const char> key);
       bool                             isSlow() const;
+      bool                             isReadOnly() const;
+
+      // Returns a SHA-256 hash of each database's content, indexed by DbId, as
+      // of the end of a block. Database::writeRevision records these. Hashes
+      // of unchanged subtrees are cached, so recording them costs about as
+      // much as the changes the block made.
+      std::optional<std::vector<Checksum256>> getStateRoots(Writer&            writer,
+                                                            const Checksum256& blockId);
+
+      // Grows the database while it's in use, without recreating it. Sizes
+      // which aren't larger than the current ones are ignored.
+      void grow(uint64_t max_objects,
+                uint64_t hot_addr_bits,
+                uint64_t warm_addr_bits,
+                uint64_t cool_addr_bits,
+                uint64_t cold_addr_bits);
+
+      // Dropped revisions are released on a background thread
+      RootReleaseStats getRootReleaseStats() const;
+
+      // Starts checking the database for corruption in the background, within
+      // the given budget. See triedent::scrubber.
+      void startScrubber(uint64_t nodesPerSec, uint64_t bytesPerSec);
+
+      // Cheap enough to poll periodically
+      DatabaseStats getStats() const;
    };
 
    struct DatabaseImpl;
@@ -128,10 +252,15 @@ namespace psibase
       void             abort(Session&);
 
       // TODO: kvPutRaw, kvRemoveRaw: return deltas
-      // TODO: getters: pass in input buffers instead of returning KVResult
 
       void kvPutRaw(DbId db, psio::input_stream key, psio::input_stream value);
       void kvRemoveRaw(DbId db, psio::input_stream key);
+
+      // Stores rows, which must be sorted by key and unique, in a single pass
+      // over the tree. This is much faster than kvPutRaw for bulk loads.
+      void kvPutManyRaw(DbId                                                               db,
+                        std::span<const std::pair<psio::input_stream, psio::input_stream>> rows);
+
       std::optional<psio::input_stream> kvGetRaw(DbId db, psio::input_stream key);
       std::optional<KVResult>           kvGreaterEqualRaw(DbId               db,
                                                           psio::input_stream key,
@@ -139,6 +268,36 @@ namespace psibase
       std::optional<KVResult> kvLessThanRaw(DbId db, psio::input_stream key, size_t matchKeySize);
       std::optional<KVResult> kvMaxRaw(DbId db, psio::input_stream key);
 
+      // These copy the result straight out of the database into the caller's
+      // buffers, which are left untouched if there's no match. The overloads
+      // above go through an internal buffer instead.
+      bool kvGetRaw(DbId db, psio::input_stream key, std::vector<char>& value);
+      bool kvGreaterEqualRaw(DbId               db,
+                             psio::input_stream key,
+                             size_t             matchKeySize,
+                             std::vector<char>& resultKey,
+                             std::vector<char>& value);
+      bool kvLessThanRaw(DbId               db,
+                         psio::input_stream key,
+                         size_t             matchKeySize,
+                         std::vector<char>& resultKey,
+                         std::vector<char>& value);
+      bool kvMaxRaw(DbId               db,
+                    psio::input_stream key,
+                    std::vector<char>& resultKey,
+                    std::vector<char>& value);
+
+      // Returns the size of the value without copying it
+      std::optional<size_t> kvValueSizeRaw(DbId db, psio::input_stream key);
+
+      // Looks up keys, which must be sorted and unique, in a single pass over
+      // the tree. The values are appended to arena; the results point into it
+      // and are valid until arena is modified.
+      std::vector<std::optional<psio::input_stream>> kvGetManyRaw(
+          DbId                                db,
+          std::span<const psio::input_stream> keys,
+          std::vector<char>&                  arena);
+
       template <typename K, typename V>
       auto kvPut(DbId db, const K& key, const V& value)
           -> std::enable_if_t<!psio::is_std_optional<V>(), void>
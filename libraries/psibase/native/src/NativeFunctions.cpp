@@ -227,21 +227,11 @@ namespace psibase
          return self.result_value.size();
       }
 
-      uint32_t setResult(NativeFunctions& self, const std::optional<psio::input_stream>& o)
+      // For the Database functions which fill result_key and result_value directly
+      uint32_t foundResult(NativeFunctions& self, bool found)
       {
-         if (!o)
+         if (!found)
             return clearResult(self);
-         self.result_key.clear();
-         self.result_value.assign(o->pos, o->end);
-         return self.result_value.size();
-      }
-
-      uint32_t setResult(NativeFunctions& self, const std::optional<Database::KVResult>& o)
-      {
-         if (!o)
-            return clearResult(self);
-         self.result_key.assign(o->key.pos, o->key.end);
-         self.result_value.assign(o->value.pos, o->value.end);
          return self.result_value.size();
       }
    }  // namespace
@@ -387,11 +377,11 @@ namespace psibase
                 delta.valueBytes += value.size();
                 if (w.refundable)
                 {
-                   if (auto existing = database.kvGetRaw(w.db, {key.data(), key.size()}))
+                   if (auto existing = database.kvValueSizeRaw(w.db, {key.data(), key.size()}))
                    {
                       delta.records -= 1;
                       delta.keyBytes -= key.size();
-                      delta.valueBytes -= existing->remaining();
+                      delta.valueBytes -= *existing;
                    }
                 }
              }
@@ -441,13 +431,14 @@ namespace psibase
                     auto w = getDbWrite(*this, db, {key.data(), key.size()});
                     if (w.refundable)
                     {
-                       if (auto existing = database.kvGetRaw(w.db, {key.data(), key.size()}))
+                       if (auto existing =
+                               database.kvValueSizeRaw(w.db, {key.data(), key.size()}))
                        {
                           auto& delta =
                               transactionContext.kvResourceDeltas[KvResourceKey{code.codeNum, db}];
                           delta.records -= 1;
                           delta.keyBytes -= key.size();
-                          delta.valueBytes -= existing->remaining();
+                          delta.valueBytes -= *existing;
                        }
                     }
                     database.kvRemoveRaw(w.db, {key.data(), key.size()});
@@ -458,9 +449,11 @@ namespace psibase
    {
       return timeDb(  //
           *this,
-          [&] {
-             return setResult(*this,
-                              database.kvGetRaw(getDbRead(*this, db), {key.data(), key.size()}));
+          [&]
+          {
+             result_key.clear();
+             return foundResult(*this, database.kvGetRaw(getDbRead(*this, db),
+                                                         {key.data(), key.size()}, result_value));
           });
    }
 
@@ -471,7 +464,9 @@ namespace psibase
           [&]
           {
              auto m = getDbReadSequential(*this, db);
-             return setResult(*this, database.kvGetRaw(m, psio::convert_to_key(indexNumber)));
+             result_key.clear();
+             return foundResult(
+                 *this, database.kvGetRaw(m, psio::convert_to_key(indexNumber), result_value));
           });
    }
 
@@ -487,9 +482,9 @@ namespace psibase
              if (keyHasServicePrefix(db))
                 check(matchKeySize >= sizeof(AccountNumber::value),
                       "matchKeySize is smaller than 8 bytes");
-             return setResult(
+             return foundResult(
                  *this, database.kvGreaterEqualRaw(getDbRead(*this, db), {key.data(), key.size()},
-                                                   matchKeySize));
+                                                   matchKeySize, result_key, result_value));
           });
    }
 
@@ -505,9 +500,9 @@ namespace psibase
              if (keyHasServicePrefix(db))
                 check(matchKeySize >= sizeof(AccountNumber::value),
                       "matchKeySize is smaller than 8 bytes");
-             return setResult(*this,
-                              database.kvLessThanRaw(getDbRead(*this, db), {key.data(), key.size()},
-                                                     matchKeySize));
+             return foundResult(
+                 *this, database.kvLessThanRaw(getDbRead(*this, db), {key.data(), key.size()},
+                                               matchKeySize, result_key, result_value));
           });
    }
 
@@ -519,8 +514,9 @@ namespace psibase
           {
              if (keyHasServicePrefix(db))
                 check(key.size() >= sizeof(AccountNumber::value), "key is shorter than 8 bytes");
-             return setResult(*this,
-                              database.kvMaxRaw(getDbRead(*this, db), {key.data(), key.size()}));
+             return foundResult(*this, database.kvMaxRaw(getDbRead(*this, db),
+                                                         {key.data(), key.size()}, result_key,
+                                                         result_value));
           });
    }
 
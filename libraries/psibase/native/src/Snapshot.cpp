@@ -0,0 +1,287 @@
+#include <psibase/Snapshot.hpp>
+
+#include <psibase/check.hpp>
+#include <psibase/crypto.hpp>
+#include <psibase/nativeTables.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <thread>
+
+namespace psibase
+{
+   namespace
+   {
+      constexpr char   snapshotMagic[8] = {'p', 's', 'i', 's', 'n', 'a', 'p', '\0'};
+      constexpr size_t chunkBytes       = 1 << 20;
+      constexpr size_t maxRecordBytes   = 1 << 30;
+
+      void writeRecord(std::ostream& out, const SnapshotRecord& record)
+      {
+         auto data = psio::convert_to_frac(record);
+         check(data.size() <= maxRecordBytes, "snapshot record is too large");
+         uint32_t size = data.size();
+         char     prefix[sizeof(size)];
+         for (size_t i = 0; i < sizeof(size); ++i)
+            prefix[i] = static_cast<char>(size >> (8 * i));
+         auto hash = sha256(data.data(), data.size());
+         out.write(prefix, sizeof(prefix));
+         out.write(reinterpret_cast<const char*>(hash.data()), hash.size());
+         out.write(data.data(), data.size());
+         check(!!out, "failed to write snapshot");
+      }
+
+      struct RawRecord
+      {
+         Checksum256       hash;
+         std::vector<char> data;
+      };
+
+      // Returns false at end of file
+      bool readRecord(std::istream& in, RawRecord& record)
+      {
+         unsigned char prefix[4];
+         if (!in.read(reinterpret_cast<char*>(prefix), sizeof(prefix)))
+         {
+            check(in.gcount() == 0, "snapshot is truncated");
+            return false;
+         }
+         uint32_t size = 0;
+         for (size_t i = 0; i < sizeof(prefix); ++i)
+            size |= uint32_t(prefix[i]) << (8 * i);
+         check(size <= maxRecordBytes, "snapshot record is too large");
+         record.data.resize(size);
+         in.read(reinterpret_cast<char*>(record.hash.data()), record.hash.size());
+         in.read(record.data.data(), size);
+         check(!!in, "snapshot is truncated");
+         return true;
+      }
+
+      SnapshotRecord decodeRecord(const RawRecord& record)
+      {
+         check(sha256(record.data.data(), record.data.size()) == record.hash,
+               "snapshot checksum mismatch");
+         return psio::convert_from_frac<SnapshotRecord>(record.data);
+      }
+
+      // Verifies and decodes records on a fixed set of threads
+      class DecodePool
+      {
+        public:
+         explicit DecodePool(unsigned numThreads)
+         {
+            for (unsigned i = 0; i < numThreads; ++i)
+               threads.emplace_back([this] { run(); });
+         }
+
+         // Records which haven't been decoded yet are dropped
+         ~DecodePool()
+         {
+            {
+               std::lock_guard lock{mutex};
+               stopping = true;
+            }
+            queueChanged.notify_all();
+            for (auto& t : threads)
+               t.join();
+         }
+
+         std::future<SnapshotRecord> push(RawRecord record)
+         {
+            std::packaged_task<SnapshotRecord()> task{[record = std::move(record)]
+                                                      { return decodeRecord(record); }};
+            auto                                 result = task.get_future();
+            {
+               std::lock_guard lock{mutex};
+               queue.push_back(std::move(task));
+            }
+            queueChanged.notify_one();
+            return result;
+         }
+
+        private:
+         void run()
+         {
+            std::unique_lock lock{mutex};
+            while (true)
+            {
+               queueChanged.wait(lock, [&] { return stopping || !queue.empty(); });
+               if (stopping)
+                  break;
+               auto task = std::move(queue.front());
+               queue.pop_front();
+               lock.unlock();
+               // Exceptions are stored in the future
+               task();
+               lock.lock();
+            }
+         }
+
+         std::mutex                                       mutex;
+         std::condition_variable                          queueChanged;
+         std::deque<std::packaged_task<SnapshotRecord()>> queue;
+         bool                                             stopping = false;
+         std::vector<std::thread>                         threads;
+      };
+
+      bool keyLess(const std::vector<char>& a, const std::vector<char>& b)
+      {
+         return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(),
+                                             [](char x, char y)
+                                             { return (unsigned char)x < (unsigned char)y; });
+      }
+   }  // namespace
+
+   Checksum256 exportSnapshot(SharedDatabase& shared, std::ostream& out)
+   {
+      Database db{shared, shared.getHead()};
+      auto     session = db.startRead();
+      auto     status  = db.kvGet<StatusRow>(StatusRow::db, statusKey());
+      check(status && status->head.has_value(), "database has no chain to export");
+
+      SnapshotHeader header{.blockId = status->head->blockId};
+      {
+         auto writer       = shared.createWriter();
+         header.stateRoots = shared.getStateRoots(*writer, header.blockId);
+      }
+
+      out.write(snapshotMagic, sizeof(snapshotMagic));
+      writeRecord(out, header);
+
+      SnapshotFooter    footer;
+      std::vector<char> key, next, value;
+      for (uint32_t i = 0; i < numDatabases; ++i)
+      {
+         SnapshotChunk chunk{.db = i};
+         size_t        bytes = 0;
+         auto          flush = [&]
+         {
+            if (chunk.rows.empty())
+               return;
+            writeRecord(out, chunk);
+            ++footer.numChunks;
+            footer.numRows += chunk.rows.size();
+            chunk.rows.clear();
+            bytes = 0;
+         };
+         key.clear();
+         while (db.kvGreaterEqualRaw((DbId)i, key, 0, next, value))
+         {
+            bytes += next.size() + value.size();
+            chunk.rows.push_back({next, value});
+            if (bytes >= chunkBytes)
+               flush();
+            // The smallest key which is greater than next
+            key.assign(next.begin(), next.end());
+            key.push_back(0);
+         }
+         flush();
+      }
+
+      writeRecord(out, footer);
+      out.flush();
+      check(!!out, "failed to write snapshot");
+      return header.blockId;
+   }
+
+   Checksum256 importSnapshot(SharedDatabase& shared, std::istream& in, unsigned numThreads)
+   {
+      char magic[sizeof(snapshotMagic)];
+      check(in.read(magic, sizeof(magic)) && !std::memcmp(magic, snapshotMagic, sizeof(magic)),
+            "not a snapshot file");
+
+      RawRecord raw;
+      check(readRecord(in, raw), "snapshot is truncated");
+      auto first = decodeRecord(raw);
+      check(std::holds_alternative<SnapshotHeader>(first), "snapshot does not start with a header");
+      auto header = std::get<SnapshotHeader>(std::move(first));
+      check(header.version <= snapshotVersion,
+            "snapshot version " + std::to_string(header.version) + " is not supported");
+
+      Database db{shared, shared.getHead()};
+      {
+         auto session = db.startRead();
+         check(!db.kvGet<StatusRow>(StatusRow::db, statusKey()),
+               "snapshots can only be imported into an empty database");
+      }
+      auto writer  = shared.createWriter();
+      auto session = db.startWrite(writer);
+
+      // Checksums and unpacking run ahead on the pool while this thread
+      // feeds the decoded chunks, in file order, to the single tree writer.
+      numThreads = std::max(numThreads, 1u);
+      std::deque<std::future<SnapshotRecord>> pending;
+      DecodePool                              pool{numThreads};
+      bool                                    eof  = false;
+      auto                                    fill = [&]
+      {
+         while (!eof && pending.size() < 2 * numThreads)
+         {
+            RawRecord next;
+            if (!readRecord(in, next))
+            {
+               eof = true;
+               break;
+            }
+            pending.push_back(pool.push(std::move(next)));
+         }
+      };
+
+      std::optional<SnapshotFooter>    footer;
+      SnapshotFooter                   loaded;
+      std::optional<uint32_t>          lastDb;
+      std::optional<std::vector<char>> lastKey;
+
+      std::vector<std::pair<psio::input_stream, psio::input_stream>> rows;
+      for (fill(); !pending.empty(); fill())
+      {
+         auto record = pending.front().get();
+         pending.pop_front();
+         check(!footer, "snapshot has data after the footer");
+         if (auto* f = std::get_if<SnapshotFooter>(&record))
+         {
+            footer = *f;
+            continue;
+         }
+         auto* chunk = std::get_if<SnapshotChunk>(&record);
+         check(chunk, "snapshot has more than one header");
+         check(chunk->db < numDatabases, "snapshot has an unknown database");
+         check(!lastDb || *lastDb <= chunk->db, "snapshot databases are out of order");
+         if (lastDb != chunk->db)
+         {
+            lastDb = chunk->db;
+            lastKey.reset();
+         }
+         rows.clear();
+         for (auto& row : chunk->rows)
+         {
+            check(!lastKey || keyLess(*lastKey, row.key), "snapshot keys are out of order");
+            lastKey = row.key;
+            rows.push_back({row.key, row.value});
+         }
+         db.kvPutManyRaw((DbId)chunk->db, rows);
+         ++loaded.numChunks;
+         loaded.numRows += rows.size();
+      }
+      check(footer.has_value(), "snapshot is truncated");
+      check(footer->numChunks == loaded.numChunks && footer->numRows == loaded.numRows,
+            "snapshot footer does not match its contents");
+
+      auto status = db.kvGet<StatusRow>(StatusRow::db, statusKey());
+      check(status && status->head && status->head->blockId == header.blockId,
+            "snapshot state does not match its block id");
+
+      auto revision = session.writeRevision(header.blockId);
+      if (header.stateRoots)
+         check(shared.getStateRoots(*writer, header.blockId) == header.stateRoots,
+               "snapshot state roots do not match");
+      shared.setHead(*writer, revision);
+      return header.blockId;
+   }
+}  // namespace psibase
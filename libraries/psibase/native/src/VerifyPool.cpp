@@ -0,0 +1,113 @@
+#include <psibase/VerifyPool.hpp>
+
+#include <psibase/log.hpp>
+
+namespace psibase
+{
+   VerifyPool::VerifyPool(std::shared_ptr<SharedState> sharedState, unsigned numThreads)
+       : sharedState{std::move(sharedState)}
+   {
+      numThreads = std::max(numThreads, 1u);
+      for (unsigned i = 0; i < numThreads; ++i)
+         threads.emplace_back([this] { run(); });
+   }
+
+   VerifyPool::~VerifyPool()
+   {
+      {
+         std::lock_guard lock{mutex};
+         stopping = true;
+      }
+      queueChanged.notify_all();
+      for (auto& t : threads)
+         t.join();
+   }
+
+   void VerifyPool::post(Job job)
+   {
+      {
+         std::lock_guard lock{mutex};
+         queue.push_back(std::move(job));
+      }
+      queueChanged.notify_one();
+   }
+
+   void VerifyPool::runAll(unsigned numJobs, const Job& job)
+   {
+      std::mutex              doneMutex;
+      std::condition_variable done;
+      unsigned                remaining = numJobs;
+      std::exception_ptr      error;
+
+      auto wrapper = [&](SystemContext& context)
+      {
+         std::exception_ptr e;
+         try
+         {
+            job(context);
+         }
+         catch (...)
+         {
+            e = std::current_exception();
+         }
+         std::lock_guard lock{doneMutex};
+         if (e && !error)
+            error = std::move(e);
+         // Notify while holding the lock, because the waiter owns done
+         if (--remaining == 0)
+            done.notify_one();
+      };
+      {
+         std::lock_guard lock{mutex};
+         for (unsigned i = 0; i < numJobs; ++i)
+            queue.push_front(wrapper);
+      }
+      queueChanged.notify_all();
+
+      std::unique_lock lock{doneMutex};
+      done.wait(lock, [&] { return remaining == 0; });
+      if (error)
+         std::rethrow_exception(error);
+   }
+
+   size_t VerifyPool::queued()
+   {
+      std::lock_guard lock{mutex};
+      return queue.size();
+   }
+
+   void VerifyPool::run()
+   {
+      auto             context = sharedState->getSystemContext();
+      std::unique_lock lock{mutex};
+      while (true)
+      {
+         queueChanged.wait(lock, [&] { return stopping || !queue.empty(); });
+         if (queue.empty())
+            break;
+         auto job = std::move(queue.front());
+         queue.pop_front();
+
+         lock.unlock();
+         // An exception must not end the thread; jobs which need to report
+         // errors catch them themselves, like runAll does.
+         try
+         {
+            job(*context);
+         }
+         catch (std::exception& e)
+         {
+            PSIBASE_LOG(loggers::generic::get(), error) << "VerifyPool job failed: " << e.what();
+         }
+         catch (...)
+         {
+            PSIBASE_LOG(loggers::generic::get(), error) << "VerifyPool job failed";
+         }
+         // Release whatever the job captured before waiting again
+         job = nullptr;
+         lock.lock();
+      }
+      lock.unlock();
+      sharedState->addSystemContext(std::move(context));
+   }
+}  // namespace psibase
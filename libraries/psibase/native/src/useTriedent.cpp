@@ -1,6 +1,11 @@
 #include <psibase/db.hpp>
 
 #include <boost/filesystem/operations.hpp>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory_resource>
+#include <thread>
 #include <triedent/database.hpp>
 
 // #define SANITY_CHECK
@@ -16,6 +21,7 @@ namespace psibase
    static constexpr uint8_t revisionHeadPrefix = 0;
    static constexpr uint8_t revisionByIdPrefix = 1;
    static constexpr uint8_t blockDataPrefix    = 2;
+   static constexpr uint8_t stateRootsPrefix   = 3;
 
    static const char revisionHeadKey[] = {revisionHeadPrefix};
 
@@ -27,11 +33,116 @@ namespace psibase
       return result;
    }
 
-   // TODO: move triedent::root destruction to a gc thread
+   static auto stateRootsById(const Checksum256& blockId)
+   {
+      auto result = revisionById(blockId);
+      result[0]   = stateRootsPrefix;
+      return result;
+   }
+
+   // Destroys roots on a dedicated thread. Dropping the last reference to a
+   // root recursively frees every node which only it kept alive. After a fork
+   // switch or a large irreversibility jump, that may be most of a revision,
+   // which would otherwise stall the thread which happened to drop it.
+   //
+   // The queue is bounded. release() blocks when it's full, so the worker
+   // can't fall arbitrarily far behind while holding on to storage.
+   class RootReleaser
+   {
+     public:
+      using Roots = std::vector<std::shared_ptr<triedent::root>>;
+
+      explicit RootReleaser(size_t maxQueued) : maxQueued{maxQueued}
+      {
+         thread = std::thread{[this] { run(); }};
+      }
+
+      ~RootReleaser()
+      {
+         {
+            std::lock_guard lock{mutex};
+            stopping = true;
+         }
+         queueChanged.notify_all();
+         thread.join();
+      }
+
+      void release(Roots&& roots)
+      {
+         // Nothing is freed if another reference exists; it's cheaper to drop
+         // those here than to queue them.
+         if (std::ranges::none_of(roots, [](auto& r) { return r && r.use_count() == 1; }))
+            return;
+
+         std::unique_lock lock{mutex};
+         if (queue.size() >= maxQueued)
+         {
+            ++stats.blocked;
+            queueChanged.wait(lock, [&] { return queue.size() < maxQueued; });
+         }
+         queue.push_back({std::move(roots), std::chrono::steady_clock::now()});
+         stats.queueDepth    = queue.size();
+         stats.maxQueueDepth = std::max(stats.maxQueueDepth, stats.queueDepth);
+         queueChanged.notify_all();
+      }
+
+      RootReleaseStats getStats()
+      {
+         std::lock_guard lock{mutex};
+         return stats;
+      }
+
+     private:
+      struct Item
+      {
+         Roots                                 roots;
+         std::chrono::steady_clock::time_point queued;
+      };
+
+      void run()
+      {
+         std::unique_lock lock{mutex};
+         while (true)
+         {
+            queueChanged.wait(lock, [&] { return stopping || !queue.empty(); });
+            if (queue.empty())
+               return;
+            auto item = std::move(queue.front());
+            queue.pop_front();
+            stats.queueDepth = queue.size();
+            queueChanged.notify_all();
+
+            lock.unlock();
+            item.roots.clear();
+            auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - item.queued)
+                               .count();
+            lock.lock();
+
+            ++stats.released;
+            stats.totalLatencyNs += latency;
+            stats.maxLatencyNs = std::max(stats.maxLatencyNs, uint64_t(latency));
+         }
+      }
+
+      const size_t            maxQueued;
+      std::mutex              mutex;
+      std::condition_variable queueChanged;
+      std::deque<Item>        queue;
+      bool                    stopping = false;
+      RootReleaseStats        stats    = {};
+      std::thread             thread;
+   };  // RootReleaser
+
    struct Revision
    {
       std::shared_ptr<triedent::root> roots[numDatabases];
 
+      // If set, then the roots are destroyed by releaser instead of by ~Revision.
+      // Only revisions which belong to blocks have this; the short-lived
+      // copies which block production makes are cheap to drop directly.
+      std::weak_ptr<RootReleaser> releaser;
+
 #ifdef SANITY_CHECK
       std::map<std::vector<char>, std::vector<char>, blob_less> _sanity[numDatabases];
 
@@ -55,6 +166,13 @@ namespace psibase
       Revision& operator=(const Revision&) = delete;
       Revision& operator=(Revision&&)      = default;
 
+      ~Revision()
+      {
+         if (auto r = releaser.lock())
+            r->release({std::make_move_iterator(std::begin(roots)),
+                        std::make_move_iterator(std::end(roots))});
+      }
+
       std::shared_ptr<Revision> clone() const
       {
          std::shared_ptr<Revision> result = std::make_shared<Revision>();
@@ -142,12 +260,15 @@ namespace psibase
       }
    };  // Revision
 
-   static std::shared_ptr<Revision> loadRevision(triedent::write_session&               s,
+   template <typename Session>
+   static std::shared_ptr<Revision> loadRevision(Session&                               s,
                                                  const std::shared_ptr<triedent::root>& topRoot,
                                                  std::span<const char>                  key,
+                                                 std::weak_ptr<RootReleaser>            releaser,
                                                  bool nullIfNotFound = false)
    {
       auto                                         revision = std::make_shared<Revision>();
+      revision->releaser                                    = std::move(releaser);
       std::vector<std::shared_ptr<triedent::root>> roots;
       if (s.get(topRoot, key, nullptr, &roots))
       {
@@ -178,13 +299,32 @@ namespace psibase
 
    struct SharedDatabaseImpl
    {
+      // Maximum number of dropped revisions waiting to be released
+      static constexpr size_t maxQueuedReleases = 64;
+
       std::shared_ptr<triedent::database> trie;
+      std::shared_ptr<RootReleaser>       releaser;
 
       std::mutex                      headMutex;
       std::shared_ptr<const Revision> head;
 
+      // Only used when read-only. head's roots are found within headTopRoot,
+      // which pins the writer's top root.
+      std::shared_ptr<triedent::read_session> replicaSession;
+      std::shared_ptr<triedent::root>         headTopRoot;
+
+      std::unique_ptr<triedent::scrubber> scrubber;
+
+      explicit SharedDatabaseImpl(const std::filesystem::path& dir)
+      {
+         trie           = std::make_shared<triedent::database>(dir.c_str(),
+                                                               triedent::database::read_only);
+         replicaSession = trie->start_read_session();
+      }
+
       SharedDatabaseImpl(const std::filesystem::path& dir,
                          bool                         allowSlow,
+                         const DatabaseMemoryConfig&  memory,
                          uint64_t                     max_objects,
                          uint64_t                     hot_addr_bits,
                          uint64_t                     warm_addr_bits,
@@ -208,15 +348,34 @@ namespace psibase
          {
             // std::cout << "Open existing " << dir << "\n";
          }
-         trie   = std::make_shared<triedent::database>(dir.c_str(), triedent::database::read_write,
-                                                     allowSlow);
-         auto s = trie->start_write_session();
-         head   = loadRevision(*s, s->get_top_root(), revisionHeadKey);
+         trie = std::make_shared<triedent::database>(
+             dir.c_str(), triedent::database::read_write, allowSlow,
+             triedent::database::memory_config{
+                 .huge_pages = memory.hugePages,
+                 .prefault   = memory.prefault,
+                 .progress   = [&](auto level, uint64_t done, uint64_t total)
+                 {
+                    if (memory.onPrefault)
+                       memory.onPrefault(level == triedent::ring_allocator::hot_cache ? "hot"
+                                                                                      : "warm",
+                                         done, total);
+                 },
+             });
+         releaser = std::make_shared<RootReleaser>(maxQueuedReleases);
+         auto s   = trie->start_write_session();
+         head     = loadRevision(*s, s->get_top_root(), revisionHeadKey, releaser);
       }
 
       auto getHead()
       {
          std::lock_guard<std::mutex> lock(headMutex);
+         if (replicaSession && (!head || !trie->is_top_root(headTopRoot)))
+         {
+            // Drop the old head first, so it doesn't pin an extra revision
+            head        = nullptr;
+            headTopRoot = trie->pin_top_root();
+            head        = loadRevision(*replicaSession, headTopRoot, revisionHeadKey, {});
+         }
          return head;
       }
 
@@ -234,14 +393,25 @@ namespace psibase
                          const Checksum256&       blockId,
                          const Revision&          r)
       {
+         // Only the nodes which changed since the previous revision need to be hashed
+         std::vector<char> stateRoots;
+         stateRoots.reserve(numDatabases * sizeof(triedent::node_hash));
+         for (auto& root : r.roots)
+         {
+            auto hash = session.get_hash(root);
+            stateRoots.insert(stateRoots.end(), hash.begin(), hash.end());
+         }
+
          auto topRoot = session.get_top_root();
          session.upsert(topRoot, revisionById(blockId), r.roots);
+         session.upsert(topRoot, stateRootsById(blockId), stateRoots);
          session.set_top_root(topRoot);
       }
    };  // SharedDatabaseImpl
 
    SharedDatabase::SharedDatabase(const boost::filesystem::path& dir,
                                   bool                           allowSlow,
+                                  const DatabaseMemoryConfig&    memory,
                                   uint64_t                       max_objects,
                                   uint64_t                       hot_addr_bits,
                                   uint64_t                       warm_addr_bits,
@@ -249,6 +419,7 @@ namespace psibase
                                   uint64_t                       cold_addr_bits)
        : impl{std::make_shared<SharedDatabaseImpl>(dir.c_str(),
                                                    allowSlow,
+                                                   memory,
                                                    max_objects,
                                                    hot_addr_bits,
                                                    warm_addr_bits,
@@ -257,6 +428,13 @@ namespace psibase
    {
    }
 
+   SharedDatabase SharedDatabase::openReadOnly(const boost::filesystem::path& dir)
+   {
+      SharedDatabase result;
+      result.impl = std::make_shared<SharedDatabaseImpl>(dir.c_str());
+      return result;
+   }
+
    ConstRevisionPtr SharedDatabase::getHead()
    {
       return impl->getHead();
@@ -274,15 +452,79 @@ namespace psibase
 
    ConstRevisionPtr SharedDatabase::getRevision(Writer& writer, const Checksum256& blockId)
    {
-      return loadRevision(writer, writer.get_top_root(), revisionById(blockId), true);
+      return loadRevision(writer, writer.get_top_root(), revisionById(blockId), impl->releaser,
+                          true);
+   }
+
+   RootReleaseStats SharedDatabase::getRootReleaseStats() const
+   {
+      return impl->releaser ? impl->releaser->getStats() : RootReleaseStats{};
+   }
+
+   DatabaseStats SharedDatabase::getStats() const
+   {
+      auto stats   = impl->trie->get_stats();
+      auto convert = [](const triedent::ring_allocator::level_stats& level)
+      {
+         return DatabaseLevelStats{
+             .capacity        = level.capacity,
+             .used            = level.used,
+             .free            = level.free,
+             .swapLag         = level.swap_lag,
+             .hits            = level.hits,
+             .misses          = level.misses,
+             .swappedBytes    = level.swapped_bytes,
+             .swapBytesPerSec = level.swap_bytes_per_sec,
+             .hugePages       = level.huge_pages,
+         };
+      };
+      using triedent::ring_allocator;
+      return {
+          .hot             = convert(stats.levels[ring_allocator::hot_cache]),
+          .warm            = convert(stats.levels[ring_allocator::warm_cache]),
+          .cool            = convert(stats.levels[ring_allocator::cool_cache]),
+          .cold            = convert(stats.levels[ring_allocator::cold_cache]),
+          .usedObjectIds   = stats.used_ids,
+          .maxObjectIds    = stats.max_ids,
+          .freeSpaceWaits  = stats.free_space_waits,
+          .activeSessions  = stats.active_sessions,
+          .replicaSessions = stats.replica_sessions,
+          .deferredRoots   = stats.deferred_roots,
+          .rootRelease     = getRootReleaseStats(),
+          .scrub           = {.passes    = stats.scrub.passes,
+                              .nodes     = stats.scrub.nodes,
+                              .bytes     = stats.scrub.bytes,
+                              .errors    = stats.scrub.errors,
+                              .lastError = stats.scrub.last_error},
+      };
+   }
+
+   void SharedDatabase::startScrubber(uint64_t nodesPerSec, uint64_t bytesPerSec)
+   {
+      impl->scrubber = std::make_unique<triedent::scrubber>(impl->trie);
+      impl->scrubber->start({.nodes_per_sec = nodesPerSec, .bytes_per_sec = bytesPerSec});
    }
 
-   // TODO: move triedent::root destruction to a gc thread
    void SharedDatabase::removeRevisions(Writer& writer, const Checksum256& irreversible)
    {
       auto              topRoot = writer.get_top_root();
       std::vector<char> key{revisionByIdPrefix};
 
+      // Removing a revision from the top root would free its trees right here.
+      // Holding on to its roots until after the removal leaves that to the releaser.
+      RootReleaser::Roots removed;
+      auto                removeRevision = [&]
+      {
+         std::vector<std::shared_ptr<triedent::root>> roots;
+         writer.get(topRoot, key, nullptr, &roots);
+         removed.insert(removed.end(), std::make_move_iterator(roots.begin()),
+                        std::make_move_iterator(roots.end()));
+         writer.remove(topRoot, key);
+         key[0] = stateRootsPrefix;
+         writer.remove(topRoot, key);
+         key[0] = revisionByIdPrefix;
+      };
+
       // Remove everything with a blockNum <= irreversible's, except irreversible.
       while (writer.get_greater_equal(topRoot, key, &key, nullptr, nullptr))
       {
@@ -290,7 +532,7 @@ namespace psibase
              memcmp(key.data() + 1, irreversible.data(), sizeof(BlockNum)) > 0)
             break;
          if (memcmp(key.data() + 1, irreversible.data(), irreversible.size()))
-            writer.remove(topRoot, key);
+            removeRevision();
          key.push_back(0);
       }
 
@@ -310,11 +552,12 @@ namespace psibase
          if (!status.head)
             throw std::runtime_error("Status row is missing head information in fork");
          if (!writer.get(topRoot, revisionById(status.head->header.previous), nullptr, nullptr))
-            writer.remove(topRoot, key);
+            removeRevision();
          key.push_back(0);
       }
 
       writer.set_top_root(topRoot);
+      impl->releaser->release(std::move(removed));
    }  // removeRevisions
 
    void SharedDatabase::setBlockData(Writer&               writer,
@@ -345,22 +588,130 @@ namespace psibase
       return reader.get(topRoot, fullKey);
    }
 
+   std::optional<std::vector<Checksum256>> SharedDatabase::getStateRoots(
+       Writer&            reader,
+       const Checksum256& blockId)
+   {
+      auto topRoot = reader.get_top_root();
+      auto bytes   = reader.get(topRoot, stateRootsById(blockId));
+      if (!bytes)
+         return std::nullopt;
+      check(bytes->size() == numDatabases * sizeof(Checksum256), "wrong size for state roots");
+      std::vector<Checksum256> result(numDatabases);
+      for (uint32_t i = 0; i < numDatabases; ++i)
+         memcpy(result[i].data(), bytes->data() + i * sizeof(Checksum256), sizeof(Checksum256));
+      return result;
+   }
+
    bool SharedDatabase::isSlow() const
    {
       return impl->trie->is_slow();
    }
 
+   bool SharedDatabase::isReadOnly() const
+   {
+      return impl->trie->is_read_only();
+   }
+
+   void SharedDatabase::grow(uint64_t max_objects,
+                             uint64_t hot_addr_bits,
+                             uint64_t warm_addr_bits,
+                             uint64_t cool_addr_bits,
+                             uint64_t cold_addr_bits)
+   {
+      impl->trie->grow(triedent::database::config{
+          .max_objects = max_objects,
+          .hot_pages   = hot_addr_bits,
+          .warm_pages  = warm_addr_bits,
+          .cool_pages  = cool_addr_bits,
+          .cold_pages  = cold_addr_bits,
+      });
+   }
+
+   // Changes made by a nested write session which haven't reached the tree
+   // yet. A missing value marks a removed key. Keys, values, and map nodes all
+   // live in arena, so aborting the session only has to free it.
+   struct WriteOverlay
+   {
+      using Bytes = std::span<const char>;
+      using Map   = std::pmr::map<Bytes, std::optional<Bytes>, blob_less>;
+
+      std::pmr::monotonic_buffer_resource arena;
+      std::vector<Map>                    dbs;
+
+      WriteOverlay()
+      {
+         dbs.reserve(numDatabases);
+         for (uint32_t i = 0; i < numDatabases; ++i)
+            dbs.emplace_back(&arena);
+      }
+
+      WriteOverlay(const WriteOverlay&)            = delete;
+      WriteOverlay& operator=(const WriteOverlay&) = delete;
+
+      Bytes copy(Bytes data)
+      {
+         auto p = static_cast<char*>(arena.allocate(std::max(data.size(), size_t(1)), 1));
+         memcpy(p, data.data(), data.size());
+         return {p, data.size()};
+      }
+
+      void set(uint32_t db, Bytes key, std::optional<Bytes> value)
+      {
+         auto& m = dbs[db];
+         if (value)
+            value = copy(*value);
+         auto it = m.find(key);
+         if (it != m.end())
+            it->second = value;
+         else
+            m.emplace(copy(key), value);
+      }
+
+      // Moves this overlay's changes on top of parent's
+      void mergeInto(WriteOverlay& parent)
+      {
+         for (uint32_t i = 0; i < numDatabases; ++i)
+            for (auto& [key, value] : dbs[i])
+               parent.set(i, key, value);
+      }
+   };  // WriteOverlay
+
+   static bool startsWith(std::span<const char> key, std::span<const char> prefix)
+   {
+      return key.size() >= prefix.size() && !memcmp(key.data(), prefix.data(), prefix.size());
+   }
+
+   // The smallest key which is greater than every key that starts with prefix,
+   // or nullopt if every key larger than prefix starts with it.
+   static std::optional<std::vector<char>> prefixEnd(std::span<const char> prefix)
+   {
+      std::vector<char> result(prefix.begin(), prefix.end());
+      while (!result.empty() && (uint8_t)result.back() == 0xff)
+         result.pop_back();
+      if (result.empty())
+         return std::nullopt;
+      ++result.back();
+      return result;
+   }
+
    struct DatabaseImpl
    {
       SharedDatabase                           shared;
       std::shared_ptr<const Revision>          baseRevision;
       std::shared_ptr<triedent::write_session> writeSession;
       std::shared_ptr<triedent::read_session>  readSession;
-      std::vector<std::shared_ptr<Revision>>   writeRevisions;
+      std::shared_ptr<Revision>                modifiedRevision;
       std::shared_ptr<const Revision>          readOnlyRevision;
       std::vector<char>                        keyBuffer;
       std::vector<char>                        valueBuffer;
 
+      // One per write session nested inside the outermost one. Writes go to
+      // the last overlay; reads check the overlays, last first, before the
+      // tree. Only committing the first overlay writes to the tree, as a
+      // single batch per database.
+      std::vector<std::unique_ptr<WriteOverlay>> overlays;
+
       template <typename F>
       auto read(F f)
       {
@@ -368,8 +719,8 @@ namespace psibase
          {
             if (readOnlyRevision)
                return *readOnlyRevision;
-            check(!writeRevisions.empty(), "no database sessions active");
-            return *writeRevisions.back();
+            check(modifiedRevision != nullptr, "no database sessions active");
+            return *modifiedRevision;
          }();
 
          if (readSession)
@@ -383,22 +734,234 @@ namespace psibase
       template <typename F>
       auto write(F f)
       {
-         check(writeSession && !writeRevisions.empty(), "no database write sessions active");
-         return f(*writeSession, *writeRevisions.back());
+         check(writeSession && modifiedRevision, "no database write sessions active");
+         return f(*writeSession, *modifiedRevision);
+      }
+
+      // Returns the most recent overlay's change to key, or nullptr if none
+      // of the overlays changed it
+      const std::optional<WriteOverlay::Bytes>* findChange(DbId db, std::span<const char> key)
+      {
+         for (auto it = overlays.rbegin(); it != overlays.rend(); ++it)
+         {
+            auto& m   = (*it)->dbs[(int)db];
+            auto  pos = m.find(key);
+            if (pos != m.end())
+               return &pos->second;
+         }
+         return nullptr;
+      }
+
+      // Finds the first key >= key (forward) or the last key < key (!forward)
+      // after applying the overlays to the tree. A tree iterator and one
+      // iterator per overlay move together in key order, so a run of keys
+      // which the overlays removed is skipped without searching from the
+      // root again for each of them.
+      bool seek(DbId                  db,
+                std::span<const char> key,
+                size_t                matchKeySize,
+                bool                  forward,
+                std::vector<char>&    resultKey,
+                std::vector<char>&    value)
+      {
+         // key may point into resultKey
+         const std::vector<char> start(key.begin(), key.end());
+
+         struct Cursor
+         {
+            WriteOverlay::Map*                map;
+            WriteOverlay::Map::const_iterator it;
+            bool                              valid;
+         };
+         std::vector<Cursor> cursors;
+         cursors.reserve(overlays.size());
+         for (auto& overlay : overlays)
+         {
+            auto& m  = overlay->dbs[(int)db];
+            auto  it = m.lower_bound(start);
+            if (forward)
+               cursors.push_back({&m, it, it != m.end()});
+            else if (it != m.begin())
+               cursors.push_back({&m, std::prev(it), true});
+            else
+               cursors.push_back({&m, it, false});
+         }
+         auto advance = [&](Cursor& c)
+         {
+            if (forward)
+               c.valid = ++c.it != c.map->end();
+            else if (c.it == c.map->begin())
+               c.valid = false;
+            else
+               --c.it;
+         };
+
+         return read(
+             [&](auto& session, auto& revision)
+             {
+                auto tree = session.lower_bound(revision.roots[(int)db], start);
+                if (!forward)
+                   --tree;
+                std::vector<char> treeKey;
+                if (tree)
+                   tree.key(treeKey);
+
+                while (true)
+                {
+                   bool                  have = tree.valid();
+                   std::span<const char> best = treeKey;
+                   for (auto& c : cursors)
+                   {
+                      if (!c.valid)
+                         continue;
+                      auto cmp = compare_blob(c.it->first, best);
+                      if (!have || (forward ? cmp < 0 : cmp > 0))
+                      {
+                         have = true;
+                         best = c.it->first;
+                      }
+                   }
+                   if (!have || best.size() < matchKeySize ||
+                       memcmp(best.data(), start.data(), matchKeySize))
+                      return false;
+
+                   // The last overlay which changed best decides
+                   const std::optional<WriteOverlay::Bytes>* change = nullptr;
+                   for (auto& c : cursors)
+                      if (c.valid && !compare_blob(c.it->first, best))
+                         change = &c.it->second;
+                   if (!change)
+                   {
+                      resultKey = std::move(treeKey);
+                      tree.value(&value, nullptr);
+                      return true;
+                   }
+                   if (*change)
+                   {
+                      resultKey.assign(best.begin(), best.end());
+                      value.assign((*change)->begin(), (*change)->end());
+                      return true;
+                   }
+
+                   // best was removed; move everything which is on it past it
+                   bool treeOnBest = tree && !compare_blob(treeKey, best);
+                   for (auto& c : cursors)
+                      if (c.valid && !compare_blob(c.it->first, best))
+                         advance(c);
+                   if (treeOnBest)
+                   {
+                      if (forward)
+                         ++tree;
+                      else
+                         --tree;
+                      if (tree)
+                         tree.key(treeKey);
+                   }
+                }
+             });
+      }  // seek
+
+      // Finds the last key which starts with prefix after applying the overlays
+      bool getMax(DbId                  db,
+                  std::span<const char> prefixArg,
+                  std::vector<char>&    resultKey,
+                  std::vector<char>&    value)
+      {
+         // prefixArg may point into resultKey
+         const std::vector<char> prefix(prefixArg.begin(), prefixArg.end());
+
+         bool have = read(
+             [&](auto& session, auto& revision)
+             {
+                return session.get_max(revision.roots[(int)db], prefix,
+                                       [&](std::span<const char> k, std::span<const char> v)
+                                       {
+                                          resultKey.assign(k.begin(), k.end());
+                                          value.assign(v.begin(), v.end());
+                                       });
+             });
+
+         auto                                      end    = prefixEnd(prefix);
+         std::span<const char>                     best   = resultKey;
+         const std::optional<WriteOverlay::Bytes>* change = nullptr;
+         for (auto& overlay : overlays)
+         {
+            auto& m  = overlay->dbs[(int)db];
+            auto  it = end ? m.lower_bound(*end) : m.end();
+            if (it == m.begin())
+               continue;
+            --it;
+            if (!startsWith(it->first, prefix))
+               continue;
+            if (!have || compare_blob(it->first, best) >= 0)
+            {
+               have   = true;
+               best   = it->first;
+               change = &it->second;
+            }
+         }
+
+         if (!have || !change)
+            return have;
+         if (*change)
+         {
+            resultKey.assign(best.begin(), best.end());
+            value.assign((*change)->begin(), (*change)->end());
+            return true;
+         }
+         return seek(db, best, prefix.size(), false, resultKey, value);
+      }  // getMax
+
+      void apply(const WriteOverlay& overlay, Revision& revision)
+      {
+         std::vector<triedent::write_session::batch_entry> entries;
+         for (uint32_t i = 0; i < numDatabases; ++i)
+         {
+            auto& m = overlay.dbs[i];
+            if (m.empty())
+               continue;
+            entries.clear();
+            for (auto& [key, value] : m)
+               entries.push_back({key, value});
+            writeSession->apply_batch(revision.roots[i], entries);
+            if constexpr (sanityCheck)
+            {
+               for (auto& [key, value] : m)
+               {
+                  std::vector<char> k(key.begin(), key.end());
+                  if (value)
+                     revision.sanity()[i][k].assign(value->begin(), value->end());
+                  else
+                     revision.sanity()[i].erase(k);
+               }
+               revision.checkContent("commit", (DbId)i, *writeSession);
+            }
+         }
+      }
+
+      // The outermost write session's revision with the overlays applied
+      std::shared_ptr<Revision> flattened()
+      {
+         if (overlays.empty())
+            return modifiedRevision;
+         WriteOverlay merged;
+         for (auto& overlay : overlays)
+            overlay->mergeInto(merged);
+         auto result = modifiedRevision->clone();
+         apply(merged, *result);
+         return result;
       }
 
-      // TODO: release old revision roots in GC thread
       void setRevision(ConstRevisionPtr revision)
       {
-         check(writeRevisions.empty() && !readOnlyRevision,
-               "setRevision: database session is active");
+         check(!modifiedRevision && !readOnlyRevision, "setRevision: database session is active");
          check(revision != nullptr, "null revision");
          baseRevision = std::move(revision);
       }
 
       void startRead()
       {
-         check(writeRevisions.empty() && !readOnlyRevision,
+         check(!modifiedRevision && !readOnlyRevision,
                "startRead: database session already active");
          if (!readSession && !writeSession)
             readSession = shared.impl->trie->start_read_session();
@@ -411,20 +974,28 @@ namespace psibase
          check(writer != nullptr, "startWrite: writer is null");
          writeSession = std::move(writer);
          readSession  = nullptr;
-         if (writeRevisions.empty())
-            writeRevisions.push_back(baseRevision->clone());
+         if (!modifiedRevision)
+            modifiedRevision = baseRevision->clone();
          else
-            writeRevisions.push_back(writeRevisions.back()->clone());
+            overlays.push_back(std::make_unique<WriteOverlay>());
       }
 
       void commit()
       {
          if (readOnlyRevision)
             readOnlyRevision = nullptr;
-         else if (writeRevisions.size() == 1)
+         else if (overlays.size() > 1)
+         {
+            overlays.back()->mergeInto(*overlays[overlays.size() - 2]);
+            overlays.pop_back();
+         }
+         else if (overlays.size() == 1)
+         {
+            apply(*overlays.back(), *modifiedRevision);
+            overlays.pop_back();
+         }
+         else if (modifiedRevision)
             throw std::runtime_error("final commit needs writeRevision()");
-         else if (writeRevisions.size() > 1)
-            writeRevisions.erase(writeRevisions.end() - 2);
          else
             throw std::runtime_error("mismatched commit");
       }
@@ -432,11 +1003,11 @@ namespace psibase
       ConstRevisionPtr writeRevision(const Checksum256& blockId)
       {
          check((bool)writeSession, "writeSession is missing");
-         check(writeRevisions.size() == 1, "not final commit");
-         auto rev = writeRevisions.back();
+         check(modifiedRevision && overlays.empty(), "not final commit");
+         auto rev = std::move(modifiedRevision);
          shared.impl->writeRevision(*writeSession, blockId, *rev);
-         baseRevision = std::move(rev);
-         writeRevisions.pop_back();
+         rev->releaser = shared.impl->releaser;
+         baseRevision  = std::move(rev);
          return baseRevision;
       }
 
@@ -444,8 +1015,10 @@ namespace psibase
       {
          if (readOnlyRevision)
             readOnlyRevision = nullptr;
-         else if (!writeRevisions.empty())
-            writeRevisions.pop_back();
+         else if (!overlays.empty())
+            overlays.pop_back();
+         else
+            modifiedRevision = nullptr;
       }
    };  // DatabaseImpl
 
@@ -470,8 +1043,8 @@ namespace psibase
 
    ConstRevisionPtr Database::getModifiedRevision()
    {
-      if (!impl->writeRevisions.empty())
-         return impl->writeRevisions.back();
+      if (impl->modifiedRevision)
+         return impl->flattened();
       else
          return impl->baseRevision;
    }
@@ -505,6 +1078,9 @@ namespace psibase
 
    void Database::kvPutRaw(DbId db, psio::input_stream key, psio::input_stream value)
    {
+      if (!impl->overlays.empty())
+         return impl->overlays.back()->set((int)db, {key.pos, key.remaining()},
+                                           std::span<const char>{value.pos, value.remaining()});
       impl->write(
           [&](auto& session, auto& revision)
           {
@@ -517,8 +1093,38 @@ namespace psibase
           });
    }
 
+   void Database::kvPutManyRaw(
+       DbId                                                               db,
+       std::span<const std::pair<psio::input_stream, psio::input_stream>> rows)
+   {
+      if (!impl->overlays.empty())
+      {
+         for (auto& [key, value] : rows)
+            impl->overlays.back()->set((int)db, {key.pos, key.remaining()},
+                                       std::span<const char>{value.pos, value.remaining()});
+         return;
+      }
+      impl->write(
+          [&](auto& session, auto& revision)
+          {
+             std::vector<triedent::write_session::batch_entry> entries;
+             entries.reserve(rows.size());
+             for (auto& [key, value] : rows)
+                entries.push_back({{key.pos, key.remaining()}, {{value.pos, value.remaining()}}});
+             session.apply_batch(revision.roots[(int)db], entries);
+             if constexpr (sanityCheck)
+             {
+                for (auto& [key, value] : rows)
+                   revision.sanity()[(int)db][key.vector()] = value.vector();
+                revision.checkContent("kvPutManyRaw", db, session);
+             }
+          });
+   }
+
    void Database::kvRemoveRaw(DbId db, psio::input_stream key)
    {
+      if (!impl->overlays.empty())
+         return impl->overlays.back()->set((int)db, {key.pos, key.remaining()}, std::nullopt);
       impl->write(
           [&](auto& session, auto& revision)
           {
@@ -533,11 +1139,24 @@ namespace psibase
 
    std::optional<psio::input_stream> Database::kvGetRaw(DbId db, psio::input_stream key)
    {
+      if (!kvGetRaw(db, key, impl->valueBuffer))
+         return {};
+      return {{impl->valueBuffer}};
+   }
+
+   bool Database::kvGetRaw(DbId db, psio::input_stream key, std::vector<char>& value)
+   {
+      if (auto change = impl->findChange(db, {key.pos, key.remaining()}))
+      {
+         if (*change)
+            value.assign((*change)->begin(), (*change)->end());
+         return change->has_value();
+      }
       return impl->read(
-          [&](auto& session, auto& revision) -> std::optional<psio::input_stream>
+          [&](auto& session, auto& revision)
           {
-             if (!session.get(revision.roots[(int)db], key.string_view(), &impl->valueBuffer,
-                              nullptr))
+             if (!session.get(revision.roots[(int)db], key.string_view(),
+                              [&](std::span<const char> v) { value.assign(v.begin(), v.end()); }))
              {
                 if constexpr (sanityCheck)
                 {
@@ -545,7 +1164,7 @@ namespace psibase
                    if (it != revision.sanity()[(int)db].end())
                       printf("sanity check failure: kvGetRaw: data missing\n");
                 }
-                return {};
+                return false;
              }
 
              if constexpr (sanityCheck)
@@ -553,25 +1172,117 @@ namespace psibase
                 auto it = revision.sanity()[(int)db].find(key.vector());
                 if (it == revision.sanity()[(int)db].end())
                    printf("sanity check failure: kvGetRaw: data exists\n");
-                else if (it->second != impl->valueBuffer)
+                else if (it->second != value)
                    printf("sanity check failure: kvGetRaw: data is different\n");
              }
-             return {{impl->valueBuffer}};
+             return true;
           });
    }  // Database::kvGetRaw
 
+   std::optional<size_t> Database::kvValueSizeRaw(DbId db, psio::input_stream key)
+   {
+      if (auto change = impl->findChange(db, {key.pos, key.remaining()}))
+      {
+         if (*change)
+            return (*change)->size();
+         return std::nullopt;
+      }
+      return impl->read(
+          [&](auto& session, auto& revision)
+          {
+             std::optional<size_t> result;
+             session.get(revision.roots[(int)db], key.string_view(),
+                         [&](std::span<const char> v) { result = v.size(); });
+             return result;
+          });
+   }
+
+   std::vector<std::optional<psio::input_stream>> Database::kvGetManyRaw(
+       DbId                                db,
+       std::span<const psio::input_stream> keys,
+       std::vector<char>&                  arena)
+   {
+      // Values are located by offset, since arena may move while it grows
+      static constexpr size_t                notFound = -1;
+      std::vector<std::pair<size_t, size_t>> found(keys.size(), {notFound, 0});
+
+      auto append = [&](size_t i, std::span<const char> value)
+      {
+         found[i] = {arena.size(), value.size()};
+         arena.insert(arena.end(), value.begin(), value.end());
+      };
+
+      // Only the keys which the overlays haven't changed go to the tree
+      std::vector<std::span<const char>> keySpans;
+      std::vector<size_t>                keyIndexes;
+      keySpans.reserve(keys.size());
+      keyIndexes.reserve(keys.size());
+      for (size_t i = 0; i < keys.size(); ++i)
+      {
+         std::span<const char> key{keys[i].pos, keys[i].remaining()};
+         if (auto change = impl->findChange(db, key))
+         {
+            if (*change)
+               append(i, **change);
+         }
+         else
+         {
+            keySpans.push_back(key);
+            keyIndexes.push_back(i);
+         }
+      }
+
+      impl->read(
+          [&](auto& session, auto& revision)
+          {
+             session.get_many(revision.roots[(int)db], keySpans,
+                              [&](size_t i, std::span<const char> value)
+                              { append(keyIndexes[i], value); });
+          });
+
+      std::vector<std::optional<psio::input_stream>> result;
+      result.reserve(found.size());
+      for (auto [offset, size] : found)
+      {
+         if (offset == notFound)
+            result.push_back(std::nullopt);
+         else
+            result.push_back(psio::input_stream{arena.data() + offset, size});
+      }
+      return result;
+   }  // Database::kvGetManyRaw
+
    std::optional<Database::KVResult> Database::kvGreaterEqualRaw(DbId               db,
                                                                  psio::input_stream key,
                                                                  size_t             matchKeySize)
    {
+      if (!kvGreaterEqualRaw(db, key, matchKeySize, impl->keyBuffer, impl->valueBuffer))
+         return {};
+      return {{{impl->keyBuffer}, {impl->valueBuffer}}};
+   }
+
+   bool Database::kvGreaterEqualRaw(DbId               db,
+                                    psio::input_stream key,
+                                    size_t             matchKeySize,
+                                    std::vector<char>& resultKey,
+                                    std::vector<char>& value)
+   {
+      if (!impl->overlays.empty())
+         return impl->seek(db, {key.pos, key.remaining()}, matchKeySize, true, resultKey, value);
       return impl->read(
-          [&](auto& session, auto& revision) -> std::optional<Database::KVResult>
+          [&](auto& session, auto& revision)
           {
-             auto found = session.get_greater_equal(revision.roots[(int)db], key.string_view(),
-                                                    &impl->keyBuffer, &impl->valueBuffer, nullptr);
-             if (found && (impl->keyBuffer.size() < matchKeySize ||
-                           memcmp(impl->keyBuffer.data(), key.pos, matchKeySize)))
-                found = false;
+             bool found = false;
+             session.get_greater_equal(
+                 revision.roots[(int)db], key.string_view(),
+                 [&](std::span<const char> k, std::span<const char> v)
+                 {
+                    if (k.size() < matchKeySize || memcmp(k.data(), key.pos, matchKeySize))
+                       return;
+                    resultKey.assign(k.begin(), k.end());
+                    value.assign(v.begin(), v.end());
+                    found = true;
+                 });
 
              if (!found)
              {
@@ -585,7 +1296,7 @@ namespace psibase
                    if (it != m.end())
                       printf("sanity check failure: kvGreaterEqualRaw: data missing\n");
                 }
-                return {};
+                return false;
              }
 
              if constexpr (sanityCheck)
@@ -597,12 +1308,12 @@ namespace psibase
                    it = m.end();
                 if (it == m.end())
                    printf("sanity check failure: kvGreaterEqualRaw: data exists\n");
-                else if (it->first != impl->keyBuffer)
+                else if (it->first != resultKey)
                    printf("sanity check failure: kvGreaterEqualRaw: key is different\n");
-                else if (it->second != impl->valueBuffer)
+                else if (it->second != value)
                    printf("sanity check failure: kvGreaterEqualRaw: data is different\n");
              }
-             return {{{impl->keyBuffer}, {impl->valueBuffer}}};
+             return true;
           });
    }  // Database::kvGreaterEqualRaw
 
@@ -610,14 +1321,33 @@ namespace psibase
                                                              psio::input_stream key,
                                                              size_t             matchKeySize)
    {
+      if (!kvLessThanRaw(db, key, matchKeySize, impl->keyBuffer, impl->valueBuffer))
+         return {};
+      return {{{impl->keyBuffer}, {impl->valueBuffer}}};
+   }
+
+   bool Database::kvLessThanRaw(DbId               db,
+                                psio::input_stream key,
+                                size_t             matchKeySize,
+                                std::vector<char>& resultKey,
+                                std::vector<char>& value)
+   {
+      if (!impl->overlays.empty())
+         return impl->seek(db, {key.pos, key.remaining()}, matchKeySize, false, resultKey, value);
       return impl->read(
-          [&](auto& session, auto& revision) -> std::optional<Database::KVResult>
+          [&](auto& session, auto& revision)
           {
-             auto found = session.get_less_than(revision.roots[(int)db], key.string_view(),
-                                                &impl->keyBuffer, &impl->valueBuffer, nullptr);
-             if (found && (impl->keyBuffer.size() < matchKeySize ||
-                           memcmp(impl->keyBuffer.data(), key.pos, matchKeySize)))
-                found = false;
+             bool found = false;
+             session.get_less_than(
+                 revision.roots[(int)db], key.string_view(),
+                 [&](std::span<const char> k, std::span<const char> v)
+                 {
+                    if (k.size() < matchKeySize || memcmp(k.data(), key.pos, matchKeySize))
+                       return;
+                    resultKey.assign(k.begin(), k.end());
+                    value.assign(v.begin(), v.end());
+                    found = true;
+                 });
 
              if (!found)
              {
@@ -640,7 +1370,7 @@ namespace psibase
                       printf("  needs: %s\n", psio::convert_to_json(it->first).c_str());
                    }
                 }
-                return {};
+                return false;
              }
 
              if constexpr (sanityCheck)
@@ -656,22 +1386,38 @@ namespace psibase
                    it = m.end();
                 if (it == m.end())
                    printf("sanity check failure: kvLessThanRaw: data exists\n");
-                else if (it->first != impl->keyBuffer)
+                else if (it->first != resultKey)
                    printf("sanity check failure: kvLessThanRaw: key is different\n");
-                else if (it->second != impl->valueBuffer)
+                else if (it->second != value)
                    printf("sanity check failure: kvLessThanRaw: data is different\n");
              }
-             return {{{impl->keyBuffer}, {impl->valueBuffer}}};
+             return true;
           });
    }  // Database::kvLessThanRaw
 
    std::optional<Database::KVResult> Database::kvMaxRaw(DbId db, psio::input_stream key)
    {
+      if (!kvMaxRaw(db, key, impl->keyBuffer, impl->valueBuffer))
+         return {};
+      return {{{impl->keyBuffer}, {impl->valueBuffer}}};
+   }
+
+   bool Database::kvMaxRaw(DbId               db,
+                           psio::input_stream key,
+                           std::vector<char>& resultKey,
+                           std::vector<char>& value)
+   {
+      if (!impl->overlays.empty())
+         return impl->getMax(db, {key.pos, key.remaining()}, resultKey, value);
       return impl->read(
-          [&](auto& session, auto& revision) -> std::optional<Database::KVResult>
+          [&](auto& session, auto& revision)
           {
-             if (!session.get_max(revision.roots[(int)db], key.string_view(), &impl->keyBuffer,
-                                  &impl->valueBuffer, nullptr))
+             if (!session.get_max(revision.roots[(int)db], key.string_view(),
+                                  [&](std::span<const char> k, std::span<const char> v)
+                                  {
+                                     resultKey.assign(k.begin(), k.end());
+                                     value.assign(v.begin(), v.end());
+                                  }))
              {
                 if constexpr (sanityCheck)
                 {
@@ -679,7 +1425,7 @@ namespace psibase
                    if (it != revision.sanity()[(int)db].end())
                       printf("sanity check failure: kvMaxRaw: data missing\n");
                 }
-                return {};
+                return false;
              }
 
              if constexpr (sanityCheck)
@@ -687,12 +1433,12 @@ namespace psibase
                 auto it = revision.approx_max(db, key.vector());
                 if (it == revision.sanity()[(int)db].end())
                    printf("sanity check failure: kvMaxRaw: data exists\n");
-                else if (it->first != impl->keyBuffer)
+                else if (it->first != resultKey)
                    printf("sanity check failure: kvMaxRaw: key is different\n");
-                else if (it->second != impl->valueBuffer)
+                else if (it->second != value)
                    printf("sanity check failure: kvMaxRaw: data is different\n");
              }
-             return {{{impl->keyBuffer}, {impl->valueBuffer}}};
+             return true;
           });
    }  // Database::kvMaxRaw
 
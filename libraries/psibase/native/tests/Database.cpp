@@ -0,0 +1,300 @@
+#include <catch2/catch.hpp>
+#include <psibase/db.hpp>
+
+#include <boost/filesystem/operations.hpp>
+
+using namespace psibase;
+
+namespace
+{
+   constexpr auto db = DbId::service;
+
+   struct TestDatabase
+   {
+      SharedDatabase shared;
+      WriterPtr      writer;
+      Database       database;
+
+      TestDatabase()
+          : shared{(boost::filesystem::remove_all("psibase-testdb"), "psibase-testdb"),
+                   true,
+                   {},
+                   10000,
+                   27,
+                   27,
+                   27,
+                   27},
+            writer{shared.createWriter()},
+            database{shared, shared.getHead()}
+      {
+      }
+   };
+
+   void put(Database& database, std::string_view key, std::string_view value)
+   {
+      database.kvPutRaw(db, key, value);
+   }
+
+   void remove(Database& database, std::string_view key)
+   {
+      database.kvRemoveRaw(db, key);
+   }
+
+   std::optional<std::string> get(Database& database, std::string_view key)
+   {
+      if (auto value = database.kvGetRaw(db, key))
+         return std::string(value->string_view());
+      return std::nullopt;
+   }
+
+   using KV = std::optional<std::pair<std::string, std::string>>;
+
+   KV toKV(const std::optional<Database::KVResult>& result)
+   {
+      if (!result)
+         return std::nullopt;
+      return std::pair{std::string(result->key.string_view()),
+                       std::string(result->value.string_view())};
+   }
+
+   KV greaterEqual(Database& database, std::string_view key, size_t matchKeySize = 0)
+   {
+      return toKV(database.kvGreaterEqualRaw(db, key, matchKeySize));
+   }
+
+   KV lessThan(Database& database, std::string_view key, size_t matchKeySize = 0)
+   {
+      return toKV(database.kvLessThanRaw(db, key, matchKeySize));
+   }
+
+   KV max(Database& database, std::string_view prefix)
+   {
+      return toKV(database.kvMaxRaw(db, prefix));
+   }
+
+   KV kv(std::string_view key, std::string_view value)
+   {
+      return std::pair{std::string(key), std::string(value)};
+   }
+}  // namespace
+
+TEST_CASE("nested write sessions")
+{
+   TestDatabase t;
+   auto&        database = t.database;
+   auto         outer    = database.startWrite(t.writer);
+   put(database, "a", "1");
+   put(database, "b", "2");
+
+   SECTION("commit")
+   {
+      {
+         auto inner = database.startWrite(t.writer);
+         put(database, "b", "3");
+         put(database, "c", "4");
+         remove(database, "a");
+         {
+            auto innermost = database.startWrite(t.writer);
+            put(database, "a", "5");
+            put(database, "d", "6");
+            CHECK(get(database, "a") == "5");
+            innermost.commit();
+         }
+         CHECK(get(database, "a") == "5");
+         CHECK(get(database, "b") == "3");
+         inner.commit();
+      }
+      CHECK(get(database, "a") == "5");
+      CHECK(get(database, "b") == "3");
+      CHECK(get(database, "c") == "4");
+      CHECK(get(database, "d") == "6");
+   }
+
+   SECTION("abort")
+   {
+      {
+         auto inner = database.startWrite(t.writer);
+         put(database, "b", "3");
+         remove(database, "a");
+         {
+            auto innermost = database.startWrite(t.writer);
+            put(database, "c", "4");
+            innermost.commit();
+         }
+         CHECK(get(database, "a") == std::nullopt);
+         CHECK(get(database, "c") == "4");
+         // inner aborts when it goes out of scope
+      }
+      CHECK(get(database, "a") == "1");
+      CHECK(get(database, "b") == "2");
+      CHECK(get(database, "c") == std::nullopt);
+   }
+
+   SECTION("abort innermost")
+   {
+      auto inner = database.startWrite(t.writer);
+      put(database, "b", "3");
+      {
+         auto innermost = database.startWrite(t.writer);
+         remove(database, "b");
+         put(database, "c", "4");
+      }
+      inner.commit();
+      CHECK(get(database, "b") == "3");
+      CHECK(get(database, "c") == std::nullopt);
+   }
+}
+
+TEST_CASE("seek across overlay tombstones")
+{
+   TestDatabase t;
+   auto&        database = t.database;
+   auto         outer    = database.startWrite(t.writer);
+   for (auto key : {"k1", "k2", "k3", "k5"})
+      put(database, key, std::string("tree-") + key);
+
+   auto inner = database.startWrite(t.writer);
+   // Hide trie keys, and add keys between them
+   remove(database, "k2");
+   remove(database, "k3");
+   put(database, "k4", "overlay-k4");
+   // Removing a key which only the overlay has leaves nothing behind
+   put(database, "k6", "overlay-k6");
+   remove(database, "k6");
+
+   CHECK(greaterEqual(database, "k2") == kv("k4", "overlay-k4"));
+   CHECK(greaterEqual(database, "k1") == kv("k1", "tree-k1"));
+   CHECK(greaterEqual(database, "k5") == kv("k5", "tree-k5"));
+   CHECK(greaterEqual(database, "k51") == std::nullopt);
+   CHECK(lessThan(database, "k4") == kv("k1", "tree-k1"));
+   CHECK(lessThan(database, "k5") == kv("k4", "overlay-k4"));
+   CHECK(lessThan(database, "k1") == std::nullopt);
+
+   // A tombstone at the end of the matching range leaves no match
+   remove(database, "k1");
+   CHECK(lessThan(database, "k4", 1) == std::nullopt);
+   CHECK(greaterEqual(database, "k0", 1) == kv("k4", "overlay-k4"));
+   remove(database, "k4");
+   remove(database, "k5");
+   CHECK(greaterEqual(database, "k0", 1) == std::nullopt);
+
+   // A nested overlay can restore a key which an outer overlay removed
+   {
+      auto innermost = database.startWrite(t.writer);
+      put(database, "k3", "innermost-k3");
+      CHECK(greaterEqual(database, "k0", 1) == kv("k3", "innermost-k3"));
+      CHECK(lessThan(database, "l") == kv("k3", "innermost-k3"));
+   }
+   CHECK(greaterEqual(database, "k0", 1) == std::nullopt);
+}
+
+TEST_CASE("kvMaxRaw over overlay tombstones")
+{
+   TestDatabase t;
+   auto&        database = t.database;
+   auto         outer    = database.startWrite(t.writer);
+   for (auto key : {"p1", "p2", "p3", "q1"})
+      put(database, key, std::string("tree-") + key);
+
+   auto inner = database.startWrite(t.writer);
+   CHECK(max(database, "p") == kv("p3", "tree-p3"));
+
+   // The overlay's max is a tombstone
+   remove(database, "p3");
+   CHECK(max(database, "p") == kv("p2", "tree-p2"));
+
+   // ... and so is the next key in the tree
+   remove(database, "p2");
+   CHECK(max(database, "p") == kv("p1", "tree-p1"));
+
+   put(database, "p25", "overlay-p25");
+   CHECK(max(database, "p") == kv("p25", "overlay-p25"));
+
+   remove(database, "p25");
+   remove(database, "p1");
+   CHECK(max(database, "p") == std::nullopt);
+   CHECK(max(database, "q") == kv("q1", "tree-q1"));
+   CHECK(max(database, "") == kv("q1", "tree-q1"));
+}
+
+TEST_CASE("batch operations inside an overlay")
+{
+   TestDatabase t;
+   auto&        database = t.database;
+   auto         outer    = database.startWrite(t.writer);
+   for (auto key : {"a", "b", "c"})
+      put(database, key, std::string("tree-") + key);
+
+   {
+      auto inner = database.startWrite(t.writer);
+      remove(database, "b");
+
+      std::vector<std::pair<psio::input_stream, psio::input_stream>> rows{
+          {std::string_view{"c"}, std::string_view{"many-c"}},
+          {std::string_view{"d"}, std::string_view{"many-d"}},
+      };
+      database.kvPutManyRaw(db, rows);
+
+      std::vector<psio::input_stream> keys{std::string_view{"a"}, std::string_view{"b"},
+                                           std::string_view{"c"}, std::string_view{"d"},
+                                           std::string_view{"e"}};
+      std::vector<char>               arena;
+      auto                            values = database.kvGetManyRaw(db, keys, arena);
+      REQUIRE(values.size() == 5);
+      CHECK(values[0]->string_view() == "tree-a");
+      CHECK(!values[1]);
+      CHECK(values[2]->string_view() == "many-c");
+      CHECK(values[3]->string_view() == "many-d");
+      CHECK(!values[4]);
+
+      inner.commit();
+   }
+
+   // The outermost session writes the overlay's changes to the tree
+   std::vector<psio::input_stream> keys{std::string_view{"b"}, std::string_view{"c"},
+                                        std::string_view{"d"}};
+   std::vector<char>               arena;
+   auto                            values = database.kvGetManyRaw(db, keys, arena);
+   CHECK(!values[0]);
+   CHECK(values[1]->string_view() == "many-c");
+   CHECK(values[2]->string_view() == "many-d");
+}
+
+TEST_CASE("scan an overlay which removed a range")
+{
+   TestDatabase t;
+   auto&        database = t.database;
+   auto         outer    = database.startWrite(t.writer);
+   auto         name     = [](int i)
+   {
+      auto s = std::to_string(i);
+      return "r" + std::string(4 - s.size(), '0') + s;
+   };
+   for (int i = 0; i < 1000; ++i)
+      put(database, name(i), "tree");
+
+   auto inner = database.startWrite(t.writer);
+   // Keep every 100th key, and replace one in the middle of the removed range
+   for (int i = 0; i < 1000; ++i)
+      if (i % 100)
+         remove(database, name(i));
+   put(database, name(550), "overlay");
+
+   std::vector<std::string> forward;
+   for (auto row = greaterEqual(database, "r", 1); row;
+        row      = greaterEqual(database, row->first + '\0', 1))
+      forward.push_back(row->first + "=" + row->second);
+   std::vector<std::string> backward;
+   for (auto row = lessThan(database, "r\xff", 1); row; row = lessThan(database, row->first, 1))
+      backward.insert(backward.begin(), row->first + "=" + row->second);
+
+   std::vector<std::string> expected;
+   for (int i = 0; i < 1000; i += 100)
+   {
+      expected.push_back(name(i) + "=tree");
+      if (i == 500)
+         expected.push_back(name(550) + "=overlay");
+   }
+   CHECK(forward == expected);
+   CHECK(backward == expected);
+}
@@ -0,0 +1,100 @@
+#include <catch2/catch.hpp>
+#include <psibase/TransactionQueue.hpp>
+
+using namespace psibase;
+
+namespace
+{
+   using Queue = TransactionQueue<std::string>;
+
+   std::vector<std::string> popAll(Queue& queue)
+   {
+      std::vector<std::string> result;
+      while (queue.pop(result, 2))
+      {
+      }
+      return result;
+   }
+}  // namespace
+
+TEST_CASE("TransactionQueue takes sources in turn")
+{
+   int   readyCalls = 0;
+   Queue queue(100, [&] { ++readyCalls; });
+   for (auto item : {"a1", "a2", "a3", "a4"})
+      REQUIRE(queue.push("a", item) == Queue::PushResult::accepted);
+   for (auto item : {"b1", "b2"})
+      REQUIRE(queue.push("b", item) == Queue::PushResult::accepted);
+   REQUIRE(queue.push("c", "c1") == Queue::PushResult::accepted);
+
+   // Only the first push schedules the consumer
+   CHECK(readyCalls == 1);
+   CHECK(queue.pending() == 7);
+   CHECK(popAll(queue) == std::vector<std::string>{"a1", "b1", "c1", "a2", "b2", "a3", "a4"});
+
+   // Popped transactions still count until they are released
+   CHECK(queue.pending() == 7);
+   for (auto source : {"a", "a", "a", "a", "b", "b", "c"})
+      queue.release(source);
+   CHECK(queue.pending() == 0);
+
+   // After pop returned false, the next push schedules the consumer again
+   REQUIRE(queue.push("b", "b3") == Queue::PushResult::accepted);
+   CHECK(readyCalls == 2);
+   CHECK(popAll(queue) == std::vector<std::string>{"b3"});
+}
+
+TEST_CASE("TransactionQueue rejects transactions when full")
+{
+   Queue queue(4, [] {});
+   for (int i = 0; i < 4; ++i)
+      REQUIRE(queue.push("a", "a" + std::to_string(i)) == Queue::PushResult::accepted);
+
+   // A rejected item is left for the caller to answer
+   std::string item = "b0";
+   CHECK(queue.push("b", std::move(item)) == Queue::PushResult::full);
+   CHECK(item == "b0");
+   CHECK(queue.push("a", "a4") == Queue::PushResult::full);
+   CHECK(queue.pending() == 4);
+
+   // Once there is room, a new source gets its share, and a doesn't get more
+   CHECK(popAll(queue) == std::vector<std::string>{"a0", "a1", "a2", "a3"});
+   queue.release("a");
+   CHECK(queue.push("b", std::move(item)) == Queue::PushResult::accepted);
+   CHECK(queue.push("a", "a4") == Queue::PushResult::full);
+   queue.release("a");
+   CHECK(queue.push("b", "b1") == Queue::PushResult::accepted);
+   CHECK(queue.push("b", "b2") == Queue::PushResult::full);
+   CHECK(queue.pending() == 4);
+
+   // close returns what wasn't popped, and rejects later pushes
+   CHECK(queue.close() == std::vector<std::string>{"b0", "b1"});
+   CHECK(queue.push("c", "c0") == Queue::PushResult::closed);
+}
+
+TEST_CASE("TransactionQueue gives every source at least one slot")
+{
+   Queue queue(3, [] {});
+   for (auto source : {"a", "b", "c"})
+      REQUIRE(queue.push(source, std::string(source) + "0") == Queue::PushResult::accepted);
+   CHECK(queue.push("d", "d0") == Queue::PushResult::full);
+
+   // Sources come and go while the queue is nearly full
+   for (int i = 0; i < 10; ++i)
+   {
+      queue.release(i % 2 ? "c" : "b");
+      auto source = "s" + std::to_string(i);
+      REQUIRE(queue.push(source, source + "-0") == Queue::PushResult::accepted);
+      CHECK(queue.push(source, source + "-1") == Queue::PushResult::full);
+      queue.release(source);
+      REQUIRE(queue.push(i % 2 ? "c" : "b", "again") == Queue::PushResult::accepted);
+   }
+   CHECK(queue.pending() == 3);
+
+   // Only one pending source, so it may use all of maxPending
+   for (auto source : {"a", "b", "c"})
+      queue.release(source);
+   for (int i = 0; i < 3; ++i)
+      REQUIRE(queue.push("d", "d" + std::to_string(i)) == Queue::PushResult::accepted);
+   CHECK(queue.push("d", "d3") == Queue::PushResult::full);
+}
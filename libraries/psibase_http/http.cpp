@@ -674,7 +674,7 @@ namespace psibase::http
             //       but... that could open up a vulnerability (resource starvation) where the client intentionally doesn't
             //       read and doesn't close the socket.
             server.http_config->push_transaction_async(
-                std::move(req.body()),
+                std::move(req.body()), send.self.derived_session().source,
                 [error, ok, session = send.self.derived_session().shared_from_this()](
                     push_transaction_result result)
                 {
@@ -691,6 +691,12 @@ namespace psibase::http
                                       psio::to_json(*trace, stream);
                                       session->queue_(ok(std::move(data), "application/json"));
                                    }
+                                   else if (auto* unavailable =
+                                                std::get_if<service_unavailable>(&result))
+                                   {
+                                      session->queue_(error(bhttp::status::service_unavailable,
+                                                            unavailable->message));
+                                   }
                                    else
                                    {
                                       session->queue_(error(bhttp::status::internal_server_error,
@@ -933,6 +939,23 @@ namespace psibase::http
             }
             return;
          }
+         else if (req.target() == "/native/admin/database" &&
+                  server.http_config->get_database_stats)
+         {
+            if (!is_admin(*server.http_config, req))
+            {
+               return send(not_found(req.target()));
+            }
+            if (req.method() != bhttp::verb::get)
+            {
+               return send(method_not_allowed(req.target(), req.method_string(), "GET"));
+            }
+            run_native_handler(server.http_config->get_database_stats,
+                               [ok, session = send.self.derived_session().shared_from_this()](
+                                   auto&& make_result)
+                               { session->queue_(ok(make_result(), "application/json")); });
+            return;
+         }
          else if (req.target() == "/native/admin/keys")
          {
             if (req.method() == bhttp::verb::get)
@@ -1310,9 +1333,12 @@ namespace psibase::http
          ss << stream.socket().remote_endpoint();
          logger.add_attribute("RemoteEndpoint",
                               boost::log::attributes::constant<std::string>(ss.str()));
+         // All connections from one address share a source, regardless of port
+         source = stream.socket().remote_endpoint().address().to_string();
       }
 
       beast::tcp_stream stream;
+      std::string       source;
    };
 
    struct unix_http_session : public http_session<unix_http_session>,
@@ -1333,6 +1359,8 @@ namespace psibase::http
 #endif
                           beast::unlimited_rate_policy>
           stream;
+      // Local clients are trusted equally, so they share one source
+      std::string source = "unix";
    };
 
    // Accepts incoming connections and launches the sessions
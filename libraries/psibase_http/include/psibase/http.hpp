@@ -15,10 +15,17 @@ namespace psibase::http
    using push_boot_t =
        std::function<void(std::vector<char> packed_signed_transactions, push_boot_callback)>;
 
-   using push_transaction_result   = std::variant<TransactionTrace, std::string>;
+   // The node can't take the transaction right now; the client may retry later
+   struct service_unavailable
+   {
+      std::string message;
+   };
+
+   using push_transaction_result   = std::variant<TransactionTrace, std::string, service_unavailable>;
    using push_transaction_callback = std::function<void(push_transaction_result)>;
-   using push_transaction_t =
-       std::function<void(std::vector<char> packed_signed_trx, push_transaction_callback)>;
+   // source identifies the client, e.g. by its address, for fair queuing
+   using push_transaction_t = std::function<
+       void(std::vector<char> packed_signed_trx, std::string source, push_transaction_callback)>;
 
    using shutdown_t = std::function<void(std::vector<char>)>;
 
@@ -176,6 +183,7 @@ namespace psibase::http
       connect_t                 set_config             = {};
       get_config_t              get_keys               = {};
       generic_json_t            new_key                = {};
+      get_config_t              get_database_stats     = {};
       admin_service             admin                  = {};
       services_t                services;
       std::atomic<bool>         enable_p2p;
@@ -41,6 +41,14 @@ int main(int argc, char** argv)
    uint64_t    insert_count;
    uint64_t    status_count;
    bool        check_content = false;
+   uint64_t    scan_count;
+   uint64_t    batch_size;
+   uint64_t    cold_scan_count;
+   bool        compress = false;
+   bool        huge_pages = false;
+   bool        prefault   = false;
+   uint32_t    inline_values;
+   uint64_t    hash_count;
 
    uint32_t                num_read_threads = 6;
    po::options_description desc("Allowed options");
@@ -67,6 +75,25 @@ int main(int argc, char** argv)
    opt("stat,s", po::value<uint64_t>(&status_count)->default_value(1000000ull),
        "the number of how often to print stats");
    opt("check-content", po::bool_switch(&check_content), "check content against std::map (slow)");
+   opt("scan", po::value<uint64_t>(&scan_count)->default_value(0),
+       "after inserting, scan this many keys using an iterator and using repeated "
+       "get_greater_equal, and compare");
+   opt("batch-size", po::value<uint64_t>(&batch_size)->default_value(0),
+       "insert keys in sorted batches of this size using apply_batch (0 = upsert each key)");
+   opt("cold-scan", po::value<uint64_t>(&cold_scan_count)->default_value(0),
+       "after inserting, scan this many keys from random starting points, with and without "
+       "prefetch. Use a database which is much larger than RAM and -i 0 to measure cold reads");
+   opt("compress", po::bool_switch(&compress),
+       "compress values as they move into the cool and cold rings");
+   opt("huge-pages", po::bool_switch(&huge_pages),
+       "back the hot and warm rings with transparent huge pages");
+   opt("prefault", po::bool_switch(&prefault),
+       "fault in the hot and warm rings before starting, instead of during the run");
+   opt("inline-values", po::value<uint32_t>(&inline_values)->default_value(0),
+       "store values up to this size inside of their parent nodes (0 = off, max 255)");
+   opt("hash", po::value<uint64_t>(&hash_count)->default_value(0),
+       "after inserting, hash the tree, then repeatedly change this many keys in a new "
+       "revision and time hashing it again");
 
    po::variables_map vm;
    po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -95,8 +122,29 @@ int main(int argc, char** argv)
    }
 
    uint64_t total = insert_count;  //2 * 1000 * 1000 * 1000;
-   auto  _db = std::make_shared<triedent::database>(db_dir.c_str(), triedent::database::read_write);
-   auto& db  = *_db;
+   auto open_start = std::chrono::steady_clock::now();
+   auto _db        = std::make_shared<triedent::database>(
+       db_dir.c_str(), triedent::database::read_write, false,
+       triedent::database::memory_config{
+           .huge_pages = huge_pages,
+           .prefault   = prefault,
+           .progress   = [](auto level, uint64_t done, uint64_t total)
+           {
+              if (done == total || done % (1ull << 30) == 0)
+                 std::cerr << "prefault level " << level << ": " << done / (1024 * 1024) << " / "
+                           << total / (1024 * 1024) << " MB\n";
+           },
+       });
+   auto& db = *_db;
+   std::cerr << "opened in "
+             << std::chrono::duration<double>(std::chrono::steady_clock::now() - open_start).count()
+             << " sec";
+   for (int i : {triedent::ring_allocator::hot_cache, triedent::ring_allocator::warm_cache})
+      if (huge_pages && !db.get_stats().levels[i].huge_pages)
+         std::cerr << ", huge pages are not available for level " << i;
+   std::cerr << "\n";
+   db.set_compression(compress);
+   db.set_inline_values(inline_values);
    db.print_stats();
    std::cerr << "\n";
    auto s    = db.start_write_session();
@@ -150,10 +198,9 @@ int main(int argc, char** argv)
             while (r.load(std::memory_order_relaxed) == v)
             {
                uint64_t h = (uint64_t(gen()) << 32) | gen();
-               // TODO
-               // auto     itr = rs->lower_bound(rr, std::string_view((char*)&h, sizeof(h)));
-               // if (itr.valid())
-               //    ++total_lookups[c].total_lookups;
+               auto     itr = rs->lower_bound(rr, std::string_view((char*)&h, sizeof(h)));
+               if (itr.valid())
+                  ++total_lookups[c].total_lookups;
                if (done.load(std::memory_order_relaxed))
                   break;
             }
@@ -211,8 +258,22 @@ int main(int argc, char** argv)
 
    std::vector<std::unique_ptr<std::thread>> rthreads;
 
-   int64_t     read_start = 0;
+   int64_t     read_start   = 0;
+   uint64_t    allocs_start = db.num_allocs();
    std::string k;
+
+   std::vector<std::string> pending;
+   auto                     flush_batch = [&]
+   {
+      std::sort(pending.begin(), pending.end());
+      pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+      std::vector<triedent::write_session::batch_entry> batch;
+      batch.reserve(pending.size());
+      for (auto& key : pending)
+         batch.push_back({key, std::span<const char>{key}});
+      s->apply_batch(root, batch);
+      pending.clear();
+   };
    // TRIEDENT_WARN("INSERT COUNT: ", insert_count);
    std::map<std::string, std::string> comparison_map;
    for (uint64_t i = 0; i < insert_count; ++i)
@@ -254,6 +315,9 @@ int main(int argc, char** argv)
             auto read_end   = get_total_lookups();
             auto delta_read = read_end - read_start;
             read_start      = read_end;
+            auto allocs_end = db.num_allocs();
+            auto delta_allc = allocs_end - allocs_start;
+            allocs_start    = allocs_end;
             std::cerr << std::setw(12)
                       << int64_t(status_count /
                                  (std::chrono::duration<double, std::milli>(delta).count() / 1000))
@@ -261,7 +325,7 @@ int main(int argc, char** argv)
                       << uint64_t(
                              delta_read /
                              ((std::chrono::duration<double, std::milli>(delta).count() / 1000)))
-                      << "\n";
+                      << "  allocs/key: " << double(delta_allc) / status_count << "\n";
          }
 
          uint64_t    v[2];
@@ -284,7 +348,16 @@ int main(int argc, char** argv)
          if (i < total)
          {
             //base.emplace( std::make_pair(k,std::string((char*)&h, sizeof(h))) );
-            if (use_string)
+            if (batch_size)
+            {
+               auto key = use_string ? str : std::string(hk);
+               if (check_content)
+                  comparison_map[key] = key;
+               pending.push_back(std::move(key));
+               if (pending.size() >= batch_size)
+                  flush_batch();
+            }
+            else if (use_string)
             {
                if (check_content)
                   comparison_map[str] = str;
@@ -318,6 +391,8 @@ int main(int argc, char** argv)
          return -1;
       }
    }
+   if (!pending.empty())
+      flush_batch();
    done.store(true);
    for (auto& r : rthreads)
       r->join();
@@ -347,5 +422,110 @@ int main(int argc, char** argv)
       std::cerr << "missing: " << missing << " mismatched: " << mismatched << "\n";
    }
 
+   auto time_scan = [&](const std::string& name, auto&& scan)
+   {
+      auto     start = std::chrono::steady_clock::now();
+      uint64_t count = scan();
+      auto     delta = std::chrono::steady_clock::now() - start;
+      std::cerr << std::setw(34) << name << ": " << count << " keys in "
+                << std::chrono::duration<double, std::milli>(delta).count() << " ms  "
+                << uint64_t(count / std::chrono::duration<double>(delta).count())
+                << " keys/sec\n";
+   };
+
+   if (scan_count)
+   {
+      time_scan("iterator",
+                [&]
+                {
+                   uint64_t count = 0;
+                   for (auto itr = s->first(root); itr && count < scan_count; ++itr)
+                      ++count;
+                   return count;
+                });
+
+      time_scan("get_greater_equal",
+                [&]
+                {
+                   uint64_t          count = 0;
+                   std::vector<char> key;
+                   while (count < scan_count &&
+                          s->get_greater_equal(root, key, &key, nullptr, nullptr))
+                   {
+                      key.push_back(0);
+                      ++count;
+                   }
+                   return count;
+                });
+   }
+
+   if (cold_scan_count)
+   {
+      // Each scan starts from a different random key, so with a large enough
+      // database, most of what it reads won't be in RAM yet
+      auto random_start = [&]
+      {
+         auto start = rand64();
+         return use_string ? std::to_string(start) : std::string((char*)&start, sizeof(start));
+      };
+      for (bool prefetch : {false, true})
+      {
+         s->set_prefetch(prefetch);
+         std::string suffix = prefetch ? " (prefetch)" : "";
+         time_scan("cold iterator" + suffix,
+                   [&]
+                   {
+                      uint64_t count = 0;
+                      for (auto itr = s->lower_bound(root, random_start());
+                           itr && count < cold_scan_count; ++itr)
+                         ++count;
+                      return count;
+                   });
+         time_scan("cold get_greater_equal" + suffix,
+                   [&]
+                   {
+                      uint64_t          count = 0;
+                      auto              start = random_start();
+                      std::vector<char> key(start.begin(), start.end());
+                      while (count < cold_scan_count &&
+                             s->get_greater_equal(root, key, &key, nullptr, nullptr))
+                      {
+                         key.push_back(0);
+                         ++count;
+                      }
+                      return count;
+                   });
+      }
+      s->set_prefetch(false);
+   }
+
+   if (hash_count)
+   {
+      auto time_hash = [&](const std::string& name)
+      {
+         auto start = std::chrono::steady_clock::now();
+         s->get_hash(root);
+         auto delta = std::chrono::steady_clock::now() - start;
+         std::cerr << std::setw(34) << name << ": "
+                   << std::chrono::duration<double, std::milli>(delta).count() << " ms\n";
+      };
+      time_hash("hash");
+      time_hash("hash again");
+      for (int round = 0; round < 5; ++round)
+      {
+         // Keep the previous revision alive, like a block's revision, so the
+         // changes copy the paths to the keys instead of editing them in place
+         root_t previous = root;
+         for (uint64_t i = 0; i < hash_count; ++i)
+         {
+            auto h   = rand64();
+            auto key = use_string ? std::to_string(h) : std::string((char*)&h, sizeof(h));
+            s->upsert(root, key, key);
+         }
+         time_hash("hash after " + std::to_string(hash_count) + " upserts");
+         s->release(previous);
+      }
+   }
+
    return 0;
 }
@@ -2,6 +2,9 @@
 #include <boost/interprocess/mapped_region.hpp>
 #include <boost/interprocess/offset_ptr.hpp>
 #include <boost/interprocess/sync/interprocess_sharable_mutex.hpp>
+#include <openssl/evp.h>
+#include <signal.h>
+#include <unistd.h>
 #include <triedent/database.hpp>
 #include <triedent/debug.hpp>
 
@@ -15,9 +18,15 @@ namespace triedent
    std::atomic<int>      database::_read_thread_number = 0;
    thread_local uint32_t database::_thread_num         = 0;
 
-   database::database(std::filesystem::path dir, access_mode allow_write, bool allow_slow)
+   database::database(std::filesystem::path dir,
+                      access_mode           allow_write,
+                      bool                  allow_slow,
+                      const memory_config&  mem)
+       : _read_only(allow_write == read_only), _pid(::getpid())
    {
-      _active_sessions.push_back(&_root_release_session);
+      // A replica never releases roots
+      if (!_read_only)
+         _root_release_session._slot = claim_session_slot();
 
       auto db = dir / "db";
       if (not std::filesystem::exists(dir))
@@ -26,18 +35,62 @@ namespace triedent
       if (not std::filesystem::exists(db))
          throw std::runtime_error("file does not exist: '" + db.generic_string() + "'");
 
+      if (std::filesystem::file_size(db) < sizeof(database_memory))
+      {
+         if (_read_only)
+            throw std::runtime_error("database hasn't been opened read_write by this version: '" +
+                                     dir.generic_string() + "'");
+         std::filesystem::resize_file(db, sizeof(database_memory));
+      }
+
       auto md = allow_write == read_write ? bip::read_write : bip::read_only;
       _file   = std::make_unique<bip::file_mapping>(db.generic_string().c_str(), md);
       _region = std::make_unique<bip::mapped_region>(*_file, md);
 
       _dbm = reinterpret_cast<database_memory*>(_region->get_address());
 
-      _ring.reset(new ring_allocator(dir / "data", ring_allocator::read_write, allow_slow));
+      // Replicas write their sessions and pins here, so everyone maps it read_write
+      auto replicas = dir / "replicas";
+      bool init     = false;
+      if (!std::filesystem::exists(replicas) ||
+          std::filesystem::file_size(replicas) != sizeof(replica_memory))
+      {
+         if (_read_only)
+            throw std::runtime_error("database hasn't been opened read_write by this version: '" +
+                                     dir.generic_string() + "'");
+         std::ofstream f(replicas.generic_string(), std::ofstream::trunc);
+         f.close();
+         std::filesystem::resize_file(replicas, sizeof(replica_memory));
+         init = true;
+      }
+      _replica_file =
+          std::make_unique<bip::file_mapping>(replicas.generic_string().c_str(), bip::read_write);
+      _replica_region = std::make_unique<bip::mapped_region>(*_replica_file, bip::read_write);
+      _replicas       = reinterpret_cast<replica_memory*>(_replica_region->get_address());
+      if (init)
+         new (_replicas) replica_memory();
+      sweep_replicas();
+
+      _ring.reset(new ring_allocator(
+          dir / "data", _read_only ? ring_allocator::read_only : ring_allocator::read_write,
+          allow_slow, mem));
 
       _ring->_try_claim_free = [this]() { claim_free(); };
+
+      // Release the roots which a previous writer deferred, if nothing pins them anymore
+      if (!_read_only)
+      {
+         std::lock_guard          lock(_root_change_mutex);
+         session_base::swap_guard guard(*this, _root_release_session);
+         release_top_root({});
+      }
    }
 
-   database::~database() {}
+   database::~database()
+   {
+      for (auto* slab = _session_slots.next.load(); slab;)
+         delete std::exchange(slab, slab->next.load());
+   }
 
    void database::create(std::filesystem::path dir, config cfg)
    {
@@ -65,8 +118,670 @@ namespace triedent
                                             .cold_pages = cfg.cold_pages});
    }
 
+   void database::grow(const config& cfg)
+   {
+      if (_read_only)
+         throw std::runtime_error("database is read only");
+      _ring->grow({.max_ids    = cfg.max_objects,
+                   .hot_pages  = cfg.hot_pages,
+                   .warm_pages = cfg.warm_pages,
+                   .cool_pages = cfg.cool_pages,
+                   .cold_pages = cfg.cold_pages});
+   }
+
    void database::print_stats(bool detail)
    {
       _ring->dump(detail);
    }
+
+   database::stats database::get_stats() const
+   {
+      stats result{_ring->get_stats(), 0, 0, 0, {}};
+      for_each_session_slot(
+          [&](const session_slot& slot)
+          { result.active_sessions += slot.in_use.load(std::memory_order_relaxed); });
+      // Excludes _root_release_session
+      if (!_read_only)
+         --result.active_sessions;
+      for (auto& slot : _replicas->sessions)
+         result.replica_sessions += slot.pid.load(std::memory_order_relaxed) != 0;
+      for (auto& d : _replicas->deferred)
+         result.deferred_roots += d.load(std::memory_order_relaxed) != 0;
+
+      result.scrub.passes = _dbm->scrub.passes.load(std::memory_order_relaxed);
+      result.scrub.errors = _dbm->scrub.errors.load(std::memory_order_relaxed);
+      result.scrub.nodes  = _scrub_nodes.load(std::memory_order_relaxed);
+      result.scrub.bytes  = _scrub_bytes.load(std::memory_order_relaxed);
+      std::lock_guard lock(_scrub_error_mutex);
+      result.scrub.last_error = _scrub_last_error;
+      return result;
+   }
+
+   session_slot* database::claim_session_slot()
+   {
+      // The writer has to see a replica's swap positions, so they go in shared memory
+      if (_read_only)
+         return claim_replica_slot();
+      auto* slab = &_session_slots;
+      while (true)
+      {
+         for (auto& slot : slab->slots)
+         {
+            bool expected = false;
+            if (!slot.in_use.load(std::memory_order_relaxed) &&
+                slot.in_use.compare_exchange_strong(expected, true))
+               return &slot;
+         }
+         auto* next = slab->next.load();
+         if (!next)
+         {
+            // The new slab is linked before its first slot is returned, so
+            // claim_free sees the slot before the session publishes a position
+            // in it.
+            auto new_slab = std::make_unique<session_slab>();
+            new_slab->slots[0].in_use.store(true);
+            if (slab->next.compare_exchange_strong(next, new_slab.get()))
+               return &new_slab.release()->slots[0];
+            // Another thread added a slab first; next is now that slab
+         }
+         slab = next;
+      }
+   }
+
+   void database::release_session_slot(session_slot* slot)
+   {
+      for (auto& p : slot->swap_p)
+         p.store(-1ull);
+      slot->in_use.store(false);
+      slot->pid.store(0);
+   }
+
+   session_slot* database::claim_replica_slot()
+   {
+      for (auto& slot : _replicas->sessions)
+      {
+         int32_t expected = 0;
+         if (!slot.pid.load(std::memory_order_relaxed) &&
+             slot.pid.compare_exchange_strong(expected, _pid))
+         {
+            slot.in_use.store(true);
+            return &slot;
+         }
+      }
+      throw std::runtime_error("too many active replica sessions");
+   }
+
+   std::shared_ptr<root> database::pin_top_root()
+   {
+      if (!_read_only)
+         throw std::runtime_error("pin_top_root requires a read_only database");
+
+      root_pin* pin = nullptr;
+      for (auto& p : _replicas->pins)
+      {
+         int32_t expected = 0;
+         if (!p.pid.load(std::memory_order_relaxed) &&
+             p.pid.compare_exchange_strong(expected, _pid))
+         {
+            pin = &p;
+            break;
+         }
+      }
+      if (!pin)
+         throw std::runtime_error("too many pinned roots");
+
+      // set_top_root stores the new root before it looks at the pins, and this
+      // stores the pin before it checks the root again. Either the writer sees
+      // the pin, or this sees that the root changed and tries again.
+      while (true)
+      {
+         auto id = _dbm->top_root.load();
+         if (!id)
+         {
+            unpin(pin);
+            return {};
+         }
+         pin->id.store(id);
+         if (_dbm->top_root.load() == id)
+         {
+            auto result = std::make_shared<root>(root{shared_from_this(), nullptr, {id}});
+            result->pin = pin;
+            return result;
+         }
+      }
+   }
+
+   void database::unpin(root_pin* pin)
+   {
+      pin->id.store(0);
+      pin->pid.store(0);
+   }
+
+   void database::release_top_root(id old)
+   {
+      std::vector<uint64_t> pinned;
+      for (auto& pin : _replicas->pins)
+         if (auto id = pin.id.load())
+            pinned.push_back(id);
+      auto is_pinned = [&](uint64_t id) { return std::ranges::find(pinned, id) != pinned.end(); };
+
+      bool kept = false;
+      for (auto& d : _replicas->deferred)
+      {
+         auto id = d.load();
+         if (!id)
+            continue;
+         if (is_pinned(id))
+            kept = true;
+         else
+         {
+            d.store(0);
+            release({id});
+         }
+      }
+
+      if (old && is_pinned(old.id))
+      {
+         auto slot = std::ranges::find(_replicas->deferred, 0, [](auto& d) { return d.load(); });
+         if (slot == std::end(_replicas->deferred))
+            throw std::runtime_error("too many deferred roots");
+         slot->store(old.id);
+         kept = true;
+      }
+      else if (old)
+         release(old);
+
+      // A replica which exited without unpinning would keep these forever
+      if (kept)
+         maybe_sweep_replicas();
+   }
+
+   void database::sweep_replicas() const
+   {
+      // kill fails with EPERM if the process exists but belongs to someone else
+      auto dead = [](int32_t pid) { return pid && ::kill(pid, 0) < 0 && errno == ESRCH; };
+      for (auto& slot : _replicas->sessions)
+      {
+         auto pid = slot.pid.load();
+         if (dead(pid))
+         {
+            for (auto& p : slot.swap_p)
+               p.store(-1ull);
+            slot.in_use.store(false);
+            slot.pid.compare_exchange_strong(pid, 0);
+         }
+      }
+      for (auto& pin : _replicas->pins)
+      {
+         auto pid = pin.pid.load();
+         if (dead(pid))
+         {
+            pin.id.store(0);
+            pin.pid.compare_exchange_strong(pid, 0);
+         }
+      }
+   }
+
+   void database::maybe_sweep_replicas() const
+   {
+      auto now  = std::chrono::steady_clock::now().time_since_epoch().count();
+      auto last = _last_sweep.load(std::memory_order_relaxed);
+      if (now - last < std::chrono::steady_clock::duration(sweep_interval).count())
+         return;
+      if (_last_sweep.compare_exchange_strong(last, now))
+         sweep_replicas();
+   }
+
+   namespace
+   {
+      class sha256_builder
+      {
+        public:
+         sha256_builder() : _ctx(EVP_MD_CTX_new())
+         {
+            if (!_ctx || !EVP_DigestInit_ex(_ctx, EVP_sha256(), nullptr))
+               throw std::runtime_error("sha256 init failed");
+         }
+         ~sha256_builder() { EVP_MD_CTX_free(_ctx); }
+
+         sha256_builder(const sha256_builder&)            = delete;
+         sha256_builder& operator=(const sha256_builder&) = delete;
+
+         void add(const void* data, size_t size) { EVP_DigestUpdate(_ctx, data, size); }
+
+         void add_int(uint64_t v, int size)
+         {
+            uint8_t bytes[8];
+            for (int i = 0; i < size; ++i)
+               bytes[i] = v >> (i * 8);
+            add(bytes, size);
+         }
+
+         void add_header(char kind, key_view key)
+         {
+            add(&kind, 1);
+            add_int(key.size(), 4);
+            add(key.data(), key.size());
+         }
+
+         node_hash finish()
+         {
+            node_hash result;
+            EVP_DigestFinal_ex(_ctx, result.data(), nullptr);
+            return result;
+         }
+
+        private:
+         EVP_MD_CTX* _ctx;
+      };
+   }  // namespace
+
+   node_hash write_session::get_hash(const std::shared_ptr<root>& r)
+   {
+      return hash_node(get_id(r));
+   }
+
+   // Node hashes cover their keys, which are in 6-bit form:
+   //    bytes:  'v' key_size key value
+   //    roots:  'r' key_size key hash(root)...
+   //    inner:  'i' key_size key branches hash(value) hash(branch)...
+   // Missing nodes hash to all zeros. Trees with the same content have the
+   // same shape, so the hash doesn't depend on how the tree was built.
+   node_hash write_session::hash_node(object_id id)
+   {
+      if (!id)
+         return {};
+      auto& cache = _db->_ring->hashes();
+      if (auto cached = cache.get(id.id))
+         return *cached;
+
+      sha256_builder         builder;
+      std::vector<object_id> children;
+      {
+         // The guard isn't held while hashing the children, so hashing a
+         // large tree for the first time doesn't hold up swap()
+         swap_guard g(*this);
+         auto       n = get_by_id(id);
+         if (n.type() == node_type::bytes)
+         {
+            auto& vn = n.as_value_node();
+            builder.add_header('v', vn.key());
+            builder.add(vn.data_ptr(), vn.data_size());
+         }
+         else if (n.type() == node_type::roots)
+         {
+            auto& vn = n.as_value_node();
+            builder.add_header('r', vn.key());
+            children.assign(vn.roots(), vn.roots() + vn.num_roots());
+         }
+         else
+         {
+            auto& in = n.as_inner_node();
+            builder.add_header('i', in.key());
+            builder.add_int(in.branches(), 8);
+            children.push_back(in.value());
+            children.insert(children.end(), in.children(), in.children() + in.num_branches());
+         }
+      }
+
+      for (auto child : children)
+      {
+         auto h = hash_node(child);
+         builder.add(h.data(), h.size());
+      }
+      auto result = builder.finish();
+      if (!is_inline(id))
+         cache.set(id.id, result);
+      return result;
+   }
+
+   struct scrubber::walk
+   {
+      ring_allocator&                          ring;
+      const std::vector<frame>&                resume;
+      std::vector<frame>&                      stopped_at;
+      std::function<void(const std::string&)> report;
+      uint64_t                                 budget;
+      uint64_t                                 nodes = 0;
+      uint64_t                                 bytes = 0;
+      std::vector<frame>                       path;  // the roots values which hold this tree
+
+      // Checks the subtree at id, whose key starts with key6. If resuming,
+      // it skips the keys before resume[path.size()]. Returns false if the
+      // budget ran out; stopped_at then holds where to continue.
+      bool visit(object_id id, std::string& key6, bool resuming, bool is_value)
+      {
+         if (!budget)
+         {
+            stopped_at = path;
+            stopped_at.push_back({key6, 0});
+            return false;
+         }
+         --budget;
+         ++nodes;
+
+         uint32_t    size = 0;
+         const char* ptr;
+         node_type   type;
+         if (is_inline(id))
+         {
+            // The parent already checked that the value is inside of it
+            std::tie(ptr, type, std::ignore) = ring.get_cache<false>(inline_parent(id));
+            ptr  = reinterpret_cast<const char*>(
+                &reinterpret_cast<const inner_node*>(ptr)->inline_value(inline_index(id)));
+            type = node_type::bytes;
+            size = reinterpret_cast<const value_node*>(ptr)->size();
+            bytes += size;
+         }
+         else
+         {
+            if (auto err = ring.check(id, size); !err.empty())
+            {
+               report(err);
+               return true;
+            }
+            bytes += size;
+            try
+            {
+               std::tie(ptr, type, std::ignore) = ring.get_cache<false>(id);
+            }
+            catch (std::exception& e)
+            {
+               report(e.what());
+               return true;
+            }
+            // The decoded size, if the object is compressed
+            size = (reinterpret_cast<const object_header*>(ptr) - 1)->size;
+         }
+
+         auto invalid = [&](std::string_view what)
+         {
+            report("object " + std::to_string(id.id) + " " + std::string(what));
+            return true;
+         };
+         auto valid_key6 = [](key_view k)
+         { return std::all_of(k.begin(), k.end(), [](char c) { return uint8_t(c) < 64; }); };
+
+         if (type == node_type::inner)
+         {
+            auto& in = *reinterpret_cast<const inner_node*>(ptr);
+            if (is_value)
+               return invalid("is an inner node in a value position");
+            uint32_t end = sizeof(inner_node) + in.num_branches() * sizeof(object_id) + in.key_size();
+            if (in.num_inline())
+            {
+               // Each inline value must be inside the node, after the offset table
+               end = ((end + 7) & -8) + ((in.num_inline() * sizeof(uint16_t) + 7) & -8);
+               for (uint32_t i = 0; i < in.num_inline(); ++i)
+               {
+                  uint64_t offset = reinterpret_cast<const char*>(&in.inline_value(i)) - ptr;
+                  if (offset < end + sizeof(object_header) ||
+                      offset + sizeof(value_node) > size ||
+                      offset + in.inline_value(i).size() > size)
+                     return invalid("has an inline value outside of it");
+                  end = offset + ((in.inline_value(i).size() + 7) & -8);
+               }
+            }
+            if (size != end)
+               return invalid("has the wrong size for an inner node");
+            if (!in.branches())
+               return invalid("is an inner node without branches");
+            if (!valid_key6(in.key()))
+               return invalid("has an invalid key");
+            for (auto c = in.children(), e = c + in.num_branches(); c != e; ++c)
+            {
+               if (!*c)
+                  return invalid("has an empty branch");
+               if (is_inline(*c) &&
+                   (inline_parent(*c) != id || inline_index(*c) >= in.num_inline()))
+                  return invalid("has an inline branch which isn't inside of it");
+            }
+
+            auto base = key6.size();
+            key6 += in.key();
+            bool     resume_value  = resuming;
+            bool     resume_branch = false;
+            uint32_t first         = 0;
+            if (resuming)
+            {
+               auto& k = resume[path.size()].key6;
+               if (k.starts_with(key6))
+               {
+                  if (k.size() > key6.size())
+                  {
+                     resume_value  = false;
+                     resume_branch = true;
+                     first         = uint8_t(k[key6.size()]);
+                  }
+               }
+               else if (key6 < k)
+               {
+                  key6.resize(base);
+                  return true;
+               }
+               else
+                  resuming = false;
+            }
+
+            if (in.value() && !resume_branch && !visit(in.value(), key6, resume_value, true))
+               return false;
+            for (uint32_t b = first; b < 64; ++b)
+            {
+               if (!in.has_branch(b))
+                  continue;
+               key6.push_back(b);
+               if (!visit(in.branch(b), key6, resume_branch && b == first, false))
+                  return false;
+               key6.pop_back();
+            }
+            key6.resize(base);
+            return true;
+         }
+
+         auto& vn = *reinterpret_cast<const value_node*>(ptr);
+         if (size < sizeof(value_node) + vn.key_size())
+            return invalid("is too small for its key");
+         if (is_value && vn.key_size())
+            return invalid("has a key, but is an inner node's value");
+         if (!valid_key6(vn.key()))
+            return invalid("has an invalid key");
+         if (type != node_type::roots)
+            return true;
+         if (vn.data_size() % sizeof(object_id))
+            return invalid("has a size which isn't a whole number of roots");
+
+         auto     key    = key6 + std::string(vn.key());
+         uint32_t start  = 0;
+         bool     nested = false;
+         if (resuming)
+         {
+            auto& r = resume[path.size()];
+            if (key < r.key6)
+               return true;
+            if (key == r.key6)
+            {
+               start  = r.index;
+               nested = resume.size() > path.size() + 1;
+            }
+         }
+         for (uint32_t i = start; i < vn.num_roots(); ++i)
+         {
+            if (!vn.roots()[i])
+               continue;
+            std::string sub;
+            path.push_back({key, i});
+            if (!visit(vn.roots()[i], sub, nested && i == start, false))
+               return false;
+            path.pop_back();
+         }
+         return true;
+      }
+   };
+
+   scrubber::scrubber(std::shared_ptr<database> db) : _db(std::move(db))
+   {
+      if (_db->_read_only)
+         throw std::runtime_error("a scrubber needs a database which is open read_write");
+      if (_db->_have_scrubber.exchange(true))
+         throw std::runtime_error("the database already has a scrubber");
+      _session._slot = _db->claim_session_slot();
+      load_position();
+   }
+
+   scrubber::~scrubber()
+   {
+      {
+         std::lock_guard lock(_mutex);
+         _stop = true;
+      }
+      _cond.notify_all();
+      if (_thread.joinable())
+         _thread.join();
+      _db->release_session_slot(_session._slot);
+      _db->_have_scrubber.store(false);
+   }
+
+   void scrubber::start(const config& cfg)
+   {
+      _thread = std::thread(
+          [this, cfg]
+          {
+             thread_name("scrub");
+             run(cfg);
+          });
+   }
+
+   void scrubber::run(config cfg)
+   {
+      using clock     = std::chrono::steady_clock;
+      auto pass_start = clock::now();
+      while (true)
+      {
+         auto nodes    = _db->_scrub_nodes.load();
+         auto bytes    = _db->_scrub_bytes.load();
+         auto start    = clock::now();
+         bool finished = false;
+         try
+         {
+            finished = step();
+         }
+         catch (std::exception& e)
+         {
+            report(e.what());
+         }
+
+         // Sleep long enough that this step stays within both budgets
+         auto budget = std::max(
+             std::chrono::duration<double>((_db->_scrub_nodes.load() - nodes) /
+                                           double(std::max<uint64_t>(cfg.nodes_per_sec, 1))),
+             std::chrono::duration<double>((_db->_scrub_bytes.load() - bytes) /
+                                           double(std::max<uint64_t>(cfg.bytes_per_sec, 1))));
+         auto until = start + std::chrono::duration_cast<clock::duration>(budget);
+         if (finished)
+         {
+            until      = std::max(until, pass_start + cfg.min_pass_interval);
+            pass_start = until;
+         }
+
+         std::unique_lock lock(_mutex);
+         if (_cond.wait_until(lock, until, [&] { return _stop; }))
+            return;
+      }
+   }
+
+   bool scrubber::step(uint64_t max_nodes)
+   {
+      std::shared_ptr<root> top;
+      {
+         std::lock_guard lock(_db->_root_change_mutex);
+         auto            id = _db->_dbm->top_root.load();
+         // A ref count which is already at its maximum would have to be copied,
+         // which only the writer may do. Try again next time.
+         if (id && !_db->_ring->bump_count({id}))
+            return false;
+         if (id)
+            top = std::make_shared<root>(root{_db, nullptr, {id}});
+      }
+
+      std::vector<frame> stopped_at;
+      bool               finished = true;
+      walk               w{
+          .ring       = *_db->_ring,
+          .resume     = _position,
+          .stopped_at = stopped_at,
+          .report     = [this](const std::string& error) { report(error); },
+          .budget     = max_nodes,
+          .nodes      = 0,
+          .bytes      = 0,
+          .path       = {},
+      };
+      if (top)
+      {
+         session_base::swap_guard guard(*_db, _session);
+         std::string              key6;
+         finished = w.visit(top->id, key6, !_position.empty(), false);
+      }
+      _db->_scrub_nodes.fetch_add(w.nodes, std::memory_order_relaxed);
+      _db->_scrub_bytes.fetch_add(w.bytes, std::memory_order_relaxed);
+
+      _position = std::move(stopped_at);
+      if (finished)
+         _db->_dbm->scrub.passes.fetch_add(1);
+      save_position();
+      return finished;
+   }
+
+   void scrubber::report(const std::string& error)
+   {
+      _db->_dbm->scrub.errors.fetch_add(1);
+      std::lock_guard lock(_db->_scrub_error_mutex);
+      _db->_scrub_last_error = error;
+   }
+
+   // Each frame is stored as a 2-byte key size, the key, and a 4-byte index.
+   // A position which doesn't fit is cut short, which only means that some
+   // nodes are checked twice.
+   void scrubber::save_position()
+   {
+      auto&  cp   = _db->_dbm->scrub;
+      size_t size = 0;
+      for (auto& f : _position)
+      {
+         auto room = sizeof(cp.position) - size;
+         if (room <= sizeof(uint16_t) + sizeof(uint32_t))
+            break;
+         uint16_t n     = std::min(f.key6.size(), room - sizeof(uint16_t) - sizeof(uint32_t));
+         uint32_t index = n == f.key6.size() ? f.index : 0;
+         memcpy(cp.position + size, &n, sizeof(n));
+         memcpy(cp.position + size + sizeof(n), f.key6.data(), n);
+         memcpy(cp.position + size + sizeof(n) + n, &index, sizeof(index));
+         size += sizeof(n) + n + sizeof(index);
+         if (n != f.key6.size())
+            break;
+      }
+      cp.position_size = size;
+   }
+
+   void scrubber::load_position()
+   {
+      auto& cp   = _db->_dbm->scrub;
+      auto  size = std::min<size_t>(cp.position_size, sizeof(cp.position));
+      _position.clear();
+      for (size_t pos = 0; pos < size;)
+      {
+         uint16_t n;
+         uint32_t index;
+         if (size - pos < sizeof(n) + sizeof(index))
+            break;
+         memcpy(&n, cp.position + pos, sizeof(n));
+         if (size - pos < sizeof(n) + n + sizeof(index))
+            break;
+         frame f{std::string(cp.position + pos + sizeof(n), n)};
+         memcpy(&f.index, cp.position + pos + sizeof(n) + n, sizeof(index));
+         pos += sizeof(n) + n + sizeof(index);
+         if (!std::all_of(f.key6.begin(), f.key6.end(), [](char c) { return uint8_t(c) < 64; }))
+            break;
+         _position.push_back(std::move(f));
+      }
+   }
 }  // namespace triedent
@@ -0,0 +1,145 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+namespace triedent
+{
+   // A small LZ77 block codec for objects in the cool and cold rings.
+   //
+   // The encoding is a series of sequences:
+   //    token:    literal length (high 4 bits), match length - 4 (low 4 bits)
+   //    [extra literal length bytes if 15; each adds 0-255, a byte < 255 ends it]
+   //    literals
+   //    offset:   2 bytes, little endian, distance back from the current position
+   //    [extra match length bytes if 15, as above]
+   // The final sequence has literals only, and ends at the end of the input.
+   //
+   // Objects are compressed independently, so the codec favors speed and a
+   // small table over ratio.
+
+   // Returns the compressed size, or 0 if the result wouldn't fit in capacity
+   inline uint32_t compress_block(const char* src, uint32_t size, char* dst, uint32_t capacity)
+   {
+      constexpr uint32_t min_match  = 4;
+      constexpr uint32_t hash_bits  = 12;
+      constexpr uint32_t max_offset = 0xffff;
+
+      uint32_t table[1 << hash_bits];
+      memset(table, 0xff, sizeof(table));
+
+      auto read32 = [&](uint32_t pos)
+      {
+         uint32_t v;
+         memcpy(&v, src + pos, sizeof(v));
+         return v;
+      };
+      auto hash = [&](uint32_t pos) { return (read32(pos) * 2654435761u) >> (32 - hash_bits); };
+
+      uint32_t out = 0;
+      auto     put = [&](uint8_t b)
+      {
+         if (out >= capacity)
+            return false;
+         dst[out++] = b;
+         return true;
+      };
+      auto put_length = [&](uint32_t len)
+      {
+         for (; len >= 255; len -= 255)
+            if (!put(255))
+               return false;
+         return put(len);
+      };
+      auto put_sequence = [&](uint32_t lit_begin, uint32_t lit_len, uint32_t offset,
+                              uint32_t match_len, bool last)
+      {
+         uint8_t token = (lit_len < 15 ? lit_len : 15) << 4;
+         if (!last)
+            token |= match_len - min_match < 15 ? match_len - min_match : 15;
+         if (!put(token) || (lit_len >= 15 && !put_length(lit_len - 15)))
+            return false;
+         if (lit_len > capacity - out)
+            return false;
+         memcpy(dst + out, src + lit_begin, lit_len);
+         out += lit_len;
+         if (last)
+            return true;
+         if (!put(offset & 0xff) || !put(offset >> 8))
+            return false;
+         return match_len - min_match < 15 || put_length(match_len - min_match - 15);
+      };
+
+      uint32_t lit_begin = 0;
+      uint32_t pos       = 0;
+      while (pos + min_match <= size)
+      {
+         auto  h         = hash(pos);
+         auto  candidate = table[h];
+         table[h]        = pos;
+         if (candidate == 0xffffffff || pos - candidate > max_offset ||
+             read32(candidate) != read32(pos))
+         {
+            ++pos;
+            continue;
+         }
+         uint32_t match_len = min_match;
+         while (pos + match_len < size && src[candidate + match_len] == src[pos + match_len])
+            ++match_len;
+         if (!put_sequence(lit_begin, pos - lit_begin, pos - candidate, match_len, false))
+            return 0;
+         pos += match_len;
+         lit_begin = pos;
+      }
+      if (!put_sequence(lit_begin, size - lit_begin, 0, 0, true))
+         return 0;
+      return out;
+   }
+
+   // Returns false if src is malformed or doesn't decompress to exactly size bytes
+   inline bool decompress_block(const char* src, uint32_t src_size, char* dst, uint32_t size)
+   {
+      uint32_t in  = 0;
+      uint32_t out = 0;
+      auto     get_length = [&](uint32_t& len)
+      {
+         uint8_t b;
+         do
+         {
+            if (in >= src_size)
+               return false;
+            b = src[in++];
+            len += b;
+         } while (b == 255);
+         return true;
+      };
+
+      while (in < src_size)
+      {
+         uint8_t  token   = src[in++];
+         uint32_t lit_len = token >> 4;
+         if (lit_len == 15 && !get_length(lit_len))
+            return false;
+         if (lit_len > src_size - in || lit_len > size - out)
+            return false;
+         memcpy(dst + out, src + in, lit_len);
+         in += lit_len;
+         out += lit_len;
+         if (in == src_size)
+            break;
+
+         if (src_size - in < 2)
+            return false;
+         uint32_t offset = uint8_t(src[in]) | uint32_t(uint8_t(src[in + 1])) << 8;
+         in += 2;
+         uint32_t match_len = (token & 15) + 4;
+         if ((token & 15) == 15 && !get_length(match_len))
+            return false;
+         if (offset == 0 || offset > out || match_len > size - out)
+            return false;
+         // The source and destination may overlap, so this copies a byte at a time
+         for (auto p = dst + out - offset, e = p + match_len; p != e; ++p)
+            dst[out++] = *p;
+      }
+      return out == size;
+   }
+}  // namespace triedent
@@ -2,8 +2,12 @@
 
 #include <algorithm>
 #include <boost/interprocess/sync/interprocess_sharable_mutex.hpp>
+#include <chrono>
+#include <concepts>
+#include <condition_variable>
 #include <memory>
 #include <span>
+#include <triedent/key6.hpp>
 #include <triedent/node.hpp>
 
 namespace triedent
@@ -14,6 +18,7 @@ namespace triedent
    class session;
 
    class database;
+   class scrubber;
    class shared_root;
    class write_session;
 
@@ -71,11 +76,15 @@ namespace triedent
    //   `*p = ...` or `std::move(*p)` outside of this file. If you do, you'll have
    //   additional synchronization and iterator rules to deal with which aren't
    //   explained here.
+   struct root_pin;
+
    class root
    {
       template <typename AccessMode>
       friend class session;
 
+      friend database;
+      friend scrubber;
       friend shared_root;
       friend write_session;
 
@@ -100,10 +109,15 @@ namespace triedent
       // held anywhere else, then either its shared_ptr::use_count or its storage
       // refcount will be greater than 1, preventing it from being dropped or edited
       // in place, which in turn keeps this id and the node it references safe.
+      //
+      // If pin != nullptr, then this is a top root which a read_only database
+      // got from database::pin_top_root. It has no refcount of its own; the
+      // writer keeps id alive until ~root() clears the pin.
 
       std::shared_ptr<database> db;
       std::shared_ptr<root>     ancestor;
       object_id                 id;
+      root_pin*                 pin = nullptr;
 
       root(std::shared_ptr<database> db, std::shared_ptr<root> ancestor, object_id id)
           : db(std::move(db)), ancestor(std::move(ancestor)), id(id)
@@ -124,21 +138,40 @@ namespace triedent
       root& operator=(root&&)      = default;
    };  // root
 
+   // The swap positions a session may be reading from. claim_free doesn't free
+   // anything at or past the minimum published position of each level. Slots
+   // are padded to a cache line so that sessions on different threads don't
+   // contend when they publish.
+   struct alignas(64) session_slot
+   {
+      std::atomic<bool>     in_use    = false;
+      std::atomic<uint64_t> swap_p[4] = {-1ull, -1ull, -1ull, -1ull};
+      // The process which owns the slot, or 0 if it's free. Only used by
+      // slots which are shared with read_only processes.
+      std::atomic<int32_t> pid = 0;
+   };
+
+   // A top root which a read_only process is reading. The writer doesn't
+   // release a top root that it replaced while any pin holds its id.
+   struct alignas(64) root_pin
+   {
+      std::atomic<int32_t>  pid = 0;  // 0 if the pin is free
+      std::atomic<uint64_t> id  = 0;
+   };
+
    class session_base
    {
       friend database;
       friend root;
+      friend scrubber;
 
      public:
       using string_view = std::string_view;
       using id          = object_id;
 
      protected:
-      /* auto inc id used to detect when we can modify in place*/
-      mutable std::atomic<uint64_t> _hot_swap_p  = -1ull;
-      mutable std::atomic<uint64_t> _warm_swap_p = -1ull;
-      mutable std::atomic<uint64_t> _cool_swap_p = -1ull;
-      mutable std::atomic<uint64_t> _cold_swap_p = -1ull;
+      // Owned by the database. Null if this session can't read nodes.
+      session_slot* _slot = nullptr;
 
       void lock_swap_p(database& db) const;
       void unlock_swap_p() const;
@@ -165,84 +198,81 @@ namespace triedent
    template <typename AccessMode = write_access>
    class session : public session_base
    {
-      using iterator_data = std::vector<std::pair<id, char>>;
-      mutable std::vector<iterator_data> _iterators;
-      mutable uint64_t                   _used_iterators = 0;
-      inline uint64_t&                   used_iterators() const { return _used_iterators; }
-      inline auto&                       iterators() const { return _iterators; }
-
      public:
-      // Caution: as long as an iterator is in use:
-      // * The session which created it must be alive
-      // * The root which created it must be alive and unchanged.
-      //   To meet this requirement, don't drop or modify the root
-      //   shared_ptr, or pass it by non-const ref to any functions
-      //   in this library. You may modify copies of the shared_ptr.
+      // An iterator caches the path from the root to its current position
+      // so ++ and -- don't have to descend from the root again. It holds a
+      // copy of the root's shared_ptr, which keeps every node on the path
+      // alive and prevents the tree from being edited in place underneath
+      // it. Each operation holds a swap_guard while it touches nodes, so
+      // nodes may move between rings between operations.
+      //
+      // In psibase, only the scans which merge nested write sessions with
+      // the tree use an iterator. Other kvGreaterEqualRaw and kvLessThanRaw
+      // calls, which KvIterator and RPC scans make, still search from the
+      // root each time. Keeping an iterator between those calls would keep
+      // a copy of the root, so the writer would copy nodes instead of
+      // editing them in place.
+      //
+      // Caution:
+      // * The session which created an iterator must outlive it
+      // * Like the session itself, an iterator isn't thread safe
       // * Don't compare iterators created by different sessions or
       //   different roots.
-      //
-      // TODO: iterator implementation isn't complete; multiple functions
-      //       need to be fixed
-#if 0
-      struct iterator
-      {
-         uint32_t    key_size() const;
-         uint32_t    read_key(char* data, uint32_t data_len) const;
-         std::string key() const;
-         iterator&   operator++();
-         iterator&   operator--();
-         bool        valid() const { return path().size() > 0; }
+      class iterator
+      {
+        public:
+         iterator() = default;
+
+         bool valid() const { return !_path.empty(); }
 
          explicit operator bool() const { return valid(); }
 
-         ~iterator()
-         {
-            if (_iter_num != -1)
-            {
-               path().clear();
-               _session->used_iterators() ^= 1ull << _iter_num;
-            }
-         }
+         // Incrementing the end iterator leaves it at the end. Decrementing
+         // the end iterator moves it to the last key.
+         iterator& operator++();
+         iterator& operator--();
 
-         iterator(const iterator& c) : _session(c._session)
-         {
-            // TODO: detect none available; currently causes UB
-            _iter_num = std::countr_one(_session->_used_iterators);
-            _session->used_iterators() ^= 1ull << _iter_num;
-            path() = c.path();
-         }
-         iterator(iterator&& c) : _session(c._session), _iter_num(c._iter_num) { c._iter_num = -1; }
+         // Moves to the first key >= key without creating a new iterator
+         iterator& seek(std::span<const char> key);
 
-         // TODO: ==, !=
+         std::vector<char> key() const;
+         void              key(std::vector<char>& result) const;
 
-         void value(std::string& v) const;
+         bool              value(std::vector<char>*                  result_bytes,
+                                 std::vector<std::shared_ptr<root>>* result_roots) const;
+         std::vector<char> value() const;
 
-         std::string value() const
+         friend bool operator==(const iterator& a, const iterator& b)
          {
-            std::string r;
-            value(r);
-            return r;
+            return a._key6 == b._key6 && a._path.empty() == b._path.empty();
          }
 
         private:
          friend class session;
 
-         string_view unguarded_value() const;
-         uint32_t    unguarded_key_size() const;
-         uint32_t    unguarded_read_key(char* data, uint32_t data_len) const;
-         iterator(const session& s) : _session(&s)
+         struct path_entry
          {
-            // TODO: detect none available; currently causes UB
-            _iter_num = std::countr_one(_session->_used_iterators);
-            _session->used_iterators() ^= 1ull << _iter_num;
+            object_id id;
+            int8_t    branch;   // -1: positioned at this node's value
+            uint32_t  key_pos;  // offset of this node's key within _key6
          };
 
-         iterator_data& path() const { return _session->iterators()[_iter_num]; };
-
-         uint32_t       _iter_num;
-         const session* _session;
+         iterator(const session& s, const std::shared_ptr<root>& r) : _session(&s), _root(r) {}
+
+         void clear();
+         void push(object_id id, key_view node_key, int8_t branch);
+         void set_branch(path_entry& e, size_t node_key_size, int8_t branch);
+         void push_first(object_id id);
+         void push_last(object_id id);
+         void next();
+         void prev();
+         void lower_bound(key_view key);
+
+         const session*          _session = nullptr;
+         std::shared_ptr<root>   _root;
+         std::vector<path_entry> _path;
+         std::vector<char>       _key6;
       };
-#endif
 
       // This is more efficient than simply dropping r since it
       // doesn't usually lock a mutex. However, like dropping r,
@@ -250,11 +280,10 @@ namespace triedent
       // calling this from a dedicated cleanup thread.
       void release(std::shared_ptr<root>& r);
 
-      // iterator first(const std::shared_ptr<root>& r) const;
-      // iterator last(const std::shared_ptr<root>& r) const;
-      // iterator find(const std::shared_ptr<root>& r, string_view key) const;
-      // iterator lower_bound(const std::shared_ptr<root>& r, string_view key) const;
-      // iterator last_with_prefix(const std::shared_ptr<root>& r, string_view prefix) const;
+      iterator first(const std::shared_ptr<root>& r) const;
+      iterator last(const std::shared_ptr<root>& r) const;
+      iterator find(const std::shared_ptr<root>& r, std::span<const char> key) const;
+      iterator lower_bound(const std::shared_ptr<root>& r, std::span<const char> key) const;
 
       bool                             get(const std::shared_ptr<root>&        r,
                                            std::span<const char>               key,
@@ -279,6 +308,63 @@ namespace triedent
                    std::vector<char>*                  result_bytes,
                    std::vector<std::shared_ptr<root>>* result_roots) const;
 
+      // These overloads pass the value to f instead of copying it. value
+      // points into the database and is only valid until f returns. f must
+      // not use this session. For roots values, value holds the raw ids.
+      template <typename F>
+         requires std::invocable<F&, std::span<const char>>
+      bool get(const std::shared_ptr<root>& r, std::span<const char> key, F&& f) const;
+
+      // f(key, value)
+      template <typename F>
+         requires std::invocable<F&, std::span<const char>, std::span<const char>>
+      bool get_greater_equal(const std::shared_ptr<root>& r,
+                             std::span<const char>        key,
+                             F&&                          f) const;
+      template <typename F>
+         requires std::invocable<F&, std::span<const char>, std::span<const char>>
+      bool get_less_than(const std::shared_ptr<root>& r, std::span<const char> key, F&& f) const;
+      template <typename F>
+         requires std::invocable<F&, std::span<const char>, std::span<const char>>
+      bool get_max(const std::shared_ptr<root>& r, std::span<const char> prefix, F&& f) const;
+
+      // Calls f(key, old_value, new_value) in key order for every key whose
+      // value differs between a and b. old_value is empty for keys which were
+      // added and new_value is empty for keys which were removed. Subtrees
+      // which a and b share are skipped, so the cost depends on the size of
+      // the difference, not on the size of the trees. f has the same
+      // restrictions as for get.
+      template <typename F>
+         requires std::invocable<F&,
+                                 std::span<const char>,
+                                 std::optional<std::span<const char>>,
+                                 std::optional<std::span<const char>>>
+      void diff(const std::shared_ptr<root>& a, const std::shared_ptr<root>& b, F&& f) const;
+
+      // Looks up keys, which must be sorted and unique, in a single descent
+      // which only splits where the keys diverge, instead of descending from
+      // the root once per key. Calls f(i, value) in key order for each keys[i]
+      // which is found. f has the same restrictions as for get.
+      template <typename F>
+         requires std::invocable<F&, size_t, std::span<const char>>
+      void get_many(const std::shared_ptr<root>&           r,
+                    std::span<const std::span<const char>> keys,
+                    F&&                                    f) const;
+
+      // Like above, but appends the values to arena and returns each key's
+      // value within arena, or nullopt if the key wasn't found. The results
+      // are valid until arena is modified.
+      std::vector<std::optional<std::span<const char>>> get_many(
+          const std::shared_ptr<root>&           r,
+          std::span<const std::span<const char>> keys,
+          std::vector<char>&                     arena) const;
+
+      // When enabled, iterators and get_greater_equal ask the OS to start
+      // reading nodes which they are likely to visit next, if those nodes
+      // aren't pinned in RAM. This speeds up scans over cold data, but costs
+      // extra work when the data is already in RAM, so it's off by default.
+      void set_prefetch(bool enable) { _prefetch = enable; }
+
       void print(const std::shared_ptr<root>& r);
       void validate(const std::shared_ptr<root>& r);
 
@@ -290,18 +376,14 @@ namespace triedent
 
       inline object_id get_id(const std::shared_ptr<root>& r) const;
       void             validate(id);
-      // void                       next(iterator& itr) const;
-      // void                       prev(iterator& itr) const;
-      // iterator                   find(id n, string_view key) const;
       void               print(id n, string_view prefix = "", std::string k = "");
       inline deref<node> get_by_id(ring_allocator::id i) const;
       inline deref<node> get_by_id(ring_allocator::id i, bool& unique) const;
+      inline deref<node> get_inline(ring_allocator::id i) const;
 
-      bool unguarded_get(const std::shared_ptr<triedent::root>&        ancestor,
-                         object_id                                     root,
-                         std::string_view                              key,
-                         std::vector<char>*                            result_bytes,
-                         std::vector<std::shared_ptr<triedent::root>>* result_roots) const;
+      // The unguarded_* lookups return the matching value node, or nullptr.
+      // The caller must hold a swap_guard for as long as it uses the result.
+      const value_node* unguarded_get(object_id root, std::string_view key, node_type& type) const;
 
       bool fill_result(const std::shared_ptr<root>&        ancestor,
                        const value_node&                   vn,
@@ -309,29 +391,72 @@ namespace triedent
                        std::vector<char>*                  result_bytes,
                        std::vector<std::shared_ptr<root>>* result_roots) const;
 
-      bool unguarded_get_greater_equal(
-          const std::shared_ptr<triedent::root>&        ancestor,
-          object_id                                     root,
-          std::string_view                              key,
-          std::vector<char>&                            result_key,
-          std::vector<char>*                            result_bytes,
-          std::vector<std::shared_ptr<triedent::root>>* result_roots) const;
-
-      bool unguarded_get_less_than(
-          const std::shared_ptr<triedent::root>&        ancestor,
-          object_id                                     root,
-          std::optional<std::string_view>               key,
-          std::vector<char>&                            result_key,
-          std::vector<char>*                            result_bytes,
-          std::vector<std::shared_ptr<triedent::root>>* result_roots) const;
-
-      bool unguarded_get_max(const std::shared_ptr<triedent::root>&        ancestor,
-                             object_id                                     root,
-                             std::string_view                              prefix_min,
-                             std::string_view                              prefix_max,
-                             std::vector<char>&                            result_key,
-                             std::vector<char>*                            result_bytes,
-                             std::vector<std::shared_ptr<triedent::root>>* result_roots) const;
+      const value_node* unguarded_get_greater_equal(object_id          root,
+                                                    std::string_view   key,
+                                                    std::vector<char>& result_key,
+                                                    node_type&         type) const;
+
+      const value_node* unguarded_get_less_than(object_id                       root,
+                                                std::optional<std::string_view> key,
+                                                std::vector<char>&              result_key,
+                                                node_type&                      type) const;
+
+      const value_node* unguarded_get_max(object_id             root,
+                                          std::span<const char> prefix,
+                                          std::vector<char>&    result_key,
+                                          node_type&            type) const;
+      const value_node* unguarded_get_max(object_id          root,
+                                          std::string_view   prefix_min,
+                                          std::string_view   prefix_max,
+                                          std::vector<char>& result_key,
+                                          node_type&         type) const;
+
+      // A node whose first skip key symbols have already been matched
+      struct diff_node
+      {
+         object_id id;
+         uint32_t  skip = 0;
+      };
+      struct diff_view
+      {
+         key_view          key;
+         object_id         value;
+         uint64_t          branches;
+         const inner_node* in;
+      };
+      diff_view diff_get(diff_node n) const;
+      template <typename F>
+      void emit_diff(key_view key6, object_id old_id, object_id new_id, F& f) const;
+      template <typename F>
+      void unguarded_diff(diff_node a, diff_node b, std::string& key6, F& f) const;
+      template <typename F>
+      void unguarded_diff_all(diff_node n, bool added, std::string& key6, F& f) const;
+
+      struct get_many_item
+      {
+         key_view key;    // in key6 form
+         size_t   index;  // into the caller's keys
+      };
+      // Each item's first pos symbols have already been matched
+      template <typename F>
+      void unguarded_get_many(object_id                      root,
+                              std::span<const get_many_item> items,
+                              size_t                         pos,
+                              F&                             f) const;
+
+      // get_many holds a swap_guard for this many keys at a time. A write
+      // session may copy the nodes it visits to the hot ring, and that space
+      // can't be reclaimed while the guard is held.
+      static constexpr size_t get_many_chunk = 256;
+
+      // get_greater_equal only looks ahead this many branches, since it doesn't
+      // know whether the caller will continue the scan
+      static constexpr uint32_t get_greater_equal_prefetch = 8;
+
+      // Prefetches in's children, starting with branch b, if prefetching is enabled
+      void prefetch_branches(const inner_node& in, uint8_t b, uint32_t max = 64) const;
+
+      bool _prefetch = false;
 
       inline id   retain(id);
       inline void release(id);
@@ -371,6 +496,25 @@ namespace triedent
 
       int remove(std::shared_ptr<root>& r, std::span<const char> key);
 
+      // Returns a SHA-256 hash which covers every key and value in the tree,
+      // or all zeros if it's empty. Trees with the same content have the same
+      // hash. Hashes of nodes are cached, so this only has to visit the nodes
+      // which changed since the last call.
+      node_hash get_hash(const std::shared_ptr<root>& r);
+
+      // An entry for apply_batch. A missing value removes the key.
+      struct batch_entry
+      {
+         std::span<const char>                key;
+         std::optional<std::span<const char>> value;
+      };
+
+      // Applies upserts and removes which are sorted by key, with no
+      // duplicates. This gives the same result as calling upsert and remove
+      // for each entry, but each inner node on the affected paths is built
+      // or edited once per batch instead of once per key.
+      void apply_batch(std::shared_ptr<root>& r, std::span<const batch_entry> entries);
+
       /**
           *  These methods are used to recover the database after a crash,
           *  start_collect_garbage resets all non-zero refcounts to 1,
@@ -388,6 +532,7 @@ namespace triedent
       inline void update_root(std::shared_ptr<root>& r, object_id id);
 
       void recursive_retain(object_id id);
+      node_hash hash_node(object_id id);
 
       inline mutable_deref<value_node> make_value(node_type   type,
                                                   string_view k,
@@ -410,6 +555,29 @@ namespace triedent
                           int&        old_size);
       inline id remove_child(id root, bool unique, string_view key, int& removed_size);
 
+      struct batch_item
+      {
+         key_view   key;  // 6-bit key
+         value_view value;
+         node_type  type;
+         bool       remove;
+         bool       bump_root_refs;
+      };
+
+      // Keys of the items are relative to pos
+      inline id apply_batch(id root, bool unique, std::span<const batch_item> items, size_t pos);
+      inline id apply_batch_leaf(deref<node>                 n,
+                                 bool                        unique,
+                                 std::span<const batch_item> items,
+                                 size_t                      pos);
+      inline id apply_batch_inner(deref<node>                 n,
+                                  bool                        unique,
+                                  std::span<const batch_item> items,
+                                  size_t                      pos);
+      inline id build_batch(std::span<const batch_item> items, size_t pos);
+      inline id build_subtree(std::span<const batch_item> items, size_t pos);
+      inline id prepend_key(key_view prefix, uint8_t b, id child);
+
       inline void modify_value(mutable_deref<value_node> mut, string_view val);
       inline id   set_value(deref<node> n,
                             bool        unique,
@@ -435,6 +603,7 @@ namespace triedent
       friend write_session;
       friend session_base;
       friend root;
+      friend scrubber;
 
      public:
       // TODO: rename *_pages
@@ -453,26 +622,111 @@ namespace triedent
          read_write = 1
       };
 
-      using string_view = std::string_view;
-      using id          = object_id;
-
-      database(std::filesystem::path dir, access_mode allow_write, bool allow_slow = false);
+      using string_view   = std::string_view;
+      using id            = object_id;
+      using memory_config = ring_allocator::memory_config;
+
+      // Any number of processes may open a database read_only while one
+      // process has it open read_write. Read-only processes only have read
+      // sessions, and get their roots from pin_top_root. The processes must
+      // share a pid namespace, so the writer can tell when one has exited.
+      database(std::filesystem::path dir,
+               access_mode           allow_write,
+               bool                  allow_slow = false,
+               const memory_config&  mem        = {});
       ~database();
 
       static void create(std::filesystem::path dir, config);
 
+      // Grows the object id table and the rings while the database is in use.
+      // Sizes which aren't larger than the current ones are ignored.
+      void grow(const config& cfg);
+
       std::shared_ptr<write_session> start_write_session();
       std::shared_ptr<read_session>  start_read_session();
 
+      // Returns the top root which the writer most recently stored with
+      // set_top_root. Only for read_only databases. The writer won't free the
+      // tree until the returned root and every root found within it are gone,
+      // so hold on to it for no longer than needed.
+      std::shared_ptr<root> pin_top_root();
+
+      // Whether r is still the writer's top root
+      bool is_top_root(const std::shared_ptr<root>& r) const
+      {
+         return _dbm->top_root.load() == (r && r->db ? r->id.id : 0);
+      }
+
+      bool is_read_only() const { return _read_only; }
+
       void print_stats(bool detail = false);
 
+      // See scrubber. passes and errors are totals over the life of the
+      // database; the other counters start when it's opened.
+      struct scrub_stats
+      {
+         uint64_t    passes = 0;  // walks which reached the end of the tree
+         uint64_t    nodes  = 0;
+         uint64_t    bytes  = 0;
+         uint64_t    errors = 0;
+         std::string last_error;
+      };
+
+      struct stats : ring_allocator::stats
+      {
+         uint32_t    active_sessions  = 0;
+         uint32_t    replica_sessions = 0;  // sessions of read_only processes
+         uint32_t    deferred_roots   = 0;  // replaced top roots which replicas still pin
+         scrub_stats scrub;
+      };
+
+      // Cheap enough to poll periodically, unlike print_stats
+      stats get_stats() const;
+
       bool is_slow() const { return _ring->is_slow(); }
 
+      // number of nodes allocated since the database was opened
+      uint64_t num_allocs() const { return _ring->num_allocs(); }
+
+      // Compress byte values in the cool and cold levels. This is a property of
+      // the open database, not of the files; it may be toggled at any time.
+      void set_compression(bool enable) { _ring->set_compression(enable); }
+
+      // Store byte values of up to max_size bytes inside their parent inner
+      // node instead of as objects of their own, which saves an object id,
+      // an object header, and a lookup for each of them. 0 turns it off.
+      // Values are inlined when the writer copies their parent, so existing
+      // trees convert as they're modified. Both formats may be mixed in the
+      // same tree, and this may be changed at any time. Inlined values make
+      // inner nodes larger, so copying them costs more; small limits work best.
+      void set_inline_values(uint32_t max_size)
+      {
+         _inline_limit.store(std::min(max_size, max_inline_value_size));
+      }
+
      private:
       inline void release(id);
       inline void claim_free() const;
       inline void ensure_free_space();
 
+      // Throws if all slots are in use
+      session_slot* claim_session_slot();
+      void          release_session_slot(session_slot*);
+      session_slot* claim_replica_slot();
+
+      // Called by set_top_root after it replaces old. Releases old, and any
+      // top roots it deferred earlier, unless a replica pins them. The caller
+      // must hold _root_change_mutex and a swap_guard.
+      void release_top_root(id old);
+      void unpin(root_pin* pin);
+
+      // Frees the slots and pins of read_only processes which have exited.
+      // maybe_sweep_replicas does this at most once per sweep_interval.
+      void sweep_replicas() const;
+      void maybe_sweep_replicas() const;
+
+      static constexpr std::chrono::seconds sweep_interval{1};
+
       struct revision
       {
          object_id _root;
@@ -491,9 +745,38 @@ namespace triedent
          // by instruction reordering and multi-instruction non-atomic writes.
          std::atomic<uint64_t> top_root;
 
+         // Where the scrubber continues. Only the scrubber's thread uses
+         // position. Files from before the scrubber existed end before this;
+         // the writer extends them with zeros.
+         struct scrub_checkpoint
+         {
+            std::atomic<uint64_t> passes        = 0;
+            std::atomic<uint64_t> errors        = 0;
+            uint32_t              position_size = 0;
+            char                  position[1004];
+         } scrub;
+
          database_memory() { top_root.store(0); }
       };
 
+      // Shared by every process which opens the database, through the
+      // "replicas" file. The writer creates it.
+      struct replica_memory
+      {
+         static constexpr uint32_t max_sessions = 256;
+         static constexpr uint32_t max_pins     = 256;
+
+         session_slot sessions[max_sessions];
+         root_pin     pins[max_pins];
+
+         // Top roots which the writer replaced while they were pinned; 0 if
+         // unused. When one is added, every entry is pinned by a different
+         // pin, so there can't be more of them than there are pins. Only the
+         // writer uses this. It's in the file so that a restarted writer
+         // still releases them.
+         std::atomic<uint64_t> deferred[max_pins];
+      };
+
       static std::atomic<int>      _read_thread_number;
       static thread_local uint32_t _thread_num;
       static std::atomic<uint32_t> _write_thread_rev;
@@ -503,14 +786,106 @@ namespace triedent
       std::unique_ptr<bip::file_mapping>  _file;
       std::unique_ptr<bip::mapped_region> _region;
       database_memory*                    _dbm;
+      bool                                _read_only;
+      int32_t                             _pid;
+      std::unique_ptr<bip::file_mapping>  _replica_file;
+      std::unique_ptr<bip::mapped_region> _replica_region;
+      replica_memory*                     _replicas;
+      mutable std::atomic<int64_t>        _last_sweep = 0;  // steady_clock ticks
+
+      mutable std::mutex _root_change_mutex;
 
-      mutable std::mutex         _root_change_mutex;
-      mutable std::mutex         _active_sessions_mutex;
-      std::vector<session_base*> _active_sessions;
-      bool                       _have_write_session;
+      // The slots of this process's sessions. When every slot is in use,
+      // claim_session_slot appends another slab. Slabs stay until the
+      // database is destroyed, so a slot never moves.
+      struct session_slab
+      {
+         static constexpr uint32_t size = 64;
+
+         session_slot               slots[size];
+         std::atomic<session_slab*> next = nullptr;
+      };
+
+      template <typename F>
+      void for_each_session_slot(F&& f) const;
+
+      session_slab      _session_slots;
+      std::atomic<bool> _have_write_session = false;
 
       std::mutex   _root_release_session_mutex;
       session_base _root_release_session;
+
+      std::atomic<uint32_t> _inline_limit = 0;
+
+      std::atomic<bool>     _have_scrubber = false;
+      std::atomic<uint64_t> _scrub_nodes   = 0;
+      std::atomic<uint64_t> _scrub_bytes   = 0;
+      mutable std::mutex    _scrub_error_mutex;
+      std::string           _scrub_last_error;
+   };
+
+   // Walks the writer's top tree a little at a time, looking for corruption
+   // before it makes its way into a block: object ids which are out of range
+   // or which have no references, locations which don't lead to the object's
+   // header, and nodes which break the trie's invariants. Nested trees are
+   // walked too.
+   //
+   // Each step holds a reference to the current top root only while it
+   // checks a bounded number of nodes, then saves its position as a key path
+   // in the db file. The next step continues from that key in whatever the
+   // top root is by then, so a pass doesn't keep old revisions alive and
+   // resumes after a restart. Findings are reported by database::get_stats.
+   //
+   // Only one scrubber may exist per database, and only in the process
+   // which has it open read_write.
+   class scrubber
+   {
+     public:
+      struct config
+      {
+         uint64_t             nodes_per_sec     = 10'000;
+         uint64_t             bytes_per_sec     = 16 * 1024 * 1024;  // as stored in the rings
+         std::chrono::seconds min_pass_interval = std::chrono::seconds{60};
+      };
+
+      explicit scrubber(std::shared_ptr<database> db);
+      ~scrubber();
+
+      scrubber(const scrubber&)            = delete;
+      scrubber& operator=(const scrubber&) = delete;
+
+      // Starts a thread which calls step, sleeping between steps to stay
+      // within cfg's budget. Don't call step directly after this.
+      void start(const config& cfg);
+
+      // Checks up to max_nodes nodes. Returns true if that finished a pass.
+      bool step(uint64_t max_nodes = step_nodes);
+
+      static constexpr uint64_t step_nodes = 1024;
+
+     private:
+      // A position within one tree. Nested trees add a frame for each roots
+      // value that the walk is inside of.
+      struct frame
+      {
+         std::string key6;
+         uint32_t    index = 0;  // of the nested root within the value at key6
+      };
+      struct walk;
+
+      void load_position();
+      void save_position();
+      void report(const std::string& error);
+      void run(config cfg);
+
+      std::shared_ptr<database> _db;
+      session_base              _session;
+      std::vector<frame>        _position;
+
+      std::mutex              _mutex;
+      std::condition_variable _cond;
+      bool                    _stop = false;
+      std::thread             _thread;
    };
 
    inline root::~root()
@@ -519,7 +894,9 @@ namespace triedent
          if (db && id)
             std::cout << id.id << ": ~root(): ancestor=" << (ancestor ? ancestor->id.id : 0)
                       << std::endl;
-      if (db && id && !ancestor)
+      if (db && pin)
+         db->unpin(pin);
+      else if (db && id && !ancestor)
       {
          std::lock_guard<std::mutex> lock(db->_root_release_session_mutex);
          session_base::swap_guard    guard(*db, db->_root_release_session);
@@ -604,46 +981,44 @@ namespace triedent
 
    inline void session_base::lock_swap_p(database& db) const
    {
+      ring_allocator::enter_read();
       auto sp = db._ring->get_swap_pos();
-      _hot_swap_p.store(sp._swap_pos[0]);
-      _warm_swap_p.store(sp._swap_pos[1]);
-      _cool_swap_p.store(sp._swap_pos[2]);
-      _cold_swap_p.store(sp._swap_pos[3]);
+      for (int i = 0; i < 4; ++i)
+         _slot->swap_p[i].store(sp._swap_pos[i]);
    }
 
    inline void session_base::unlock_swap_p() const
    {
-      _hot_swap_p.store(-1ull);
-      _warm_swap_p.store(-1ull);
-      _cool_swap_p.store(-1ull);
-      _cold_swap_p.store(-1ull);
+      for (auto& p : _slot->swap_p)
+         p.store(-1ull);
+      ring_allocator::exit_read();
    }
 
    template <typename AccessMode>
    session<AccessMode>::session(std::shared_ptr<database> db) : _db(std::move(db))
    {
-      _iterators.resize(64);
-
-      std::lock_guard<std::mutex> lock(_db->_active_sessions_mutex);
-
-      if (std::is_same_v<AccessMode, write_access> && _db->_have_write_session)
-         throw std::runtime_error("Only 1 write session may be active");
-
-      _db->_active_sessions.push_back(this);
-
       if constexpr (std::is_same_v<AccessMode, write_access>)
-         _db->_have_write_session = true;
+         if (_db->_have_write_session.exchange(true))
+            throw std::runtime_error("Only 1 write session may be active");
+
+      try
+      {
+         _slot = _db->claim_session_slot();
+      }
+      catch (...)
+      {
+         if constexpr (std::is_same_v<AccessMode, write_access>)
+            _db->_have_write_session.store(false);
+         throw;
+      }
    }
    template <typename AccessMode>
    session<AccessMode>::~session()
    {
-      std::lock_guard<std::mutex> lock(_db->_active_sessions_mutex);
-
-      auto itr = std::find(_db->_active_sessions.begin(), _db->_active_sessions.end(), this);
-      _db->_active_sessions.erase(itr);
+      _db->release_session_slot(_slot);
 
       if constexpr (std::is_same_v<AccessMode, write_access>)
-         _db->_have_write_session = false;
+         _db->_have_write_session.store(false);
    }
 
    inline std::shared_ptr<read_session> database::start_read_session()
@@ -653,12 +1028,16 @@ namespace triedent
 
    inline std::shared_ptr<write_session> database::start_write_session()
    {
+      if (_read_only)
+         throw std::runtime_error("database is read only");
       return std::make_shared<write_session>(shared_from_this());
    }
 
    template <typename AccessMode>
    inline deref<node> session<AccessMode>::get_by_id(id i) const
    {
+      if (is_inline(i))
+         return get_inline(i);
       auto [ptr, type, ref] = _db->_ring->get_cache<std::is_same_v<AccessMode, write_access>>(i);
       return {i, ptr, type};
    }
@@ -666,11 +1045,29 @@ namespace triedent
    template <typename AccessMode>
    inline deref<node> session<AccessMode>::get_by_id(id i, bool& unique) const
    {
+      if (is_inline(i))
+      {
+         // Inline values are never edited in place
+         unique = false;
+         return get_inline(i);
+      }
       auto [ptr, type, ref] = _db->_ring->get_cache<std::is_same_v<AccessMode, write_access>>(i);
       unique &= ref == 1;
+      // The caller may modify a unique node in place, or one of its descendants
+      if (unique)
+         _db->_ring->hashes().invalidate(i.id);
       return {i, ptr, type};
    }
 
+   template <typename AccessMode>
+   inline deref<node> session<AccessMode>::get_inline(id i) const
+   {
+      auto [ptr, type, ref] =
+          _db->_ring->get_cache<std::is_same_v<AccessMode, write_access>>(inline_parent(i));
+      auto& vn = reinterpret_cast<const inner_node*>(ptr)->inline_value(inline_index(i));
+      return {i, reinterpret_cast<char*>(const_cast<value_node*>(&vn)), node_type::bytes};
+   }
+
    template <typename AccessMode>
    inline void session<AccessMode>::release(std::shared_ptr<root>& r)
    {
@@ -679,7 +1076,7 @@ namespace triedent
             std::cout << r->id.id
                       << ": release(root): ancestor=" << (r->ancestor ? r->ancestor->id.id : 0)
                       << std::endl;
-      if (r.use_count() == 1 && r->db && !r->ancestor && r->id)
+      if (r.use_count() == 1 && r->db && !r->ancestor && !r->pin && r->id)
       {
          auto id = r->id;
          r->id   = {};
@@ -752,7 +1149,7 @@ namespace triedent
          std::cout << id.id << ": set_top_root: old=" << current << std::endl;
       id = retain(id);
       _db->_dbm->top_root.store(id.id);
-      release({current});
+      _db->release_top_root({current});
    }
 
    inline bool write_session::get_unique(std::shared_ptr<root>& r)
@@ -818,12 +1215,15 @@ namespace triedent
                                                               id                val,
                                                               uint64_t          branches)
    {
-      return inner_node::make(*_db->_ring, cpy, pre, val, branches);
+      return inner_node::make(*_db->_ring, cpy, pre, val, branches,
+                              _db->_inline_limit.load(std::memory_order_relaxed));
    }
 
    template <typename T>
    inline mutable_deref<T> write_session::lock(const deref<T>& obj)
    {
+      // The caller is about to modify obj in place
+      _db->_ring->hashes().invalidate(id(obj).id);
       return {_db->_ring->spin_lock(obj), obj};
    }
 
@@ -1113,600 +1513,551 @@ namespace triedent
       return old_size;
    }
 
-#if 0
    template <typename AccessMode>
-   typename session<AccessMode>::iterator& session<AccessMode>::iterator::operator++()
+   void session<AccessMode>::iterator::clear()
    {
-      if constexpr (std::is_same_v<AccessMode, write_access>)
-         _session->_db->ensure_free_space();
-      swap_guard g(*_session);
-
-      _session->next(*this);
-      return *this;
+      _path.clear();
+      _key6.clear();
    }
+
    template <typename AccessMode>
-   typename session<AccessMode>::iterator& session<AccessMode>::iterator::operator--()
+   void session<AccessMode>::iterator::push(object_id id, key_view node_key, int8_t branch)
    {
-      if constexpr (std::is_same_v<AccessMode, write_access>)
-         _session->_db->ensure_free_space();
-      swap_guard g(*_session);
+      _path.push_back({id, branch, uint32_t(_key6.size())});
+      _key6.insert(_key6.end(), node_key.begin(), node_key.end());
+      if (branch >= 0)
+         _key6.push_back(branch);
+   }
 
-      _session->prev(*this);
-      return *this;
+   template <typename AccessMode>
+   void session<AccessMode>::iterator::set_branch(path_entry& e,
+                                                   size_t      node_key_size,
+                                                   int8_t      branch)
+   {
+      e.branch = branch;
+      _key6.resize(e.key_pos + node_key_size);
+      if (branch >= 0)
+         _key6.push_back(branch);
    }
+
+   // Descend to the smallest key in the subtree
    template <typename AccessMode>
-   void session<AccessMode>::prev(iterator& itr) const
+   void session<AccessMode>::iterator::push_first(object_id id)
    {
       for (;;)
       {
-         if (not itr.path().size())
-            return;
-
-         auto& c = itr.path().back();
-         auto  n = get_by_id(c.first);
-
-         if (c.second <= 0)
-         {
-            if (c.second == 0 and n.as_inner_node().value())
-            {
-               c.second = -1;
-               return;
-            }
-         }
-         else
-         {
-            auto& in = n.as_inner_node();
-            c.second = in.reverse_lower_bound(c.second - 1);
+         auto n = _session->get_by_id(id);
+         if (n.is_leaf_node())
+            return push(id, n.as_value_node().key(), -1);
 
-            if (c.second >= 0)
-               break;
+         auto& in = n.as_inner_node();
+         if (in.value())
+            return push(id, in.key(), -1);
 
-            if (in.value())
-               return;
-         }
-         itr.path().pop_back();
+         auto b = in.lower_bound(0);
+         push(id, in.key(), b);
+         _session->prefetch_branches(in, b);
+         id = in.branch(b);
       }
+   }
 
-      // find last
+   // Descend to the largest key in the subtree
+   template <typename AccessMode>
+   void session<AccessMode>::iterator::push_last(object_id id)
+   {
       for (;;)
       {
-         auto& c = itr.path().back();
-         auto  n = get_by_id(c.first);
-
+         auto n = _session->get_by_id(id);
          if (n.is_leaf_node())
-            return;
+            return push(id, n.as_value_node().key(), -1);
 
          auto& in = n.as_inner_node();
-         auto  b  = in.branch(c.second);
-         auto  bi = get_by_id(b);
+         auto  b  = in.reverse_lower_bound(63);
+         if (b < 0) [[unlikely]]  // should be impossible in a well formed tree
+            return push(id, in.key(), -1);
 
-         if (bi.is_leaf_node())
+         push(id, in.key(), b);
+         _session->prefetch_branches(in, 0);
+         id = in.branch(b);
+      }
+   }
+
+   template <typename AccessMode>
+   void session<AccessMode>::iterator::next()
+   {
+      while (!_path.empty())
+      {
+         auto& e = _path.back();
+         auto  n = _session->get_by_id(e.id);
+         if (!n.is_leaf_node())
          {
-            itr.path().emplace_back(b, -1);
-            return;
+            auto& in = n.as_inner_node();
+            auto  b  = in.lower_bound(e.branch + 1);
+            if (b < 64)
+            {
+               if (e.branch < 0)
+                  _session->prefetch_branches(in, b);
+               set_branch(e, in.key_size(), b);
+               return push_first(in.branch(b));
+            }
          }
-         auto& bin = bi.as_inner_node();
-         itr.path().emplace_back(b, bin.reverse_lower_bound(63));
+         _path.pop_back();
       }
+      _key6.clear();
    }
+
    template <typename AccessMode>
-   void session<AccessMode>::next(iterator& itr) const
+   void session<AccessMode>::iterator::prev()
    {
-      while (itr.path().size())
+      while (!_path.empty())
       {
-         auto& c = itr.path().back();
-
-         auto n = get_by_id(c.first);
-
-         if (not n.is_leaf_node())
+         auto& e = _path.back();
+         auto  n = _session->get_by_id(e.id);
+         if (!n.is_leaf_node() && e.branch >= 0)
          {
             auto& in = n.as_inner_node();
-            c.second = in.lower_bound(c.second + 1);
-
-            if (c.second <= 63)
+            auto  b  = e.branch > 0 ? in.reverse_lower_bound(e.branch - 1) : -1;
+            if (b >= 0)
             {
-               // find first
-               for (;;)
-               {
-                  auto n = get_by_id(itr.path().back().first);
-                  if (n.is_leaf_node())
-                     return;
+               set_branch(e, in.key_size(), b);
+               return push_last(in.branch(b));
+            }
+            if (in.value())
+               return set_branch(e, in.key_size(), -1);
+         }
+         _path.pop_back();
+      }
+      _key6.clear();
+   }
 
-                  auto& in = n.as_inner_node();
+   // Position on the first key >= key. Each node is visited at most once
+   // on the way down; if a subtree turns out to be entirely less than key,
+   // next() continues from the parent which is already on the path.
+   template <typename AccessMode>
+   void session<AccessMode>::iterator::lower_bound(key_view key)
+   {
+      clear();
+      object_id id = _session->get_id(_root);
+      if (!id)
+         return;
 
-                  auto  b   = in.branch(itr.path().back().second);
-                  auto  bi  = get_by_id(b);
-                  auto& bin = bi.as_inner_node();
+      for (;;)
+      {
+         auto n = _session->get_by_id(id);
+         if (n.is_leaf_node())
+         {
+            auto vn_key = n.as_value_node().key();
+            push(id, vn_key, -1);
+            if (vn_key < key)
+               next();
+            return;
+         }
 
-                  if (bin.value())
-                  {
-                     itr.path().emplace_back(b, -1);
-                     return;
-                  }
+         auto& in     = n.as_inner_node();
+         auto  in_key = in.key();
+         auto  cpre   = common_prefix(in_key, key);
+         if (cpre.size() != in_key.size())
+         {
+            if (in_key > key)
+               return push_first(id);
+            return next();
+         }
 
-                  itr.path().emplace_back(b, bin.lower_bound(0));
-               }
-            }
+         key = key.substr(in_key.size());
+         if (key.empty())
+         {
+            push(id, in_key, -1);
+            if (!in.value())
+               next();
+            return;
          }
 
-         itr.path().pop_back();
+         uint8_t c = key[0];
+         auto    b = in.lower_bound(c);
+         if (b >= 64)
+            return next();
+
+         push(id, in_key, b);
+         _session->prefetch_branches(in, b);
+         if (b != c)
+            return push_first(in.branch(b));
+
+         key = key.substr(1);
+         id  = in.branch(b);
       }
    }
 
    template <typename AccessMode>
-   void session<AccessMode>::iterator::value(std::string& val) const
+   typename session<AccessMode>::iterator& session<AccessMode>::iterator::operator++()
    {
       if constexpr (std::is_same_v<AccessMode, write_access>)
          _session->_db->ensure_free_space();
-      swap_guard g(*_session);
+      swap_guard g(_session);
 
-      auto dat = unguarded_value();
-      val.resize(dat.size());
-      memcpy(val.data(), dat.data(), dat.size());
+      next();
+      return *this;
    }
 
    template <typename AccessMode>
-   std::string_view session<AccessMode>::iterator::unguarded_value() const
+   typename session<AccessMode>::iterator& session<AccessMode>::iterator::operator--()
    {
-      if (path().size() == 0)
-         return std::string_view();
-      auto n = _session->get_by_id(path().back().first);
-      if (n.is_leaf_node())
+      if constexpr (std::is_same_v<AccessMode, write_access>)
+         _session->_db->ensure_free_space();
+      swap_guard g(_session);
+
+      if (_path.empty())
       {
-         return n.as_value_node().data();
+         if (auto id = _session->get_id(_root))
+            push_last(id);
       }
       else
-      {
-         return _session->get_by_id(n.as_inner_node().value()).as_value_node().data();
-      }
+         prev();
+      return *this;
    }
 
    template <typename AccessMode>
-   uint32_t session<AccessMode>::iterator::key_size() const
+   typename session<AccessMode>::iterator& session<AccessMode>::iterator::seek(
+       std::span<const char> key)
    {
       if constexpr (std::is_same_v<AccessMode, write_access>)
          _session->_db->ensure_free_space();
-      swap_guard g(*_session);
+      swap_guard g(_session);
 
-      return unguarded_key_size();
+      lower_bound(_session->to_key6({key.data(), key.size()}));
+      return *this;
    }
 
    template <typename AccessMode>
-   uint32_t session<AccessMode>::iterator::unguarded_key_size() const
+   void session<AccessMode>::iterator::key(std::vector<char>& result) const
    {
-      if (path().size() == 0)
-         return 0;
-      int s = path().size() - 1;
-
-      for (auto& e : path())
-      {
-         auto n = _session->get_by_id(e.first);
-         s += n->key_size();
-      }
-      return s;
+      auto s = from_key6({_key6.data(), _key6.size()});
+      result.assign(s.begin(), s.end());
    }
 
    template <typename AccessMode>
-   uint32_t session<AccessMode>::iterator::read_key(char* data, uint32_t data_len) const
+   std::vector<char> session<AccessMode>::iterator::key() const
    {
-      if constexpr (std::is_same_v<AccessMode, write_access>)
-         _session->_db->ensure_free_space();
-      swap_guard g(*_session);
-
-      return unguarded_read_key(data, data_len);
+      std::vector<char> result;
+      key(result);
+      return result;
    }
 
    template <typename AccessMode>
-   uint32_t session<AccessMode>::iterator::unguarded_read_key(char* data, uint32_t data_len) const
+   bool session<AccessMode>::iterator::value(
+       std::vector<char>*                  result_bytes,
+       std::vector<std::shared_ptr<root>>* result_roots) const
    {
-      auto  key_len = std::min<uint32_t>(data_len, key_size());
-      char* start   = data;
-
-      for (auto& e : path())
-      {
-         auto n = _session->get_by_id(e.first);
-         auto b = n->key_size();
-         if (b > 0)
-         {
-            auto        part_len = std::min<uint32_t>(key_len, b);
-            const char* key_ptr;
-
-            if (n.is_leaf_node())
-            {
-               key_ptr = n.as_value_node().key_ptr();
-            }
-            else
-            {
-               key_ptr = n.as_inner_node().key_ptr();
-            }
-            memcpy(data, key_ptr, part_len);
-            key_len -= part_len;
-            data += part_len;
-         }
-
-         if (key_len == 0)
-            return data - start;
+      if (_path.empty())
+         return false;
 
-         *data = e.second;
-         ++data;
-         --key_len;
+      if constexpr (std::is_same_v<AccessMode, write_access>)
+         _session->_db->ensure_free_space();
+      swap_guard g(_session);
 
-         if (key_len == 0)
-            return data - start;
-      }
-      return data - start;
+      auto n = _session->get_by_id(_path.back().id);
+      if (!n.is_leaf_node())
+         n = _session->get_by_id(n.as_inner_node().value());
+      return _session->fill_result(_root, n.as_value_node(), n.type(), result_bytes,
+                                   result_roots);
    }
 
    template <typename AccessMode>
-   std::string session<AccessMode>::iterator::key() const
+   std::vector<char> session<AccessMode>::iterator::value() const
    {
-      if constexpr (std::is_same_v<AccessMode, write_access>)
-         _session->_db->ensure_free_space();
-      swap_guard g(*_session);
-
-      std::string result;
-      result.resize(unguarded_key_size());
-      unguarded_read_key(result.data(), result.size());
-      return from_key6(result);
+      std::vector<char> result;
+      value(&result, nullptr);
+      return result;
    }
 
    template <typename AccessMode>
    typename session<AccessMode>::iterator session<AccessMode>::first(
        const std::shared_ptr<root>& r) const
    {
-      id       root = get_id(r);
-      iterator result(*this);
-      if (not root)
-         return result;
-
-      if constexpr (std::is_same_v<AccessMode, write_access>)
-         _db->ensure_free_space();
-
-      swap_guard g(*this);
-
-      for (;;)
+      iterator result(*this, r);
+      if (auto id = get_id(r))
       {
-         auto n = get_by_id(root);
-         if (n.is_leaf_node())
-         {
-            result.path().emplace_back(root, -1);
-            return result;
-         }
-         auto& in = n.as_inner_node();
-         if (in.value())
-         {
-            result.path().emplace_back(root, -1);
-            return result;
-         }
-         auto lb = in.lower_bound(0);
-         result.path().emplace_back(root, lb);
-         root = in.branch(lb);
+         if constexpr (std::is_same_v<AccessMode, write_access>)
+            _db->ensure_free_space();
+         swap_guard g(*this);
+         result.push_first(id);
       }
+      return result;
    }
+
    template <typename AccessMode>
    typename session<AccessMode>::iterator session<AccessMode>::last(
        const std::shared_ptr<root>& r) const
    {
-      id       root = get_id(r);
-      iterator result(*this);
-      if (not root)
-         return result;
-
-      if constexpr (std::is_same_v<AccessMode, write_access>)
-         _db->ensure_free_space();
-
-      swap_guard g(*this);
-
-      for (;;)
+      iterator result(*this, r);
+      if (auto id = get_id(r))
       {
-         auto n = get_by_id(root);
-         if (n.is_leaf_node())
-         {
-            result.path().emplace_back(root, -1);
-            return result;
-         }
-
-         auto& in  = n.as_inner_node();
-         auto  rlb = in.reverse_lower_bound(63);
-         result.path().emplace_back(root, rlb);
-
-         if (rlb < 0) [[unlikely]]  // should be impossible until keys > 128b are supported
-            return result;
-
-         root = in.branch(rlb);
+         if constexpr (std::is_same_v<AccessMode, write_access>)
+            _db->ensure_free_space();
+         swap_guard g(*this);
+         result.push_last(id);
       }
       return result;
    }
 
    template <typename AccessMode>
-   typename session<AccessMode>::iterator session<AccessMode>::find(const std::shared_ptr<root>& r,
-                                                                    string_view key) const
+   typename session<AccessMode>::iterator session<AccessMode>::lower_bound(
+       const std::shared_ptr<root>& r,
+       std::span<const char>        key) const
    {
-      return find(r, to_key6(key));
+      iterator result(*this, r);
+      result.seek(key);
+      return result;
    }
+
    template <typename AccessMode>
-   typename session<AccessMode>::iterator session<AccessMode>::last_with_prefix(
+   typename session<AccessMode>::iterator session<AccessMode>::find(
        const std::shared_ptr<root>& r,
-       string_view                  prefix) const
+       std::span<const char>        key) const
    {
-      id       root = get_id(r);
-      iterator result(*this);
-
-      if (not root)
-         return result;
+      iterator result(*this, r);
+      result.seek(key);
+      auto key6 = to_key6({key.data(), key.size()});
+      if (result && !std::ranges::equal(result._key6, key6))
+         result.clear();
+      return result;
+   }
 
-      prefix = to_key6(prefix);
+   template <typename AccessMode>
+   std::optional<std::vector<char>> session<AccessMode>::get(const std::shared_ptr<root>& r,
+                                                             std::span<const char>        key) const
+   {
+      std::vector<char> result;
+      if (get(r, key, &result, nullptr))
+         return std::optional(std::move(result));
+      return std::nullopt;
+   }
 
+   template <typename AccessMode>
+   bool session<AccessMode>::get(const std::shared_ptr<root>&        r,
+                                 std::span<const char>               key,
+                                 std::vector<char>*                  result_bytes,
+                                 std::vector<std::shared_ptr<root>>* result_roots) const
+   {
       if constexpr (std::is_same_v<AccessMode, write_access>)
          _db->ensure_free_space();
       swap_guard g(*this);
-
-      for (;;)
-      {
-         auto n = get_by_id(root);
-         if (n.is_leaf_node())
-         {
-            auto& vn = n.as_value_node();
-
-            auto pre = common_prefix(vn.key(), prefix);
-
-            if (pre == prefix)
-            {
-               result.path().emplace_back(root, -1);
-               return result;
-            }
-            return iterator(*this);
-         }
-
-         auto& in     = n.as_inner_node();
-         auto  in_key = in.key();
-
-         if (in_key == prefix)
-         {
-            for (;;)  // find last
-            {
-               auto n = get_by_id(root);
-
-               if (n.is_leaf_node())
-               {
-                  result.path().emplace_back(root, -1);
-                  return result;
-               }
-
-               auto& in = n.as_inner_node();
-               auto  b  = in.reverse_lower_bound(63);
-
-               if (b == -1) [[unlikely]]
-               {  /// this should be impossible in well formed tree
-                  result.path().emplace_back(root, -1);
-                  return result;
-               }
-
-               result.path().emplace_back(root, b);
-               root = in.branch(b);
-            }
-            return result;
-         }
-
-         auto cpre = common_prefix(in_key, prefix);
-         if (in_key.size() > prefix.size())
-         {
-            if (cpre == prefix)
-            {
-               result.path().emplace_back(root, -1);
-               return result;
-            }
-            return iterator(*this);
-         }
-         if (cpre != in_key)
-            break;
-
-         auto b = in.lower_bound(prefix[cpre.size()]);
-         root   = in.branch(b);
-         prefix = prefix.substr(cpre.size() + 1);
-      }
-      return iterator(*this);
+      node_type  type;
+      auto       vn = unguarded_get(get_id(r), to_key6({key.data(), key.size()}), type);
+      return vn && fill_result(r, *vn, type, result_bytes, result_roots);
    }
+
    template <typename AccessMode>
-   typename session<AccessMode>::iterator session<AccessMode>::lower_bound(
-       const std::shared_ptr<root>& r,
-       string_view                  key) const
+   template <typename F>
+      requires std::invocable<F&, std::span<const char>>
+   bool session<AccessMode>::get(const std::shared_ptr<root>& r,
+                                 std::span<const char>        key,
+                                 F&&                          f) const
    {
-      id       root = get_id(r);
-      iterator result(*this);
-      if (not root)
-         return result;
-
-      key = to_key6(key);
-
       if constexpr (std::is_same_v<AccessMode, write_access>)
          _db->ensure_free_space();
       swap_guard g(*this);
-      for (;;)
-      {
-         auto n = get_by_id(root);
-         if (n.is_leaf_node())
-         {
-            auto& vn = n.as_value_node();
-
-            result.path().emplace_back(root, -1);
-
-            if (vn.key() < key)
-               next(result);
-
-            return result;
-         }
-
-         auto& in     = n.as_inner_node();
-         auto  in_key = in.key();
-
-         if (in_key >= key)
-         {
-            result.path().emplace_back(root, -1);
-            if (not in.value())
-               next(result);
-            return result;
-         }
-
-         auto cpre = common_prefix(key, in_key);
-         if (key <= cpre)
-         {
-            result.path().emplace_back(root, -1);
-            if (not in.value())
-               next(result);
-            return result;
-         }
-
-         // key > cpre
-
-         auto b = in.lower_bound(key[cpre.size()]);
-         if (b < 64)
-         {
-            result.path().emplace_back(root, b);
-            root = in.branch(b);
-            key  = key.substr(cpre.size() + 1);
-            continue;
-         }
-
-         return result;
-      }
+      node_type  type;
+      auto       vn = unguarded_get(get_id(r), to_key6({key.data(), key.size()}), type);
+      if (!vn)
+         return false;
+      f(std::span<const char>{vn->data_ptr(), vn->data_size()});
+      return true;
    }
 
    template <typename AccessMode>
-   inline typename session<AccessMode>::iterator session<AccessMode>::find(id          root,
-                                                                           string_view key) const
+   const value_node* session<AccessMode>::unguarded_get(object_id        root,
+                                                        std::string_view key,
+                                                        node_type&       type) const
    {
       if (not root)
-         return iterator(*this);
+         return nullptr;
 
-      iterator result(*this);
-
-      if constexpr (std::is_same_v<AccessMode, write_access>)
-         _db->ensure_free_space();
-
-      swap_guard g(*this);
       for (;;)
       {
          auto n = get_by_id(root);
          if (n.is_leaf_node())
          {
             auto& vn = n.as_value_node();
-            if (vn.key() == key)
-            {
-               result.path().emplace_back(root, -1);
-               return result;
-            }
-            break;
+            if (vn.key() != key)
+               return nullptr;
+            type = n.type();
+            return &vn;
          }
-
          auto& in     = n.as_inner_node();
          auto  in_key = in.key();
 
          if (key.size() < in_key.size())
-            break;
+            return nullptr;
 
          if (key == in_key)
          {
-            if (not in.value())
-               break;
-
-            //result.path().emplace_back(root, -1);
             root = in.value();
-            key  = string_view();
+
+            if (not root)
+               return nullptr;
+
+            key = string_view();
             continue;
          }
 
          auto cpre = common_prefix(key, in_key);
          if (cpre != in_key)
-            break;
+            return nullptr;
 
          auto b = key[cpre.size()];
 
          if (not in.has_branch(b))
-            break;
+            return nullptr;
 
-         result.path().emplace_back(root, b);
          key  = key.substr(cpre.size() + 1);
          root = in.branch(b);
       }
-      return iterator(*this);
+      return nullptr;
    }
-#endif
 
    template <typename AccessMode>
-   std::optional<std::vector<char>> session<AccessMode>::get(const std::shared_ptr<root>& r,
-                                                             std::span<const char>        key) const
+   template <typename F>
+      requires std::invocable<F&, size_t, std::span<const char>>
+   void session<AccessMode>::get_many(const std::shared_ptr<root>&           r,
+                                      std::span<const std::span<const char>> keys,
+                                      F&&                                    f) const
    {
-      std::vector<char> result;
-      if (get(r, key, &result, nullptr))
-         return std::optional(std::move(result));
-      return std::nullopt;
+      std::string         key6s;
+      std::vector<size_t> key6_ends;
+      key6_ends.reserve(keys.size());
+      for (auto& key : keys)
+      {
+         key6s += to_key6({key.data(), key.size()});
+         key6_ends.push_back(key6s.size());
+      }
+
+      std::vector<get_many_item> items;
+      items.reserve(keys.size());
+      size_t key6_begin = 0;
+      for (size_t i = 0; i < keys.size(); ++i)
+      {
+         auto key = key_view{key6s}.substr(key6_begin, key6_ends[i] - key6_begin);
+         if (!items.empty() && !(items.back().key < key))
+            throw std::runtime_error("get_many: keys must be sorted and unique");
+         items.push_back({key, i});
+         key6_begin = key6_ends[i];
+      }
+
+      auto root = get_id(r);
+      if (!root)
+         return;
+      for (std::span<const get_many_item> remaining{items}; !remaining.empty();)
+      {
+         auto n = std::min(remaining.size(), get_many_chunk);
+         if constexpr (std::is_same_v<AccessMode, write_access>)
+            _db->ensure_free_space();
+         swap_guard g(*this);
+         unguarded_get_many(root, remaining.first(n), 0, f);
+         remaining = remaining.subspan(n);
+      }
    }
 
    template <typename AccessMode>
-   bool session<AccessMode>::get(const std::shared_ptr<root>&        r,
-                                 std::span<const char>               key,
-                                 std::vector<char>*                  result_bytes,
-                                 std::vector<std::shared_ptr<root>>* result_roots) const
-   {
-      if constexpr (std::is_same_v<AccessMode, write_access>)
-         _db->ensure_free_space();
-      swap_guard g(*this);
-      return unguarded_get(r, get_id(r), to_key6({key.data(), key.size()}), result_bytes,
-                           result_roots);
+   std::vector<std::optional<std::span<const char>>> session<AccessMode>::get_many(
+       const std::shared_ptr<root>&           r,
+       std::span<const std::span<const char>> keys,
+       std::vector<char>&                     arena) const
+   {
+      // arena may move while it grows, so this records offsets until the end
+      constexpr auto                         not_found = ~size_t(0);
+      std::vector<std::pair<size_t, size_t>> found(keys.size(), {not_found, 0});
+      get_many(r, keys,
+               [&](size_t i, std::span<const char> value)
+               {
+                  found[i] = {arena.size(), value.size()};
+                  arena.insert(arena.end(), value.begin(), value.end());
+               });
+
+      std::vector<std::optional<std::span<const char>>> result;
+      result.reserve(keys.size());
+      for (auto [offset, size] : found)
+      {
+         if (offset == not_found)
+            result.push_back(std::nullopt);
+         else
+            result.push_back(std::span<const char>{arena.data() + offset, size});
+      }
+      return result;
    }
 
    template <typename AccessMode>
-   bool session<AccessMode>::unguarded_get(
-       const std::shared_ptr<triedent::root>&        ancestor,
-       object_id                                     root,
-       std::string_view                              key,
-       std::vector<char>*                            result_bytes,
-       std::vector<std::shared_ptr<triedent::root>>* result_roots) const
+   template <typename F>
+   void session<AccessMode>::unguarded_get_many(object_id                      root,
+                                                std::span<const get_many_item> items,
+                                                size_t                         pos,
+                                                F&                             f) const
    {
-      if (not root)
-         return false;
+      auto n = get_by_id(root);
+      if (n.is_leaf_node())
+      {
+         // At most one key matches
+         auto& vn  = n.as_value_node();
+         auto  key = vn.key();
+         auto  it  = std::ranges::lower_bound(items, key, {},
+                                              [&](auto& item) { return item.key.substr(pos); });
+         if (it != items.end() && it->key.substr(pos) == key)
+            f(it->index, std::span<const char>{vn.data_ptr(), vn.data_size()});
+         return;
+      }
 
-      for (;;)
+      auto& in     = n.as_inner_node();
+      auto  in_key = in.key();
+
+      // Sorting keeps the keys which match in_key together, and within them,
+      // the keys which continue with the same branch together.
+      struct group
       {
-         auto n = get_by_id(root);
-         if (n.is_leaf_node())
+         object_id id;
+         size_t    begin;
+         size_t    end;
+         size_t    pos;
+      };
+      group  groups[65];
+      size_t num_groups = 0;
+      auto   next_pos   = pos + in_key.size();
+      for (size_t i = 0; i < items.size();)
+      {
+         auto suffix = items[i].key.substr(pos);
+         if (!suffix.starts_with(in_key))
          {
-            auto& vn = n.as_value_node();
-            if (vn.key() == key)
-               return fill_result(ancestor, vn, n.type(), result_bytes, result_roots);
-            return false;
+            ++i;
+            continue;
          }
-         auto& in     = n.as_inner_node();
-         auto  in_key = in.key();
-
-         if (key.size() < in_key.size())
-            return false;
-
-         if (key == in_key)
+         if (suffix.size() == in_key.size())
          {
-            root = in.value();
-
-            if (not root)
-               return false;
-
-            key = string_view();
+            if (auto value = in.value())
+               groups[num_groups++] = {value, i, i + 1, next_pos};
+            ++i;
             continue;
          }
+         auto b   = suffix[in_key.size()];
+         auto end = i + 1;
+         while (end < items.size() && items[end].key.size() > next_pos &&
+                items[end].key[next_pos] == b && items[end].key.substr(pos).starts_with(in_key))
+            ++end;
+         if (in.has_branch(b))
+            groups[num_groups++] = {in.branch(b), i, end, next_pos + 1};
+         i = end;
+      }
 
-         auto cpre = common_prefix(key, in_key);
-         if (cpre != in_key)
-            return false;
-
-         auto b = key[cpre.size()];
-
-         if (not in.has_branch(b))
-            return false;
+      if (_prefetch && num_groups > 1)
+      {
+         object_id ids[65];
+         for (size_t i = 0; i < num_groups; ++i)
+            ids[i] = groups[i].id;
+         _db->_ring->prefetch({ids, num_groups});
+      }
 
-         key  = key.substr(cpre.size() + 1);
-         root = in.branch(b);
+      for (size_t i = 0; i < num_groups; ++i)
+      {
+         auto& g = groups[i];
+         unguarded_get_many(g.id, items.subspan(g.begin, g.end - g.begin), g.pos, f);
       }
-      return false;
    }
 
    template <typename AccessMode>
@@ -1750,37 +2101,69 @@ namespace triedent
          _db->ensure_free_space();
       swap_guard        g(*this);
       std::vector<char> result_key6;
-      if (!unguarded_get_greater_equal(r, get_id(r), to_key6({key.data(), key.size()}), result_key6,
-                                       result_bytes, result_roots))
+      node_type         type;
+      auto              vn = unguarded_get_greater_equal(
+          get_id(r), to_key6({key.data(), key.size()}), result_key6, type);
+      if (!vn)
          return false;
       if (result_key)
       {
          auto s = from_key6({result_key6.data(), result_key6.size()});
          result_key->assign(s.begin(), s.end());
       }
+      return fill_result(r, *vn, type, result_bytes, result_roots);
+   }
+
+   template <typename AccessMode>
+   template <typename F>
+      requires std::invocable<F&, std::span<const char>, std::span<const char>>
+   bool session<AccessMode>::get_greater_equal(const std::shared_ptr<root>& r,
+                                               std::span<const char>        key,
+                                               F&&                          f) const
+   {
+      if constexpr (std::is_same_v<AccessMode, write_access>)
+         _db->ensure_free_space();
+      swap_guard        g(*this);
+      std::vector<char> result_key6;
+      node_type         type;
+      auto              vn = unguarded_get_greater_equal(
+          get_id(r), to_key6({key.data(), key.size()}), result_key6, type);
+      if (!vn)
+         return false;
+      auto s = from_key6({result_key6.data(), result_key6.size()});
+      f(std::span<const char>{s.data(), s.size()},
+        std::span<const char>{vn->data_ptr(), vn->data_size()});
       return true;
    }
 
    template <typename AccessMode>
-   bool session<AccessMode>::unguarded_get_greater_equal(
-       const std::shared_ptr<triedent::root>&        ancestor,
-       object_id                                     root,
-       std::string_view                              key,
-       std::vector<char>&                            result_key,
-       std::vector<char>*                            result_bytes,
-       std::vector<std::shared_ptr<triedent::root>>* result_roots) const
+   void session<AccessMode>::prefetch_branches(const inner_node& in, uint8_t b, uint32_t max) const
+   {
+      if (!_prefetch)
+         return;
+      uint32_t first = std::popcount(in.branches() & ((1ull << b) - 1));
+      _db->_ring->prefetch({in.children() + first, std::min(in.num_branches() - first, max)});
+   }
+
+   template <typename AccessMode>
+   const value_node* session<AccessMode>::unguarded_get_greater_equal(
+       object_id          root,
+       std::string_view   key,
+       std::vector<char>& result_key,
+       node_type&         type) const
    {
       if (!root)
-         return false;
+         return nullptr;
       auto n = get_by_id(root);
       if (n.is_leaf_node())
       {
          auto& vn     = n.as_value_node();
          auto  vn_key = vn.key();
          if (vn_key < key)
-            return false;
+            return nullptr;
          result_key.insert(result_key.end(), vn_key.begin(), vn_key.end());
-         return fill_result(ancestor, vn, n.type(), result_bytes, result_roots);
+         type = n.type();
+         return &vn;
       }
       auto& in     = n.as_inner_node();
       auto  in_key = in.key();
@@ -1788,7 +2171,7 @@ namespace triedent
       if (cpre == in_key)
          key = key.substr(cpre.size());
       else if (in_key < key)
-         return false;
+         return nullptr;
       else
          key = {};
       result_key.insert(result_key.end(), in_key.begin(), in_key.end());
@@ -1800,22 +2183,23 @@ namespace triedent
       }
       else if (in.value())
       {
-         auto  v  = get_by_id(in.value());
-         auto& vn = v.as_value_node();
-         return fill_result(ancestor, vn, v.type(), result_bytes, result_roots);
+         auto v = get_by_id(in.value());
+         type   = v.type();
+         return &v.as_value_node();
       }
       auto b = in.lower_bound(start_b);
       if (b > start_b)
          key = {};
+      if (b < 64)
+         prefetch_branches(in, b, get_greater_equal_prefetch);
       while (true)
       {
          if (b >= 64)
-            return false;
+            return nullptr;
          auto rk = result_key.size();
          result_key.push_back(b);
-         if (unguarded_get_greater_equal(ancestor, in.branch(b), key, result_key, result_bytes,
-                                         result_roots))
-            return true;
+         if (auto vn = unguarded_get_greater_equal(in.branch(b), key, result_key, type))
+            return vn;
          result_key.resize(rk);
          b   = in.lower_bound(b + 1);
          key = {};
@@ -1833,37 +2217,60 @@ namespace triedent
          _db->ensure_free_space();
       swap_guard        g(*this);
       std::vector<char> result_key6;
-      if (!unguarded_get_less_than(r, get_id(r), to_key6({key.data(), key.size()}), result_key6,
-                                   result_bytes, result_roots))
+      node_type         type;
+      auto              vn = unguarded_get_less_than(get_id(r), to_key6({key.data(), key.size()}),
+                                                     result_key6, type);
+      if (!vn)
          return false;
       if (result_key)
       {
          auto s = from_key6({result_key6.data(), result_key6.size()});
          result_key->assign(s.begin(), s.end());
       }
+      return fill_result(r, *vn, type, result_bytes, result_roots);
+   }
+
+   template <typename AccessMode>
+   template <typename F>
+      requires std::invocable<F&, std::span<const char>, std::span<const char>>
+   bool session<AccessMode>::get_less_than(const std::shared_ptr<root>& r,
+                                           std::span<const char>        key,
+                                           F&&                          f) const
+   {
+      if constexpr (std::is_same_v<AccessMode, write_access>)
+         _db->ensure_free_space();
+      swap_guard        g(*this);
+      std::vector<char> result_key6;
+      node_type         type;
+      auto              vn = unguarded_get_less_than(get_id(r), to_key6({key.data(), key.size()}),
+                                                     result_key6, type);
+      if (!vn)
+         return false;
+      auto s = from_key6({result_key6.data(), result_key6.size()});
+      f(std::span<const char>{s.data(), s.size()},
+        std::span<const char>{vn->data_ptr(), vn->data_size()});
       return true;
    }
 
    template <typename AccessMode>
-   bool session<AccessMode>::unguarded_get_less_than(
-       const std::shared_ptr<triedent::root>&        ancestor,
-       object_id                                     root,
-       std::optional<std::string_view>               key,
-       std::vector<char>&                            result_key,
-       std::vector<char>*                            result_bytes,
-       std::vector<std::shared_ptr<triedent::root>>* result_roots) const
+   const value_node* session<AccessMode>::unguarded_get_less_than(
+       object_id                       root,
+       std::optional<std::string_view> key,
+       std::vector<char>&              result_key,
+       node_type&                      type) const
    {
       if (!root)
-         return false;
+         return nullptr;
       auto n = get_by_id(root);
       if (n.is_leaf_node())
       {
          auto& vn     = n.as_value_node();
          auto  vn_key = vn.key();
          if (key && vn_key >= *key)
-            return false;
+            return nullptr;
          result_key.insert(result_key.end(), vn_key.begin(), vn_key.end());
-         return fill_result(ancestor, vn, n.type(), result_bytes, result_roots);
+         type = n.type();
+         return &vn;
       }
       auto&   in     = n.as_inner_node();
       auto    in_key = in.key();
@@ -1871,7 +2278,7 @@ namespace triedent
       if (key)
       {
          if (in_key >= *key)
-            return false;
+            return nullptr;
          auto cpre = common_prefix(in_key, *key);
          if (cpre == in_key)
          {
@@ -1889,9 +2296,8 @@ namespace triedent
       {
          auto rk = result_key.size();
          result_key.push_back(b);
-         if (unguarded_get_less_than(ancestor, in.branch(b), key, result_key, result_bytes,
-                                     result_roots))
-            return true;
+         if (auto vn = unguarded_get_less_than(in.branch(b), key, result_key, type))
+            return vn;
          result_key.resize(rk);
          if (b < 1)
             break;
@@ -1900,11 +2306,11 @@ namespace triedent
       }
       if (in.value())
       {
-         auto  v  = get_by_id(in.value());
-         auto& vn = v.as_value_node();
-         return fill_result(ancestor, vn, v.type(), result_bytes, result_roots);
+         auto v = get_by_id(in.value());
+         type   = v.type();
+         return &v.as_value_node();
       }
-      return false;
+      return nullptr;
    }  // unguarded_get_less_than
 
    template <typename AccessMode>
@@ -1916,36 +2322,64 @@ namespace triedent
    {
       if constexpr (std::is_same_v<AccessMode, write_access>)
          _db->ensure_free_space();
-      swap_guard g(*this);
-      auto       prefix_min = to_key6({prefix.data(), prefix.size()});
-      auto       extra_bits = prefix_min.size() * 6 - prefix.size() * 8;
-      auto       prefix_max = (std::string)prefix_min;
-      if (!prefix_max.empty())
-         prefix_max.back() |= (1 << extra_bits) - 1;
+      swap_guard        g(*this);
       std::vector<char> result_key6;
-      if (!unguarded_get_max(r, get_id(r), prefix_min, prefix_max, result_key6, result_bytes,
-                             result_roots))
+      node_type         type;
+      auto              vn = unguarded_get_max(get_id(r), prefix, result_key6, type);
+      if (!vn)
          return false;
       if (result_key)
       {
          auto s = from_key6({result_key6.data(), result_key6.size()});
          result_key->assign(s.begin(), s.end());
       }
+      return fill_result(r, *vn, type, result_bytes, result_roots);
+   }
+
+   template <typename AccessMode>
+   template <typename F>
+      requires std::invocable<F&, std::span<const char>, std::span<const char>>
+   bool session<AccessMode>::get_max(const std::shared_ptr<root>& r,
+                                     std::span<const char>        prefix,
+                                     F&&                          f) const
+   {
+      if constexpr (std::is_same_v<AccessMode, write_access>)
+         _db->ensure_free_space();
+      swap_guard        g(*this);
+      std::vector<char> result_key6;
+      node_type         type;
+      auto              vn = unguarded_get_max(get_id(r), prefix, result_key6, type);
+      if (!vn)
+         return false;
+      auto s = from_key6({result_key6.data(), result_key6.size()});
+      f(std::span<const char>{s.data(), s.size()},
+        std::span<const char>{vn->data_ptr(), vn->data_size()});
       return true;
    }
 
    template <typename AccessMode>
-   bool session<AccessMode>::unguarded_get_max(
-       const std::shared_ptr<triedent::root>&        ancestor,
-       object_id                                     root,
-       std::string_view                              prefix_min,
-       std::string_view                              prefix_max,
-       std::vector<char>&                            result_key,
-       std::vector<char>*                            result_bytes,
-       std::vector<std::shared_ptr<triedent::root>>* result_roots) const
+   const value_node* session<AccessMode>::unguarded_get_max(object_id             root,
+                                                            std::span<const char> prefix,
+                                                            std::vector<char>&    result_key,
+                                                            node_type&            type) const
+   {
+      auto prefix_min = to_key6({prefix.data(), prefix.size()});
+      auto extra_bits = prefix_min.size() * 6 - prefix.size() * 8;
+      auto prefix_max = (std::string)prefix_min;
+      if (!prefix_max.empty())
+         prefix_max.back() |= (1 << extra_bits) - 1;
+      return unguarded_get_max(root, prefix_min, prefix_max, result_key, type);
+   }
+
+   template <typename AccessMode>
+   const value_node* session<AccessMode>::unguarded_get_max(object_id          root,
+                                                            std::string_view   prefix_min,
+                                                            std::string_view   prefix_max,
+                                                            std::vector<char>& result_key,
+                                                            node_type&         type) const
    {
       if (!root)
-         return false;
+         return nullptr;
 
       while (true)
       {
@@ -1957,9 +2391,10 @@ namespace triedent
             if (vn_key.size() < prefix_min.size() ||
                 memcmp(vn_key.data(), prefix_min.data(), prefix_min.size()) < 0 ||
                 memcmp(vn_key.data(), prefix_max.data(), prefix_max.size()) > 0)
-               return false;
+               return nullptr;
             result_key.insert(result_key.end(), vn_key.begin(), vn_key.end());
-            return fill_result(ancestor, vn, n.type(), result_bytes, result_roots);
+            type = n.type();
+            return &vn;
          }
 
          auto& in     = n.as_inner_node();
@@ -1967,7 +2402,7 @@ namespace triedent
          auto  l      = std::min(in_key.size(), prefix_min.size());
          if (memcmp(in_key.data(), prefix_min.data(), l) < 0 ||
              memcmp(in_key.data(), prefix_max.data(), l) > 0)
-            return false;
+            return nullptr;
 
          result_key.insert(result_key.end(), in_key.begin(), in_key.end());
          prefix_min = prefix_min.substr(l);
@@ -1985,12 +2420,156 @@ namespace triedent
 
          auto b = in.reverse_lower_bound(last_b);
          if (b < first_b)
-            return false;
+            return nullptr;
          result_key.push_back(b);
          root = in.branch(b);
       }
    }  // unguarded_get_max
 
+   template <typename AccessMode>
+   template <typename F>
+      requires std::invocable<F&,
+                              std::span<const char>,
+                              std::optional<std::span<const char>>,
+                              std::optional<std::span<const char>>>
+   void session<AccessMode>::diff(const std::shared_ptr<root>& a,
+                                  const std::shared_ptr<root>& b,
+                                  F&&                          f) const
+   {
+      if constexpr (std::is_same_v<AccessMode, write_access>)
+         _db->ensure_free_space();
+      swap_guard  g(*this);
+      std::string key6;
+      unguarded_diff({get_id(a), 0}, {get_id(b), 0}, key6, f);
+   }
+
+   template <typename AccessMode>
+   auto session<AccessMode>::diff_get(diff_node n) const -> diff_view
+   {
+      auto node = get_by_id(n.id);
+      if (node.is_leaf_node())
+         return {node.as_value_node().key().substr(n.skip), n.id, 0, nullptr};
+      auto& in = node.as_inner_node();
+      return {in.key().substr(n.skip), in.value(), in.branches(), &in};
+   }
+
+   template <typename AccessMode>
+   template <typename F>
+   void session<AccessMode>::emit_diff(key_view key6, object_id old_id, object_id new_id, F& f)
+       const
+   {
+      if (old_id == new_id)
+         return;
+
+      std::optional<std::span<const char>> old_value, new_value;
+      node_type                            old_type = node_type::bytes, new_type = node_type::bytes;
+      if (old_id)
+      {
+         auto v    = get_by_id(old_id);
+         auto data = v.as_value_node().data();
+         old_value = std::span<const char>{data.data(), data.size()};
+         old_type  = v.type();
+      }
+      if (new_id)
+      {
+         auto v    = get_by_id(new_id);
+         auto data = v.as_value_node().data();
+         new_value = std::span<const char>{data.data(), data.size()};
+         new_type  = v.type();
+      }
+      if (old_value && new_value && old_type == new_type &&
+          std::ranges::equal(*old_value, *new_value))
+         return;
+
+      auto key = from_key6(key6);
+      f(std::span<const char>{key.data(), key.size()}, old_value, new_value);
+   }
+
+   template <typename AccessMode>
+   template <typename F>
+   void session<AccessMode>::unguarded_diff(diff_node a, diff_node b, std::string& key6, F& f)
+       const
+   {
+      if (a.id == b.id && a.skip == b.skip)
+         return;
+      if (!a.id)
+         return unguarded_diff_all(b, true, key6, f);
+      if (!b.id)
+         return unguarded_diff_all(a, false, key6, f);
+
+      auto av   = diff_get(a);
+      auto bv   = diff_get(b);
+      auto cpre = common_prefix(av.key, bv.key);
+      if (cpre.size() < av.key.size() && cpre.size() < bv.key.size())
+      {
+         // The keys diverge, so the subtrees have nothing in common
+         if (av.key[cpre.size()] < bv.key[cpre.size()])
+         {
+            unguarded_diff_all(a, false, key6, f);
+            unguarded_diff_all(b, true, key6, f);
+         }
+         else
+         {
+            unguarded_diff_all(b, true, key6, f);
+            unguarded_diff_all(a, false, key6, f);
+         }
+         return;
+      }
+
+      // One key is a prefix of the other. The node with the longer key
+      // is treated as if it were the only branch of a node which ends at cpre.
+      auto old_size = key6.size();
+      key6 += cpre;
+      auto a_ends = av.key.size() == cpre.size();
+      auto b_ends = bv.key.size() == cpre.size();
+      emit_diff(key6, a_ends ? av.value : object_id(), b_ends ? bv.value : object_id(), f);
+
+      auto branches = [&](const diff_view& v, bool ends)
+      { return ends ? v.branches : inner_node::branches(uint8_t(v.key[cpre.size()])); };
+      auto child = [&](diff_node n, const diff_view& v, bool ends, uint8_t br)
+      {
+         if (!ends)
+            return diff_node{n.id, uint32_t(n.skip + cpre.size() + 1)};
+         return diff_node{v.in->branch(br), 0};
+      };
+
+      auto a_branches = branches(av, a_ends);
+      auto b_branches = branches(bv, b_ends);
+      for (auto bits = a_branches | b_branches; bits; bits &= bits - 1)
+      {
+         uint8_t br = std::countr_zero(bits);
+         key6.push_back(br);
+         unguarded_diff((a_branches >> br) & 1 ? child(a, av, a_ends, br) : diff_node{},
+                        (b_branches >> br) & 1 ? child(b, bv, b_ends, br) : diff_node{}, key6, f);
+         key6.resize(old_size + cpre.size());
+      }
+      key6.resize(old_size);
+   }  // unguarded_diff
+
+   template <typename AccessMode>
+   template <typename F>
+   void session<AccessMode>::unguarded_diff_all(diff_node    n,
+                                                bool         added,
+                                                std::string& key6,
+                                                F&           f) const
+   {
+      if (!n.id)
+         return;
+      auto v        = diff_get(n);
+      auto old_size = key6.size();
+      key6 += v.key;
+      if (v.value)
+         emit_diff(key6, added ? object_id() : v.value, added ? v.value : object_id(), f);
+      for (auto bits = v.branches; bits; bits &= bits - 1)
+      {
+         uint8_t br = std::countr_zero(bits);
+         key6.push_back(br);
+         unguarded_diff_all({v.in->branch(br), 0}, added, key6, f);
+         key6.resize(old_size + v.key.size());
+      }
+      key6.resize(old_size);
+   }
+
    inline int write_session::remove(std::shared_ptr<root>& r, std::span<const char> key)
    {
       _db->ensure_free_space();
@@ -2153,6 +2732,365 @@ namespace triedent
       return root;
    }
 
+   inline void write_session::apply_batch(std::shared_ptr<root>&       r,
+                                          std::span<const batch_entry> entries)
+   {
+      // Bytes of hot ring space each chunk may use. ensure_free_space() runs
+      // before each chunk, since space can't be reclaimed while the chunk's
+      // swap_guard is held. Each entry is charged for its key, its value, and
+      // an allowance for the inner nodes it may cause to be rebuilt.
+      constexpr uint64_t chunk_bytes     = 4 * 1024 * 1024;
+      constexpr uint64_t entry_node_cost = 512;
+
+      std::string         key6s;
+      std::vector<size_t> key6_ends;
+      key6_ends.reserve(entries.size());
+      for (auto& e : entries)
+      {
+         key6s += to_key6({e.key.data(), e.key.size()});
+         key6_ends.push_back(key6s.size());
+      }
+
+      std::vector<batch_item> items;
+      items.reserve(entries.size());
+      size_t key6_begin = 0;
+      for (size_t i = 0; i < entries.size(); ++i)
+      {
+         auto& e   = entries[i];
+         auto  key = key_view{key6s}.substr(key6_begin, key6_ends[i] - key6_begin);
+         if (!items.empty() && !(items.back().key < key))
+            throw std::runtime_error("apply_batch: keys must be sorted and unique");
+         items.push_back({key,
+                          e.value ? value_view{e.value->data(), e.value->size()} : value_view{},
+                          node_type::bytes, !e.value, false});
+         key6_begin = key6_ends[i];
+      }
+
+      std::span<const batch_item> remaining{items};
+      while (!remaining.empty())
+      {
+         size_t   n     = 0;
+         uint64_t bytes = 0;
+         do
+         {
+            bytes += remaining[n].key.size() + remaining[n].value.size() + entry_node_cost;
+            ++n;
+         } while (n < remaining.size() && bytes < chunk_bytes);
+
+         _db->ensure_free_space();
+         swap_guard g(*this);
+         auto       new_root = apply_batch(get_id(r), get_unique(r), remaining.first(n), 0);
+         update_root(r, new_root);
+         remaining = remaining.subspan(n);
+      }
+   }
+
+   /**
+    *  Like add_child: returns the new id of the subtree. If it differs from root,
+    *  then the caller releases root.
+    */
+   inline database::id write_session::apply_batch(id                          root,
+                                                  bool                        unique,
+                                                  std::span<const batch_item> items,
+                                                  size_t                      pos)
+   {
+      if (not root)
+         return build_batch(items, pos);
+
+      auto n = get_by_id(root, unique);
+      if (n.is_leaf_node())
+         return apply_batch_leaf(n, unique, items, pos);
+      return apply_batch_inner(n, unique, items, pos);
+   }
+
+   inline database::id write_session::apply_batch_leaf(deref<node>                 n,
+                                                       bool                        unique,
+                                                       std::span<const batch_item> items,
+                                                       size_t                      pos)
+   {
+      auto& vn     = n.as_value_node();
+      auto  vn_key = vn.key();
+
+      if (items.size() == 1 && items[0].key.substr(pos) == vn_key)
+      {
+         if (items[0].remove)
+            return id();
+         return set_value(n, unique, items[0].type, vn_key, items[0].value);
+      }
+
+      // Merge the existing value into the batch and build a new subtree
+      std::vector<batch_item> merged;
+      merged.reserve(items.size() + 1);
+      bool changed = false;
+      bool placed  = false;
+      for (auto& item : items)
+      {
+         auto key = item.key.substr(pos);
+         if (!placed && vn_key <= key)
+         {
+            placed = true;
+            if (vn_key < key)
+               merged.push_back(
+                   {vn_key, vn.data(), n.type(), false, n.type() == node_type::roots});
+            else
+               changed = true;
+         }
+         if (!item.remove)
+         {
+            merged.push_back({key, item.value, item.type, false, item.bump_root_refs});
+            changed = true;
+         }
+      }
+      if (!changed)
+         return n;
+      if (!placed)
+         merged.push_back({vn_key, vn.data(), n.type(), false, n.type() == node_type::roots});
+      if (merged.empty())
+         return id();
+      return build_subtree(merged, 0);
+   }
+
+   inline database::id write_session::apply_batch_inner(deref<node>                 n,
+                                                        bool                        unique,
+                                                        std::span<const batch_item> items,
+                                                        size_t                      pos)
+   {
+      auto& in     = n.as_inner_node();
+      auto  in_key = in.key();
+
+      auto before_in_key = [&](const batch_item& item) { return item.key.substr(pos) < in_key; };
+      if (common_prefix(in_key, items.front().key.substr(pos)).size() < in_key.size() ||
+          common_prefix(in_key, items.back().key.substr(pos)).size() < in_key.size())
+      {
+         // Some keys diverge from this node's prefix. The keys which are under
+         // this node form a contiguous run; if everything outside of it is a
+         // remove, then the rest of the batch doesn't change anything.
+         auto first = std::ranges::partition_point(items, before_in_key);
+         auto last  = std::ranges::find_if(first, items.end(),
+                                           [&](const batch_item& item)
+                                           { return !item.key.substr(pos).starts_with(in_key); });
+         auto is_remove = [](const batch_item& item) { return item.remove; };
+         if (std::all_of(items.begin(), first, is_remove) &&
+             std::all_of(last, items.end(), is_remove))
+         {
+            if (first == last)
+               return n;
+            return apply_batch_inner(n, unique, {first, last}, pos);
+         }
+
+         // Split this node's prefix where the keys diverge, then apply the
+         // batch to the new (unique) parent.
+         auto l = std::min(common_prefix(in_key, items.front().key.substr(pos)).size(),
+                           common_prefix(in_key, items.back().key.substr(pos)).size());
+         id   parent;
+         {
+            auto b      = in_key[l];
+            auto sub    = make_inner(in, in_key.substr(l + 1), retain(in.value()), in.branches());
+            auto nin    = make_inner(in_key.substr(0, l), id(), inner_node::branches(b));
+            nin->branch(b) = sub;
+            parent         = nin;
+         }
+         auto result = apply_batch_inner(get_by_id(parent), true, items, pos);
+         if (result != parent)
+            release(parent);
+         return result;
+      }
+
+      pos += in_key.size();
+      const batch_item* value_item = nullptr;
+      if (items.front().key.size() == pos)
+      {
+         value_item = &items.front();
+         items      = items.subspan(1);
+      }
+
+      struct branch_update
+      {
+         uint8_t b;
+         id      new_id;
+      };
+      branch_update updates[64];
+      uint32_t      num_updates  = 0;
+      uint64_t      new_branches = in.branches();
+      while (!items.empty())
+      {
+         uint8_t b    = items.front().key[pos];
+         auto    size = std::ranges::find_if(items, [&](const batch_item& item)
+                                             { return uint8_t(item.key[pos]) != b; }) -
+                     items.begin();
+         auto group = items.first(size);
+         items      = items.subspan(size);
+         if (in.has_branch(b))
+         {
+            auto cur_b = in.branch(b);
+            auto new_b = apply_batch(cur_b, unique, group, pos + 1);
+            if (new_b != cur_b)
+            {
+               updates[num_updates++] = {b, new_b};
+               if (!new_b)
+                  new_branches &= ~inner_node::branches(b);
+            }
+         }
+         else if (auto new_b = build_batch(group, pos + 1))
+         {
+            updates[num_updates++] = {b, new_b};
+            new_branches |= inner_node::branches(b);
+         }
+      }
+
+      auto old_value = in.value();
+      auto new_value = old_value;
+      if (value_item)
+      {
+         if (value_item->remove)
+            new_value = id();
+         else
+         {
+            bool modified = false;
+            if (unique && old_value)
+            {
+               auto v = get_by_id(old_value);
+               if (v.type() == value_item->type &&
+                   v.as_value_node().data_size() == value_item->value.size() &&
+                   _db->_ring->ref(old_value) == 1)
+               {
+                  modify_value(lock(deref<value_node>(v)), value_item->value);
+                  modified = true;
+               }
+            }
+            if (!modified)
+               new_value = make_value(value_item->type, string_view(), value_item->value,
+                                      value_item->bump_root_refs);
+         }
+      }
+
+      if (!num_updates && new_value == old_value)
+         return n;
+
+      auto num_children = std::popcount(new_branches) + bool(new_value);
+      if (num_children == 0)
+         return id();
+      if (num_children == 1)
+      {
+         // Collapse this node into its only remaining child
+         if (new_value)
+         {
+            auto v      = get_by_id(new_value);
+            auto result = make_value(v.type(), in_key, v.as_value_node().data(),
+                                     v.type() == node_type::roots);
+            if (new_value != old_value)
+               release(new_value);
+            return result;
+         }
+         uint8_t b = std::countr_zero(new_branches);
+         for (uint32_t i = 0; i < num_updates; ++i)
+         {
+            if (updates[i].b == b)
+            {
+               auto result = prepend_key(in_key, b, updates[i].new_id);
+               release(updates[i].new_id);
+               return result;
+            }
+         }
+         return prepend_key(in_key, b, in.branch(b));
+      }
+
+      if (unique && new_branches == in.branches())
+      {
+         auto  locked = lock(n);
+         auto& lin    = locked.as_inner_node();
+         for (uint32_t i = 0; i < num_updates; ++i)
+         {
+            auto& cur_b = lin.branch(updates[i].b);
+            release(cur_b);
+            cur_b = updates[i].new_id;
+         }
+         if (new_value != old_value)
+         {
+            release(old_value);
+            lin.set_value(new_value);
+         }
+         return n;
+      }
+
+      auto new_in = make_inner(in, in_key, new_value == old_value ? retain(old_value) : new_value,
+                               new_branches);
+      for (uint32_t i = 0; i < num_updates; ++i)
+      {
+         if (!updates[i].new_id)
+            continue;
+         auto& cur_b = new_in->branch(updates[i].b);
+         release(cur_b);
+         cur_b = updates[i].new_id;
+      }
+      return new_in;
+   }  // write_session::apply_batch_inner
+
+   // Builds a new subtree from the upserts in items
+   inline database::id write_session::build_batch(std::span<const batch_item> items, size_t pos)
+   {
+      if (std::ranges::none_of(items, [](const batch_item& item) { return item.remove; }))
+         return build_subtree(items, pos);
+
+      std::vector<batch_item> upserts;
+      std::ranges::copy_if(items, std::back_inserter(upserts),
+                           [](const batch_item& item) { return !item.remove; });
+      if (upserts.empty())
+         return id();
+      return build_subtree(upserts, pos);
+   }
+
+   // items must be non-empty and contain no removes
+   inline database::id write_session::build_subtree(std::span<const batch_item> items, size_t pos)
+   {
+      if (items.size() == 1)
+         return make_value(items[0].type, items[0].key.substr(pos), items[0].value,
+                           items[0].bump_root_refs);
+
+      auto cpre = common_prefix(items.front().key.substr(pos), items.back().key.substr(pos));
+      id   value;
+      if (items.front().key.size() == pos + cpre.size())
+      {
+         value = make_value(items[0].type, string_view(), items[0].value, items[0].bump_root_refs);
+         items = items.subspan(1);
+      }
+      pos += cpre.size();
+
+      uint64_t branches = 0;
+      for (auto& item : items)
+         branches |= inner_node::branches(uint8_t(item.key[pos]));
+
+      auto in = make_inner(cpre, value, branches);
+      while (!items.empty())
+      {
+         uint8_t b    = items.front().key[pos];
+         auto    size = std::ranges::find_if(items, [&](const batch_item& item)
+                                             { return uint8_t(item.key[pos]) != b; }) -
+                     items.begin();
+         in->branch(b) = build_subtree(items.first(size), pos + 1);
+         items         = items.subspan(size);
+      }
+      return in;
+   }
+
+   // Returns a copy of child with prefix + b prepended to its key
+   inline database::id write_session::prepend_key(key_view prefix, uint8_t b, id child)
+   {
+      auto        n = get_by_id(child);
+      std::string new_key;
+      new_key += prefix;
+      new_key += char(b);
+      if (n.is_leaf_node())
+      {
+         auto& vn = n.as_value_node();
+         new_key += vn.key();
+         return make_value(n.type(), new_key, vn.data(), n.type() == node_type::roots);
+      }
+      auto& cin = n.as_inner_node();
+      new_key += cin.key();
+      return make_inner(cin, new_key, retain(cin.value()), cin.branches());
+   }
+
    template <typename AccessMode>
    void session<AccessMode>::print(const std::shared_ptr<root>& r)
    {
@@ -2229,7 +3167,7 @@ namespace triedent
 
    inline void write_session::recursive_retain(id r)
    {
-      if (not r)
+      if (not r or is_inline(r))
          return;
       int cur_ref_count = _db->_ring->ref(r);
 
@@ -2291,6 +3229,8 @@ namespace triedent
 
       auto validate_id = [&](auto i)
       {
+         if (is_inline(r))
+            return;
          _db->_ring->validate(r);
          if (0 == _db->_ring->ref(r))
             throw std::runtime_error("found reference to object with 0 ref count: " +
@@ -2318,72 +3258,16 @@ namespace triedent
    inline key_type from_key6(const key_view sixb)
    {
       std::string out;
-      out.resize((sixb.size() * 6) / 8);
-
-      const uint8_t* pos6     = (uint8_t*)sixb.data();
-      const uint8_t* pos6_end = (uint8_t*)sixb.data() + sixb.size();
-      uint8_t*       pos8     = (uint8_t*)out.data();
-
-      while (pos6_end - pos6 >= 4)
-      {
-         pos8[0] = (pos6[0] << 2) | (pos6[1] >> 4);  // 6 + 2t
-         pos8[1] = (pos6[1] << 4) | (pos6[2] >> 2);  // 4b + 4t
-         pos8[2] = (pos6[2] << 6) | pos6[3];         // 2b + 6
-         pos6 += 4;
-         pos8 += 3;
-      }
-      switch (pos6_end - pos6)
-      {
-         case 3:
-            pos8[0] = (pos6[0] << 2) | (pos6[1] >> 4);  // 6 + 2t
-            pos8[1] = (pos6[1] << 4) | (pos6[2] >> 2);  // 4b + 4t
-            //    pos8[2] = (pos6[2] << 6);                   // 2b + 6-0
-            break;
-         case 2:
-            pos8[0] = (pos6[0] << 2) | (pos6[1] >> 4);  // 6 + 2t
-            //     pos8[1] = (pos6[1] << 4);                   // 4b + 4-0
-            break;
-         case 1:
-            pos8[0] = (pos6[0] << 2);  // 6 + 2-0
-            break;
-      }
+      out.resize(key8_size(sixb.size()));
+      decode_key6((const uint8_t*)sixb.data(), (const uint8_t*)sixb.data() + sixb.size(),
+                  (uint8_t*)out.data());
       return out;
    }
    inline key_view session_base::to_key6(key_view v) const
    {
-      uint32_t bits  = v.size() * 8;
-      uint32_t byte6 = (bits + 5) / 6;
-
-      key_buf.resize(byte6);
-
-      uint8_t*       pos6     = (uint8_t*)key_buf.data();
-      const uint8_t* pos8     = (uint8_t*)v.data();
-      const uint8_t* pos8_end = (uint8_t*)v.data() + v.size();
-
-      while (pos8_end - pos8 >= 3)
-      {
-         pos6[0] = pos8[0] >> 2;
-         pos6[1] = (pos8[0] & 0x3) << 4 | pos8[1] >> 4;
-         pos6[2] = (pos8[1] & 0xf) << 2 | (pos8[2] >> 6);
-         pos6[3] = pos8[2] & 0x3f;
-         pos8 += 3;
-         pos6 += 4;
-      }
-
-      switch (pos8_end - pos8)
-      {
-         case 2:
-            pos6[0] = pos8[0] >> 2;
-            pos6[1] = (pos8[0] & 0x3) << 4 | pos8[1] >> 4;
-            pos6[2] = (pos8[1] & 0xf) << 2;
-            break;
-         case 1:
-            pos6[0] = pos8[0] >> 2;
-            pos6[1] = (pos8[0] & 0x3) << 4;
-            break;
-         default:
-            break;
-      }
+      key_buf.resize(key6_size(v.size()));
+      encode_key6((const uint8_t*)v.data(), (const uint8_t*)v.data() + v.size(),
+                  (uint8_t*)key_buf.data());
       return {key_buf.data(), key_buf.size()};
    }
    inline void database::ensure_free_space()
@@ -2391,19 +3275,32 @@ namespace triedent
       _ring->ensure_free_space();
    }
 
+   template <typename F>
+   void database::for_each_session_slot(F&& f) const
+   {
+      for (auto* slab = &_session_slots; slab; slab = slab->next.load())
+         for (auto& slot : slab->slots)
+            f(slot);
+   }
+
    inline void database::claim_free() const
    {
+      // Unused slots hold -1, so there's no need to check in_use
       ring_allocator::swap_position sp;
-      {
-         std::lock_guard<std::mutex> lock(_active_sessions_mutex);
-         for (auto s : _active_sessions)
-         {
-            sp._swap_pos[0] = std::min<uint64_t>(s->_hot_swap_p.load(), sp._swap_pos[0]);
-            sp._swap_pos[1] = std::min<uint64_t>(s->_warm_swap_p.load(), sp._swap_pos[1]);
-            sp._swap_pos[2] = std::min<uint64_t>(s->_cool_swap_p.load(), sp._swap_pos[2]);
-            sp._swap_pos[3] = std::min<uint64_t>(s->_cold_swap_p.load(), sp._swap_pos[3]);
-         }
-      }
+      for_each_session_slot(
+          [&](const session_slot& slot)
+          {
+             for (int level = 0; level < 4; ++level)
+                sp._swap_pos[level] =
+                    std::min<uint64_t>(slot.swap_p[level].load(), sp._swap_pos[level]);
+          });
+
+      // A replica which died while reading would hold back its positions forever
+      maybe_sweep_replicas();
+      for (auto& slot : _replicas->sessions)
+         for (int level = 0; level < 4; ++level)
+            sp._swap_pos[level] =
+                std::min<uint64_t>(slot.swap_p[level].load(), sp._swap_pos[level]);
       _ring->claim_free(sp);
    }
 
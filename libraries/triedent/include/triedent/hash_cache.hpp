@@ -0,0 +1,91 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <triedent/mapping.hpp>
+
+namespace triedent
+{
+   using node_hash = std::array<uint8_t, 32>;
+
+   /**
+    * Hashes of nodes, indexed by object id. Nodes which aren't modified keep
+    * their hashes, so hashing a new revision only visits the nodes which
+    * changed since the last time it was hashed.
+    *
+    * The hashes live in a file next to the id table, so they survive a
+    * restart, and the kernel pages them in and out like the rings instead of
+    * the process holding all of them in memory. An entry of all zeros is
+    * empty; no node hashes to that.
+    *
+    * Until open() is called, nothing is cached. Only the writing thread may
+    * use it, except for grow().
+    */
+   class hash_cache
+   {
+     public:
+      static constexpr uint64_t entry_size = sizeof(node_hash);
+
+      // Creates file if it doesn't exist. Space for max_ids entries is reserved
+      // so that grow() doesn't move the mapping.
+      void open(const std::filesystem::path& file, uint64_t num_ids, uint64_t max_ids)
+      {
+         if (!std::filesystem::exists(file))
+            std::ofstream(file.generic_string(), std::ofstream::trunc).close();
+         if (std::filesystem::file_size(file) < num_ids * entry_size)
+            std::filesystem::resize_file(file, num_ids * entry_size);
+         _file = std::make_unique<mapping>(file, true, max_ids * entry_size);
+         _num_ids.store(_file->size() / entry_size);
+      }
+
+      // Makes room for num_ids entries
+      void grow(uint64_t num_ids)
+      {
+         if (!_file || num_ids <= _num_ids.load())
+            return;
+         _file->grow(num_ids * entry_size);
+         _num_ids.store(num_ids);
+      }
+
+      const node_hash* get(uint64_t id) const
+      {
+         auto e = entry(id);
+         return e && !is_empty(*e) ? e : nullptr;
+      }
+
+      void set(uint64_t id, const node_hash& h)
+      {
+         if (auto e = entry(id))
+            *e = h;
+      }
+
+      // Must be called before a node is modified in place and when an id is reused
+      void invalidate(uint64_t id)
+      {
+         // Don't write to entries which are already empty, so that ids which
+         // were never hashed don't take up space in the file
+         if (auto e = entry(id); e && !is_empty(*e))
+            *e = {};
+      }
+
+     private:
+      node_hash* entry(uint64_t id) const
+      {
+         if (id >= _num_ids.load(std::memory_order_relaxed))
+            return nullptr;
+         return reinterpret_cast<node_hash*>(_file->data()) + id;
+      }
+
+      static bool is_empty(const node_hash& h)
+      {
+         return std::all_of(h.begin(), h.end(), [](uint8_t b) { return b == 0; });
+      }
+
+      std::unique_ptr<mapping> _file;
+      std::atomic<uint64_t>    _num_ids = 0;
+   };
+}  // namespace triedent
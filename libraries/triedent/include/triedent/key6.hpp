@@ -0,0 +1,248 @@
+#pragma once
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define TRIEDENT_KEY6_BMI2 1
+#else
+#define TRIEDENT_KEY6_BMI2 0
+#endif
+
+namespace triedent
+{
+   // Keys are stored 6 bits per byte ("key6") so inner nodes have 64 branches.
+   // Every 3 bytes become 4 symbols, most significant bits first; a partial
+   // group at the end is padded with 0 bits.
+   //
+   // The kernels below handle 6 bytes <-> 8 symbols per 64-bit word and fall
+   // back to the byte-at-a-time code for the tail. encode_key6/decode_key6
+   // pick BMI2 pdep/pext when the CPU has fast implementations of them, and
+   // otherwise a shift-and-mask version which is portable.
+
+   inline uint32_t key6_size(uint32_t key8_size)
+   {
+      return (key8_size * 8 + 5) / 6;
+   }
+
+   inline uint32_t key8_size(uint32_t key6_size)
+   {
+      return key6_size * 6 / 8;
+   }
+
+   namespace key6_detail
+   {
+      inline constexpr uint64_t symbol_mask = 0x3f3f'3f3f'3f3f'3f3full;
+
+      inline constexpr bool little_endian = std::endian::native == std::endian::little;
+
+      inline uint16_t to_big_endian(uint16_t v)
+      {
+         return little_endian ? __builtin_bswap16(v) : v;
+      }
+      inline uint32_t to_big_endian(uint32_t v)
+      {
+         return little_endian ? __builtin_bswap32(v) : v;
+      }
+      inline uint64_t to_big_endian(uint64_t v)
+      {
+         return little_endian ? __builtin_bswap64(v) : v;
+      }
+
+      // The 6 bytes at pos8 as a 48-bit big-endian number. This uses two
+      // loads instead of copying to a temporary, which would stall on store
+      // forwarding.
+      inline uint64_t load48(const uint8_t* pos8)
+      {
+         uint32_t hi;
+         uint16_t lo;
+         memcpy(&hi, pos8, 4);
+         memcpy(&lo, pos8 + 4, 2);
+         return uint64_t(to_big_endian(hi)) << 16 | to_big_endian(lo);
+      }
+
+      inline void store48(uint8_t* pos8, uint64_t x)
+      {
+         uint32_t hi = to_big_endian(uint32_t(x >> 16));
+         uint16_t lo = to_big_endian(uint16_t(x));
+         memcpy(pos8, &hi, 4);
+         memcpy(pos8 + 4, &lo, 2);
+      }
+
+      // 8 symbols, the first in the most significant byte
+      inline uint64_t load_symbols(const uint8_t* pos6)
+      {
+         uint64_t v;
+         memcpy(&v, pos6, 8);
+         return to_big_endian(v);
+      }
+
+      inline void store_symbols(uint8_t* pos6, uint64_t v)
+      {
+         v = to_big_endian(v);
+         memcpy(pos6, &v, 8);
+      }
+
+      // Spreads the 8 6-bit fields of x into the low bits of 8 bytes
+      inline uint64_t spread48(uint64_t x)
+      {
+         x = ((x & 0xffff'ff00'0000ull) << 8) | (x & 0xff'ffffull);
+         x = ((x & 0x00ff'f000'00ff'f000ull) << 4) | (x & 0x0000'0fff'0000'0fffull);
+         x = ((x & 0x0fc0'0fc0'0fc0'0fc0ull) << 2) | (x & 0x003f'003f'003f'003full);
+         return x;
+      }
+
+      // Inverse of spread48
+      inline uint64_t gather48(uint64_t v)
+      {
+         v = ((v & 0x3f00'3f00'3f00'3f00ull) >> 2) | (v & 0x003f'003f'003f'003full);
+         v = ((v & 0x0fff'0000'0fff'0000ull) >> 4) | (v & 0x0000'0fff'0000'0fffull);
+         v = ((v & 0x00ff'ffff'0000'0000ull) >> 8) | (v & 0x0000'0000'00ff'ffffull);
+         return v;
+      }
+   }  // namespace key6_detail
+
+   // Converts the bytes [pos8, pos8_end) to key6_size(pos8_end - pos8) symbols
+   inline void encode_key6_bytewise(const uint8_t* pos8, const uint8_t* pos8_end, uint8_t* pos6)
+   {
+      while (pos8_end - pos8 >= 3)
+      {
+         pos6[0] = pos8[0] >> 2;
+         pos6[1] = (pos8[0] & 0x3) << 4 | pos8[1] >> 4;
+         pos6[2] = (pos8[1] & 0xf) << 2 | (pos8[2] >> 6);
+         pos6[3] = pos8[2] & 0x3f;
+         pos8 += 3;
+         pos6 += 4;
+      }
+
+      switch (pos8_end - pos8)
+      {
+         case 2:
+            pos6[0] = pos8[0] >> 2;
+            pos6[1] = (pos8[0] & 0x3) << 4 | pos8[1] >> 4;
+            pos6[2] = (pos8[1] & 0xf) << 2;
+            break;
+         case 1:
+            pos6[0] = pos8[0] >> 2;
+            pos6[1] = (pos8[0] & 0x3) << 4;
+            break;
+         default:
+            break;
+      }
+   }
+
+   // Converts the symbols [pos6, pos6_end) to key8_size(pos6_end - pos6) bytes.
+   // Trailing bits which don't fill a byte are dropped.
+   inline void decode_key6_bytewise(const uint8_t* pos6, const uint8_t* pos6_end, uint8_t* pos8)
+   {
+      while (pos6_end - pos6 >= 4)
+      {
+         pos8[0] = (pos6[0] << 2) | (pos6[1] >> 4);  // 6 + 2t
+         pos8[1] = (pos6[1] << 4) | (pos6[2] >> 2);  // 4b + 4t
+         pos8[2] = (pos6[2] << 6) | pos6[3];         // 2b + 6
+         pos6 += 4;
+         pos8 += 3;
+      }
+      switch (pos6_end - pos6)
+      {
+         case 3:
+            pos8[0] = (pos6[0] << 2) | (pos6[1] >> 4);  // 6 + 2t
+            pos8[1] = (pos6[1] << 4) | (pos6[2] >> 2);  // 4b + 4t
+            break;
+         case 2:
+            pos8[0] = (pos6[0] << 2) | (pos6[1] >> 4);  // 6 + 2t
+            break;
+         case 1:
+            break;
+      }
+   }
+
+   inline void encode_key6_swar(const uint8_t* pos8, const uint8_t* pos8_end, uint8_t* pos6)
+   {
+      using namespace key6_detail;
+      while (pos8_end - pos8 >= 6)
+      {
+         store_symbols(pos6, spread48(load48(pos8)));
+         pos8 += 6;
+         pos6 += 8;
+      }
+      encode_key6_bytewise(pos8, pos8_end, pos6);
+   }
+
+   inline void decode_key6_swar(const uint8_t* pos6, const uint8_t* pos6_end, uint8_t* pos8)
+   {
+      using namespace key6_detail;
+      while (pos6_end - pos6 >= 8)
+      {
+         store48(pos8, gather48(load_symbols(pos6)));
+         pos6 += 8;
+         pos8 += 6;
+      }
+      decode_key6_bytewise(pos6, pos6_end, pos8);
+   }
+
+#if TRIEDENT_KEY6_BMI2
+   __attribute__((target("bmi2"))) inline void encode_key6_bmi2(const uint8_t* pos8,
+                                                                const uint8_t* pos8_end,
+                                                                uint8_t*       pos6)
+   {
+      using namespace key6_detail;
+      while (pos8_end - pos8 >= 6)
+      {
+         store_symbols(pos6, _pdep_u64(load48(pos8), symbol_mask));
+         pos8 += 6;
+         pos6 += 8;
+      }
+      encode_key6_bytewise(pos8, pos8_end, pos6);
+   }
+
+   __attribute__((target("bmi2"))) inline void decode_key6_bmi2(const uint8_t* pos6,
+                                                                const uint8_t* pos6_end,
+                                                                uint8_t*       pos8)
+   {
+      using namespace key6_detail;
+      while (pos6_end - pos6 >= 8)
+      {
+         store48(pos8, _pext_u64(load_symbols(pos6), symbol_mask));
+         pos6 += 8;
+         pos8 += 6;
+      }
+      decode_key6_bytewise(pos6, pos6_end, pos8);
+   }
+
+   // pdep/pext are microcoded on AMD before Zen 3 and much slower there than
+   // the shift-and-mask version. This is checked at runtime even when the
+   // compiler targets BMI2, because -march=haswell binaries run on those CPUs.
+   inline bool key6_detect_bmi2()
+   {
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("bmi2") && !__builtin_cpu_is("znver1") &&
+             !__builtin_cpu_is("znver2");
+   }
+
+   // Zero-initialized before it is set, so callers from other static
+   // initializers still get correct (portable) results.
+   inline const bool key6_use_bmi2 = key6_detect_bmi2();
+#else
+   inline constexpr bool key6_use_bmi2 = false;
+#endif
+
+   inline void encode_key6(const uint8_t* pos8, const uint8_t* pos8_end, uint8_t* pos6)
+   {
+#if TRIEDENT_KEY6_BMI2
+      if (key6_use_bmi2)
+         return encode_key6_bmi2(pos8, pos8_end, pos6);
+#endif
+      encode_key6_swar(pos8, pos8_end, pos6);
+   }
+
+   inline void decode_key6(const uint8_t* pos6, const uint8_t* pos6_end, uint8_t* pos8)
+   {
+#if TRIEDENT_KEY6_BMI2
+      if (key6_use_bmi2)
+         return decode_key6_bmi2(pos6, pos6_end, pos8);
+#endif
+      decode_key6_swar(pos6, pos6_end, pos8);
+   }
+}  // namespace triedent
@@ -0,0 +1,222 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+namespace triedent
+{
+   /**
+    * Maps a file at an address which doesn't change when the file grows.
+    * Address space for max_size bytes is reserved when the file is opened,
+    * so pointers into the mapping stay valid while another thread extends
+    * it. Reserved address space which isn't mapped doesn't use memory.
+    * The reservation is aligned to huge_page_size, so the kernel can back
+    * the mapping with huge pages.
+    */
+   class mapping
+   {
+     public:
+      static constexpr uint64_t huge_page_size = 2 * 1024 * 1024;
+
+      mapping(const std::filesystem::path& file, bool writable, uint64_t max_size);
+      ~mapping();
+
+      mapping(const mapping&)            = delete;
+      mapping& operator=(const mapping&) = delete;
+
+      char*    data() const { return _data; }
+      uint64_t size() const { return _size; }
+
+      // Locks the mapping in RAM, including the parts which grow() adds later.
+      // Returns false if the OS refused.
+      bool pin();
+
+      // Asks for transparent huge pages, including for the parts which grow()
+      // adds later. The kernel only honors this for file systems which support
+      // them, e.g. tmpfs mounted with huge=advise. Returns false if the kernel
+      // refused.
+      bool use_huge_pages();
+
+      // Faults in every page of the mapping, so the first accesses don't
+      // have to. Calls progress(done, total) in bytes after each chunk.
+      void prefault(const std::function<void(uint64_t, uint64_t)>& progress);
+
+      // Extends the file to new_size bytes and maps the new part. Must not
+      // run concurrently with itself. Throws if new_size exceeds the space
+      // which was reserved.
+      void grow(uint64_t new_size);
+
+      // Maps the part of the file which another process added with grow().
+      // Must not run concurrently with itself.
+      void follow();
+
+     private:
+      void map_to(uint64_t new_size);
+
+      static uint64_t round_up(uint64_t n)
+      {
+         uint64_t page = sysconf(_SC_PAGESIZE);
+         return (n + page - 1) & -page;
+      }
+
+      std::string _name;
+      int         _fd       = -1;
+      int         _prot     = 0;
+      char*       _data     = nullptr;
+      uint64_t    _size     = 0;  // file size
+      uint64_t    _mapped   = 0;  // _size rounded up to a page
+      uint64_t    _reserved = 0;
+      bool        _pinned   = false;
+      bool        _huge     = false;
+   };
+
+   inline mapping::mapping(const std::filesystem::path& file, bool writable, uint64_t max_size)
+       : _name(file.generic_string()), _prot(writable ? PROT_READ | PROT_WRITE : PROT_READ)
+   {
+      _fd = ::open(_name.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+      if (_fd < 0)
+         throw std::system_error(errno, std::generic_category(), "open " + _name);
+
+      struct stat st;
+      if (::fstat(_fd, &st) < 0)
+      {
+         auto err = errno;
+         ::close(_fd);
+         throw std::system_error(err, std::generic_category(), "stat " + _name);
+      }
+      _size     = st.st_size;
+      _mapped   = round_up(_size);
+      _reserved = std::max(round_up(max_size), _mapped);
+
+      // Over-reserve, then trim the ends so _data is aligned to a huge page
+      auto padded   = _reserved + huge_page_size;
+      auto reserved = ::mmap(nullptr, padded, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (reserved == MAP_FAILED)
+      {
+         auto err = errno;
+         ::close(_fd);
+         throw std::system_error(err, std::generic_category(),
+                                 "reserve address space for " + _name);
+      }
+      auto base = reinterpret_cast<uintptr_t>(reserved);
+      auto head = ((base + huge_page_size - 1) & -huge_page_size) - base;
+      if (head)
+         ::munmap(reserved, head);
+      if (huge_page_size - head)
+         ::munmap(static_cast<char*>(reserved) + head + _reserved, huge_page_size - head);
+      _data = static_cast<char*>(reserved) + head;
+
+      if (_mapped && ::mmap(_data, _mapped, _prot, MAP_SHARED | MAP_FIXED, _fd, 0) == MAP_FAILED)
+      {
+         auto err = errno;
+         ::munmap(_data, _reserved);
+         ::close(_fd);
+         throw std::system_error(err, std::generic_category(), "mmap " + _name);
+      }
+   }
+
+   inline mapping::~mapping()
+   {
+      ::munmap(_data, _reserved);
+      ::close(_fd);
+   }
+
+   inline bool mapping::pin()
+   {
+      if (::mlock(_data, _mapped) < 0)
+         return false;
+      _pinned = true;
+      return true;
+   }
+
+   inline bool mapping::use_huge_pages()
+   {
+      if (_mapped && ::madvise(_data, _mapped, MADV_HUGEPAGE) < 0)
+         return false;
+      _huge = true;
+      return true;
+   }
+
+   inline void mapping::prefault(const std::function<void(uint64_t, uint64_t)>& progress)
+   {
+      constexpr uint64_t chunk    = 64 * 1024 * 1024;
+      int                advice   = (_prot & PROT_WRITE) ? MADV_POPULATE_WRITE : MADV_POPULATE_READ;
+      bool               populate = true;
+      for (uint64_t pos = 0; pos < _mapped; pos += chunk)
+      {
+         auto n = std::min(chunk, _mapped - pos);
+         if (populate && ::madvise(_data + pos, n, advice) < 0)
+         {
+            // Kernels before 5.14 don't have MADV_POPULATE_*
+            if (errno != EINVAL)
+               throw std::system_error(errno, std::generic_category(), "prefault " + _name);
+            populate = false;
+         }
+         if (!populate)
+         {
+            uint64_t page = sysconf(_SC_PAGESIZE);
+            for (auto p = pos; p < pos + n; p += page)
+               (void)*static_cast<volatile char*>(_data + p);
+         }
+         if (progress)
+            progress(pos + n, _mapped);
+      }
+   }
+
+   inline void mapping::grow(uint64_t new_size)
+   {
+      if (new_size <= _size)
+         return;
+      if (new_size > _reserved)
+         throw std::runtime_error("cannot grow " + _name + " beyond its reserved address space");
+
+      if (::ftruncate(_fd, new_size) < 0)
+         throw std::system_error(errno, std::generic_category(), "resize " + _name);
+      map_to(new_size);
+   }
+
+   inline void mapping::follow()
+   {
+      struct stat st;
+      if (::fstat(_fd, &st) < 0)
+         throw std::system_error(errno, std::generic_category(), "stat " + _name);
+      uint64_t new_size = std::min<uint64_t>(st.st_size, _reserved);
+      if (new_size > _size)
+         map_to(new_size);
+   }
+
+   inline void mapping::map_to(uint64_t new_size)
+   {
+      auto new_mapped = round_up(new_size);
+      if (new_mapped > _mapped)
+      {
+         if (::mmap(_data + _mapped, new_mapped - _mapped, _prot, MAP_SHARED | MAP_FIXED, _fd,
+                    _mapped) == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), "mmap " + _name);
+         if (_huge)
+            ::madvise(_data + _mapped, new_mapped - _mapped, MADV_HUGEPAGE);
+         if (_pinned && ::mlock(_data + _mapped, new_mapped - _mapped) < 0)
+            throw std::system_error(errno, std::generic_category(), "lock memory for " + _name);
+         _mapped = new_mapped;
+      }
+      _size = new_size;
+   }
+}  // namespace triedent
@@ -13,6 +13,39 @@ namespace triedent
 
    object_id bump_refcount_or_copy(ring_allocator& ra, object_id id);
 
+   // Small byte values may be stored inside their parent inner node instead
+   // of in objects of their own (see inner_node). The parent's branch then
+   // holds an inline id:
+   //    bit 39:    set; object_db ids never get this high
+   //    bits 6-38: the parent's id
+   //    bits 0-5:  which of the parent's inline values it is
+   // An inline value has no refcount of its own; it lives as long as its
+   // parent. It's never edited in place, and retaining it makes a copy which
+   // is a separate object.
+   inline constexpr uint64_t inline_id_flag    = 1ull << 39;
+   inline constexpr uint64_t max_inline_parent = (1ull << 33) - 1;
+
+   // Larger values are never inlined. This keeps inner nodes small enough
+   // for 16-bit offsets.
+   inline constexpr uint32_t max_inline_value_size = 255;
+
+   inline bool is_inline(object_id id)
+   {
+      return id.id & inline_id_flag;
+   }
+   inline object_id make_inline_id(object_id parent, uint32_t index)
+   {
+      return {.id = inline_id_flag | parent.id << 6 | index};
+   }
+   inline object_id inline_parent(object_id id)
+   {
+      return {.id = (id.id & ~inline_id_flag) >> 6};
+   }
+   inline uint32_t inline_index(object_id id)
+   {
+      return id.id & 63;
+   }
+
    class node
    {
      public:
@@ -47,6 +80,12 @@ namespace triedent
       inline value_view data() const { return value_view(data_ptr(), data_size()); }
       inline key_view   key() const { return key_view(key_ptr(), key_size()); }
 
+      // Including this object, but not the object_header
+      inline uint32_t size() const
+      {
+         return (reinterpret_cast<const object_header*>(this) - 1)->size;
+      }
+
       inline static std::pair<location_lock, value_node*> make(ring_allocator& a,
                                                                key_view        key,
                                                                value_view      val,
@@ -124,11 +163,15 @@ namespace triedent
       inline int8_t  reverse_lower_bound(uint8_t b) const;
       inline uint8_t upper_bound(uint8_t b) const;
 
+      // Copies the branches of in which are selected by branches. The copy
+      // keeps in's inline values, and inlines byte values of up to
+      // inline_limit bytes which are in RAM.
       inline static std::pair<location_lock, inner_node*> make(ring_allocator&   a,
                                                                const inner_node& in,
                                                                key_view          prefix,
                                                                object_id         val,
-                                                               uint64_t          branches);
+                                                               uint64_t          branches,
+                                                               uint32_t          inline_limit = 0);
 
       inline static std::pair<location_lock, inner_node*> make(ring_allocator& a,
                                                                key_view        prefix,
@@ -139,6 +182,32 @@ namespace triedent
 
       inline key_view key() const { return key_view(key_ptr(), key_size()); }
 
+      // Inline values are stored after the key, starting at the next multiple
+      // of 8 bytes: a table of num_inline() 16-bit offsets from the start of
+      // the node, then each value as an object_header followed by a
+      // value_node, so that value_node works on it unchanged. A value stays
+      // in the node after an edit in place replaces its branch, until the
+      // node is copied.
+      inline uint32_t          num_inline() const { return _num_inline; }
+      inline const value_node& inline_value(uint32_t index) const
+      {
+         uint16_t offset;
+         memcpy(&offset, reinterpret_cast<const char*>(this) + inline_table() + index * 2, 2);
+         return *reinterpret_cast<const value_node*>(reinterpret_cast<const char*>(this) +
+                                                     offset + sizeof(object_header));
+      }
+
+      // The size of the node, which is checked against its object_header.
+      // Each inline value is padded to a multiple of 8 bytes, including the last.
+      inline uint32_t size() const
+      {
+         if (!_num_inline)
+            return sizeof(inner_node) + num_branches() * sizeof(object_id) + key_size();
+         auto& last = inline_value(_num_inline - 1);
+         return reinterpret_cast<const char*>(&last) - reinterpret_cast<const char*>(this) +
+                ((last.size() + 7) & -8);
+      }
+
       inline int32_t     branch_index(uint32_t branch) const;
       object_id*         children() { return reinterpret_cast<object_id*>(this + 1); }
       const object_id*   children() const { return reinterpret_cast<const object_id*>(this + 1); }
@@ -149,36 +218,99 @@ namespace triedent
       }
 
      private:
-      inner_node(object_id         id,
-                 ring_allocator&   a,
-                 const inner_node& in,
-                 key_view          prefix,
-                 object_id         val,
-                 uint64_t          branches);
+      inner_node(object_id                id,
+                 ring_allocator&          a,
+                 const inner_node&        in,
+                 key_view                 prefix,
+                 object_id                val,
+                 uint64_t                 branches,
+                 const value_node* const* inline_sources);
       inner_node(object_id id, key_view prefix, object_id val, uint64_t branches);
 
+      static uint32_t inline_table_offset(uint32_t num_branches, uint32_t prefix_size)
+      {
+         return (sizeof(inner_node) + num_branches * sizeof(object_id) + prefix_size + 7) & -8;
+      }
+      uint32_t inline_table() const { return inline_table_offset(num_branches(), key_size()); }
+      static uint32_t inline_entry_size(const value_node& vn)
+      {
+         return sizeof(object_header) + ((vn.size() + 7) & -8);
+      }
+
+      // Chooses which of in's children a copy with the given branches stores
+      // inline. Sets sources[b] for each of them, and returns the space they need.
+      static uint32_t plan_inline(ring_allocator&    a,
+                                  const inner_node&  in,
+                                  uint64_t           branches,
+                                  uint32_t           inline_limit,
+                                  const value_node** sources);
+
       uint8_t   _prefix_length = 0;  // mirrors value nodes to signal type and prefix length
-      uint8_t   _reserved_a    = 0;  // future use
+      uint8_t   _num_inline    = 0;  // was reserved; 0 in nodes from before inline values
       uint8_t   _reserved_b    = 0;  // future use
       object_id _value;              // this is 5 bytes
       uint64_t  _present_bits = 0;   // keep this 8 byte aligned for popcount instructions
    } __attribute__((packed));
    static_assert(sizeof(inner_node) == 3 + 5 + 8, "unexpected padding");
 
+   inline uint32_t inner_node::plan_inline(ring_allocator&    a,
+                                           const inner_node&  in,
+                                           uint64_t           branches,
+                                           uint32_t           inline_limit,
+                                           const value_node** sources)
+   {
+      // Ids of new nodes must fit in inline ids
+      if (a.max_ids() > max_inline_parent)
+         inline_limit = 0;
+
+      uint32_t num  = 0;
+      uint32_t size = 0;
+      for (auto bits = in._present_bits & branches; bits; bits &= bits - 1)
+      {
+         auto              b     = std::countr_zero(bits);
+         auto              child = in.branch(b);
+         const value_node* vn    = nullptr;
+         if (is_inline(child))
+            vn = &in.inline_value(inline_index(child));
+         else if (inline_limit)
+         {
+            // Reading children which aren't in RAM would make copying a node fault
+            // in all of its children, so those stay separate objects.
+            auto [ptr, type] = a.get_if_in_ram(child);
+            if (ptr && type == node_type::bytes &&
+                reinterpret_cast<const value_node*>(ptr)->data_size() <= inline_limit)
+               vn = reinterpret_cast<const value_node*>(ptr);
+         }
+         sources[b] = vn;
+         if (vn)
+         {
+            ++num;
+            size += inline_entry_size(*vn);
+         }
+      }
+      if (!num)
+         return 0;
+      return ((num * sizeof(uint16_t) + 7) & -8) + size;
+   }
+
    inline std::pair<location_lock, inner_node*> inner_node::make(ring_allocator&   a,
                                                                  const inner_node& in,
                                                                  key_view          prefix,
                                                                  object_id         val,
-                                                                 uint64_t          branches)
+                                                                 uint64_t          branches,
+                                                                 uint32_t          inline_limit)
    {
-      uint32_t alloc_size =
-          sizeof(inner_node) + prefix.size() + std::popcount(branches) * sizeof(object_id);
+      const value_node* sources[64];
+      uint32_t alloc_size = sizeof(inner_node) + prefix.size() +
+                            std::popcount(branches) * sizeof(object_id);
+      if (auto inline_size = plan_inline(a, in, branches, inline_limit, sources))
+         alloc_size = inline_table_offset(std::popcount(branches), prefix.size()) + inline_size;
       auto p  = a.alloc(alloc_size, node_type::inner);
       auto id = p.first.get_id();
       if constexpr (debug_nodes)
          std::cout << id.id << ": construct inner_node" << std::endl;
       return std::make_pair(std::move(p.first),
-                            new (p.second) inner_node(id, a, in, prefix, val, branches));
+                            new (p.second) inner_node(id, a, in, prefix, val, branches, sources));
    }
 
    inline std::pair<location_lock, inner_node*> inner_node::make(ring_allocator& a,
@@ -198,7 +330,7 @@ namespace triedent
 
    inline inner_node::inner_node(object_id id, key_view prefix, object_id val, uint64_t branches)
        : _prefix_length(prefix.size()),
-         _reserved_a(0),
+         _num_inline(0),
          _reserved_b(0),
          _value(val),
          _present_bits(branches)
@@ -209,63 +341,67 @@ namespace triedent
       memcpy(key_ptr(), prefix.data(), prefix.size());
    }
    /*
-    *  Constructs a copy of in with the branches selected by 'branches'
+    *  Constructs a copy of in with the branches selected by 'branches'. The
+    *  children which have inline_sources are stored inline.
     */
-   inline inner_node::inner_node(object_id         id,
-                                 ring_allocator&   a,
-                                 const inner_node& in,
-                                 key_view          prefix,
-                                 object_id         val,
-                                 uint64_t          branches)
+   inline inner_node::inner_node(object_id                id,
+                                 ring_allocator&          a,
+                                 const inner_node&        in,
+                                 key_view                 prefix,
+                                 object_id                val,
+                                 uint64_t                 branches,
+                                 const value_node* const* inline_sources)
        : _prefix_length(prefix.size()),
-         _reserved_a(0),
+         _num_inline(0),
          _reserved_b(0),
          _value(val),
          _present_bits(branches)
    {
       if constexpr (debug_nodes)
          std::cout << id.id << ": inner_node(): value=" << val.id << std::endl;
-      if (in._present_bits == branches)
-      {
-         // memcpy( (char*)children(), (char*)in.children(), num_branches()*sizeof(object_id) );
-         auto c  = children();
-         auto ic = in.children();
-         auto e  = c + num_branches();
-         while (c != e)
-         {
-            if constexpr (debug_nodes)
-               std::cout << id.id << ": inner_node(copy): bump child " << ic->id << std::endl;
-            *c = bump_refcount_or_copy(a, *ic);
-            ++c;
-            ++ic;
-         }
-      }
-      else
+
+      auto common_branches = in._present_bits & _present_bits;
+      auto null_branches   = _present_bits & ~in._present_bits;
+      for (auto bits = null_branches; bits; bits &= bits - 1)
+         branch(std::countr_zero(bits)).id = 0;
+      memcpy(key_ptr(), prefix.data(), prefix.size());
+
+      uint32_t num_sources = 0;
+      for (auto bits = common_branches; bits; bits &= bits - 1)
+         num_sources += inline_sources[std::countr_zero(bits)] != nullptr;
+      char*    self   = reinterpret_cast<char*>(this);
+      uint32_t offset = inline_table() + ((num_sources * sizeof(uint16_t) + 7) & -8);
+
+      for (auto bits = common_branches; bits; bits &= bits - 1)
       {
-         auto common_branches = in._present_bits & _present_bits;
-         auto fb              = std::countr_zero(common_branches);
-         while (fb < 64)
+         auto fb = std::countr_zero(bits);
+         auto vn = inline_sources[fb];
+         if (!vn)
          {
             if constexpr (debug_nodes)
                std::cout << id.id << ": inner_node(copy): bump child " << in.branch(fb).id
                          << std::endl;
             branch(fb) = bump_refcount_or_copy(a, in.branch(fb));
-            common_branches ^= 1ull << fb;
-            fb = std::countr_zero(common_branches);
+            continue;
          }
 
-         auto null_branches = (in._present_bits & branches) ^ branches;
-         fb                 = std::countr_zero(null_branches);
-         while (fb < 64)
-         {
-            branch(fb).id = 0;
-            null_branches ^= 1ull << fb;
-            fb = std::countr_zero(null_branches);
-         }
+         uint16_t table_entry = offset;
+         memcpy(self + inline_table() + _num_inline * sizeof(uint16_t), &table_entry,
+                sizeof(table_entry));
+         auto header = reinterpret_cast<object_header*>(self + offset);
+         header->set({}, vn->size());
+         memcpy(header->data(), vn, vn->size());
+         offset += inline_entry_size(*vn);
+
+         // The database has grown past the ids which inline ids can hold since
+         // plan_inline ran. The value stays here unused.
+         if (id.id <= max_inline_parent)
+            branch(fb) = make_inline_id(id, _num_inline);
+         else
+            branch(fb) = value_node::make(a, vn->key(), vn->data(), node_type::bytes, false)
+                             .first.into_unlock_unchecked();
+         ++_num_inline;
       }
-      memcpy(key_ptr(), prefix.data(), prefix.size());
-
-      //assert(not is_value_node());
    }
 
    inline object_id& inner_node::branch(uint8_t b)
@@ -314,7 +450,7 @@ namespace triedent
 
    inline void release_node(ring_allocator& ra, object_id obj)
    {
-      if (!obj)
+      if (!obj || is_inline(obj))
          return;
       auto [ptr, type] = ra.release(obj);
       if (ptr && type == node_type::inner)
@@ -373,6 +509,13 @@ namespace triedent
          return id;
       if constexpr (debug_nodes)
          std::cout << id.id << ": bump_refcount_or_copy" << std::endl;
+      if (is_inline(id))
+      {
+         auto [ptr, type, ref] = ra.get_cache<false>(inline_parent(id));
+         auto& vn = reinterpret_cast<inner_node*>(ptr)->inline_value(inline_index(id));
+         return value_node::make(ra, vn.key(), vn.data(), node_type::bytes, false)
+             .first.into_unlock_unchecked();
+      }
       if (ra.bump_count(id))
          return id;
       auto [ptr, type, ref] = ra.get_cache<false>(id);
@@ -7,6 +7,8 @@
 #include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
 #include <triedent/debug.hpp>
+#include <triedent/hash_cache.hpp>
+#include <triedent/mapping.hpp>
 
 namespace triedent
 {
@@ -116,6 +118,20 @@ namespace triedent
       object_db(std::filesystem::path idfile, bool allow_write, bool allow_slow);
       static void create(std::filesystem::path idfile, uint64_t max_id);
 
+      // Extends the table so it can hold max_id ids. Other threads may keep
+      // using the object_db, but grow must not run concurrently with itself.
+      void grow(uint64_t max_id);
+
+      // Maps ids which a writer in another process added with grow(). Must
+      // not run concurrently with itself.
+      void follow_growth();
+
+      // Whether id can be looked up without calling follow_growth first
+      bool is_mapped(object_id id) const
+      {
+         return id.id < _mapped_ids.load(std::memory_order_relaxed);
+      }
+
       // Bumps the reference count by 1 if possible
       bool bump_count(object_id id)
       {
@@ -138,13 +154,15 @@ namespace triedent
       // A thread which holds a location_lock may:
       // * Move the object to another location
       // * Modify the object if it's not already exposed to reader threads
+      //
+      // Fails if the object was released, since its entry then links the free list
       std::optional<location_lock> try_lock(object_id id)
       {
          auto& atomic = _header->objects[id.id];
          auto  obj    = atomic.load();
          do
          {
-            if (obj & position_lock_mask)
+            if ((obj & position_lock_mask) || !(obj & ref_count_mask))
                return std::nullopt;
          } while (!atomic.compare_exchange_weak(obj, obj | position_lock_mask));
 
@@ -204,12 +222,41 @@ namespace triedent
       object_location get(object_id id, uint16_t& ref);
 
       void print_stats();
+
+      // Maintained in memory, so it only counts allocs and releases done through this object_db
+      uint64_t num_used_ids() const { return _header->first_unallocated.id - _num_free.load(); }
+      uint64_t max_ids() const { return _max_ids.load(); }
+
+      // Hashes of the objects. alloc() clears an id's entry when it hands out
+      // the id. Only the writer opens it; see open_hashes.
+      hash_cache& hashes() { return _hashes; }
+      void        open_hashes(const std::filesystem::path& file)
+      {
+         _hashes.open(file, _max_ids.load(), max_reserved_ids);
+      }
+
       void validate(object_id i)
       {
          if (i.id > _header->first_unallocated.id)
             throw std::runtime_error("invalid object id discovered: " + std::to_string(i.id));
       }
 
+      // Checks the entry of an id which something references. Returns a
+      // description of the problem, or an empty string if there's none.
+      std::string check(object_id i) const
+      {
+         if (!i.id || i.id > _header->first_unallocated.id)
+            return "object id " + std::to_string(i.id) + " is out of range";
+         auto val = _header->objects[i.id].load();
+         if (!extract_ref(val))
+            return "object " + std::to_string(i.id) + " is referenced but has a ref count of 0";
+         if (extract_ref(val) == ref_count_mask)
+            return "object " + std::to_string(i.id) + " has an invalid ref count";
+         if (extract_type(val) > node_type::roots)
+            return "object " + std::to_string(i.id) + " has an invalid type";
+         return {};
+      }
+
       /**
        * Sets all non-zero refs to c
        */
@@ -271,11 +318,25 @@ namespace triedent
          std::atomic<uint64_t> objects[1];
       };
 
-      std::unique_ptr<bip::file_mapping>  _file;
-      std::unique_ptr<bip::mapped_region> _region;
+      // Address space is reserved for this many ids, so the table can grow
+      // without moving. Reserving it doesn't use any memory.
+      static constexpr uint64_t max_reserved_ids = 1ull << 35;
+
+      std::unique_ptr<mapping> _file;
 
       object_db_header* _header;
 
+      // Copied from _header->max_unallocated, which grow() changes while alloc runs
+      std::atomic<uint64_t> _max_ids = 0;
+
+      // Number of ids which the mapping covers
+      std::atomic<uint64_t> _mapped_ids = 0;
+
+      // Number of ids on the free list
+      std::atomic<uint64_t> _num_free = 0;
+
+      hash_cache _hashes;
+
       void debug(uint64_t id, const char* msg)
       {
          if constexpr (debug_id)
@@ -316,19 +377,15 @@ namespace triedent
       if (not std::filesystem::exists(idfile))
          throw std::runtime_error("file does not exist: " + idfile.generic_string());
 
-      auto existing_size = std::filesystem::file_size(idfile);
-
       // std::cerr << "mapping '" << idfile << "' in "  //
       //           << (allow_write ? "read/write" : "read only") << " mode\n";
 
-      auto mode = allow_write ? bip::read_write : bip::read_only;
+      _file = std::make_unique<mapping>(idfile, allow_write,
+                                        sizeof(object_db_header) + max_reserved_ids * 8);
+      _mapped_ids.store((_file->size() - sizeof(object_db_header)) / 8);
 
-      _file = std::make_unique<bip::file_mapping>(  //
-          idfile.generic_string().c_str(), mode);
-
-      _region = std::make_unique<bip::mapped_region>(*_file, mode);
-
-      if (mlock(_region->get_address(), existing_size) < 0)
+      // The writer keeps the table in RAM; a reader would only pin the same pages
+      if (allow_write && !_file->pin())
          if (!allow_slow)
             throw std::runtime_error(
                 "unable to lock memory for " + idfile.generic_string() +
@@ -336,27 +393,60 @@ namespace triedent
                 "If that doesn't work, try running psinode with \"sudo\". If that doesn't work, "
                 "then try using psinode's \"--slow\" option.");
 
-      _header = reinterpret_cast<object_db_header*>(_region->get_address());
+      _header = reinterpret_cast<object_db_header*>(_file->data());
 
-      if (_header->max_unallocated.id != (existing_size - sizeof(object_db_header)) / 8)
+      // grow() extends the file before it records the new size. If it was
+      // interrupted, then the rest of the file holds unused ids.
+      auto capacity = (_file->size() - sizeof(object_db_header)) / 8;
+      if (_header->max_unallocated.id > capacity)
          throw std::runtime_error("file corruption detected: " + idfile.generic_string());
+      if (allow_write)
+         _header->max_unallocated.id = capacity;
+      _max_ids.store(_header->max_unallocated.id);
+      if (!allow_write)
+         return;
 
       // Objects may have been locked for move when process was SIGKILLed. If any objects
       // were locked because they were being written to, their root will not be reachable
       // from database_memory::_root_revision, and will be leaked. Mermaid can clean this
       // leak.
+      uint64_t num_free = 0;
       for (uint64_t i = 0; i <= _header->first_unallocated.id; ++i)
+      {
          _header->objects[i] &= ~position_lock_mask;
+         // id 0 is never allocated
+         num_free += i && (_header->objects[i].load() & ref_count_mask) == 0;
+      }
+      _num_free.store(num_free);
+   }
+
+   inline void object_db::grow(uint64_t max_id)
+   {
+      if (max_id <= _max_ids.load())
+         return;
+      _file->grow(sizeof(object_db_header) + max_id * 8);
+      _hashes.grow(max_id);
+      _mapped_ids.store(max_id);
+      _header->max_unallocated.id = max_id;
+      _max_ids.store(max_id);
+   }
+
+   inline void object_db::follow_growth()
+   {
+      _file->follow();
+      _mapped_ids.store((_file->size() - sizeof(object_db_header)) / 8);
+      _max_ids.store(_header->max_unallocated.id);
    }
 
    inline location_lock object_db::alloc(node_type type)
    {
       if (_header->first_free.load() == 0)
       {
-         if (_header->first_unallocated.id >= _header->max_unallocated.id)
+         if (_header->first_unallocated.id >= _max_ids.load(std::memory_order_relaxed))
             throw std::runtime_error("no more object ids");
          ++_header->first_unallocated.id;
          auto  r   = _header->first_unallocated;
+         _hashes.invalidate(r.id);
          auto& obj = _header->objects[r.id];
          obj.store(obj_val(object_location{.type = type}, 1) |
                    position_lock_mask);  // init ref count 1
@@ -375,6 +465,8 @@ namespace triedent
              ff, extract_next_ptr(_header->objects[ff].load())))
          {
          }
+         _num_free.fetch_sub(1, std::memory_order_relaxed);
+         _hashes.invalidate(ff);
          _header->objects[ff].store(obj_val(object_location{.type = type}, 1) |
                                     position_lock_mask);  // init ref count 1
 
@@ -429,6 +521,12 @@ namespace triedent
       //   }
       if (new_count == 0)
       {
+         // The swap thread may have locked the object just before its last
+         // reference went away. Wait for it to finish moving the object, so
+         // that it doesn't overwrite the link to the next free id.
+         while (val & position_lock_mask)
+            val = obj.load();
+
          // the invariant is first_free->object with id that points to next free
          // 1. update object to point to next free
          // 2. then attempt to update first free
@@ -438,6 +536,7 @@ namespace triedent
             ff = _header->first_free.load();
             obj.store(create_next_ptr(ff));
          } while (not _header->first_free.compare_exchange_strong(ff, id.id));
+         _num_free.fetch_add(1, std::memory_order_relaxed);
       }
 
       debug(id.id, "release");
@@ -495,7 +594,7 @@ namespace triedent
       uint64_t total        = 0;
       uint64_t non_zero_ref = 0;
       auto*    ptr          = _header->objects;
-      auto*    end          = _header->objects + _header->max_unallocated.id;
+      auto*    end          = _header->objects + _max_ids.load();
       while (ptr != end)
       {
          zero_ref += 0 == (ptr->load() & ref_count_mask);
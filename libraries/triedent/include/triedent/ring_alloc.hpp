@@ -2,8 +2,11 @@
 #include <boost/interprocess/offset_ptr.hpp>
 #include <chrono>
 #include <functional>
+#include <mutex>
 #include <optional>
+#include <span>
 #include <thread>
+#include <triedent/compression.hpp>
 #include <triedent/object_db.hpp>
 
 namespace triedent
@@ -30,6 +33,27 @@ namespace triedent
          uint64_t cold_pages = 1000 * 1000ull;
       };
 
+      enum cache_level_type
+      {
+         hot_cache  = 0,  // pinned, zero copy access (ram) 50% of RAM
+         warm_cache = 1,  // pinned, copy to hot on access (ram) 25% of RAM
+         cool_cache = 2,  // not pinned, copy to hot on access (disk cache)  25% of RAM
+         cold_cache = 3   // not pinned, copy to hot on access (uncached) AS NEEDED DISK
+      };
+
+      // How the hot and warm levels are backed by RAM
+      struct memory_config
+      {
+         // Ask for transparent huge pages, which cut TLB misses on random
+         // reads. See mapping::use_huge_pages.
+         bool huge_pages = false;
+         // Fault the levels in while opening, so the first blocks after a
+         // restart don't have to
+         bool prefault = false;
+         // Called while prefaulting with the bytes done and total for a level
+         std::function<void(cache_level_type level, uint64_t done, uint64_t total)> progress;
+      };
+
       struct swap_position
       {
          swap_position() {}
@@ -39,8 +63,27 @@ namespace triedent
       swap_position get_swap_pos() const;
 
       ring_allocator(std::filesystem::path dir, access_mode mode, bool allow_slow);
+      ring_allocator(std::filesystem::path dir,
+                     access_mode           mode,
+                     bool                  allow_slow,
+                     const memory_config&  mem);
       static void create(std::filesystem::path dir, config cfg);
 
+      // Grows the object id table and the rings to the sizes in cfg, which
+      // mean the same as they do for create. Sizes which aren't larger than
+      // the current ones are ignored. Other threads may keep using the
+      // database. The files grow immediately, but a ring only starts using
+      // its new space once none of the objects which may still be read would
+      // have to move, which happens within one pass around the ring.
+      void grow(const config& cfg);
+
+      // Maps the parts of the files which the writer's grow() added. Only
+      // needed in read_only mode; get_cache calls it when it finds an object
+      // outside the mapped space.
+      void follow_growth();
+
+      bool is_read_only() const { return _read_only; }
+
       std::pair<location_lock, char*> alloc(size_t num_bytes, node_type type);
 
       location_lock spin_lock(object_id id) { return _obj_ids->spin_lock(id); }
@@ -63,15 +106,40 @@ namespace triedent
       template <bool CopyToHot = true>
       std::tuple<char*, node_type, uint16_t> get_cache(id);
 
+      // Returns the object's data and type if it's in the hot or warm level
+      // and isn't compressed, without copying it or counting a read. Returns
+      // nullptr for objects which reading might fault in from disk.
+      std::pair<const char*, node_type> get_if_in_ram(id i);
+
+      uint64_t max_ids() const { return _obj_ids->max_ids(); }
+
+      // Asks the OS to start reading objects which are in a level that isn't
+      // pinned in RAM, without waiting for the reads to complete. This lets a
+      // scan keep many reads in flight instead of faulting pages in one at a
+      // time. Objects which are already in RAM are skipped.
+      void prefetch(std::span<const object_id> ids);
+
+      // Enables compressing byte values as swap() moves them into the cool and
+      // cold levels. get_cache decompresses them, so this is invisible to
+      // callers. Objects which were already compressed remain readable when
+      // this is off.
+      void set_compression(bool enable) { _compress.store(enable); }
+
+      // get_cache<false> decompresses into buffers owned by the calling thread.
+      // They're freed when the thread leaves its outermost read, so pointers
+      // into them stay valid for as long as a swap_guard would keep them valid.
+      static void enter_read() { ++_read_depth; }
+      static void exit_read()
+      {
+         if (!--_read_depth)
+            _decoded.clear();
+      }
+
       uint32_t ref(id i) const { return _obj_ids->ref(i); }
+      hash_cache& hashes() { return _obj_ids->hashes(); }
 
-      enum cache_level_type
-      {
-         hot_cache  = 0,  // pinned, zero copy access (ram) 50% of RAM
-         warm_cache = 1,  // pinned, copy to hot on access (ram) 25% of RAM
-         cool_cache = 2,  // not pinned, copy to hot on access (disk cache)  25% of RAM
-         cold_cache = 3   // not pinned, copy to hot on access (uncached) AS NEEDED DISK
-      };
+      // number of objects allocated by alloc() since this process opened the database
+      uint64_t num_allocs() const { return _num_allocs.load(std::memory_order_relaxed); }
 
       void dump(bool detail = false);
 
@@ -79,7 +147,8 @@ namespace triedent
       ~ring_allocator()
       {
          _done.store(true);
-         _swap_thread->join();
+         if (_swap_thread)
+            _swap_thread->join();
       }
 
       /**
@@ -91,27 +160,114 @@ namespace triedent
       void validate();
       void validate(id i) { _obj_ids->validate(i); }
 
+      // Checks i's entry in the object table and the header which it points
+      // to. On success, sets size to the object's size as stored, and returns
+      // an empty string. Otherwise returns a description of the problem. The
+      // caller must hold a swap_guard.
+      std::string check(id i, uint32_t& size);
+
       bool is_slow() const;
 
+      struct level_stats
+      {
+         uint64_t capacity           = 0;  // bytes
+         uint64_t used               = 0;  // bytes which can't be allocated until swap frees them
+         uint64_t free               = 0;  // bytes which can be allocated without waiting
+         uint64_t swap_lag           = 0;  // bytes allocated which haven't been swapped out yet
+         uint64_t hits               = 0;  // reads which found their object in this level
+         uint64_t misses             = 0;  // reads which had to go to a lower level
+         uint64_t swapped_bytes      = 0;  // bytes moved to the next level
+         double   swap_bytes_per_sec = 0;
+         bool     huge_pages         = false;  // the kernel accepted memory_config::huge_pages
+      };
+
+      // Counters are totals since the database was opened by this process.
+      // swap_bytes_per_sec covers the time since the previous call to get_stats.
+      struct stats
+      {
+         level_stats levels[4];
+         uint64_t    used_ids         = 0;
+         uint64_t    max_ids          = 0;
+         uint64_t    free_space_waits = 0;  // allocations which had to wait on swap
+      };
+
+      // Doesn't scan the rings or the object ids, so it's cheap to poll
+      stats get_stats();
+
      private:
+      // Objects are 8-byte aligned, so the low bits of their offsets are free.
+      // This one marks objects which are stored compressed.
+      static constexpr uint64_t compressed_flag = 1;
+
+      // Objects smaller than this aren't worth compressing
+      static constexpr uint32_t min_compress_size = 64;
+
       uint64_t wait_on_free_space(managed_ring& ring, uint64_t used_size);
       char*    alloc(managed_ring&        ring,
                      const location_lock& lock,
                      uint32_t             num_bytes,
-                     char*                src = nullptr);
+                     char*                src        = nullptr,
+                     bool                 compressed = false);
+
+      // Like alloc, but calls fill(data) to initialize the object before
+      // making it visible at its new location
+      template <typename F>
+      char* alloc_with(managed_ring&        ring,
+                       const location_lock& lock,
+                       uint32_t             num_bytes,
+                       bool                 compressed,
+                       F&&                  fill);
+
+      std::tuple<char*, node_type, uint16_t> get_cache_read_only(id i);
+
+      bool  try_compress(managed_ring& to, const location_lock& lock, object_header* o);
+      char* decompress(object_header* o, bool copy_to_hot);
+
+      // Switches ring to the area which grow() mapped, if possible. Only the
+      // thread which allocates in ring may call this.
+      void apply_growth(managed_ring& ring);
 
       inline managed_ring&          hot() const { return *_levels[hot_cache]; }
       inline managed_ring&          warm() const { return *_levels[warm_cache]; }
       inline managed_ring&          cool() const { return *_levels[cool_cache]; }
       inline managed_ring&          cold() const { return *_levels[cold_cache]; }
+      bool                          _read_only = false;
       std::unique_ptr<object_db>    _obj_ids;
       std::unique_ptr<managed_ring> _levels[4];
       std::unique_ptr<std::thread>  _swap_thread;
       std::atomic<bool>             _swapped;
       std::atomic<bool>             _done = false;
 
-      std::atomic<bool> _debug = false;
-      void              swap_loop()
+      std::atomic<bool>     _debug      = false;
+      std::atomic<uint64_t> _num_allocs = 0;
+
+      // claim_free and apply_growth both replace end_free_p
+      std::mutex _claim_mutex;
+      std::mutex _grow_mutex;
+
+      struct alignas(64) padded_counter
+      {
+         std::atomic<uint64_t> value = 0;
+      };
+      padded_counter        _reads[4];
+      std::atomic<uint64_t> _swapped_bytes[4] = {};
+      std::atomic<uint64_t> _free_space_waits = 0;
+
+      std::mutex                            _stats_mutex;
+      std::chrono::steady_clock::time_point _stats_time = std::chrono::steady_clock::now();
+      uint64_t                              _stats_swapped_bytes[4] = {};
+
+      std::atomic<bool>     _compress                = false;
+      std::atomic<uint64_t> _compressed_objects      = 0;
+      std::atomic<uint64_t> _compressed_input_bytes  = 0;
+      std::atomic<uint64_t> _compressed_output_bytes = 0;
+      std::atomic<uint64_t> _incompressible_objects  = 0;
+      std::atomic<uint64_t> _decompressed_objects    = 0;
+      std::atomic<uint64_t> _decompress_nanoseconds  = 0;
+
+      static thread_local uint32_t                             _read_depth;
+      static thread_local std::vector<std::unique_ptr<char[]>> _decoded;
+      void                  swap_loop()
       {
          while (not _done.load())
          {
@@ -136,8 +292,16 @@ namespace triedent
       // the object stored in memory
       struct header
       {
-         // TODO pad these variables to eliminate
-         // false sharing when using multiple threads
+         // This is the layout of the ring files. alloc_p, swap_p, and end_free_p
+         // each start a cache line, because different threads write them.
+         // The alloc area fields follow end_free_p on its line, so
+         // managed_ring keeps copies of them to keep alloc and swap from
+         // reading that line whenever claim_free moves end_free_p.
+         //
+         // Position p is at offset (p + alloc_area_rotation) & alloc_area_mask.
+         // Growing the ring changes the rotation so that objects which may
+         // still be read keep their offsets. Files from before growth was
+         // supported have zeros in these fields.
 
          void validate()
          {
@@ -170,20 +334,31 @@ namespace triedent
          alignas(64) std::atomic<uint64_t> end_free_p;
          uint64_t alloc_area_mask;
          uint64_t alloc_area_size;
+         uint64_t alloc_area_rotation;
+
+         // Growth stores this, then alloc_area_size, then the other fields. If
+         // it's interrupted, recover() finishes the job.
+         uint64_t next_rotation;
+
+         uint64_t offset_of(uint64_t p) const
+         {
+            return (p + alloc_area_rotation) & alloc_area_mask;
+         }
 
          object_header* get_alloc_pos() const
          {
             return reinterpret_cast<object_header*>(  //
-                (char*)begin.get() + (alloc_p.load() & alloc_area_mask));
+                (char*)begin.get() + offset_of(alloc_p.load()));
          }
          object_header* get_swap_pos() const
          {
             return reinterpret_cast<object_header*>(  //
-                (char*)begin.get() + (swap_p.load() & alloc_area_mask));
+                (char*)begin.get() + offset_of(swap_p.load()));
          }
          object_header* get_end_free_pos() const
          {
-            return begin.get() + (end_free_p & alloc_area_mask);
+            return reinterpret_cast<object_header*>(  //
+                (char*)begin.get() + offset_of(end_free_p.load()));
          }
          inline object_header* get_end_pos() const { return end.get(); }
          inline uint64_t       get_free_space() const { return end_free_p.load() - alloc_p.load(); }
@@ -196,8 +371,8 @@ namespace triedent
             auto ap         = alloc_p.load();
             auto ep         = end_free_p.load();
             auto free_space = ep - ap;
-            auto wraped     = (ap + free_space) & alloc_area_mask;
-            if ((ap & alloc_area_mask) > wraped)
+            auto wraped     = offset_of(ep);
+            if (offset_of(ap) > wraped)
             {
                return free_space - wraped;
             }
@@ -206,42 +381,94 @@ namespace triedent
 
          inline void update_size(uint64_t new_size);
          header(uint64_t size);
+
+         // Repairs the alloc area fields if growth was interrupted
+         void recover();
       };
 
-      managed_ring(std::filesystem::path            filename,
-                   ring_allocator::cache_level_type level,
-                   bool                             pin,
-                   bool                             allow_slow);
+      managed_ring(std::filesystem::path                filename,
+                   ring_allocator::cache_level_type     level,
+                   bool                                 writable,
+                   bool                                 pin,
+                   bool                                 allow_slow,
+                   const ring_allocator::memory_config& mem = {});
 
       static void create(std::filesystem::path filename, uint8_t logsize);
 
+      // Extends the file so the alloc area can hold 2^logsize bytes. The ring
+      // keeps using its current area until ring_allocator::apply_growth
+      // switches it over.
+      void grow(uint8_t logsize);
+
+      // The mask is stored last when the ring grows, so a thread which sees
+      // the new mask also sees the new rotation. The old mask with the new
+      // rotation gives the same offsets as before for every position which
+      // may still be in use.
+      inline uint64_t offset_of(uint64_t p) const
+      {
+         auto mask = _alloc_area_mask.load(std::memory_order_acquire);
+         return (p + _alloc_area_rotation.load(std::memory_order_relaxed)) & mask;
+      }
+
       inline auto     get_free_space() const { return _head->get_free_space(); }
-      inline auto*    get_alloc_cursor() { return _head->get_alloc_pos(); }
+      inline uint64_t get_potential_free_space() const
+      {
+         return _head->swap_p.load() + _alloc_area_size.load() - _head->alloc_p.load();
+      }
+      inline object_header* get_alloc_cursor()
+      {
+         return reinterpret_cast<object_header*>(begin_pos() + offset_of(_head->alloc_p.load()));
+      }
       inline auto*    get_swap_cursor() { return _head->get_swap_pos(); }
-      inline uint64_t max_contigous_alloc() const { return _head->max_contigous_alloc(); }
+      inline uint64_t max_contigous_alloc() const
+      {
+         auto ap         = _head->alloc_p.load();
+         auto ep         = _head->end_free_p.load();
+         auto free_space = ep - ap;
+         auto wraped     = offset_of(ep);
+         if (offset_of(ap) > wraped)
+         {
+            return free_space - wraped;
+         }
+         return free_space;
+      }
       /*
       inline auto&   swap_cursor() { return _head->swap_cursor; }
       inline auto&   end_free_cursor() { return _head->end_free; }
       inline char*   end_pos() const { return (char*)_head->end.get(); }
       */
       inline char*   begin_pos() const { return (char*)_begin; }  //_head->begin.get(); }
+      bool is_mapped(const object_header* o, uint64_t size) const
+      {
+         return (const char*)o + size <= _mapped_end.load(std::memory_order_relaxed);
+      }
       object_header* get_object(uint64_t offset)
       {
          // TODO: UB since this isn't atomic and there are multiple reader threads
          // ++_head->cache_hits;  // TODO: remove from release
-         return reinterpret_cast<object_header*>(begin_pos() + offset);
+         // The low bits hold flags (ring_allocator::compressed_flag)
+         return reinterpret_cast<object_header*>(begin_pos() + (offset & -8));
       }
 
       ring_allocator::cache_level_type level;
 
-      bool                                _slow  = false;
-      FILE*                               _cfile = nullptr;
-      int                                 _cfileno;
-      header*                             _head;
-      object_header*                      _begin;
-      object_header*                      _end;
-      std::unique_ptr<bip::file_mapping>  _file_map;
-      std::unique_ptr<bip::mapped_region> _map_region;
+      // Address space is reserved for the largest ring header allows, so the
+      // mapping never moves when the ring grows
+      static constexpr uint64_t max_reserved_size = 1ull << 38;
+
+      bool                     _slow      = false;
+      bool                     _pinned    = false;
+      bool                     huge_pages = false;
+      std::atomic<uint64_t>    _alloc_area_mask;      // copied from _head
+      std::atomic<uint64_t>    _alloc_area_size;      // copied from _head
+      std::atomic<uint64_t>    _alloc_area_rotation;  // copied from _head
+      std::atomic<uint64_t>    _grow_to    = 0;  // alloc area size which is mapped but not in use
+      std::atomic<char*>       _mapped_end = nullptr;  // end of the mapped part of the file
+      FILE*                    _cfile      = nullptr;
+      int                      _cfileno;
+      header*                  _head;
+      object_header*           _begin;
+      std::unique_ptr<mapping> _mapping;
    };
 
    inline ring_allocator::swap_position ring_allocator::get_swap_pos() const
@@ -256,6 +483,8 @@ namespace triedent
 
    inline void ring_allocator::ensure_free_space()
    {
+      if (hot()._grow_to.load(std::memory_order_relaxed)) [[unlikely]]
+         apply_growth(hot());
       if (hot()._head->get_free_space() < 16 * 1024 * 1024)
       {
          _try_claim_free();
@@ -270,9 +499,17 @@ namespace triedent
    template <bool CopyToHot>
    std::tuple<char*, node_type, uint16_t> ring_allocator::get_cache(id i)
    {
+      if constexpr (not CopyToHot)
+         if (_read_only) [[unlikely]]
+            return get_cache_read_only(i);
+
       uint16_t ref;
       auto     loc = _obj_ids->get(i, ref);
       auto     obj = _levels[loc.cache]->get_object(loc.offset);
+      _reads[loc.cache].value.fetch_add(1, std::memory_order_relaxed);
+
+      if (loc.offset & compressed_flag) [[unlikely]]
+         return {decompress(obj, CopyToHot), {loc.type}, ref};
 
       if constexpr (not CopyToHot)
          return {obj->data(), {loc.type}, ref};
@@ -288,12 +525,23 @@ namespace triedent
               ref};
    }
 
+   inline std::pair<const char*, node_type> ring_allocator::get_if_in_ram(id i)
+   {
+      uint16_t  ref;
+      auto      loc  = _obj_ids->get(i, ref);
+      node_type type = loc.type;
+      if (loc.cache > warm_cache || (loc.offset & compressed_flag))
+         return {nullptr, type};
+      return {_levels[loc.cache]->get_object(loc.offset)->data(), type};
+   }
+
    inline uint64_t ring_allocator::wait_on_free_space(managed_ring& ring, uint64_t used_size)
    {
       // TRIEDENT_WARN("wait on free space");
+      _free_space_waits.fetch_add(1, std::memory_order_relaxed);
 
       uint64_t max_contig = 0;
-      while ((ring._head->get_potential_free_space()) < used_size)
+      while ((ring.get_potential_free_space()) < used_size)
       {
          // TRIEDENT_WARN("WAITING ON FREE SPACE: level: ", ring.level);
          using namespace std::chrono_literals;
@@ -309,7 +557,7 @@ namespace triedent
 
       if (max_contig < used_size)
       {
-         while ((ring._head->get_potential_free_space()) > used_size)
+         while ((ring.get_potential_free_space()) > used_size)
          {
             _try_claim_free();
             if (ring.get_free_space() < used_size)
@@ -321,7 +569,7 @@ namespace triedent
                              " max c: ", max_contig,
                              " delta: ", ring._head->end_free_p.load() - ring._head->alloc_p.load(),
                              " swap p: ", ring._head->swap_p.load(),
-                             " pot fre: ", ring._head->get_potential_free_space(),
+                             " pot fre: ", ring.get_potential_free_space(),
                              " free: ", ring._head->get_free_space());
                dump();
 
@@ -351,7 +599,23 @@ namespace triedent
    inline char* ring_allocator::alloc(managed_ring&        ring,
                                       const location_lock& lock,
                                       uint32_t             num_bytes,
-                                      char*                data)
+                                      char*                data,
+                                      bool                 compressed)
+   {
+      return alloc_with(ring, lock, num_bytes, compressed,
+                        [&](char* dest)
+                        {
+                           if (data)
+                              memcpy(dest, data, num_bytes);
+                        });
+   }
+
+   template <typename F>
+   char* ring_allocator::alloc_with(managed_ring&        ring,
+                                    const location_lock& lock,
+                                    uint32_t             num_bytes,
+                                    bool                 compressed,
+                                    F&&                  fill)
    {
       uint32_t round_size = (num_bytes + 7) & -8;  // data padding
       uint64_t used_size  = round_size + sizeof(object_header);
@@ -367,11 +631,10 @@ namespace triedent
       auto  ap  = alp.load();
       alp.store(ap + used_size);
       cur->set(lock.get_id(), num_bytes);
+      fill(cur->data());
 
-      if (data)
-         memcpy(cur->data(), data, num_bytes);
-
-      _obj_ids->move(lock, ring.level, (char*)cur - ring.begin_pos());
+      _obj_ids->move(lock, ring.level,
+                     ((char*)cur - ring.begin_pos()) | (compressed ? compressed_flag : 0));
       return cur->data();
    }
 
@@ -384,7 +647,7 @@ namespace triedent
       {
          uint64_t sp             = from->_head->swap_p.load();
          uint64_t ap             = from->_head->alloc_p.load();
-         auto     maxs           = from->_head->alloc_area_size;
+         auto     maxs           = from->_alloc_area_size.load();
          auto     potential_free = sp + maxs - ap;
          uint64_t target = 1024 * 1024 * 40ull;  //maxs / 32;  // target a certain amount free
 
@@ -396,11 +659,14 @@ namespace triedent
             return false;
 
          uint64_t bytes_freed = 0;
+         uint64_t bytes_moved = 0;
 
-         auto beg    = (char*)from->_head->begin.get();
-         auto msk    = from->_head->alloc_area_mask;
-         auto to_obj = [beg, msk](auto p)
-         { return reinterpret_cast<object_header*>(beg + (p & msk)); };
+         // Loaded after ap, so they cover any position up to ap
+         auto beg    = from->begin_pos();
+         auto msk    = from->_alloc_area_mask.load(std::memory_order_acquire);
+         auto rot    = from->_alloc_area_rotation.load(std::memory_order_relaxed);
+         auto to_obj = [beg, msk, rot](auto p)
+         { return reinterpret_cast<object_header*>(beg + ((p + rot) & msk)); };
 
          auto p   = sp;
          auto end = std::min<uint64_t>(ap, p + bytes);
@@ -420,14 +686,28 @@ namespace triedent
                if (ref != 0 && loc.cache == from->level && from->get_object(loc.offset) == o)
                {
                   if (auto lock = _obj_ids->try_lock({.id = o->id}))
+                  {
+                     // The id may have been released and reused since loc was read
+                     if (_obj_ids->get(id{o->id}, ref) != loc)
+                     {
+                        p += o->data_capacity() + 8;
+                        continue;
+                     }
                      // TODO: don't wait on free space
-                     alloc(*to, *lock, o->size, o->data());
+                     bool compressed = loc.offset & compressed_flag;
+                     if (compressed || to->level < cool_cache || loc.type != node_type::bytes ||
+                         !_compress.load(std::memory_order_relaxed) ||
+                         !try_compress(*to, *lock, o))
+                        alloc(*to, *lock, o->size, o->data(), compressed);
+                     bytes_moved += o->size;
+                  }
                   else
                      break;
                }
                p += o->data_capacity() + 8;
             }
          }
+         _swapped_bytes[from->level].fetch_add(bytes_moved, std::memory_order_relaxed);
          if (p != sp)
          {
             from->_head->swap_p.store(p);
@@ -436,6 +716,11 @@ namespace triedent
          return false;
       };
 
+      // The swap thread is the only one which allocates in the lower levels
+      for (auto* ring : {&warm(), &cool(), &cold()})
+         if (ring->_grow_to.load(std::memory_order_relaxed)) [[unlikely]]
+            apply_growth(*ring);
+
       bool did_work = false;
       did_work |= do_swap(&hot(), &warm());
       did_work |= do_swap(&warm(), &cool());
@@ -451,15 +736,52 @@ namespace triedent
       auto claim = [this](auto& ring, uint64_t mp)
       {
          // TODO: load relaxed and store relaxed if swapping is being managed by another thread
-         ring._head->end_free_p.store(ring._head->alloc_area_size +
+         ring._head->end_free_p.store(ring._alloc_area_size.load() +
                                       std::min<uint64_t>(ring._head->swap_p.load(), mp));
       };
+      std::lock_guard lock{_claim_mutex};
       claim(hot(), sp._swap_pos[0]);
       claim(warm(), sp._swap_pos[1]);
       claim(cool(), sp._swap_pos[2]);
       claim(cold(), sp._swap_pos[3]);
    }
 
+   // Positions from end_free_p - size up to alloc_p hold objects which may
+   // still be read, so their offsets can't change. The new area starts where
+   // the current one ends, so that's only possible while those positions
+   // don't wrap around. Rotating the larger area puts the start of their
+   // pass around the current area at offset 0. Every other position is free.
+   inline void ring_allocator::apply_growth(managed_ring& ring)
+   {
+      std::lock_guard lock{_claim_mutex};
+
+      auto& head     = *ring._head;
+      auto  new_size = ring._grow_to.load();
+      auto  size     = ring._alloc_area_size.load();
+      auto  rot      = ring._alloc_area_rotation.load();
+      auto  first    = head.end_free_p.load() - size;
+      auto  ap       = head.alloc_p.load();
+      auto  last     = ap > first ? ap - 1 : first;
+      if (((first + rot) ^ (last + rot)) & ~(size - 1))
+         return;
+
+      auto new_rot = rot - ((first + rot) & (new_size - 1) & ~(size - 1));
+
+      head.next_rotation       = new_rot;
+      head.alloc_area_size     = new_size;
+      head.alloc_area_mask     = new_size - 1;
+      head.alloc_area_rotation = new_rot;
+      head.end                 = reinterpret_cast<object_header*>(ring.begin_pos() + new_size);
+
+      ring._alloc_area_rotation.store(new_rot);
+      ring._alloc_area_mask.store(new_size - 1);
+      ring._alloc_area_size.store(new_size);
+      head.end_free_p.store(first + new_size);
+
+      // grow() may have asked for more in the meantime
+      ring._grow_to.compare_exchange_strong(new_size, 0);
+   }
+
    inline void ring_allocator::dangerous_retain(id i)
    {
       _obj_ids->dangerous_retain(i);
@@ -482,6 +804,7 @@ namespace triedent
 
       auto lock = _obj_ids->alloc(type);
       auto ptr  = alloc(hot(), lock, num_bytes);
+      _num_allocs.fetch_add(1, std::memory_order_relaxed);
       return {std::move(lock), ptr};
    }
    inline void ring_allocator::validate()
@@ -0,0 +1,80 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <triedent/key6.hpp>
+
+using namespace triedent;
+
+using kernel = void (*)(const uint8_t*, const uint8_t*, uint8_t*);
+
+// Converts about 256 MB of keys of the given size and returns the rate in MB/s of input
+double bench(kernel k, const std::vector<uint8_t>& in, std::vector<uint8_t>& out, uint32_t size,
+             uint32_t out_size)
+{
+   const uint64_t total  = 256 * 1024 * 1024;
+   const uint32_t n_keys = in.size() / size;
+   uint64_t       done   = 0;
+
+   auto start = std::chrono::steady_clock::now();
+   while (done < total)
+   {
+      for (uint32_t i = 0; i < n_keys; ++i)
+         k(in.data() + i * size, in.data() + (i + 1) * size, out.data() + i * out_size);
+      done += uint64_t(n_keys) * size;
+   }
+   auto end = std::chrono::steady_clock::now();
+   // Keep the compiler from discarding the work
+   volatile uint8_t sink = out[out.size() / 2];
+   (void)sink;
+   return done / 1e6 / std::chrono::duration<double>(end - start).count();
+}
+
+int main()
+{
+   struct variant
+   {
+      const char* name;
+      kernel      encode;
+      kernel      decode;
+   };
+   std::vector<variant> variants{
+       {"bytewise", encode_key6_bytewise, decode_key6_bytewise},
+       {"swar", encode_key6_swar, decode_key6_swar},
+   };
+#if TRIEDENT_KEY6_BMI2
+   if (__builtin_cpu_supports("bmi2"))
+      variants.push_back({"bmi2", encode_key6_bmi2, decode_key6_bmi2});
+#endif
+   std::cout << "encode_key6/decode_key6 use " << (key6_use_bmi2 ? "bmi2" : "swar") << "\n";
+
+   std::mt19937         gen(0);
+   std::vector<uint8_t> key8(64 * 1024);
+   for (auto& b : key8)
+      b = gen();
+   std::vector<uint8_t> key6(key8.size() * 2);
+
+   std::cout << "MB/s of input\n";
+   std::cout << std::setw(6) << "size";
+   for (auto& v : variants)
+      std::cout << std::setw(14) << (std::string("enc ") + v.name) << std::setw(14)
+                << (std::string("dec ") + v.name);
+   std::cout << "\n";
+
+   for (uint32_t size : {6u, 12u, 24u, 48u, 96u, 192u, 384u})
+   {
+      // Pack the symbols of each key without gaps, so decoding sees the same layout
+      uint32_t size6 = key6_size(size);
+      std::cout << std::setw(6) << size;
+      for (auto& v : variants)
+      {
+         std::cout << std::setw(14) << std::fixed << std::setprecision(0)
+                   << bench(v.encode, key8, key6, size, size6);
+         std::vector<uint8_t> symbols(key6.begin(), key6.begin() + key8.size() / size * size6);
+         std::cout << std::setw(14) << bench(v.decode, symbols, key8, size6, size);
+      }
+      std::cout << "\n";
+   }
+}
@@ -3,8 +3,14 @@
 
 #include <bit>
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 namespace triedent
 {
+   thread_local uint32_t                             ring_allocator::_read_depth = 0;
+   thread_local std::vector<std::unique_ptr<char[]>> ring_allocator::_decoded;
+
    managed_ring::header::header(uint64_t s)
    {
       if (s > 38)
@@ -25,10 +31,12 @@ namespace triedent
       end_free_p      = alloc_area_size;
    }
 
-   managed_ring::managed_ring(std::filesystem::path            filename,
-                              ring_allocator::cache_level_type lev,
-                              bool                             pin,
-                              bool                             allow_slow)
+   managed_ring::managed_ring(std::filesystem::path                filename,
+                              ring_allocator::cache_level_type     lev,
+                              bool                                 writable,
+                              bool                                 pin,
+                              bool                                 allow_slow,
+                              const ring_allocator::memory_config& mem)
        : level(lev)
    {
       if (not std::filesystem::exists(filename))
@@ -44,14 +52,32 @@ namespace triedent
          throw std::runtime_error("file has invalid size: " + filename.generic_string());
       }
 
-      _file_map.reset(new bip::file_mapping(filename.generic_string().c_str(), bip::read_write));
-      _map_region.reset(new bip::mapped_region(*_file_map, bip::read_write));
+      _mapping = std::make_unique<mapping>(filename, writable, header_size + max_reserved_size);
+
+      _head  = (header*)_mapping->data();
+      _begin = _head->begin.get();
+      _mapped_end.store(_mapping->data() + _mapping->size());
+
+      if (mem.huge_pages)
+         huge_pages = _mapping->use_huge_pages();
 
-      _head = (header*)_map_region->get_address();
+      // Faulting in before mlock lets the caller see progress; mlock would
+      // otherwise fault the whole ring in without a word
+      if (mem.prefault)
+         _mapping->prefault(
+             [&](uint64_t done, uint64_t total)
+             {
+                if (mem.progress)
+                   mem.progress(lev, done, total);
+             });
+
+      // A reader only needs the objects; the allocation state belongs to the writer
+      if (!writable)
+         return;
 
       if (pin)
       {
-         if (mlock(_map_region->get_address(), file_size) < 0)
+         if (!_mapping->pin())
             if (!allow_slow)
                throw std::runtime_error(
                    "unable to lock memory for " + filename.generic_string() +
@@ -61,9 +87,20 @@ namespace triedent
                    "then try using psinode's \"--slow\" option.");
             else
                _slow = true;
+         _pinned = !_slow;
       }
-      _begin = _head->begin.get();
-      _end   = _head->end.get();
+      _head->recover();
+      _head->size = file_size;
+
+      // grow() extends the file before the ring starts using the new space
+      if (data_size < _head->alloc_area_size)
+         throw std::runtime_error("file has invalid size: " + filename.generic_string());
+      if (data_size > _head->alloc_area_size)
+         _grow_to = data_size;
+
+      _alloc_area_mask     = _head->alloc_area_mask;
+      _alloc_area_size     = _head->alloc_area_size;
+      _alloc_area_rotation = _head->alloc_area_rotation;
    }
    void managed_ring::create(std::filesystem::path filename, uint8_t logsize)
    {
@@ -91,6 +128,32 @@ namespace triedent
       new ((char*)mr.get_address()) header(logsize);
    }
 
+   void managed_ring::grow(uint8_t logsize)
+   {
+      if (logsize > 38)
+         throw std::runtime_error("max rig size level = 38 or 2^40 bytes");
+
+      auto header_size = ((sizeof(managed_ring::header) + 7) & -8);
+      auto data_size   = 1ull << logsize;
+      if (header_size + data_size <= _mapping->size())
+         return;
+
+      _mapping->grow(header_size + data_size);
+      _mapped_end.store(_mapping->data() + _mapping->size());
+      _head->size = header_size + data_size;
+      _grow_to.store(data_size);
+   }
+
+   void managed_ring::header::recover()
+   {
+      if (alloc_area_mask + 1 != alloc_area_size)
+      {
+         alloc_area_mask     = alloc_area_size - 1;
+         alloc_area_rotation = next_rotation;
+      }
+      end = reinterpret_cast<object_header*>((char*)begin.get() + alloc_area_size);
+   }
+
    void managed_ring::header::update_size(uint64_t new_size)
    {
       // TRIEDENT_WARN("new size: ", new_size, "  cur size: ", size);
@@ -102,15 +165,32 @@ namespace triedent
    }
 
    ring_allocator::ring_allocator(std::filesystem::path dir, access_mode mode, bool allow_slow)
+       : ring_allocator(std::move(dir), mode, allow_slow, memory_config{})
+   {
+   }
+
+   ring_allocator::ring_allocator(std::filesystem::path dir,
+                                  access_mode           mode,
+                                  bool                  allow_slow,
+                                  const memory_config&  mem)
+       : _read_only(mode == read_only)
    {
       _try_claim_free = [&]() { claim_free(); };
 
-      _obj_ids = std::make_unique<object_db>(dir / "obj_ids", mode == read_write, allow_slow);
+      // Pinning is the writer's job. A reader shares its pages.
+      bool w   = !_read_only;
+      _obj_ids = std::make_unique<object_db>(dir / "obj_ids", w, allow_slow);
+
+      _levels[hot_cache].reset(new managed_ring(dir / "hot", hot_cache, w, w, allow_slow, mem));
+      _levels[warm_cache].reset(new managed_ring(dir / "warm", warm_cache, w, w, allow_slow, mem));
+      _levels[cool_cache].reset(new managed_ring(dir / "cool", cool_cache, w, w, allow_slow));
+      _levels[cold_cache].reset(new managed_ring(dir / "cold", cold_cache, w, false, allow_slow));
 
-      _levels[hot_cache].reset(new managed_ring(dir / "hot", hot_cache, true, allow_slow));
-      _levels[warm_cache].reset(new managed_ring(dir / "warm", warm_cache, true, allow_slow));
-      _levels[cool_cache].reset(new managed_ring(dir / "cool", cool_cache, true, allow_slow));
-      _levels[cold_cache].reset(new managed_ring(dir / "cold", cold_cache, false, allow_slow));
+      // Objects only move in the writer's process
+      if (_read_only)
+         return;
+
+      _obj_ids->open_hashes(dir / "hashes");
 
       _swap_thread = std::make_unique<std::thread>(
           [this]()
@@ -120,6 +200,48 @@ namespace triedent
           });
    }
 
+   void ring_allocator::grow(const config& cfg)
+   {
+      std::lock_guard lock{_grow_mutex};
+      _obj_ids->grow(cfg.max_ids);
+      hot().grow(cfg.hot_pages);
+      warm().grow(cfg.warm_pages);
+      cool().grow(cfg.cool_pages);
+      cold().grow(cfg.cold_pages);
+   }
+
+   void ring_allocator::follow_growth()
+   {
+      std::lock_guard lock{_grow_mutex};
+      _obj_ids->follow_growth();
+      for (auto& ring : _levels)
+      {
+         ring->_mapping->follow();
+         ring->_mapped_end.store(ring->_mapping->data() + ring->_mapping->size());
+      }
+   }
+
+   std::tuple<char*, node_type, uint16_t> ring_allocator::get_cache_read_only(id i)
+   {
+      // The writer may have grown the files since they were mapped. Objects
+      // which the caller may read can't be in space that the writer hasn't
+      // created yet, so mapping the current size of the files is enough.
+      if (!_obj_ids->is_mapped(i)) [[unlikely]]
+         follow_growth();
+      uint16_t ref;
+      auto     loc  = _obj_ids->get(i, ref);
+      auto&    ring = *_levels[loc.cache];
+      auto     obj  = ring.get_object(loc.offset);
+      if (!ring.is_mapped(obj, sizeof(object_header)) ||
+          !ring.is_mapped(obj, sizeof(object_header) + obj->size)) [[unlikely]]
+         follow_growth();
+      _reads[loc.cache].value.fetch_add(1, std::memory_order_relaxed);
+
+      if (loc.offset & compressed_flag) [[unlikely]]
+         return {decompress(obj, false), {loc.type}, ref};
+      return {obj->data(), {loc.type}, ref};
+   }
+
    void ring_allocator::create(std::filesystem::path dir, config cfg)
    {
       if (std::filesystem::exists(dir))
@@ -205,7 +327,7 @@ namespace triedent
       auto to_obj = [&](auto p)
       {
          return reinterpret_cast<object_header*>(((char*)_head->begin.get()) +
-                                                 (p & _head->alloc_area_mask));
+                                                 _head->offset_of(p));
       };
 
       assert(_head->get_swap_pos() == to_obj(sp));
@@ -267,6 +389,165 @@ namespace triedent
       _head->validate();
    }
 
+   // Compressed objects hold the uncompressed size followed by the compressed data.
+   // Returns false if compression doesn't save enough to be worth decoding later.
+   bool ring_allocator::try_compress(managed_ring& to, const location_lock& lock, object_header* o)
+   {
+      if (o->size < min_compress_size)
+         return false;
+
+      // Only the swap thread compresses
+      static thread_local std::vector<char> buffer;
+      buffer.resize(sizeof(uint32_t) + o->size);
+      uint32_t size = o->size;
+      memcpy(buffer.data(), &size, sizeof(size));
+
+      // Require a saving of at least 1/8, and at least one 8-byte unit of storage
+      uint32_t capacity        = std::min(size - size / 8, size - 8) - sizeof(uint32_t);
+      auto     compressed_size = compress_block(o->data(), size, buffer.data() + sizeof(uint32_t),
+                                                capacity);
+      if (!compressed_size)
+      {
+         _incompressible_objects.fetch_add(1, std::memory_order_relaxed);
+         return false;
+      }
+      compressed_size += sizeof(uint32_t);
+      alloc(to, lock, compressed_size, buffer.data(), true);
+
+      _compressed_objects.fetch_add(1, std::memory_order_relaxed);
+      _compressed_input_bytes.fetch_add(size, std::memory_order_relaxed);
+      _compressed_output_bytes.fetch_add(compressed_size, std::memory_order_relaxed);
+      return true;
+   }
+
+   char* ring_allocator::decompress(object_header* o, bool copy_to_hot)
+   {
+      auto     start = std::chrono::steady_clock::now();
+      uint32_t size;
+      memcpy(&size, o->data(), sizeof(size));
+      auto decode = [&](char* dest)
+      {
+         if (!decompress_block(o->data() + sizeof(size), o->size - sizeof(size), dest, size))
+            throw std::runtime_error("corrupt compressed object: " + std::to_string(o->id));
+      };
+
+      char* result;
+      if (copy_to_hot)
+         result = alloc_with(hot(), _obj_ids->spin_lock({.id = o->id}), size, false, decode);
+      else
+      {
+         // The node accessors find the data size in the object header, so the
+         // buffer needs one too
+         auto& buffer = _decoded.emplace_back(new char[sizeof(object_header) + size]);
+         auto  header = reinterpret_cast<object_header*>(buffer.get());
+         header->set({.id = o->id}, size);
+         decode(header->data());
+         result = header->data();
+      }
+
+      _decompressed_objects.fetch_add(1, std::memory_order_relaxed);
+      _decompress_nanoseconds.fetch_add(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                               start)
+              .count(),
+          std::memory_order_relaxed);
+      return result;
+   }
+
+   std::string ring_allocator::check(id i, uint32_t& size)
+   {
+      if (auto err = _obj_ids->check(i); !err.empty())
+         return err;
+
+      uint16_t ref;
+      auto     loc  = _obj_ids->get(i, ref);
+      auto&    ring = *_levels[loc.cache];
+      if (loc.offset & 7 & ~compressed_flag)
+         return "object " + std::to_string(i.id) + " has a misaligned location";
+
+      auto obj = ring.get_object(loc.offset);
+      if (!ring.is_mapped(obj, sizeof(object_header)) ||
+          !ring.is_mapped(obj, sizeof(object_header) + obj->data_capacity()))
+         return "object " + std::to_string(i.id) + " is located outside of its ring";
+      if (obj->id != i.id)
+         return "object " + std::to_string(i.id) + " is located at the header of object " +
+                std::to_string(obj->id);
+      if (obj->is_free_area())
+         return "object " + std::to_string(i.id) + " is located in free space";
+
+      size = obj->size;
+      return {};
+   }
+
+   void ring_allocator::prefetch(std::span<const object_id> ids)
+   {
+      static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+      uint64_t prev_page = 0;
+      for (auto i : ids)
+      {
+         // A reader skips ids which the writer added after it last followed growth
+         if (!_obj_ids->is_mapped(i))
+            continue;
+         uint16_t ref;
+         auto     loc  = _obj_ids->get(i, ref);
+         auto&    ring = *_levels[loc.cache];
+         if (ring._pinned || !ref)
+            continue;
+
+         // The object's size is in its header, which is what we're trying to avoid
+         // faulting in. Most objects are much smaller than a page, so asking for
+         // the page it starts on and the next one covers nearly all of them.
+         auto region_end = reinterpret_cast<uint64_t>(ring._mapped_end.load());
+         auto page = reinterpret_cast<uint64_t>(ring.get_object(loc.offset)) & ~(page_size - 1);
+         if (page == prev_page || page >= region_end)
+            continue;
+         prev_page = page;
+         madvise(reinterpret_cast<void*>(page), std::min(2 * page_size, region_end - page),
+                 MADV_WILLNEED);
+      }
+   }
+
+   ring_allocator::stats ring_allocator::get_stats()
+   {
+      std::lock_guard lock{_stats_mutex};
+      auto            now     = std::chrono::steady_clock::now();
+      auto            seconds = std::chrono::duration<double>(now - _stats_time).count();
+      _stats_time             = now;
+
+      stats    result;
+      uint64_t lower_reads = 0;
+      for (int i = 3; i >= 0; --i)
+      {
+         auto& head  = *_levels[i]->_head;
+         auto& level = result.levels[i];
+
+         // Loaded in this order so that sp <= ap <= end_free_p, and so that
+         // growing the ring can't make used negative
+         auto sp   = head.swap_p.load();
+         auto ap   = head.alloc_p.load();
+         auto ep   = head.end_free_p.load();
+         auto size = _levels[i]->_alloc_area_size.load();
+
+         level.capacity      = size;
+         level.free          = ep - ap;
+         level.used          = level.capacity - level.free;
+         level.swap_lag      = ap - sp;
+         level.hits          = _reads[i].value.load(std::memory_order_relaxed);
+         level.misses        = lower_reads;
+         level.swapped_bytes = _swapped_bytes[i].load(std::memory_order_relaxed);
+         level.huge_pages    = _levels[i]->huge_pages;
+         if (seconds > 0)
+            level.swap_bytes_per_sec = (level.swapped_bytes - _stats_swapped_bytes[i]) / seconds;
+         _stats_swapped_bytes[i] = level.swapped_bytes;
+         lower_reads += level.hits;
+      }
+      result.used_ids         = _obj_ids->num_used_ids();
+      result.max_ids          = _obj_ids->max_ids();
+      result.free_space_waits = _free_space_waits.load(std::memory_order_relaxed);
+      return result;
+   }
+
    void ring_allocator::dump(bool detail)
    {
       std::cerr << std::setw(10) << std::left << " Level";
@@ -304,7 +585,7 @@ namespace triedent
          auto to_obj = [&](auto p)
          {
             return reinterpret_cast<object_header*>(((char*)r._head->begin.get()) +
-                                                    (p & r._head->alloc_area_mask));
+                                                    r._head->offset_of(p));
          };
          auto last_sp = sp;
          while (sp < ap)
@@ -384,6 +665,18 @@ namespace triedent
       print_level("cool", cool());
       print_level("cold", cold());
 
+      if (auto n = _compressed_objects.load())
+      {
+         auto in  = _compressed_input_bytes.load();
+         auto out = _compressed_output_bytes.load();
+         std::cerr << "compressed: " << n << " objects " << data_size(in) << " ->" << data_size(out)
+                   << " ratio: " << double(in) / out
+                   << "  incompressible: " << _incompressible_objects.load() << std::endl;
+      }
+      if (auto n = _decompressed_objects.load())
+         std::cerr << "decompressed: " << n << " objects  avg latency: "
+                   << _decompress_nanoseconds.load() / n << " ns" << std::endl;
+
       _obj_ids->print_stats();
 
       std::cerr << "============= HOT " << &hot() << " ================== \n";
@@ -57,6 +57,58 @@ TEST_CASE("key round trip")
    }
 }
 
+TEST_CASE("key6 kernels")
+{
+   static std::mt19937  gen(0);
+   std::vector<uint8_t> data(4096);
+   for (auto& b : data)
+      b = gen();
+
+   using kernel = void (*)(const uint8_t*, const uint8_t*, uint8_t*);
+   std::vector<std::pair<kernel, kernel>> kernels{{encode_key6_swar, decode_key6_swar}};
+#if TRIEDENT_KEY6_BMI2
+   if (__builtin_cpu_supports("bmi2"))
+      kernels.push_back({encode_key6_bmi2, decode_key6_bmi2});
+#endif
+
+   for (uint32_t i = 0; i < 10000; ++i)
+   {
+      auto offset = gen() % 2096;
+      auto size   = i < 64 ? i : gen() % 255;
+      auto in     = data.data() + offset;
+
+      std::vector<uint8_t> expected6(key6_size(size));
+      encode_key6_bytewise(in, in + size, expected6.data());
+      std::vector<uint8_t> expected8(key8_size(expected6.size()));
+      decode_key6_bytewise(expected6.data(), expected6.data() + expected6.size(),
+                           expected8.data());
+      REQUIRE(std::ranges::equal(expected8, std::span{in, size}));
+
+      for (auto [encode, decode] : kernels)
+      {
+         std::vector<uint8_t> k6(expected6.size());
+         encode(in, in + size, k6.data());
+         REQUIRE(k6 == expected6);
+         std::vector<uint8_t> k8(expected8.size());
+         decode(k6.data(), k6.data() + k6.size(), k8.data());
+         REQUIRE(k8 == expected8);
+      }
+
+      // Symbol strings which don't come from a whole number of bytes
+      std::vector<uint8_t> symbols(size);
+      for (auto& s : symbols)
+         s = gen() & 0x3f;
+      std::vector<uint8_t> expected(key8_size(size));
+      decode_key6_bytewise(symbols.data(), symbols.data() + size, expected.data());
+      for (auto [encode, decode] : kernels)
+      {
+         std::vector<uint8_t> k8(expected.size());
+         decode(symbols.data(), symbols.data() + size, k8.data());
+         REQUIRE(k8 == expected);
+      }
+   }
+}
+
 TEST_CASE("accidental inner removal")
 {
    // regression check: a missing compare caused a non-matching key to be removed
@@ -75,3 +127,1100 @@ TEST_CASE("accidental inner removal")
    REQUIRE(osv(session->get(root, {"\x00\x01\x03", 3})) ==
            std::optional{std::string_view{"value 2"}});
 }
+
+TEST_CASE("iterator")
+{
+   auto db      = createDb();
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+
+   // Short keys over a small alphabet produce many keys which are
+   // prefixes of other keys, which exercises values stored on inner nodes.
+   std::mt19937                       gen(0);
+   std::map<std::string, std::string> expected;
+   auto                               random_key = [&]
+   {
+      std::string key(gen() % 5, 0);
+      for (auto& ch : key)
+         ch = "\x00\x01\x7f\x80\xff"[gen() % 5];
+      return key;
+   };
+   for (int i = 0; i < 1000; ++i)
+   {
+      auto key   = random_key();
+      auto value = std::to_string(i);
+      session->upsert(root, key, value);
+      expected[key] = value;
+   }
+
+   auto as_string = [](const std::vector<char>& v) { return std::string(v.data(), v.size()); };
+
+   auto it = session->first(root);
+   for (auto& [k, v] : expected)
+   {
+      REQUIRE(it.valid());
+      REQUIRE(as_string(it.key()) == k);
+      REQUIRE(as_string(it.value()) == v);
+      ++it;
+   }
+   REQUIRE(!it.valid());
+
+   it = session->last(root);
+   for (auto pos = expected.rbegin(); pos != expected.rend(); ++pos)
+   {
+      REQUIRE(it.valid());
+      REQUIRE(as_string(it.key()) == pos->first);
+      --it;
+   }
+   REQUIRE(!it.valid());
+   --it;
+   REQUIRE(as_string(it.key()) == expected.rbegin()->first);
+
+   for (int i = 0; i < 1000; ++i)
+   {
+      auto key = random_key();
+      auto pos = expected.lower_bound(key);
+      it.seek(key);
+      REQUIRE(it.valid() == (pos != expected.end()));
+      if (pos != expected.end())
+      {
+         REQUIRE(as_string(it.key()) == pos->first);
+         if (pos != expected.begin())
+         {
+            --it;
+            REQUIRE(as_string(it.key()) == std::prev(pos)->first);
+         }
+      }
+      REQUIRE(session->find(root, key).valid() == expected.contains(key));
+   }
+
+   // Prefetching must not change the results
+   session->set_prefetch(true);
+   it = session->first(root);
+   std::vector<char> key;
+   for (auto& [k, v] : expected)
+   {
+      REQUIRE(as_string(it.key()) == k);
+      REQUIRE(session->get_greater_equal(root, key, &key, nullptr, nullptr));
+      REQUIRE(as_string(key) == k);
+      key.push_back(0);
+      ++it;
+   }
+   REQUIRE(!it.valid());
+}
+
+TEST_CASE("get with visitor")
+{
+   auto db      = createDb();
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+   for (int i = 0; i < 100; ++i)
+   {
+      auto key = std::to_string(i * 10);
+      session->upsert(root, key, "value " + key);
+   }
+
+   auto as_string = [](std::span<const char> s) { return std::string(s.data(), s.size()); };
+
+   std::string value;
+   REQUIRE(session->get(root, std::string_view{"250"},
+                        [&](std::span<const char> v) { value = as_string(v); }));
+   REQUIRE(value == "value 250");
+   REQUIRE(!session->get(root, std::string_view{"251"}, [&](std::span<const char>) {}));
+
+   std::string key;
+   auto        visit = [&](std::span<const char> k, std::span<const char> v)
+   {
+      key   = as_string(k);
+      value = as_string(v);
+   };
+   for (std::string_view probe : {"", "251", "5", "99"})
+   {
+      std::vector<char> expected_key, expected_value;
+      REQUIRE(session->get_greater_equal(root, probe, visit) ==
+              session->get_greater_equal(root, probe, &expected_key, &expected_value, nullptr));
+      REQUIRE(key == as_string(expected_key));
+      REQUIRE(value == as_string(expected_value));
+
+      REQUIRE(session->get_less_than(root, probe, visit) ==
+              session->get_less_than(root, probe, &expected_key, &expected_value, nullptr));
+      REQUIRE(key == as_string(expected_key));
+      REQUIRE(value == as_string(expected_value));
+
+      REQUIRE(session->get_max(root, probe, visit) ==
+              session->get_max(root, probe, &expected_key, &expected_value, nullptr));
+      REQUIRE(key == as_string(expected_key));
+      REQUIRE(value == as_string(expected_value));
+   }
+}
+
+TEST_CASE("apply batch")
+{
+   auto db      = createDb();
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+
+   std::mt19937                       gen(0);
+   std::map<std::string, std::string> expected;
+   auto                               random_key = [&]
+   {
+      std::string key(gen() % 5, 0);
+      for (auto& ch : key)
+         ch = "\x00\x01\x7f\x80\xff"[gen() % 5];
+      return key;
+   };
+
+   auto check = [&](const std::shared_ptr<triedent::root>&  r,
+                    const std::map<std::string, std::string>& m)
+   {
+      auto it = session->first(r);
+      for (auto& [k, v] : m)
+      {
+         REQUIRE(it.valid());
+         auto key = it.key();
+         REQUIRE(std::string(key.data(), key.size()) == k);
+         auto value = it.value();
+         REQUIRE(std::string(value.data(), value.size()) == v);
+         ++it;
+      }
+      REQUIRE(!it.valid());
+   };
+
+   for (int round = 0; round < 50; ++round)
+   {
+      // Keep a snapshot of every other round, so that the batch has to copy
+      // shared nodes instead of modifying them in place.
+      std::shared_ptr<triedent::root> snapshot;
+      auto                  snapshot_expected = expected;
+      if (round % 2)
+         snapshot = root;
+
+      std::map<std::string, std::optional<std::string>> ops;
+      for (int i = 0, n = gen() % 40; i < n; ++i)
+      {
+         if (gen() % 3)
+            ops[random_key()] = std::to_string(round * 100 + i);
+         else
+            ops[random_key()] = std::nullopt;
+      }
+
+      std::vector<write_session::batch_entry> batch;
+      for (auto& [k, v] : ops)
+      {
+         if (v)
+         {
+            batch.push_back({k, std::span<const char>{*v}});
+            expected[k] = *v;
+         }
+         else
+         {
+            batch.push_back({k, std::nullopt});
+            expected.erase(k);
+         }
+      }
+      session->apply_batch(root, batch);
+      check(root, expected);
+      if (snapshot)
+         check(snapshot, snapshot_expected);
+   }
+
+   std::vector<write_session::batch_entry> unsorted{{std::string_view{"b"}, std::nullopt},
+                                                    {std::string_view{"a"}, std::nullopt}};
+   REQUIRE_THROWS(session->apply_batch(root, unsorted));
+}
+
+TEST_CASE("hash")
+{
+   auto db      = createDb();
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+   REQUIRE(session->get_hash(root) == node_hash{});
+
+   std::mt19937                       gen(0);
+   std::map<std::string, std::string> expected;
+   auto                               random_key = [&]
+   {
+      std::string key(gen() % 5, 0);
+      for (auto& ch : key)
+         ch = "\x00\x01\x7f\x80\xff"[gen() % 5];
+      return key;
+   };
+
+   // Builds a new tree with the same content in a different order
+   auto rebuild = [&]
+   {
+      std::vector<std::pair<std::string, std::string>> items(expected.begin(), expected.end());
+      std::shuffle(items.begin(), items.end(), gen);
+      std::shared_ptr<triedent::root> r;
+      for (auto& [k, v] : items)
+         session->upsert(r, k, v);
+      return r;
+   };
+
+   std::shared_ptr<triedent::root> snapshot;
+   node_hash                       snapshot_hash{};
+   for (int round = 0; round < 100; ++round)
+   {
+      // Keep a snapshot of every other round, so that the changes copy
+      // shared nodes instead of modifying them in place.
+      if (round % 2)
+      {
+         snapshot      = root;
+         snapshot_hash = session->get_hash(root);
+      }
+      else
+         session->release(snapshot);
+
+      std::map<std::string, std::optional<std::string>> ops;
+      for (int i = 0, n = gen() % 20; i < n; ++i)
+      {
+         if (gen() % 3)
+            ops[random_key()] = std::to_string(round * 100 + i);
+         else
+            ops[random_key()] = std::nullopt;
+      }
+
+      std::vector<write_session::batch_entry> batch;
+      for (auto& [k, v] : ops)
+      {
+         if (v)
+            expected[k] = *v;
+         else
+            expected.erase(k);
+         if (round % 3 == 0)
+            batch.push_back({k, v ? std::optional{std::span<const char>{*v}} : std::nullopt});
+         else if (v)
+            session->upsert(root, k, *v);
+         else
+            session->remove(root, k);
+      }
+      if (!batch.empty())
+         session->apply_batch(root, batch);
+
+      auto hash = session->get_hash(root);
+      REQUIRE(hash == session->get_hash(root));
+      auto other = rebuild();
+      REQUIRE(session->get_hash(other) == hash);
+      session->release(other);
+      if (snapshot)
+         REQUIRE(session->get_hash(snapshot) == snapshot_hash);
+   }
+
+   REQUIRE(session->get_hash(root) != node_hash{});
+   auto before = session->get_hash(root);
+   auto copy   = root;
+   auto key    = expected.begin()->first;
+   session->upsert(root, key, std::string_view{"changed"});
+   REQUIRE(session->get_hash(root) != before);
+   REQUIRE(session->get_hash(copy) == before);
+}
+
+TEST_CASE("hash cache file")
+{
+   std::filesystem::remove_all("testhashes");
+   node_hash h;
+   std::fill(h.begin(), h.end(), 7);
+   {
+      hash_cache cache;
+      REQUIRE(cache.get(1) == nullptr);
+      cache.set(1, h);  // ignored until it's open
+      cache.open("testhashes", 10, 100);
+      REQUIRE(cache.get(1) == nullptr);
+      cache.set(1, h);
+      cache.set(9, h);
+      cache.set(10, h);  // out of range
+      REQUIRE(cache.get(10) == nullptr);
+      cache.grow(20);
+      cache.set(15, h);
+      cache.invalidate(9);
+   }
+   hash_cache cache;
+   cache.open("testhashes", 10, 100);
+   REQUIRE(cache.get(1));
+   REQUIRE(*cache.get(1) == h);
+   REQUIRE(cache.get(9) == nullptr);
+   REQUIRE(cache.get(15));
+   REQUIRE(*cache.get(15) == h);
+   std::filesystem::remove_all("testhashes");
+}
+
+TEST_CASE("hash after reopen")
+{
+   std::map<std::string, std::string> expected;
+   for (int i = 0; i < 1000; ++i)
+      expected[std::to_string(i * 7919 % 1000)] = std::to_string(i);
+
+   node_hash hash;
+   {
+      auto db      = createDb();
+      auto session = db->start_write_session();
+      auto root    = session->get_top_root();
+      for (auto& [k, v] : expected)
+         session->upsert(root, k, v);
+      hash = session->get_hash(root);
+      session->set_top_root(root);
+   }
+   REQUIRE(std::filesystem::file_size("testdb/data/hashes") > 0);
+
+   auto db      = std::make_shared<database>("testdb", database::read_write, true);
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+   REQUIRE(session->get_hash(root) == hash);
+
+   // Freed ids are reused with their old hashes cleared
+   for (int i = 0; i < 1000; i += 3)
+   {
+      session->remove(root, std::to_string(i));
+      expected.erase(std::to_string(i));
+   }
+   for (int i = 0; i < 1000; i += 5)
+   {
+      session->upsert(root, std::to_string(i), std::string_view{"changed"});
+      expected[std::to_string(i)] = "changed";
+   }
+   std::shared_ptr<triedent::root> other;
+   for (auto& [k, v] : expected)
+      session->upsert(other, k, v);
+   REQUIRE(session->get_hash(root) == session->get_hash(other));
+   REQUIRE(session->get_hash(root) != hash);
+}
+
+TEST_CASE("diff")
+{
+   auto db      = createDb();
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+
+   std::mt19937                       gen(0);
+   std::map<std::string, std::string> expected;
+   auto                               random_key = [&]
+   {
+      std::string key(gen() % 5, 0);
+      for (auto& ch : key)
+         ch = "\x00\x01\x7f\x80\xff"[gen() % 5];
+      return key;
+   };
+
+   using change = std::tuple<std::string, std::optional<std::string>, std::optional<std::string>>;
+   auto as_optional = [](std::optional<std::span<const char>> v) -> std::optional<std::string>
+   {
+      if (v)
+         return std::string(v->data(), v->size());
+      return std::nullopt;
+   };
+
+   for (int round = 0; round < 50; ++round)
+   {
+      auto prev          = root;
+      auto prev_expected = expected;
+      for (int i = 0, n = gen() % (round % 5 ? 10 : 200); i < n; ++i)
+      {
+         auto key = random_key();
+         if (gen() % 3)
+         {
+            // Reuse existing values sometimes, so that some writes don't change anything
+            auto value = std::to_string(gen() % 300);
+            session->upsert(root, key, value);
+            expected[key] = value;
+         }
+         else
+         {
+            session->remove(root, key);
+            expected.erase(key);
+         }
+      }
+
+      std::vector<change> expected_changes;
+      for (auto& [k, v] : prev_expected)
+      {
+         auto pos = expected.find(k);
+         if (pos == expected.end())
+            expected_changes.push_back({k, v, std::nullopt});
+         else if (pos->second != v)
+            expected_changes.push_back({k, v, pos->second});
+      }
+      for (auto& [k, v] : expected)
+         if (!prev_expected.contains(k))
+            expected_changes.push_back({k, std::nullopt, v});
+      std::sort(expected_changes.begin(), expected_changes.end(),
+                [](auto& a, auto& b) { return std::get<0>(a) < std::get<0>(b); });
+
+      std::vector<change> changes;
+      session->diff(prev, root,
+                    [&](std::span<const char> key, auto old_value, auto new_value)
+                    {
+                       changes.push_back({std::string(key.data(), key.size()),
+                                          as_optional(old_value), as_optional(new_value)});
+                    });
+      REQUIRE(changes == expected_changes);
+
+      // diff in the other direction reverses every change
+      std::vector<change> reversed;
+      session->diff(root, prev,
+                    [&](std::span<const char> key, auto old_value, auto new_value)
+                    {
+                       reversed.push_back({std::string(key.data(), key.size()),
+                                           as_optional(new_value), as_optional(old_value)});
+                    });
+      REQUIRE(reversed == expected_changes);
+   }
+
+   std::size_t count = 0;
+   session->diff(root, root, [&](auto&&...) { ++count; });
+   REQUIRE(count == 0);
+}
+
+TEST_CASE("compression round trip")
+{
+   std::mt19937 gen(0);
+   for (int i = 0; i < 1000; ++i)
+   {
+      // Mix runs of zeros, repeated names, and random bytes
+      std::string data;
+      auto        size = gen() % 2000;
+      while (data.size() < size)
+      {
+         switch (gen() % 3)
+         {
+            case 0:
+               data.append(gen() % 40, '\0');
+               break;
+            case 1:
+               data.append(std::vector{"alice", "bob", "carol"}[gen() % 3]);
+               break;
+            case 2:
+               for (int j = gen() % 20; j > 0; --j)
+                  data.push_back(gen());
+               break;
+         }
+      }
+
+      std::vector<char> compressed(data.size() + 16);
+      auto compressed_size = compress_block(data.data(), data.size(), compressed.data(),
+                                            compressed.size());
+      REQUIRE(compressed_size != 0);
+      std::string decompressed(data.size(), 'x');
+      REQUIRE(decompress_block(compressed.data(), compressed_size, decompressed.data(),
+                               decompressed.size()));
+      REQUIRE(decompressed == data);
+      REQUIRE(!decompress_block(compressed.data(), compressed_size, decompressed.data(),
+                                decompressed.size() - 1));
+   }
+
+   std::string zeros(4000, '\0');
+   char        out[100];
+   REQUIRE(compress_block(zeros.data(), zeros.size(), out, sizeof(out)) != 0);
+   REQUIRE(compress_block(zeros.data(), zeros.size(), out, 4) == 0);
+}
+
+TEST_CASE("stats")
+{
+   auto db      = createDb();
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+
+   auto initial = db->get_stats();
+   REQUIRE(initial.active_sessions == 1);
+   REQUIRE(initial.max_ids == 10000);
+   REQUIRE(initial.levels[ring_allocator::hot_cache].capacity == 1ull << 30);
+
+   for (int i = 0; i < 100; ++i)
+      session->upsert(root, std::to_string(i), "value");
+   for (int i = 0; i < 100; ++i)
+      REQUIRE(session->get(root, std::to_string(i)).has_value());
+
+   {
+      auto reader = db->start_read_session();
+      auto s      = db->get_stats();
+      REQUIRE(s.active_sessions == 2);
+      REQUIRE(s.used_ids > initial.used_ids);
+      REQUIRE(s.levels[ring_allocator::hot_cache].hits >= 100);
+      REQUIRE(s.levels[ring_allocator::hot_cache].used >
+              initial.levels[ring_allocator::hot_cache].used);
+      for (auto& level : s.levels)
+         REQUIRE(level.used + level.free == level.capacity);
+   }
+
+   root.reset();
+   auto s = db->get_stats();
+   REQUIRE(s.active_sessions == 1);
+   REQUIRE(s.used_ids == initial.used_ids);
+}
+
+TEST_CASE("sessions")
+{
+   auto db      = createDb();
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+
+   for (int i = 0; i < 100; ++i)
+      session->upsert(root, std::to_string(i), "value");
+
+   std::mutex                      mutex;
+   std::shared_ptr<triedent::root> published = root;
+   std::atomic<bool>               done      = false;
+   std::atomic<int>                bad       = 0;
+   std::vector<std::thread>        threads;
+   for (int t = 0; t < 8; ++t)
+      threads.emplace_back(
+          [&]
+          {
+             while (!done)
+             {
+                // Short-lived sessions on many threads, like psinode's HTTP threads
+                auto reader = db->start_read_session();
+                auto r      = [&]
+                {
+                   std::lock_guard lock{mutex};
+                   return published;
+                }();
+                for (int i = 0; i < 100; ++i)
+                   bad += !reader->get(r, std::to_string(i)).has_value();
+             }
+          });
+   for (int i = 0; i < 10000; ++i)
+   {
+      session->upsert(root, std::to_string(i % 100), std::to_string(i));
+      std::lock_guard lock{mutex};
+      published = root;
+   }
+   done = true;
+   for (auto& t : threads)
+      t.join();
+   published.reset();
+   REQUIRE(bad == 0);
+   REQUIRE(db->get_stats().active_sessions == 1);
+}
+
+TEST_CASE("many sessions")
+{
+   auto db      = createDb();
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+   session->upsert(root, "key", "value");
+
+   // More than fit in the first slab of slots
+   std::vector<std::shared_ptr<read_session>> readers;
+   for (int i = 0; i < 1000; ++i)
+      readers.push_back(db->start_read_session());
+   REQUIRE(db->get_stats().active_sessions == 1001);
+   for (auto& reader : readers)
+      REQUIRE(reader->get(root, "key").has_value());
+
+   // Released slots are reused before another slab is added
+   readers.resize(500);
+   for (int i = 0; i < 500; ++i)
+      readers.push_back(db->start_read_session());
+   REQUIRE(db->get_stats().active_sessions == 1001);
+   readers.clear();
+   REQUIRE(db->get_stats().active_sessions == 1);
+}
+
+TEST_CASE("get many")
+{
+   auto db      = createDb();
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+
+   // Includes keys which are prefixes of other keys, and keys which are missing
+   std::mt19937 gen(0);
+   auto         random_key = [&]
+   {
+      std::string key(gen() % 6, 0);
+      for (auto& ch : key)
+         ch = "\x00\x01\x7f\x80\xff"[gen() % 5];
+      return key;
+   };
+   for (int i = 0; i < 1000; ++i)
+      session->upsert(root, random_key(), std::to_string(i));
+
+   for (int round = 0; round < 20; ++round)
+   {
+      std::set<std::string> key_set;
+      for (int i = 0; i < 300; ++i)
+         key_set.insert(random_key());
+      std::vector<std::string>           owned(key_set.begin(), key_set.end());
+      std::vector<std::span<const char>> keys(owned.begin(), owned.end());
+
+      std::vector<std::optional<std::string>> expected;
+      for (auto& key : owned)
+      {
+         auto value = session->get(root, key);
+         expected.push_back(value ? std::optional{std::string(value->begin(), value->end())}
+                                  : std::nullopt);
+      }
+
+      auto reader = db->start_read_session();
+      for (bool prefetch : {false, true})
+      {
+         reader->set_prefetch(prefetch);
+         std::vector<char> arena;
+         auto              result = reader->get_many(root, keys, arena);
+         REQUIRE(result.size() == keys.size());
+         for (size_t i = 0; i < keys.size(); ++i)
+         {
+            auto actual = result[i] ? std::optional{std::string(result[i]->begin(),
+                                                                result[i]->end())}
+                                    : std::nullopt;
+            REQUIRE(actual == expected[i]);
+         }
+      }
+
+      size_t calls = 0;
+      session->get_many(root, keys,
+                        [&](size_t i, std::span<const char> value)
+                        {
+                           REQUIRE(expected[i] == std::string(value.begin(), value.end()));
+                           ++calls;
+                        });
+      std::size_t found = std::ranges::count_if(expected, [](auto& v) { return v.has_value(); });
+      REQUIRE(calls == found);
+   }
+
+   std::vector<std::span<const char>> unsorted{std::string_view{"b"}, std::string_view{"a"}};
+   REQUIRE_THROWS(session->get_many(root, unsorted, [](size_t, std::span<const char>) {}));
+}
+
+TEST_CASE("grow")
+{
+   std::filesystem::remove_all("testdb");
+   database::create("testdb", database::config{
+                                  .max_objects = 1000ull,
+                                  .hot_pages   = 27,
+                                  .warm_pages  = 27,
+                                  .cool_pages  = 27,
+                                  .cold_pages  = 27,
+                              });
+   auto db      = std::make_shared<database>("testdb", database::read_write, true);
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+
+   db->grow({.max_objects = 100000, .hot_pages = 27, .warm_pages = 27, .cool_pages = 27,
+             .cold_pages = 29});
+   REQUIRE(db->get_stats().max_ids == 100000);
+
+   std::mutex                      mutex;
+   std::shared_ptr<triedent::root> published;
+   std::atomic<bool>               done = false;
+   std::atomic<int>                bad  = 0;
+   std::thread                     reader(
+       [&]
+       {
+          while (!done)
+          {
+             auto s = db->start_read_session();
+             auto r = [&]
+             {
+                std::lock_guard lock{mutex};
+                return published;
+             }();
+             for (int i = 0; r && i < 10000; i += 7)
+             {
+                auto v = s->get(r, std::to_string(i));
+                bad += !v || v->size() != 4000 || v->front() != v->back();
+             }
+          }
+       });
+
+   // Each round allocates about 40 MB, so the hot ring wraps before it grows
+   char round = 'a';
+   auto write = [&]
+   {
+      std::string value(4000, round++);
+      for (int i = 0; i < 10000; ++i)
+         session->upsert(root, std::to_string(i), value);
+      std::lock_guard lock{mutex};
+      published = root;
+   };
+   for (int i = 0; i < 5; ++i)
+      write();
+
+   db->grow({.max_objects = 100000, .hot_pages = 28, .warm_pages = 28, .cool_pages = 28,
+             .cold_pages = 30});
+   auto grown = [&]
+   {
+      auto s = db->get_stats();
+      return s.levels[0].capacity == 1ull << 28 && s.levels[1].capacity == 1ull << 28 &&
+             s.levels[2].capacity == 1ull << 28 && s.levels[3].capacity == 1ull << 30;
+   };
+   for (int i = 0; i < 20 && !grown(); ++i)
+      write();
+   REQUIRE(grown());
+   for (int i = 0; i < 5; ++i)
+      write();
+
+   done = true;
+   reader.join();
+   REQUIRE(bad == 0);
+
+   std::string expected(4000, round - 1);
+   for (int i = 0; i < 10000; ++i)
+      REQUIRE(osv(session->get(root, std::to_string(i))) == expected);
+   session->set_top_root(root);
+
+   published.reset();
+   root.reset();
+   session.reset();
+   db.reset();
+
+   db      = std::make_shared<database>("testdb", database::read_write, true);
+   session = db->start_write_session();
+   root    = session->get_top_root();
+   REQUIRE(grown());
+   REQUIRE(db->get_stats().max_ids == 100000);
+   for (int i = 0; i < 10000; ++i)
+      REQUIRE(osv(session->get(root, std::to_string(i))) == expected);
+}
+
+TEST_CASE("replica")
+{
+   std::filesystem::remove_all("testdb");
+   database::create("testdb", database::config{
+                                  .max_objects = 1000ull,
+                                  .hot_pages   = 27,
+                                  .warm_pages  = 27,
+                                  .cool_pages  = 27,
+                                  .cold_pages  = 27,
+                              });
+   auto db      = std::make_shared<database>("testdb", database::read_write, true);
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+
+   // Normally another process
+   auto replica = std::make_shared<database>("testdb", database::read_only, true);
+   REQUIRE_THROWS(replica->start_write_session());
+   REQUIRE(replica->pin_top_root() == nullptr);
+
+   session->upsert(root, std::string("key"), std::string("first"));
+   session->set_top_root(root);
+   auto rs     = replica->start_read_session();
+   auto pinned = replica->pin_top_root();
+   REQUIRE(replica->is_top_root(pinned));
+   REQUIRE(osv(rs->get(pinned, std::string("key"))) == "first");
+
+   // The writer has to keep the old tree while it's pinned
+   session->upsert(root, std::string("key"), std::string("second"));
+   session->set_top_root(root);
+   REQUIRE(!replica->is_top_root(pinned));
+   REQUIRE(db->get_stats().deferred_roots == 1);
+   REQUIRE(db->get_stats().replica_sessions == 1);
+   REQUIRE(osv(rs->get(pinned, std::string("key"))) == "first");
+   pinned = replica->pin_top_root();
+   REQUIRE(osv(rs->get(pinned, std::string("key"))) == "second");
+   session->set_top_root(root);
+   pinned.reset();
+   session->upsert(root, std::string("key"), std::string("third"));
+   session->set_top_root(root);
+   REQUIRE(db->get_stats().deferred_roots == 0);
+   rs.reset();
+
+   // Every published revision has the same value under every key. The writer
+   // grows the files after the replica opened them, so the replica has to map
+   // the new space.
+   std::atomic<bool> done           = false;
+   std::atomic<int>  bad            = 0;
+   std::atomic<int>  revisions_seen = 0;
+   std::thread       reader(
+       [&]
+       {
+          auto s = replica->start_read_session();
+          while (!done)
+          {
+             auto r = replica->pin_top_root();
+             ++revisions_seen;
+             auto first = s->get(r, std::string("0"));
+             for (int i = 0; first && i < 2000; i += 7)
+             {
+                auto v = s->get(r, std::to_string(i));
+                bad += !v || *v != *first;
+             }
+          }
+       });
+
+   char round = 'a';
+   auto write = [&]
+   {
+      std::string value(1000, round++);
+      for (int i = 0; i < 2000; ++i)
+         session->upsert(root, std::to_string(i), value);
+      session->set_top_root(root);
+   };
+   db->grow({.max_objects = 100000, .hot_pages = 28, .warm_pages = 28, .cool_pages = 28,
+             .cold_pages = 29});
+   for (int i = 0; i < 20; ++i)
+      write();
+
+   done = true;
+   reader.join();
+   REQUIRE(bad == 0);
+   REQUIRE(revisions_seen > 0);
+
+   write();
+   REQUIRE(db->get_stats().deferred_roots == 0);
+   REQUIRE(db->get_stats().replica_sessions == 0);
+}
+
+TEST_CASE("prefault")
+{
+   std::filesystem::remove_all("testdb");
+   database::create("testdb", database::config{
+                                  .max_objects = 10000ull,
+                                  .hot_pages   = 27,
+                                  .warm_pages  = 27,
+                                  .cool_pages  = 27,
+                                  .cold_pages  = 27,
+                              });
+   {
+      auto db      = std::make_shared<database>("testdb", database::read_write, true);
+      auto session = db->start_write_session();
+      auto root    = session->get_top_root();
+      for (int i = 0; i < 100; ++i)
+         session->upsert(root, std::to_string(i), std::to_string(i));
+      session->set_top_root(root);
+   }
+
+   std::map<ring_allocator::cache_level_type, std::vector<std::pair<uint64_t, uint64_t>>> calls;
+   auto db = std::make_shared<database>(
+       "testdb", database::read_write, true,
+       database::memory_config{
+           .huge_pages = true,
+           .prefault   = true,
+           .progress   = [&](auto level, uint64_t done, uint64_t total)
+           { calls[level].push_back({done, total}); },
+       });
+
+   REQUIRE(calls.size() == 2);
+   for (auto level : {ring_allocator::hot_cache, ring_allocator::warm_cache})
+   {
+      auto& c = calls[level];
+      REQUIRE(!c.empty());
+      REQUIRE(c.back().first == c.back().second);
+      REQUIRE(c.back().second >= 1ull << 27);
+      for (std::size_t i = 1; i < c.size(); ++i)
+         REQUIRE(c[i - 1].first < c[i].first);
+   }
+
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+   for (int i = 0; i < 100; ++i)
+      REQUIRE(osv(session->get(root, std::to_string(i))) == std::to_string(i));
+}
+
+TEST_CASE("scrub")
+{
+   std::filesystem::remove_all("testdb");
+   database::create("testdb", database::config{
+                                  .max_objects = 100000ull,
+                                  .hot_pages   = 27,
+                                  .warm_pages  = 27,
+                                  .cool_pages  = 27,
+                                  .cold_pages  = 27,
+                              });
+   auto db      = std::make_shared<database>("testdb", database::read_write, true);
+   auto session = db->start_write_session();
+
+   std::shared_ptr<root> inner, top;
+   for (int i = 0; i < 1000; ++i)
+      session->upsert(inner, "key" + std::to_string(i),
+                      i == 500 ? std::string("corrupt me") : std::to_string(i));
+   std::vector<std::shared_ptr<root>> roots{inner, inner};
+   for (int i = 0; i < 10; ++i)
+      session->upsert(top, "rev" + std::to_string(i), roots);
+   session->set_top_root(top);
+
+   uint64_t pass_nodes;
+   {
+      scrubber s(db);
+      int      steps = 0;
+      while (!s.step(100))
+         ++steps;
+      auto stats = db->get_stats().scrub;
+      REQUIRE(stats.passes == 1);
+      REQUIRE(stats.errors == 0);
+      REQUIRE(stats.nodes >= 20 * 1000);
+      REQUIRE(steps >= 200);
+      pass_nodes = stats.nodes;
+   }
+
+   // Start a pass, then continue it after reopening while the tree changes
+   {
+      scrubber s(db);
+      for (int i = 0; i < 100; ++i)
+         REQUIRE(!s.step(100));
+   }
+   inner.reset();
+   roots.clear();
+   top.reset();
+   session.reset();
+   db.reset();
+   db      = std::make_shared<database>("testdb", database::read_write, true);
+   session = db->start_write_session();
+   top     = session->get_top_root();
+   {
+      scrubber s(db);
+      for (int i = 0; !s.step(100); ++i)
+      {
+         session->upsert(top, "other" + std::to_string(i), std::to_string(i));
+         session->set_top_root(top);
+      }
+      auto stats = db->get_stats().scrub;
+      REQUIRE(stats.passes == 2);
+      REQUIRE(stats.errors == 0);
+      REQUIRE(stats.nodes < pass_nodes - 5000);
+   }
+
+   // Damage the key of the leaf which holds "corrupt me"
+   top.reset();
+   session.reset();
+   db.reset();
+   int damaged = 0;
+   for (auto level : {"hot", "warm", "cool", "cold"})
+   {
+      auto        path = std::filesystem::path("testdb") / "data" / level;
+      std::string data(std::filesystem::file_size(path), 0);
+      std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+      file.read(data.data(), data.size());
+      for (auto pos = data.find("corrupt me"); pos != std::string::npos;
+           pos      = data.find("corrupt me", pos + 1))
+      {
+         file.seekp(pos - 1);
+         file.put(char(0xff));
+         ++damaged;
+      }
+   }
+   REQUIRE(damaged > 0);
+
+   db = std::make_shared<database>("testdb", database::read_write, true);
+   {
+      scrubber s(db);
+      while (!s.step())
+      {
+      }
+      auto stats = db->get_stats().scrub;
+      REQUIRE(stats.passes == 3);
+      REQUIRE(stats.errors > 0);
+      REQUIRE(!stats.last_error.empty());
+   }
+   {
+      scrubber s(db);
+      s.start({.nodes_per_sec     = 1000 * 1000,
+               .bytes_per_sec     = 1024 * 1024 * 1024,
+               .min_pass_interval = std::chrono::seconds{0}});
+      for (int i = 0; i < 1000 && db->get_stats().scrub.passes < 5; ++i)
+         std::this_thread::sleep_for(std::chrono::milliseconds{10});
+      REQUIRE(db->get_stats().scrub.passes >= 5);
+   }
+   REQUIRE_THROWS([&] {
+      scrubber a(db);
+      scrubber b(db);
+   }());
+}
+
+TEST_CASE("inline values")
+{
+   auto db      = createDb();
+   auto session = db->start_write_session();
+   auto root    = session->get_top_root();
+   db->set_inline_values(64);
+
+   std::mt19937                       gen(0);
+   std::map<std::string, std::string> expected;
+   auto                               random_key = [&]
+   {
+      std::string key(gen() % 5, 0);
+      for (auto& ch : key)
+         ch = "\x00\x01\x7f\x80\xff"[gen() % 5];
+      return key;
+   };
+   // Some values are too large to be inlined
+   auto random_value = [&] { return std::string(gen() % 100, 'a' + gen() % 26); };
+
+   // Builds a new tree with the same content without inline values
+   auto rebuild = [&]
+   {
+      db->set_inline_values(0);
+      std::shared_ptr<triedent::root> r;
+      for (auto& [k, v] : expected)
+         session->upsert(r, k, v);
+      db->set_inline_values(64);
+      return r;
+   };
+
+   auto as_string = [](const std::vector<char>& v) { return std::string(v.data(), v.size()); };
+   for (int round = 0; round < 100; ++round)
+   {
+      // Changes copy the nodes which the snapshot shares, which inlines their values
+      auto snapshot          = root;
+      auto snapshot_expected = expected;
+
+      std::vector<write_session::batch_entry>           batch;
+      std::map<std::string, std::optional<std::string>> ops;
+      for (int i = 0, n = gen() % 20; i < n; ++i)
+      {
+         if (gen() % 3)
+            ops[random_key()] = random_value();
+         else
+            ops[random_key()] = std::nullopt;
+      }
+      for (auto& [k, v] : ops)
+      {
+         if (v)
+            expected[k] = *v;
+         else
+            expected.erase(k);
+         if (round % 3 == 0)
+            batch.push_back({k, v ? std::optional{std::span<const char>{*v}} : std::nullopt});
+         else if (v)
+            session->upsert(root, k, *v);
+         else
+            session->remove(root, k);
+      }
+      if (!batch.empty())
+         session->apply_batch(root, batch);
+
+      for (auto& [k, v] : expected)
+         REQUIRE(osv(session->get(root, k)) == v);
+      auto it = session->first(root);
+      for (auto& [k, v] : expected)
+      {
+         REQUIRE(it.valid());
+         REQUIRE(as_string(it.key()) == k);
+         REQUIRE(as_string(it.value()) == v);
+         ++it;
+      }
+      REQUIRE(!it.valid());
+      for (auto& [k, v] : snapshot_expected)
+         REQUIRE(osv(session->get(snapshot, k)) == v);
+
+      std::size_t changes = 0;
+      session->diff(snapshot, root, [&](auto&&...) { ++changes; });
+      std::size_t expected_changes = 0;
+      for (auto& [k, v] : expected)
+         expected_changes += snapshot_expected.contains(k) ? snapshot_expected[k] != v : 1;
+      for (auto& [k, v] : snapshot_expected)
+         expected_changes += !expected.contains(k);
+      REQUIRE(changes == expected_changes);
+
+      auto other = rebuild();
+      REQUIRE(session->get_hash(other) == session->get_hash(root));
+      session->release(other);
+   }
+
+   session->set_top_root(root);
+   {
+      scrubber s(db);
+      while (!s.step())
+      {
+      }
+      REQUIRE(db->get_stats().scrub.errors == 0);
+   }
+
+   // The same content takes fewer objects with inline values
+   auto before   = db->get_stats().used_ids;
+   auto other    = rebuild();
+   auto separate = db->get_stats().used_ids - before;
+   root.reset();
+   session->set_top_root(other);
+   auto inlined = before + separate - db->get_stats().used_ids;
+   REQUIRE(inlined < separate);
+}
@@ -0,0 +1,623 @@
+// db-bench drives chain-like workloads through psibase::Database, so that the
+// storage backends behind it can be compared with each other and over time.
+// The backend is whichever implementation of SharedDatabase/Database the
+// program is linked with; see CMakeLists.txt.
+//
+// Each workload runs against the same database, in the order given:
+//
+// - transfer: token transfers; each transaction reads and writes two balances
+// - scan:     walks a secondary index (holders of a token) with kvGreaterEqualRaw
+// - events:   appends events the way putSequential does
+// - fork:     alternates between two branches with getRevision, building a
+//             block on each
+//
+// Results are printed as a table, and optionally written as JSON.
+
+#include <psibase/crypto.hpp>
+#include <psibase/db.hpp>
+#include <psibase/nativeTables.hpp>
+#include <psio/to_json.hpp>
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+#ifndef DB_BENCH_BACKEND
+#define DB_BENCH_BACKEND "unknown"
+#endif
+
+using namespace psibase;
+
+namespace
+{
+   using Clock = std::chrono::steady_clock;
+
+   struct BenchConfig
+   {
+      std::string backend      = DB_BENCH_BACKEND;
+      uint64_t    accounts     = 100'000;
+      uint32_t    tokens       = 100;
+      uint32_t    blocks       = 200;
+      uint32_t    txPerBlock   = 100;
+      uint32_t    abortPercent = 5;
+      uint32_t    scans        = 10'000;
+      uint32_t    scanLength   = 50;
+      uint32_t    eventsPerTx  = 4;
+      uint32_t    eventSize    = 100;
+      uint32_t    forkSwitches = 100;
+      uint32_t    forkReads    = 100;
+      uint64_t    maxObjects   = 100'000'000;
+      uint32_t    ringBits     = 32;
+      uint64_t    seed         = 0;
+   };
+   PSIO_REFLECT(BenchConfig,
+                backend,
+                accounts,
+                tokens,
+                blocks,
+                txPerBlock,
+                abortPercent,
+                scans,
+                scanLength,
+                eventsPerTx,
+                eventSize,
+                forkSwitches,
+                forkReads,
+                maxObjects,
+                ringBits,
+                seed)
+
+   // Latencies are in microseconds
+   struct LatencyStats
+   {
+      double p50  = 0;
+      double p90  = 0;
+      double p99  = 0;
+      double p999 = 0;
+      double max  = 0;
+   };
+   PSIO_REFLECT(LatencyStats, p50, p90, p99, p999, max)
+
+   struct WorkloadResult
+   {
+      std::string  name;
+      std::string  op;  // what ops and latency count
+      uint64_t     ops       = 0;
+      double       seconds   = 0;  // the whole workload, including work which isn't timed
+      double       opsPerSec = 0;
+      LatencyStats latency;
+      uint64_t     rssBytes      = 0;  // after the workload
+      uint64_t     peakRssBytes  = 0;
+      uint64_t     diskBytes     = 0;  // sum of file sizes; files may be sparse
+      uint64_t     diskUsedBytes = 0;  // blocks allocated on disk
+   };
+   PSIO_REFLECT(WorkloadResult,
+                name,
+                op,
+                ops,
+                seconds,
+                opsPerSec,
+                latency,
+                rssBytes,
+                peakRssBytes,
+                diskBytes,
+                diskUsedBytes)
+
+   struct BenchResult
+   {
+      BenchConfig                 config;
+      std::vector<WorkloadResult> workloads;
+      DatabaseStats               database;
+   };
+   PSIO_REFLECT(BenchResult, config, workloads, database)
+
+   class LatencyRecorder
+   {
+     public:
+      void add(Clock::duration d) { samples.push_back(d.count()); }
+
+      LatencyStats stats()
+      {
+         LatencyStats result;
+         if (samples.empty())
+            return result;
+         std::sort(samples.begin(), samples.end());
+         auto at = [&](double p)
+         {
+            auto i = std::min<size_t>(samples.size() - 1, p * samples.size());
+            return std::chrono::duration<double, std::micro>(Clock::duration{samples[i]}).count();
+         };
+         result.p50  = at(0.5);
+         result.p90  = at(0.9);
+         result.p99  = at(0.99);
+         result.p999 = at(0.999);
+         result.max  = at(1);
+         return result;
+      }
+
+      uint64_t size() const { return samples.size(); }
+
+     private:
+      std::vector<Clock::rep> samples;
+   };
+
+   uint64_t currentRss()
+   {
+      std::ifstream in("/proc/self/statm");
+      uint64_t      size = 0, resident = 0;
+      in >> size >> resident;
+      return resident * sysconf(_SC_PAGESIZE);
+   }
+
+   uint64_t peakRss()
+   {
+      rusage usage{};
+      getrusage(RUSAGE_SELF, &usage);
+      return uint64_t(usage.ru_maxrss) * 1024;
+   }
+
+   void diskUsage(const std::filesystem::path& dir, WorkloadResult& result)
+   {
+      for (auto& entry : std::filesystem::recursive_directory_iterator(dir))
+      {
+         struct stat st;
+         if (entry.is_regular_file() && !::stat(entry.path().c_str(), &st))
+         {
+            result.diskBytes += st.st_size;
+            result.diskUsedBytes += uint64_t(st.st_blocks) * 512;
+         }
+      }
+   }
+
+   // Block ids start with the big-endian block number, like real ones
+   Checksum256 makeBlockId(BlockNum num, uint32_t branch)
+   {
+      auto id = sha256(std::tuple(num, branch));
+      for (int i = 0; i < 4; ++i)
+         id[i] = num >> (24 - 8 * i);
+      return id;
+   }
+
+   constexpr AccountNumber tokenService{"token-sys"};
+   constexpr uint16_t      balanceTable = 1;
+   constexpr uint16_t      holderTable  = 2;
+
+   auto balanceKey(uint64_t account)
+   {
+      return psio::convert_to_key(std::tuple(tokenService, balanceTable, account));
+   }
+
+   // Holders of a token, in account order
+   auto holderPrefix(uint32_t token)
+   {
+      return psio::convert_to_key(std::tuple(tokenService, holderTable, token));
+   }
+
+   auto holderKey(uint32_t token, uint64_t account)
+   {
+      return psio::convert_to_key(std::tuple(tokenService, holderTable, token, account));
+   }
+
+   struct Bench
+   {
+      BenchConfig                 config;
+      std::filesystem::path       dir;
+      SharedDatabase              shared;
+      WriterPtr                   writer;
+      Database                    db;
+      std::mt19937_64             rng;
+      BlockNum                    headNum = 1;
+      std::vector<WorkloadResult> results;
+      std::vector<char>           key, value;
+
+      Bench(const BenchConfig& config, const std::filesystem::path& dir)
+          : config(config),
+            dir(dir),
+            shared(dir.native(),
+                   true,
+                   {},
+                   config.maxObjects,
+                   config.ringBits,
+                   config.ringBits,
+                   config.ringBits,
+                   config.ringBits),
+            writer(shared.createWriter()),
+            db(shared, shared.getHead()),
+            rng(config.seed)
+      {
+      }
+
+      uint64_t randomAccount() { return rng() % config.accounts; }
+
+      // Runs f in a block, then makes the block the irreversible head
+      template <typename F>
+      void block(F&& f)
+      {
+         auto session = db.startWrite(writer);
+         f();
+         auto id       = makeBlockId(++headNum, 0);
+         auto revision = session.writeRevision(id);
+         shared.setHead(*writer, revision);
+         shared.removeRevisions(*writer, id);
+      }
+
+      // Runs f in a transaction, which is aborted abortPercent of the time
+      template <typename F>
+      void transaction(F&& f)
+      {
+         auto session = db.startWrite(writer);
+         f();
+         if (rng() % 100 >= config.abortPercent)
+            session.commit();
+      }
+
+      void transfer()
+      {
+         auto from = randomAccount();
+         auto to   = randomAccount();
+         for (auto [account, delta] : {std::pair{from, -1}, std::pair{to, 1}})
+         {
+            auto     k       = balanceKey(account);
+            uint64_t balance = 0;
+            if (db.kvGetRaw(DbId::service, k, value))
+               balance = psio::convert_from_frac<uint64_t>(value);
+            db.kvPutRaw(DbId::service, k, psio::convert_to_frac(balance + delta));
+         }
+      }
+
+      // The account prefix and sequence number that putSequential adds
+      void appendEvent(const std::vector<char>& data)
+      {
+         auto status = db.kvGet<DatabaseStatusRow>(DatabaseStatusRow::db, DatabaseStatusRow::key())
+                           .value_or(DatabaseStatusRow{});
+         auto number = status.nextHistoryEventNumber++;
+         db.kvPut(DatabaseStatusRow::db, DatabaseStatusRow::key(), status);
+         db.kvPutRaw(DbId::historyEvent, psio::convert_to_key(number), data);
+      }
+
+      WorkloadResult& start(std::string name, std::string op)
+      {
+         results.push_back({.name = std::move(name), .op = std::move(op)});
+         return results.back();
+      }
+
+      void finish(WorkloadResult& result, Clock::time_point begin, LatencyRecorder& latency)
+      {
+         result.seconds      = std::chrono::duration<double>(Clock::now() - begin).count();
+         result.ops          = latency.size();
+         result.opsPerSec    = result.ops / result.seconds;
+         result.latency      = latency.stats();
+         result.rssBytes     = currentRss();
+         result.peakRssBytes = peakRss();
+         diskUsage(dir, result);
+      }
+
+      // Accounts hold one token each, account % tokens, and start with a
+      // balance of 1000. This isn't a workload, but is reported as one.
+      void load()
+      {
+         auto&           result = start("load", "row");
+         LatencyRecorder latency;
+         auto            begin = Clock::now();
+         // Each batch is timed as a whole; its rows get the average latency
+         const uint64_t                                                 batchSize = 10'000;
+         std::vector<std::vector<char>>                                 keys, values;
+         std::vector<std::pair<psio::input_stream, psio::input_stream>> rows;
+         auto                                                           flush = [&]
+         {
+            auto t = Clock::now();
+            rows.clear();
+            for (size_t i = 0; i < keys.size(); ++i)
+               rows.push_back({keys[i], values[i]});
+            db.kvPutManyRaw(DbId::service, rows);
+            auto elapsed = (Clock::now() - t) / std::max<size_t>(rows.size(), 1);
+            for (size_t i = 0; i < rows.size(); ++i)
+               latency.add(elapsed);
+            keys.clear();
+            values.clear();
+         };
+         block(
+             [&]
+             {
+                for (uint64_t a = 0; a < config.accounts; ++a)
+                {
+                   keys.push_back(balanceKey(a));
+                   values.push_back(psio::convert_to_frac(uint64_t(1000)));
+                   if (keys.size() == batchSize)
+                      flush();
+                }
+                flush();
+                // Keys of the holder table sort by token, then account
+                for (uint32_t t = 0; t < config.tokens; ++t)
+                {
+                   for (uint64_t a = t; a < config.accounts; a += config.tokens)
+                   {
+                      keys.push_back(holderKey(t, a));
+                      values.emplace_back();
+                      if (keys.size() == batchSize)
+                         flush();
+                   }
+                }
+                flush();
+             });
+         finish(result, begin, latency);
+      }
+
+      void runTransfers()
+      {
+         auto&           result = start("transfer", "transaction");
+         LatencyRecorder latency;
+         auto            begin = Clock::now();
+         for (uint32_t b = 0; b < config.blocks; ++b)
+         {
+            block(
+                [&]
+                {
+                   for (uint32_t i = 0; i < config.txPerBlock; ++i)
+                   {
+                      auto t = Clock::now();
+                      transaction([&] { transfer(); });
+                      latency.add(Clock::now() - t);
+                   }
+                });
+         }
+         finish(result, begin, latency);
+      }
+
+      void runScans()
+      {
+         auto&             result = start("scan", "scan");
+         LatencyRecorder   latency;
+         std::vector<char> found;
+         auto              begin = Clock::now();
+         {
+            auto session = db.startRead();
+            for (uint32_t i = 0; i < config.scans; ++i)
+            {
+               auto t      = Clock::now();
+               auto prefix = holderPrefix(rng() % config.tokens);
+               key         = prefix;
+               for (uint32_t n = 0; n < config.scanLength; ++n)
+               {
+                  if (!db.kvGreaterEqualRaw(DbId::service, key, prefix.size(), found, value))
+                     break;
+                  // The smallest key which is greater than found
+                  key.assign(found.begin(), found.end());
+                  key.push_back(0);
+               }
+               latency.add(Clock::now() - t);
+            }
+         }
+         finish(result, begin, latency);
+      }
+
+      void runEvents()
+      {
+         auto&             result = start("events", "event");
+         LatencyRecorder   latency;
+         std::vector<char> data(std::max<size_t>(config.eventSize, sizeof(AccountNumber)));
+         auto              prefix = psio::convert_to_frac(tokenService);
+         std::copy(prefix.begin(), prefix.end(), data.begin());
+         auto begin = Clock::now();
+         for (uint32_t b = 0; b < config.blocks; ++b)
+         {
+            block(
+                [&]
+                {
+                   for (uint32_t i = 0; i < config.txPerBlock; ++i)
+                   {
+                      transaction(
+                          [&]
+                          {
+                             for (uint32_t e = 0; e < config.eventsPerTx; ++e)
+                             {
+                                std::generate(data.begin() + prefix.size(), data.end(), std::ref(rng));
+                                auto t = Clock::now();
+                                appendEvent(data);
+                                latency.add(Clock::now() - t);
+                             }
+                          });
+                   }
+                });
+         }
+         finish(result, begin, latency);
+      }
+
+      // Builds two branches from the head. Each switch loads the tip of the
+      // other branch with getRevision, reads from it, and builds a block on it.
+      // Only the switch and the reads are timed.
+      void runForks()
+      {
+         auto&           result = start("fork", "switch");
+         LatencyRecorder latency;
+         auto            begin = Clock::now();
+
+         struct Branch
+         {
+            BlockNum    num;
+            Checksum256 id;
+         };
+         auto   baseId = makeBlockId(headNum, 0);
+         Branch branches[2]{{headNum, baseId}, {headNum, baseId}};
+         for (uint32_t s = 0; s < config.forkSwitches; ++s)
+         {
+            auto  which  = s % 2;
+            auto& branch = branches[which];
+
+            auto t        = Clock::now();
+            auto revision = shared.getRevision(*writer, branch.id);
+            check(revision != nullptr, "fork: revision is missing");
+            db.setRevision(revision);
+            {
+               auto session = db.startRead();
+               for (uint32_t i = 0; i < config.forkReads; ++i)
+                  db.kvGetRaw(DbId::service, balanceKey(randomAccount()), value);
+            }
+            latency.add(Clock::now() - t);
+
+            auto session = db.startWrite(writer);
+            for (uint32_t i = 0; i < config.txPerBlock; ++i)
+               transaction([&] { transfer(); });
+            branch.id = makeBlockId(++branch.num, which + 1);
+            session.writeRevision(branch.id);
+         }
+
+         // Keep the first branch and drop the other
+         auto revision = shared.getRevision(*writer, branches[0].id);
+         check(revision != nullptr, "fork: revision is missing");
+         db.setRevision(revision);
+         shared.setHead(*writer, revision);
+         shared.removeRevisions(*writer, branches[0].id);
+         headNum = std::max(branches[0].num, branches[1].num);
+         finish(result, begin, latency);
+      }
+   };
+
+   void printTable(const std::vector<WorkloadResult>& results)
+   {
+      auto mb = [](uint64_t bytes) { return bytes / (1024.0 * 1024.0); };
+      std::cout << std::left << std::setw(10) << "workload" << std::setw(13) << "op" << std::right
+                << std::setw(10) << "ops" << std::setw(12) << "ops/s" << std::setw(10) << "p50 us"
+                << std::setw(10) << "p99 us" << std::setw(11) << "p99.9 us" << std::setw(11)
+                << "max us" << std::setw(10) << "rss MB" << std::setw(10) << "disk MB"
+                << "\n";
+      for (auto& r : results)
+         std::cout << std::left << std::setw(10) << r.name << std::setw(13) << r.op << std::right
+                   << std::fixed << std::setprecision(0) << std::setw(10) << r.ops
+                   << std::setw(12) << r.opsPerSec << std::setprecision(1) << std::setw(10)
+                   << r.latency.p50 << std::setw(10) << r.latency.p99 << std::setw(11)
+                   << r.latency.p999 << std::setw(11) << r.latency.max << std::setprecision(0)
+                   << std::setw(10) << mb(r.rssBytes) << std::setw(10) << mb(r.diskUsedBytes)
+                   << "\n";
+   }
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+   namespace po = boost::program_options;
+
+   BenchConfig              config;
+   std::string              db_path;
+   std::vector<std::string> workloads;
+   std::string              json_path;
+   bool                     reset = false;
+
+   po::options_description desc("db-bench");
+   auto                    opt = desc.add_options();
+   opt("database", po::value(&db_path)->value_name("path")->required(),
+       "Path to the database. It is created if it does not exist");
+   opt("reset", po::bool_switch(&reset), "Remove the database first");
+   opt("workload,w",
+       po::value(&workloads)->default_value({"transfer", "scan", "events", "fork"},
+                                            "transfer scan events fork"),
+       "Workloads to run, in order: transfer, scan, events, fork");
+   opt("accounts", po::value(&config.accounts)->default_value(config.accounts),
+       "Number of token balances to load");
+   opt("tokens", po::value(&config.tokens)->default_value(config.tokens),
+       "Number of tokens, which partition the holder index");
+   opt("blocks", po::value(&config.blocks)->default_value(config.blocks),
+       "Blocks per transfer and events workload");
+   opt("tx-per-block", po::value(&config.txPerBlock)->default_value(config.txPerBlock),
+       "Transactions per block");
+   opt("abort-percent", po::value(&config.abortPercent)->default_value(config.abortPercent),
+       "Percentage of transactions which abort instead of committing");
+   opt("scans", po::value(&config.scans)->default_value(config.scans), "Number of index scans");
+   opt("scan-length", po::value(&config.scanLength)->default_value(config.scanLength),
+       "Rows read by each index scan");
+   opt("events-per-tx", po::value(&config.eventsPerTx)->default_value(config.eventsPerTx),
+       "Events appended by each transaction");
+   opt("event-size", po::value(&config.eventSize)->default_value(config.eventSize),
+       "Size of each event in bytes");
+   opt("fork-switches", po::value(&config.forkSwitches)->default_value(config.forkSwitches),
+       "Number of times to switch between forks");
+   opt("fork-reads", po::value(&config.forkReads)->default_value(config.forkReads),
+       "Reads after each fork switch, which are included in its latency");
+   opt("max-objects", po::value(&config.maxObjects)->default_value(config.maxObjects),
+       "Database size: maximum number of objects");
+   opt("ring-bits", po::value(&config.ringBits)->default_value(config.ringBits),
+       "Database size: log2 of the size of each cache level");
+   opt("seed", po::value(&config.seed)->default_value(config.seed), "Random seed");
+   opt("json", po::value(&json_path)->value_name("file"),
+       "Write the results as JSON to this file, or - for stdout");
+   opt("help,h", "Show this message");
+
+   po::positional_options_description p;
+   p.add("database", 1);
+
+   po::variables_map vm;
+   try
+   {
+      po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
+      if (vm.count("help"))
+      {
+         std::cerr << desc << "\n";
+         return 1;
+      }
+      po::notify(vm);
+      for (auto& w : workloads)
+         if (w != "transfer" && w != "scan" && w != "events" && w != "fork")
+            throw std::runtime_error("unknown workload: " + w);
+      if (!config.accounts || !config.tokens)
+         throw std::runtime_error("--accounts and --tokens must be positive");
+   }
+   catch (std::exception& e)
+   {
+      std::cerr << e.what() << "\n";
+      return 1;
+   }
+
+   try
+   {
+      if (reset)
+         std::filesystem::remove_all(db_path);
+      else if (std::filesystem::exists(db_path) && !std::filesystem::is_empty(db_path))
+         throw std::runtime_error(db_path + " is not empty; use --reset to remove it");
+      Bench bench(config, db_path);
+      bench.load();
+      for (auto& w : workloads)
+      {
+         if (w == "transfer")
+            bench.runTransfers();
+         else if (w == "scan")
+            bench.runScans();
+         else if (w == "events")
+            bench.runEvents();
+         else if (w == "fork")
+            bench.runForks();
+      }
+
+      printTable(bench.results);
+      if (!json_path.empty())
+      {
+         BenchResult result{config, bench.results, bench.shared.getStats()};
+         auto        json = psio::convert_to_json(result);
+         if (json_path == "-")
+            std::cout << json << std::endl;
+         else
+         {
+            std::ofstream out(json_path);
+            out << json << std::endl;
+            if (!out)
+               throw std::runtime_error("failed to write " + json_path);
+         }
+      }
+   }
+   catch (std::exception& e)
+   {
+      std::cerr << "db-bench: " << e.what() << "\n";
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,242 @@
+// intake-bench measures how long psinode's transaction intake takes to hand
+// a pushed transaction to the chain thread. It drives the same
+// TransactionQueue as psinode, with simulated clients and a simulated chain
+// thread, in two modes:
+//
+// - event: the queue posts to the chain thread when transactions arrive
+//          (what psinode does)
+// - timer: the chain thread drains the queue on a fixed interval (what
+//          psinode did before)
+//
+// Latency is from the client's push until the chain thread starts executing
+// the transaction. Execution is simulated by spinning for --exec-us.
+
+#include <psibase/TransactionQueue.hpp>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+using namespace psibase;
+
+namespace
+{
+   using Clock = std::chrono::steady_clock;
+
+   struct BenchConfig
+   {
+      uint32_t clients    = 4;
+      uint32_t rate       = 200;  // per client, per second
+      uint32_t durationMs = 2000;
+      uint32_t execUs     = 50;
+      uint32_t intervalMs = 100;
+      uint32_t batch      = 64;
+      uint64_t maxPending = 4096;
+   };
+
+   struct Item
+   {
+      Clock::time_point submitted;
+      std::string       source;
+   };
+
+   struct ModeResult
+   {
+      std::string mode;
+      uint64_t    submitted = 0;
+      uint64_t    executed  = 0;
+      uint64_t    rejected  = 0;
+      double      p50       = 0;  // latencies in microseconds
+      double      p90       = 0;
+      double      p99       = 0;
+      double      max       = 0;
+   };
+
+   void spin(std::chrono::microseconds d)
+   {
+      auto end = Clock::now() + d;
+      while (Clock::now() < end)
+      {
+      }
+   }
+
+   ModeResult run(const BenchConfig& config, bool eventDriven)
+   {
+      boost::asio::io_context      chain;
+      auto                         work = boost::asio::make_work_guard(chain);
+      std::vector<Clock::duration> latencies;  // only used by the chain thread
+      std::atomic<uint64_t>        submitted{0}, rejected{0};
+      std::function<void()>        process;
+
+      TransactionQueue<Item> queue(config.maxPending,
+                                   [&]
+                                   {
+                                      if (eventDriven)
+                                         boost::asio::post(chain, [&] { process(); });
+                                   });
+
+      auto execute = [&](std::vector<Item>& items)
+      {
+         for (auto& item : items)
+         {
+            latencies.push_back(Clock::now() - item.submitted);
+            spin(std::chrono::microseconds(config.execUs));
+            queue.release(item.source);
+         }
+      };
+
+      process = [&]
+      {
+         std::vector<Item> items;
+         if (queue.pop(items, config.batch))
+            boost::asio::post(chain, [&] { process(); });
+         execute(items);
+      };
+
+      boost::asio::steady_timer                      timer(chain);
+      std::function<void(boost::system::error_code)> tick = [&](boost::system::error_code ec)
+      {
+         if (ec)
+            return;
+         std::vector<Item> items;
+         while (queue.pop(items, config.batch))
+         {
+         }
+         execute(items);
+         timer.expires_after(std::chrono::milliseconds(config.intervalMs));
+         timer.async_wait(tick);
+      };
+      if (!eventDriven)
+         tick({});
+
+      std::thread chainThread([&] { chain.run(); });
+
+      // Each client pushes at a fixed rate, with the clients evenly offset
+      auto                     start = Clock::now();
+      auto                     end   = start + std::chrono::milliseconds(config.durationMs);
+      auto                     step  = std::chrono::nanoseconds(1'000'000'000 / config.rate);
+      std::vector<std::thread> clients;
+      for (uint32_t c = 0; c < config.clients; ++c)
+         clients.emplace_back(
+             [&, c]
+             {
+                auto source = "client-" + std::to_string(c);
+                auto next   = start + step * c / config.clients;
+                while (next < end)
+                {
+                   std::this_thread::sleep_until(next);
+                   next += step;
+                   Item item{Clock::now(), source};
+                   ++submitted;
+                   if (queue.push(source, std::move(item)) !=
+                       TransactionQueue<Item>::PushResult::accepted)
+                      ++rejected;
+                }
+             });
+      for (auto& t : clients)
+         t.join();
+
+      while (queue.pending())
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      boost::asio::post(chain, [&] { timer.cancel(); });
+      work.reset();
+      chainThread.join();
+
+      ModeResult result{eventDriven ? "event" : "timer", submitted, latencies.size(), rejected};
+      if (!latencies.empty())
+      {
+         std::sort(latencies.begin(), latencies.end());
+         auto at = [&](double p)
+         {
+            auto i = std::min<size_t>(latencies.size() - 1, p * latencies.size());
+            return std::chrono::duration<double, std::micro>(latencies[i]).count();
+         };
+         result.p50 = at(0.5);
+         result.p90 = at(0.9);
+         result.p99 = at(0.99);
+         result.max = at(1);
+      }
+      return result;
+   }
+
+   void printTable(const std::vector<ModeResult>& results)
+   {
+      std::cout << std::left << std::setw(8) << "mode" << std::right << std::setw(11)
+                << "submitted" << std::setw(10) << "executed" << std::setw(10) << "rejected"
+                << std::setw(12) << "p50 us" << std::setw(12) << "p90 us" << std::setw(12)
+                << "p99 us" << std::setw(12) << "max us"
+                << "\n";
+      for (auto& r : results)
+         std::cout << std::left << std::setw(8) << r.mode << std::right << std::setw(11)
+                   << r.submitted << std::setw(10) << r.executed << std::setw(10) << r.rejected
+                   << std::fixed << std::setprecision(1) << std::setw(12) << r.p50
+                   << std::setw(12) << r.p90 << std::setw(12) << r.p99 << std::setw(12) << r.max
+                   << "\n";
+   }
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+   namespace po = boost::program_options;
+
+   BenchConfig              config;
+   std::vector<std::string> modes;
+
+   po::options_description desc("intake-bench");
+   auto                    opt = desc.add_options();
+   opt("mode,m", po::value(&modes)->default_value({"event", "timer"}, "event timer"),
+       "Modes to run, in order: event, timer");
+   opt("clients", po::value(&config.clients)->default_value(config.clients),
+       "Number of clients, each with its own source");
+   opt("rate", po::value(&config.rate)->default_value(config.rate),
+       "Transactions per second pushed by each client");
+   opt("duration-ms", po::value(&config.durationMs)->default_value(config.durationMs),
+       "How long the clients push transactions");
+   opt("exec-us", po::value(&config.execUs)->default_value(config.execUs),
+       "Simulated execution time of each transaction");
+   opt("interval-ms", po::value(&config.intervalMs)->default_value(config.intervalMs),
+       "Polling interval of the timer mode");
+   opt("batch", po::value(&config.batch)->default_value(config.batch),
+       "Most transactions the chain thread takes at once in the event mode");
+   opt("max-pending", po::value(&config.maxPending)->default_value(config.maxPending),
+       "Limit on pending transactions; more are rejected");
+   opt("help,h", "Show this message");
+
+   po::variables_map vm;
+   try
+   {
+      po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+      if (vm.count("help"))
+      {
+         std::cerr << desc << "\n";
+         return 1;
+      }
+      po::notify(vm);
+      for (auto& m : modes)
+         if (m != "event" && m != "timer")
+            throw std::runtime_error("unknown mode: " + m);
+      if (!config.clients || !config.rate || !config.batch)
+         throw std::runtime_error("--clients, --rate, and --batch must be positive");
+   }
+   catch (std::exception& e)
+   {
+      std::cerr << e.what() << "\n";
+      return 1;
+   }
+
+   std::vector<ModeResult> results;
+   for (auto& m : modes)
+      results.push_back(run(config, m == "event"));
+   printTable(results);
+   return 0;
+}
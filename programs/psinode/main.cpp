@@ -1,6 +1,8 @@
 #include <psibase/ConfigFile.hpp>
 #include <psibase/EcdsaProver.hpp>
 #include <psibase/TransactionContext.hpp>
+#include <psibase/TransactionQueue.hpp>
+#include <psibase/VerifyPool.hpp>
 #include <psibase/bft.hpp>
 #include <psibase/cft.hpp>
 #include <psibase/direct_routing.hpp>
@@ -9,6 +11,7 @@
 #include <psibase/node.hpp>
 #include <psibase/peer_manager.hpp>
 #include <psibase/serviceEntry.hpp>
+#include <psibase/Snapshot.hpp>
 #include <psibase/websocket.hpp>
 #include <psio/finally.hpp>
 #include <psio/to_json.hpp>
@@ -290,20 +293,45 @@ namespace psibase
    }  // namespace http
 }  // namespace psibase
 
-struct transaction_queue
+struct transaction_entry
 {
-   struct entry
-   {
-      bool                            is_boot = false;
-      std::vector<char>               packed_signed_trx;
-      http::push_boot_callback        boot_callback;
-      http::push_transaction_callback callback;
-   };
-
-   std::mutex         mutex;
-   std::vector<entry> entries;
+   bool                            is_boot = false;
+   std::vector<char>               packed_signed_trx;
+   http::push_boot_callback        boot_callback;
+   http::push_transaction_callback callback;
+   std::string                     source;
 };
 
+using transaction_queue = TransactionQueue<transaction_entry>;
+
+// Releases the entry's place in the queue when it gets its reply
+void release_on_reply(const std::shared_ptr<transaction_queue>& queue, transaction_entry& entry)
+{
+   if (entry.callback)
+      entry.callback = [queue, source = entry.source, callback = std::move(entry.callback)](
+                           http::push_transaction_result result)
+      {
+         queue->release(source);
+         callback(std::move(result));
+      };
+   else if (entry.boot_callback)
+      entry.boot_callback = [queue, source = entry.source, callback = std::move(entry.boot_callback)](
+                                http::push_boot_result result)
+      {
+         queue->release(source);
+         callback(std::move(result));
+      };
+}
+
+// Answers an entry which won't be executed
+void reject(transaction_entry& entry, const std::string& message)
+{
+   if (entry.callback)
+      entry.callback(http::service_unavailable{message});
+   else if (entry.boot_callback)
+      entry.boot_callback(message);
+}
+
 #define RETHROW_BAD_ALLOC  \
    catch (std::bad_alloc&) \
    {                       \
@@ -313,7 +341,7 @@ struct transaction_queue
 #define CATCH_IGNORE \
    catch (...) {}
 
-bool push_boot(BlockContext& bc, transaction_queue::entry& entry)
+bool push_boot(BlockContext& bc, transaction_entry& entry)
 {
    try
    {
@@ -404,76 +432,153 @@ void loop(Timer& timer, F&& f)
        });
 }
 
-void pushTransaction(psibase::SharedState&                  sharedState,
-                     const std::shared_ptr<const Revision>& revisionAtBlockStart,
-                     BlockContext&                          bc,
-                     SystemContext&                         proofSystem,
-                     transaction_queue::entry&              entry,
-                     std::chrono::microseconds              firstAuthWatchdogLimit,
-                     std::chrono::microseconds              proofWatchdogLimit,
-                     std::chrono::microseconds              initialWatchdogLimit)
+// A transaction on its way to the chain thread. Its proofs and first auth
+// are checked on a VerifyPool thread, against the state at the start of the
+// block which it's meant for. On a node which isn't producing, that is the
+// block after the head.
+struct verified_transaction
+{
+   transaction_entry                entry;
+   ConstRevisionPtr                 revision;
+   std::optional<TimePointSec>      time;
+   std::optional<SignedTransaction> trx;
+   TransactionTrace                 trace;  // has an error if a check failed
+   std::optional<std::string>       error;  // a failure which has no trace
+   bool                             proofsVerified = false;
+   std::uint64_t                    seq            = 0;  // order of arrival from entry.source
+};
+
+// Verification finishes in any order, but transactions from one source run
+// in the order in which they arrived, since a later one may depend on an
+// earlier one.
+struct source_order
+{
+   std::uint64_t                                                  next_seq     = 0;
+   std::uint64_t                                                  next_release = 0;
+   std::map<std::uint64_t, std::shared_ptr<verified_transaction>> verified;
+};
+
+// Carries a verified transaction back to the chain thread. If the handler
+// holding it is destroyed without running, because chainContext stopped
+// first, the client still gets an answer.
+struct verified_completion
+{
+   std::shared_ptr<verified_transaction> v;
+
+   explicit verified_completion(std::shared_ptr<verified_transaction> v) : v{std::move(v)} {}
+   verified_completion(verified_completion&&) = default;
+   ~verified_completion()
+   {
+      if (!v)
+         return;
+      // A destructor can't rethrow bad_alloc
+      try
+      {
+         reject(v->entry, "The server is shutting down");
+      }
+      catch (...)
+      {
+      }
+   }
+};
+
+// Runs on a VerifyPool thread
+void verifyTransaction(SystemContext&            proofSystem,
+                       verified_transaction&     v,
+                       std::chrono::microseconds firstAuthWatchdogLimit,
+                       std::chrono::microseconds proofWatchdogLimit)
 {
+   v.trace = {};
+   v.error.reset();
+   v.proofsVerified = false;
    try
    {
       // TODO: verify no extra data
       // TODO: view
-      auto             trx = psio::convert_from_frac<SignedTransaction>(entry.packed_signed_trx);
-      TransactionTrace trace;
+      if (!v.trx)
+         v.trx = psio::convert_from_frac<SignedTransaction>(v.entry.packed_signed_trx);
+      auto& trx   = *v.trx;
+      auto& trace = v.trace;
 
       try
       {
-         if (bc.needGenesisAction)
-            trace.error = "Need genesis block; use 'psibase boot' to boot chain";
-         else
+         // All proofs execute as of the state at block begin. This will allow
+         // consistent parallel execution of all proofs within a block during
+         // replay. Proofs don't have direct database access, but they do rely
+         // on the set of services stored within the database. They may call
+         // other services; e.g. to call crypto functions.
+         //
+         // If the block changes before the transaction reaches the chain
+         // thread, it is checked again against the new block's state. This
+         // prevents a poison block.
+         //
+         // TODO: track CPU usage of proofs and pass it somehow to the main
+         //       execution for charging
+         // TODO: If the first proof and the first auth pass, but the transaction
+         //       fails (including other proof failures), then charge the first
+         //       authorizer
+         BlockContext proofBC{proofSystem, v.revision};
+         proofBC.start(v.time);
+         for (size_t i = 0; i < trx.proofs.size(); ++i)
          {
-            // All proofs execute as of the state at block begin. This will allow
-            // consistent parallel execution of all proofs within a block during
-            // replay. Proofs don't have direct database access, but they do rely
-            // on the set of services stored within the database. They may call
-            // other services; e.g. to call crypto functions.
-            //
-            // TODO: move proof execution to background threads
-            // TODO: track CPU usage of proofs and pass it somehow to the main
-            //       execution for charging
-            // TODO: If by the time the transaction executes it's on a different
-            //       block than the proofs were verified on, then either the proofs
-            //       need to be rerun, or the hashes of the services which ran
-            //       during the proofs need to be compared against the current
-            //       service hashes. This will prevent a poison block.
-            // TODO: If the first proof and the first auth pass, but the transaction
-            //       fails (including other proof failures), then charge the first
-            //       authorizer
-            BlockContext proofBC{proofSystem, revisionAtBlockStart};
-            proofBC.start(bc.current.header.time);
-            for (size_t i = 0; i < trx.proofs.size(); ++i)
-            {
-               proofBC.verifyProof(trx, trace, i, proofWatchdogLimit);
-               trace = {};
-            }
-
-            // TODO: in another thread: check first auth and first proof. After
-            //       they pass, schedule the remaining proofs. After they pass,
-            //       schedule the transaction for execution in the main thread.
-            //
-            // The first auth check is a prefiltering measure and is mostly redundant
-            // with main execution. Unlike the proofs, the first auth check is allowed
-            // to run with any state on any fork. This is OK since the main execution
-            // checks all auths including the first; the worst that could happen is
-            // the transaction being rejected because it passes on one fork but not
-            // another, potentially charging the user for the failed transaction. The
-            // first auth check, when not part of the main execution, runs in read-only
-            // mode. TransactionSys lets the account's auth service know it's in a
-            // read-only mode so it doesn't fail the transaction trying to update its
-            // tables.
-            //
-            // Replay doesn't run the first auth check separately. This separate
-            // execution is a subjective measure; it's possible, but not advisable,
-            // for a modified node to skip it during production. This won't hurt
-            // consensus since replay never uses read-only mode for auth checks.
-            auto saveTrace = trace;
-            proofBC.checkFirstAuth(trx, trace, firstAuthWatchdogLimit);
-            trace = std::move(saveTrace);
+            proofBC.verifyProof(trx, trace, i, proofWatchdogLimit);
+            trace = {};
+         }
+         v.proofsVerified = true;
+
+         // The first auth check is a prefiltering measure and is mostly redundant
+         // with main execution. Unlike the proofs, the first auth check is allowed
+         // to run with any state on any fork. This is OK since the main execution
+         // checks all auths including the first; the worst that could happen is
+         // the transaction being rejected because it passes on one fork but not
+         // another, potentially charging the user for the failed transaction. The
+         // first auth check, when not part of the main execution, runs in read-only
+         // mode. TransactionSys lets the account's auth service know it's in a
+         // read-only mode so it doesn't fail the transaction trying to update its
+         // tables.
+         //
+         // Replay doesn't run the first auth check separately. This separate
+         // execution is a subjective measure; it's possible, but not advisable,
+         // for a modified node to skip it during production. This won't hurt
+         // consensus since replay never uses read-only mode for auth checks.
+         auto saveTrace = trace;
+         proofBC.checkFirstAuth(trx, trace, firstAuthWatchdogLimit);
+         trace = std::move(saveTrace);
+      }
+      RETHROW_BAD_ALLOC
+      catch (...)
+      {
+         // Don't give a false positive
+         if (!trace.error)
+            throw;
+      }
+   }
+   RETHROW_BAD_ALLOC
+   catch (std::exception& e)
+   {
+      v.error = e.what();
+   }
+   catch (...)
+   {
+      v.error = "unknown error";
+   }
+}  // verifyTransaction
 
+// Runs on the chain thread, with the block which v was verified against
+void pushTransaction(BlockContext&             bc,
+                     verified_transaction&     v,
+                     std::chrono::microseconds initialWatchdogLimit)
+{
+   auto& entry = v.entry;
+   try
+   {
+      TransactionTrace trace = std::move(v.trace);
+      if (v.error)
+         throw std::runtime_error(*v.error);
+      if (!trace.error)
+      {
+         try
+         {
             // TODO: RPC: don't forward failed transactions to P2P; this gives users
             //       feedback.
             // TODO: P2P: do forward failed transactions; this enables producers to
@@ -486,15 +591,15 @@ void pushTransaction(psibase::SharedState&                  sharedState,
             //       shadow bill, and once shadow billing is in place, failed
             //       transaction billing seems unnecessary.
 
-            bc.pushTransaction(trx, trace, initialWatchdogLimit);
+            bc.pushTransaction(*v.trx, trace, initialWatchdogLimit);
+         }
+         RETHROW_BAD_ALLOC
+         catch (...)
+         {
+            // Don't give a false positive
+            if (!trace.error)
+               throw;
          }
-      }
-      RETHROW_BAD_ALLOC
-      catch (...)
-      {
-         // Don't give a false positive
-         if (!trace.error)
-            throw;
       }
 
       try
@@ -676,6 +781,12 @@ void to_config(const PsinodeConfig& config, ConfigFile& file)
    // private keys.
    file.keep("", "key");
    file.keep("", "leeway");
+   file.keep("", "huge-pages");
+   file.keep("", "prefault");
+   file.keep("", "scrub-nodes-per-sec");
+   file.keep("", "scrub-bytes-per-sec");
+   file.keep("", "proof-threads");
+   file.keep("", "max-pending-transactions");
    //
    to_config(config.loggers, file);
 }
@@ -706,16 +817,32 @@ void run(const std::string&              db_path,
          std::vector<native_service>&    services,
          http::admin_service&            admin,
          uint32_t                        leeway_us,
+         bool                            huge_pages,
+         bool                            prefault,
+         uint64_t                        scrub_nodes_per_sec,
+         uint64_t                        scrub_bytes_per_sec,
+         unsigned                        proof_threads,
+         std::size_t                     max_pending_transactions,
          RestartInfo&                    runResult)
 {
    ExecutionContext::registerHostFunctions();
 
+   DatabaseMemoryConfig dbMemory{
+       .hugePages  = huge_pages,
+       .prefault   = prefault,
+       .onPrefault = [](std::string_view level, uint64_t done, uint64_t total)
+       {
+          // Log each tenth
+          if (done * 10 / total != (done - 1) * 10 / total || done == total)
+             PSIBASE_LOG(psibase::loggers::generic::get(), info)
+                 << "Prefaulting " << level << " database cache: " << done * 100 / total << "%";
+       },
+   };
+
    // TODO: configurable WasmCache size
-   auto sharedState =
-       std::make_shared<psibase::SharedState>(SharedDatabase{db_path, true}, WasmCache{128});
-   auto system      = sharedState->getSystemContext();
-   auto proofSystem = sharedState->getSystemContext();
-   auto queue       = std::make_shared<transaction_queue>();
+   auto sharedState = std::make_shared<psibase::SharedState>(
+       SharedDatabase{db_path, true, dbMemory}, WasmCache{128});
+   auto system = sharedState->getSystemContext();
 
    if (system->sharedDatabase.isSlow())
    {
@@ -725,6 +852,15 @@ void run(const std::string&              db_path,
              "$$\". "
              "If that doesn't work, try running psinode with \"sudo\".";
    }
+   if (huge_pages)
+   {
+      auto stats = system->sharedDatabase.getStats();
+      if (!stats.hot.hugePages || !stats.warm.hugePages)
+         PSIBASE_LOG(psibase::loggers::generic::get(), warning)
+             << "transparent huge pages are not available for " << db_path;
+   }
+   if (scrub_nodes_per_sec && scrub_bytes_per_sec)
+      system->sharedDatabase.startScrubber(scrub_nodes_per_sec, scrub_bytes_per_sec);
 
    // If the server's config file doesn't exist yet, create it
    {
@@ -747,6 +883,15 @@ void run(const std::string&              db_path,
 
    auto server_work = boost::asio::make_work_guard(chainContext);
 
+   // Transactions are dispatched to chainContext as soon as they arrive. While
+   // the chain thread is busy, they accumulate in the queue and are taken in
+   // batches.
+   std::function<void()> process_transactions;
+   auto                  queue = std::make_shared<transaction_queue>(
+       max_pending_transactions,
+       [&chainContext, &process_transactions]
+       { boost::asio::post(chainContext, [&process_transactions] { process_transactions(); }); });
+
    using node_type = node<peer_manager, direct_routing, consensus, ForkDb>;
    node_type node(chainContext, system.get(), prover);
    node.set_producer_id(producer);
@@ -803,21 +948,29 @@ void run(const std::string&              db_path,
       }
       http_config->admin = admin;
 
-      // TODO: speculative execution on non-producers
-      http_config->push_boot_async =
-          [queue](std::vector<char> packed_signed_transactions, http::push_boot_callback callback)
+      auto push = [queue](transaction_entry&& entry)
       {
-         std::scoped_lock lock{queue->mutex};
-         queue->entries.push_back(
-             {true, std::move(packed_signed_transactions), std::move(callback), {}});
+         switch (queue->push(entry.source, std::move(entry)))
+         {
+            case transaction_queue::PushResult::accepted:
+               break;
+            case transaction_queue::PushResult::full:
+               reject(entry, "Too many pending transactions; try again later");
+               break;
+            case transaction_queue::PushResult::closed:
+               reject(entry, "The server is shutting down");
+               break;
+         }
       };
 
+      http_config->push_boot_async =
+          [push](std::vector<char> packed_signed_transactions, http::push_boot_callback callback)
+      { push({true, std::move(packed_signed_transactions), std::move(callback), {}, "boot"}); };
+
       http_config->push_transaction_async =
-          [queue](std::vector<char> packed_signed_trx, http::push_transaction_callback callback)
-      {
-         std::scoped_lock lock{queue->mutex};
-         queue->entries.push_back({false, std::move(packed_signed_trx), {}, std::move(callback)});
-      };
+          [push](std::vector<char> packed_signed_trx, std::string source,
+                 http::push_transaction_callback callback)
+      { push({false, std::move(packed_signed_trx), {}, std::move(callback), std::move(source)}); };
 
       http_config->accept_p2p_websocket = [&chainContext, &node](auto&& stream)
       {
@@ -827,7 +980,7 @@ void run(const std::string&              db_path,
       };
 
       http_config->shutdown = [&chainContext, &node, &http_config, &connect_one, &timer, &runResult,
-                               &server_work](std::vector<char> data)
+                               &server_work, queue](std::vector<char> data)
       {
          data.push_back('\0');
          psio::json_token_stream stream(data.data());
@@ -847,7 +1000,7 @@ void run(const std::string&              db_path,
          {
             boost::asio::post(chainContext,
                               [&chainContext, &node, &connect_one, &http_config, &timer, &runResult,
-                               &server_work, restart, soft]()
+                               &server_work, queue, restart, soft]()
                               {
                                  auto status     = http_config->status.load();
                                  status.shutdown = true;
@@ -861,6 +1014,8 @@ void run(const std::string&              db_path,
                                                                        { server_work.reset(); });
                                                   });
                                  timer.cancel();
+                                 for (auto& entry : queue->close())
+                                    reject(entry, "The server is shutting down");
                                  node.consensus().async_shutdown();
                                  node.peers().autoconnect({}, 0, connect_one);
                                  node.peers().disconnect_all(restart);
@@ -1032,6 +1187,19 @@ void run(const std::string&              db_path,
                            });
       };
 
+      // The database's statistics are thread-safe, so this doesn't need to wait for chainContext
+      http_config->get_database_stats = [&system](auto callback)
+      {
+         callback(
+             [stats = system->sharedDatabase.getStats()]
+             {
+                std::vector<char>   json;
+                psio::vector_stream stream(json);
+                to_json(stats, stream);
+                return json;
+             });
+      };
+
       http_config->new_key =
           [&chainContext, &prover, &db_path, &runResult](std::vector<char> json, auto callback)
       {
@@ -1124,67 +1292,249 @@ void run(const std::string&              db_path,
 
    node.autoconnect(translate_endpoints(peers), autoconnect.value, connect_one);
 
-   // TODO: post the transactions to chainContext rather than batching them at fixed intervals.
-   auto process_transactions = [&](const std::error_code& ec)
+   // Proofs and first auth checks run on verifyPool. The results come back to
+   // chainContext through push_verified. verifyPool is declared last so that it
+   // is destroyed, and finishes its jobs, while everything they use still exists.
+   std::function<void(std::shared_ptr<verified_transaction>)> release_verified;
+   VerifyPool verifyPool{sharedState, proof_threads};
+   node.chain().setVerifyPool(&verifyPool);
+
+   auto verify = [&](std::shared_ptr<verified_transaction> v)
+   {
+      verifyPool.post(
+          [&, v = std::move(v)](SystemContext& proofSystem) mutable
+          {
+             verifyTransaction(proofSystem, *v,
+                               std::chrono::microseconds(leeway_us),  // TODO
+                               std::chrono::microseconds(leeway_us));
+             boost::asio::post(chainContext,
+                               [&release_verified, c = verified_completion{std::move(v)}]() mutable
+                               { release_verified(std::move(c.v)); });
+          });
+   };
+
+   // Returns false if v went back to verifyPool
+   auto push_verified = [&](std::shared_ptr<verified_transaction> v)
    {
-      std::vector<transaction_queue::entry> entries;
+      auto bc = node.chain().getBlockContext();
+      if (!bc)
       {
-         std::scoped_lock lock{queue->mutex};
-         std::swap(entries, queue->entries);
+         // Prepare for the block which might include the transaction
+         if (v->trx && !v->error && !v->trace.error)
+            node.chain().speculate(
+                *v->trx, v->proofsVerified && v->revision == node.chain().getHeadRevision(),
+                std::chrono::microseconds(leeway_us));
+         try
+         {
+            v->entry.callback("Only the current leader accepts transactions");
+         }
+         RETHROW_BAD_ALLOC
+         CATCH_IGNORE
+      }
+      else if (v->revision != node.chain().getHeadRevision() ||
+               v->time != bc->current.header.time)
+      {
+         // The block changed while the proofs were running. They must be checked
+         // again against the new block's state.
+         v->revision = node.chain().getHeadRevision();
+         v->time     = bc->current.header.time;
+         verify(std::move(v));
+         return false;
       }
-      auto fail_all = [&](const std::string& message)
+      else
       {
+         pushTransaction(*bc, *v, std::chrono::microseconds(leeway_us));
+      }
+      return true;
+   };
+
+   std::map<std::string, source_order, std::less<>> source_orders;
+   auto start_verify = [&](std::shared_ptr<verified_transaction> v)
+   {
+      v->seq = source_orders[v->entry.source].next_seq++;
+      verify(std::move(v));
+   };
+   release_verified = [&](std::shared_ptr<verified_transaction> v)
+   {
+      auto  pos   = source_orders.find(v->entry.source);
+      auto& order = pos->second;
+      order.verified.emplace(v->seq, std::move(v));
+      while (!order.verified.empty() && order.verified.begin()->first == order.next_release)
+      {
+         auto next = std::move(order.verified.begin()->second);
+         order.verified.erase(order.verified.begin());
+         // A transaction which is verified again comes back with the same seq
+         if (!push_verified(std::move(next)))
+            return;
+         ++order.next_release;
+      }
+      if (order.next_release == order.next_seq)
+         source_orders.erase(pos);
+   };
+
+   // Under load, the chain thread takes up to this many transactions at a time
+   constexpr std::size_t max_transaction_batch = 64;
+   process_transactions = [&]
+   {
+      std::vector<transaction_entry> entries;
+      bool more = queue->pop(entries, max_transaction_batch);
+      for (auto& entry : entries)
+         release_on_reply(queue, entry);
+      if (more)
+      {
+         // Let other work on chainContext run between batches
+         boost::asio::post(chainContext, [&] { process_transactions(); });
+      }
+
+      if (auto bc = node.chain().getBlockContext())
+      {
+         auto revisionAtBlockStart = node.chain().getHeadRevision();
          for (auto& entry : entries)
          {
-            if (entry.callback)
+            if (entry.is_boot)
             {
-               entry.callback(message);
+               push_boot(*bc, entry);
+               continue;
             }
-            else if (entry.boot_callback)
+            auto v = std::make_shared<verified_transaction>(verified_transaction{
+                .entry    = std::move(entry),
+                .revision = revisionAtBlockStart,
+                .time     = bc->current.header.time,
+            });
+            if (bc->needGenesisAction)
             {
-               entry.boot_callback(message);
+               v->trace.error = "Need genesis block; use 'psibase boot' to boot chain";
+               pushTransaction(*bc, *v, std::chrono::microseconds(leeway_us));
+            }
+            else
+            {
+               start_verify(std::move(v));
             }
          }
-      };
-      if (ec)
-      {
-         // TODO: 503
-         fail_all("The server is shutting down");
       }
-      else if (auto bc = node.chain().getBlockContext())
+      else
       {
-         auto revisionAtBlockStart = node.chain().getHeadRevision();
          for (auto& entry : entries)
          {
             if (entry.is_boot)
-               push_boot(*bc, entry);
-            else
-               pushTransaction(*sharedState, revisionAtBlockStart, *bc, *proofSystem, entry,
-                               std::chrono::microseconds(leeway_us),  // TODO
-                               std::chrono::microseconds(leeway_us),  // TODO
-                               std::chrono::microseconds(leeway_us));
-         }
-
-         // TODO: this should go in the leader's production loop
-         if (bc->needGenesisAction)
-         {
-            if (!showedBootMsg)
             {
-               PSIBASE_LOG(node.chain().getLogger(), notice)
-                   << "Need genesis block; use 'psibase boot' to boot chain";
-               showedBootMsg = true;
+               entry.boot_callback("Only the current leader accepts transactions");
+               continue;
             }
-            //continue;
+            // Verified against the head, then run speculatively by push_verified
+            start_verify(std::make_shared<verified_transaction>(verified_transaction{
+                .entry    = std::move(entry),
+                .revision = node.chain().getHeadRevision(),
+            }));
          }
       }
-      else
+   };
+
+   // TODO: this should go in the leader's production loop
+   auto show_boot_message = [&](const std::error_code& ec)
+   {
+      if (ec || showedBootMsg)
+         return;
+      if (auto bc = node.chain().getBlockContext(); bc && bc->needGenesisAction)
       {
-         fail_all("Only the current leader accepts transactions");
+         PSIBASE_LOG(node.chain().getLogger(), notice)
+             << "Need genesis block; use 'psibase boot' to boot chain";
+         showedBootMsg = true;
       }
    };
-   loop(timer, process_transactions);
+   loop(timer, show_boot_message);
 
    chainContext.run();
+
+   // Nothing will take the remaining transactions after a forced shutdown.
+   // Transactions which are still being verified are answered when their
+   // completions are destroyed along with chainContext.
+   for (auto& entry : queue->close())
+      reject(entry, "The server is shutting down");
+   // These wait for an earlier transaction from the same source
+   for (auto& [source, order] : source_orders)
+      for (auto& [seq, v] : order.verified)
+         reject(v->entry, "The server is shutting down");
+}
+
+void run_snapshot(const std::string& db_path,
+                  const std::string& export_file,
+                  const std::string& import_file)
+{
+   SharedDatabase shared{db_path, true};
+   if (!import_file.empty())
+   {
+      std::ifstream in(import_file, std::ios::binary);
+      if (!in)
+         throw std::runtime_error("Cannot open " + import_file);
+      auto blockId = importSnapshot(shared, in, std::max(std::thread::hardware_concurrency(), 1u));
+      PSIBASE_LOG(psibase::loggers::generic::get(), info)
+          << "Imported snapshot of block " << psio::convert_to_json(blockId);
+   }
+   if (!export_file.empty())
+   {
+      std::ofstream out(export_file, std::ios::binary | std::ios::trunc);
+      if (!out)
+         throw std::runtime_error("Cannot open " + export_file);
+      auto blockId = exportSnapshot(shared, out);
+      PSIBASE_LOG(psibase::loggers::generic::get(), info)
+          << "Exported snapshot of block " << psio::convert_to_json(blockId);
+   }
+}
+
+// Serves queries from a database which another psinode process writes.
+// There's no block production, p2p, or transaction intake; each query runs
+// against the head which the writer most recently stored.
+void run_replica(const std::string&                 db_path,
+                 const std::string&                 host,
+                 unsigned short                     port,
+                 const std::vector<native_service>& services)
+{
+   ExecutionContext::registerHostFunctions();
+
+   // TODO: configurable WasmCache size
+   auto sharedState = std::make_shared<psibase::SharedState>(SharedDatabase::openReadOnly(db_path),
+                                                             WasmCache{128});
+   auto system      = sharedState->getSystemContext();
+
+   auto http_config = std::make_shared<http::http_config>();
+
+   boost::asio::io_context chainContext;
+
+   // TODO: command-line options
+   http_config->num_threads         = 4;
+   http_config->max_request_size    = 20 * 1024 * 1024;
+   http_config->idle_timeout_ms     = std::chrono::milliseconds{4000};
+   http_config->allow_origin        = "*";
+   http_config->address             = "0.0.0.0";
+   http_config->port                = port;
+   http_config->host                = host;
+   http_config->enable_transactions = false;
+   http_config->status              = http::http_status{.slow = system->sharedDatabase.isSlow()};
+
+   for (const auto& entry : services)
+   {
+      load_service(entry, http_config->services, host);
+   }
+
+   // The database's statistics are thread-safe, so this doesn't need to wait for chainContext
+   http_config->get_database_stats = [&system](auto callback)
+   {
+      callback(
+          [stats = system->sharedDatabase.getStats()]
+          {
+             std::vector<char>   json;
+             psio::vector_stream stream(json);
+             to_json(stats, stream);
+             return json;
+          });
+   };
+
+   boost::asio::make_service<http::server_service>(chainContext, http_config, sharedState);
+
+   PSIBASE_LOG(psibase::loggers::generic::get(), info)
+       << "Serving queries from " << db_path << " on port " << port;
+   chainContext.run();
 }
 
 const char usage[] = "USAGE: psinode [OPTIONS] database";
@@ -1199,9 +1549,18 @@ int main(int argc, char* argv[])
    uint32_t                    leeway_us = 200000;  // TODO: real value once resources are in place
    std::vector<std::string>    peers;
    autoconnect_t               autoconnect;
-   bool                        enable_incoming_p2p = false;
+   bool                        enable_incoming_p2p      = false;
    std::vector<native_service> services;
    http::admin_service         admin;
+   std::string                 export_snapshot;
+   std::string                 import_snapshot;
+   bool                        replica                  = false;
+   bool                        huge_pages               = false;
+   bool                        prefault                 = false;
+   uint64_t                    scrub_nodes_per_sec      = 0;
+   uint64_t                    scrub_bytes_per_sec      = 16 * 1024 * 1024;
+   unsigned                    proof_threads            = 4;
+   std::size_t                 max_pending_transactions = 4096;
 
    namespace po = boost::program_options;
 
@@ -1224,11 +1583,31 @@ int main(int argc, char* argv[])
        "Controls which services can access the admin API");
    opt("leeway,l", po::value<uint32_t>(&leeway_us)->default_value(200000),
        "Transaction leeway, in us. Defaults to 200000.");
+   opt("huge-pages", po::bool_switch(&huge_pages)->default_value(false, "off"),
+       "Back the hot and warm database caches with transparent huge pages");
+   opt("prefault", po::bool_switch(&prefault)->default_value(false, "off"),
+       "Load the hot and warm database caches into RAM on startup");
+   opt("scrub-nodes-per-sec", po::value(&scrub_nodes_per_sec)->default_value(0, "off"),
+       "Check the database for corruption in the background, visiting at most this many nodes "
+       "per second");
+   opt("scrub-bytes-per-sec", po::value(&scrub_bytes_per_sec)->default_value(16 * 1024 * 1024),
+       "Limits the rate at which the background corruption check reads the database");
+   opt("proof-threads", po::value(&proof_threads)->default_value(4),
+       "Number of threads which verify the proofs and first auth of incoming transactions");
+   opt("max-pending-transactions", po::value(&max_pending_transactions)->default_value(4096),
+       "Number of incoming transactions which may wait or execute at once. Further transactions "
+       "are rejected with 503 Service Unavailable");
    desc.add(common_opts);
    opt = desc.add_options();
    // Options that can only be specified on the command line
    opt("database", po::value<std::string>(&db_path)->value_name("path")->required(),
        "Path to database");
+   opt("export-snapshot", po::value(&export_snapshot)->value_name("file"),
+       "Write the head state to a snapshot file and exit");
+   opt("import-snapshot", po::value(&import_snapshot)->value_name("file"),
+       "Load a snapshot file into an empty database and exit");
+   opt("replica", po::bool_switch(&replica),
+       "Serve queries from a database which another psinode is running on. Requires --host");
    opt("help,h", "Show this message");
 
    po::positional_options_description p;
@@ -1292,6 +1671,18 @@ int main(int argc, char* argv[])
    {
       psibase::loggers::set_path(db_path);
       psibase::loggers::configure(vm);
+      if (!export_snapshot.empty() || !import_snapshot.empty())
+      {
+         run_snapshot(db_path, export_snapshot, import_snapshot);
+         return 0;
+      }
+      if (replica)
+      {
+         if (host.empty())
+            throw std::runtime_error("--replica requires --host");
+         run_replica(db_path, host, port, services);
+         return 0;
+      }
       RestartInfo restart;
       while (true)
       {
@@ -1299,7 +1690,8 @@ int main(int argc, char* argv[])
          restart.shouldRestart     = true;
          restart.soft              = true;
          run(db_path, AccountNumber{producer}, keys, peers, autoconnect, enable_incoming_p2p, host,
-             port, services, admin, leeway_us, restart);
+             port, services, admin, leeway_us, huge_pages, prefault, scrub_nodes_per_sec,
+             scrub_bytes_per_sec, proof_threads, max_pending_transactions, restart);
          if (!restart.shouldRestart || !restart.shutdownRequested)
          {
             PSIBASE_LOG(psibase::loggers::generic::get(), info) << "Shutdown";
@@ -1314,7 +1706,12 @@ int main(int argc, char* argv[])
                 po::command_line_parser(argc, argv).options(desc).positional(p).run();
             auto keep_opt = [&restart](const auto& opt)
             {
-               if (opt.string_key == "database" || opt.string_key == "leeway")
+               if (opt.string_key == "database" || opt.string_key == "leeway" ||
+                   opt.string_key == "huge-pages" || opt.string_key == "prefault" ||
+                   opt.string_key == "scrub-nodes-per-sec" ||
+                   opt.string_key == "scrub-bytes-per-sec" ||
+                   opt.string_key == "proof-threads" ||
+                   opt.string_key == "max-pending-transactions")
                   return true;
                else if (opt.string_key == "key")
                   return !restart.keysChanged;
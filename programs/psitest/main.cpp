@@ -152,7 +152,8 @@ struct test_chain
        : state{state}
    {
       dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
-      db  = {dir, true, max_objects, hot_addr_bits, warm_addr_bits, cool_addr_bits, cold_addr_bits};
+      db  = {dir, true, {}, max_objects, hot_addr_bits, warm_addr_bits, cool_addr_bits,
+             cold_addr_bits};
       writer = db.createWriter();
       sys    = std::make_unique<psibase::SystemContext>(psibase::SystemContext{db, {128}});
    }